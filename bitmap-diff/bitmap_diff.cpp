@@ -0,0 +1,405 @@
+#include <windows.h>
+#include <winioctl.h>
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <cwctype>
+
+#include "../common/bitmap_fetch.h"
+#include "../common/volume_geometry.h"
+#include "../common/free_run.h"
+#include "../common/snapshot.h"
+#include "../common/bitmap_diff.h"
+#include "../common/cluster_map.h"
+#include "../common/command_line.h"
+
+// Helper to print a Windows error message
+static void PrintLastError(const wchar_t *msgPrefix) {
+    DWORD errCode = GetLastError();
+    std::wcerr << msgPrefix << L" Error: " << errCode << std::endl;
+
+    LPWSTR errText = nullptr;
+    FormatMessageW(
+        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        NULL,
+        errCode,
+        0,
+        (LPWSTR)&errText,
+        0,
+        NULL);
+
+    if (errText) {
+        std::wcerr << L"Reason: " << errText << std::endl;
+        LocalFree(errText);
+    }
+}
+
+static ULONGLONG NowTicks() {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+// -----------------------------------------------------------------------------
+// Volume access
+// -----------------------------------------------------------------------------
+
+// Volume geometry from FSCTL_GET_NTFS_VOLUME_DATA: 64-bit cluster counts and
+// the MFT zone, with GetDiskFreeSpaceExW as the fallback on other file systems
+static bool GetVolumeGeometry(HANDLE volumeHandle, const std::wstring &rootPath, VolumeGeometry &geometry) {
+    geometry = VolumeGeometry();
+    NTFS_VOLUME_DATA_BUFFER data = {};
+    DWORD bytesReturned = 0;
+    if (DeviceIoControl(volumeHandle, FSCTL_GET_NTFS_VOLUME_DATA, NULL, 0, &data, sizeof(data), &bytesReturned, NULL)) {
+        geometry.isNtfs = true;
+        geometry.volumeSerial = (ULONGLONG)data.VolumeSerialNumber.QuadPart;
+        geometry.totalClusters = (ULONGLONG)data.TotalClusters.QuadPart;
+        geometry.freeClusters = (ULONGLONG)data.FreeClusters.QuadPart;
+        geometry.bytesPerSector = data.BytesPerSector;
+        geometry.bytesPerCluster = data.BytesPerCluster;
+        geometry.bytesPerFileRecord = data.BytesPerFileRecordSegment;
+        geometry.mftStartLcn = (ULONGLONG)data.MftStartLcn.QuadPart;
+        geometry.mft2StartLcn = (ULONGLONG)data.Mft2StartLcn.QuadPart;
+        geometry.mftValidDataLength = (ULONGLONG)data.MftValidDataLength.QuadPart;
+        geometry.mftZoneStart = (ULONGLONG)data.MftZoneStart.QuadPart;
+        geometry.mftZoneEnd = (ULONGLONG)data.MftZoneEnd.QuadPart;
+        return true;
+    }
+
+    DWORD sectorsPerCluster = 0;
+    DWORD bytesPerSector = 0;
+    DWORD numberOfFreeClusters = 0;
+    DWORD totalNumberOfClusters = 0;
+    ULARGE_INTEGER freeBytes = {};
+    ULARGE_INTEGER totalBytes = {};
+    ULARGE_INTEGER totalFreeBytes = {};
+    if (!GetDiskFreeSpaceW(rootPath.c_str(), &sectorsPerCluster, &bytesPerSector,
+                           &numberOfFreeClusters, &totalNumberOfClusters) ||
+        !GetDiskFreeSpaceExW(rootPath.c_str(), &freeBytes, &totalBytes, &totalFreeBytes)) {
+        PrintLastError(L"GetDiskFreeSpaceW failed");
+        return false;
+    }
+    geometry.bytesPerSector = bytesPerSector;
+    geometry.bytesPerCluster = sectorsPerCluster * bytesPerSector;
+    if (geometry.bytesPerCluster == 0) {
+        return false;
+    }
+    geometry.totalClusters = totalBytes.QuadPart / geometry.bytesPerCluster;
+    geometry.freeClusters = totalFreeBytes.QuadPart / geometry.bytesPerCluster;
+    DWORD serial = 0;
+    if (GetVolumeInformationW(rootPath.c_str(), NULL, 0, &serial, NULL, NULL, NULL, 0)) {
+        geometry.volumeSerial = serial;
+    }
+    return true;
+}
+
+// FSCTL_GET_VOLUME_BITMAP on one volume handle
+class VolumeBitmapSource : public BitmapSource {
+public:
+    VolumeBitmapSource(HANDLE volumeHandle, bool ownsHandle) : volumeHandle(volumeHandle), ownsHandle(ownsHandle) {}
+    ~VolumeBitmapSource() override {
+        if (ownsHandle) {
+            CloseHandle(volumeHandle);
+        }
+    }
+
+    IoStatus Read(int64_t startingLcn, void *out, uint32_t outSize, uint32_t &bytesReturned) override {
+        STARTING_LCN_INPUT_BUFFER inBuf = {};
+        inBuf.StartingLcn.QuadPart = startingLcn;
+        DWORD returned = 0;
+        BOOL ok = DeviceIoControl(volumeHandle, FSCTL_GET_VOLUME_BITMAP, &inBuf, sizeof(inBuf),
+                                  out, outSize, &returned, NULL);
+        bytesReturned = returned;
+        if (ok) {
+            return IoStatus::Success;
+        }
+        if (GetLastError() == ERROR_MORE_DATA) {
+            return IoStatus::MoreData;
+        }
+        PrintLastError(L"FSCTL_GET_VOLUME_BITMAP failed");
+        return IoStatus::Failed;
+    }
+
+private:
+    HANDLE volumeHandle;
+    bool ownsHandle;
+};
+
+// -----------------------------------------------------------------------------
+// The two bitmaps
+// -----------------------------------------------------------------------------
+
+// One side of the comparison: a snapshot file, or the bitmap of a mounted
+// volume read now
+struct BitmapSide {
+    std::wstring source;
+    bool live = false;
+    SnapshotReader snapshot;
+    std::vector<BYTE> fetched;
+    const BYTE *bitmap = nullptr;
+    uint64_t totalClusters = 0;
+    uint32_t bytesPerCluster = 0;
+    uint64_t volumeSerial = 0;
+    uint64_t ticks = 0;          // when the bitmap was taken
+    double readSeconds = 0;      // live reads only
+    std::vector<LcnRange> reserved;
+};
+
+// "C", "C:" and "C:\" name a volume; anything else is a snapshot file
+static bool IsDriveLetter(const std::wstring &source) {
+    return !source.empty() && iswalpha(source[0]) &&
+           (source.size() == 1 || (source[1] == L':' && (source.size() == 2 || (source.size() == 3 && source[2] == L'\\'))));
+}
+
+static bool ReadLiveBitmap(const std::wstring &driveLetter, unsigned ranges, BitmapSide &side) {
+    std::wstring rootPath = driveLetter + L":\\";
+    std::wstring volumePath = L"\\\\.\\" + driveLetter + L":";
+    HANDLE hVolume = CreateFileW(volumePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                 OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE) {
+        PrintLastError((L"Failed to open volume " + volumePath).c_str());
+        return false;
+    }
+    VolumeGeometry geometry;
+    if (!GetVolumeGeometry(hVolume, rootPath, geometry) || geometry.totalClusters == 0) {
+        std::wcerr << L"GetVolumeGeometry failed.\n";
+        CloseHandle(hVolume);
+        return false;
+    }
+
+    auto makeSource = [&](unsigned range) -> std::unique_ptr<BitmapSource> {
+        if (range == 0) {
+            return std::unique_ptr<BitmapSource>(new VolumeBitmapSource(hVolume, false));
+        }
+        HANDLE hRange = CreateFileW(volumePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                    NULL, OPEN_EXISTING, 0, NULL);
+        if (hRange == INVALID_HANDLE_VALUE) {
+            PrintLastError((L"Failed to open volume " + volumePath + L" for a bitmap range").c_str());
+            return nullptr;
+        }
+        return std::unique_ptr<BitmapSource>(new VolumeBitmapSource(hRange, true));
+    };
+    BitmapFetchOptions fetchOptions;
+    fetchOptions.ranges = std::max(1u, ranges);
+    BitmapFetchStats fetchStats;
+    side.ticks = NowTicks();
+    bool ok = FetchVolumeBitmap(geometry.totalClusters, side.fetched, fetchOptions, makeSource, &fetchStats);
+    CloseHandle(hVolume);
+    if (!ok) {
+        std::wcerr << L"Cannot read the bitmap of " << volumePath << L".\n";
+        return false;
+    }
+    side.live = true;
+    side.bitmap = side.fetched.data();
+    side.totalClusters = geometry.totalClusters;
+    side.bytesPerCluster = geometry.bytesPerCluster;
+    side.volumeSerial = geometry.volumeSerial;
+    side.readSeconds = fetchStats.seconds;
+    side.reserved = geometry.ReservedRanges();
+    std::wcout << L"Bitmap of " << driveLetter << L": read in " << fetchStats.seconds << L" s ("
+               << fetchStats.ioctlCalls << L" calls).\n";
+    return true;
+}
+
+static bool OpenSnapshotBitmap(const std::wstring &path, BitmapSide &side) {
+    SnapshotStatus status = side.snapshot.Open(path);
+    if (status != SnapshotStatus::Ok) {
+        std::wcerr << path << (status == SnapshotStatus::CannotOpen     ? L": cannot open the file.\n"
+                               : status == SnapshotStatus::WrongVersion ? L": unsupported snapshot version.\n"
+                                                                        : L": not a valid snapshot.\n");
+        return false;
+    }
+    const SnapshotHeader &h = side.snapshot.Header();
+    side.bitmap = side.snapshot.Bitmap();
+    side.totalClusters = h.totalClusters;
+    side.bytesPerCluster = h.bytesPerCluster;
+    side.volumeSerial = h.volumeSerial;
+    side.ticks = h.createdTicks;
+    std::wcout << L"Snapshot " << path << L": " << h.totalClusters << L" clusters, taken "
+               << (NowTicks() - std::min(NowTicks(), h.createdTicks)) / 600000000ULL << L" minutes ago.\n";
+    return true;
+}
+
+static bool LoadSide(const std::wstring &source, unsigned ranges, BitmapSide &side) {
+    side.source = source;
+    if (IsDriveLetter(source)) {
+        return ReadLiveBitmap(source.substr(0, 1), ranges, side);
+    }
+    return OpenSnapshotBitmap(source, side);
+}
+
+// -----------------------------------------------------------------------------
+// Comparing
+// -----------------------------------------------------------------------------
+
+// One line per changed range: "allocated <lcn> <clusters>" or "freed <lcn> <clusters>"
+class RangeList {
+public:
+    bool Open(const std::wstring &path) {
+        if (path == L"-") {
+            out = &std::cout;
+            return true;
+        }
+        file.open(std::filesystem::path(path), std::ios::binary);
+        out = &file;
+        return file.is_open();
+    }
+
+    void Add(const BitmapChange &c) {
+        *out << (c.kind == BitmapChangeKind::Allocated ? "allocated " : "freed ") << c.start << ' ' << c.end - c.start
+             << '\n';
+    }
+
+    bool Close() {
+        out->flush();
+        if (file.is_open()) {
+            file.close();
+        }
+        return !out->fail();
+    }
+
+private:
+    std::ofstream file;
+    std::ostream *out = nullptr;
+};
+
+int main(int argc, char **argv) {
+    ToolOptions options(L"bitmap-diff", {
+        {L"before", OptionKind::Text, true, L"earlier bitmap: a snapshot file or a drive letter"},
+        {L"after", OptionKind::Text, true, L"later bitmap: a snapshot file or a drive letter"},
+        {L"interval", OptionKind::Count, false, L"seconds between two reads of the same volume (default 60)"},
+        {L"bitmap-ranges", OptionKind::Count, false, L"bitmap ranges fetched in parallel from a volume (default 4)"},
+        {L"list", OptionKind::Text, false, L"file listing every changed range (- = console, none = no list, default)"},
+        {L"map", OptionKind::Text, false, L"changes map image, .png or .ppm (- = none, default)"},
+        {L"map-width", OptionKind::Count, false, L"changes map width in pixels (default 1024)"},
+        {L"map-height", OptionKind::Count, false, L"changes map height in pixels, less for small volumes (default 768)"},
+    });
+    int exitCode = 0;
+    if (!options.Parse(argc, argv, exitCode)) {
+        return exitCode;
+    }
+
+    std::wstring beforeSource =
+        options.Line(L"before", L"Earlier bitmap: snapshot file, or drive letter to read the volume now: ");
+    std::wstring afterSource =
+        options.Line(L"after", L"Later bitmap: snapshot file, or drive letter to read the volume (then): ");
+    if (beforeSource.empty() || afterSource.empty()) {
+        std::wcerr << L"Two bitmaps are needed.\n";
+        return options.Finish(TOOL_EXIT_USAGE);
+    }
+    unsigned ranges = 4;
+    if (IsDriveLetter(beforeSource) || IsDriveLetter(afterSource)) {
+        ranges = options.Number(L"bitmap-ranges", L"Bitmap fetch: how many ranges in parallel? (default = 4): ", ranges);
+    }
+    ULONGLONG interval = 0;
+    bool sameVolume = IsDriveLetter(beforeSource) && IsDriveLetter(afterSource) &&
+                      towupper(beforeSource[0]) == towupper(afterSource[0]);
+    if (sameVolume) {
+        interval = options.Number(L"interval", L"Seconds between the two reads (default = 60): ", 60ULL);
+    }
+    std::wstring listPath =
+        options.Line(L"list", L"List every changed range to a file (- = console, none = no list, default = none): ",
+                     L"none");
+    std::wstring mapPath = options.Line(L"map", L"Changes map image, .png or .ppm (- = none, default = -): ", L"-");
+
+    BitmapSide before;
+    BitmapSide after;
+    if (!LoadSide(beforeSource, ranges, before)) {
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+    if (sameVolume && interval > 0) {
+        std::wcout << L"Reading the volume again in " << interval << L" s...\n";
+        std::this_thread::sleep_for(std::chrono::seconds(interval));
+    }
+    if (!LoadSide(afterSource, ranges, after)) {
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+    if (before.totalClusters != after.totalClusters || before.bytesPerCluster != after.bytesPerCluster) {
+        std::wcerr << L"The bitmaps describe volumes of different sizes (" << before.totalClusters << L" and "
+                   << after.totalClusters << L" clusters); they cannot be compared.\n";
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+    if (before.volumeSerial && after.volumeSerial && before.volumeSerial != after.volumeSerial) {
+        std::wcerr << L"Warning: the bitmaps come from volumes with different serial numbers.\n";
+    }
+    if (after.ticks < before.ticks) {
+        std::wcerr << L"Warning: the later bitmap was taken before the earlier one.\n";
+    }
+
+    RangeList list;
+    bool listing = listPath != L"none";
+    if (listing && !list.Open(listPath)) {
+        std::wcerr << L"Cannot create " << listPath << L"\n";
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+    uint64_t largestAllocated = 0;
+    uint64_t largestFreed = 0;
+    auto started = std::chrono::steady_clock::now();
+    BitmapDiffSummary s = DiffBitmaps(before.bitmap, after.bitmap, before.totalClusters, [&](const BitmapChange &c) {
+        uint64_t &largest = c.kind == BitmapChangeKind::Allocated ? largestAllocated : largestFreed;
+        largest = std::max(largest, c.end - c.start);
+        if (listing) {
+            list.Add(c);
+        }
+    });
+    double diffSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    bool ok = true;
+    if (listing && !list.Close()) {
+        std::wcerr << L"Cannot write the range list to " << listPath << L"\n";
+        ok = false;
+    }
+
+    double bitmapMB = (double)((before.totalClusters + 7) / 8) / (1024 * 1024);
+    uint64_t blocks = s.blocksSkipped + s.blocksCompared;
+    std::wcout << L"Between the bitmaps: " << (double)(after.ticks - std::min(after.ticks, before.ticks)) / 1e7
+               << L" s\n";
+    std::wcout << L"Newly allocated: " << s.clustersAllocated << L" clusters in " << s.rangesAllocated
+               << L" ranges (largest " << largestAllocated << L")\n";
+    std::wcout << L"Freed: " << s.clustersFreed << L" clusters in " << s.rangesFreed << L" ranges (largest "
+               << largestFreed << L")\n";
+    std::wcout << L"Changed: " << s.ClustersChanged() << L" of " << before.totalClusters << L" clusters ("
+               << 100.0 * (double)s.ClustersChanged() / (double)before.totalClusters << L"%) in "
+               << s.RangesChanged() << L" ranges\n";
+    std::wcout << L"Compared 2 x " << bitmapMB << L" MB in " << diffSeconds << L" s ("
+               << (diffSeconds > 0 ? 2 * bitmapMB / diffSeconds : 0.0) << L" MB/s); "
+               << (blocks ? 100.0 * (double)s.blocksSkipped / (double)blocks : 100.0)
+               << L"% of the 512-cluster blocks were identical and skipped\n";
+
+    if (mapPath != L"-") {
+        ClusterMap changes(before.totalClusters, options.Value(L"map-width", 1024u), options.Value(L"map-height", 768u));
+        changes.ScanChanges(BitmapWords(before.bitmap, (size_t)((before.totalClusters + 7) / 8)),
+                            BitmapWords(after.bitmap, (size_t)((after.totalClusters + 7) / 8)),
+                            std::max(1u, std::thread::hardware_concurrency()));
+        changes.AddReserved(before.live ? before.reserved : after.reserved);
+        if (changes.Write(std::filesystem::path(mapPath))) {
+            std::wcout << L"Changes map written to " << mapPath << L": " << changes.Width() << L" x "
+                       << changes.Height() << L" pixels, " << changes.ClustersPerPixel() << L" clusters per pixel.\n";
+        } else {
+            std::wcerr << L"Cannot write the changes map to " << mapPath << L"\n";
+            ok = false;
+        }
+    }
+
+    JsonObject &result = options.Result();
+    result.Set("totalClusters", before.totalClusters).Set("bytesPerCluster", before.bytesPerCluster);
+    result.Child("before").Set("source", before.source).Set("live", before.live).Set("ticks", before.ticks)
+        .Set("readSeconds", before.readSeconds);
+    result.Child("after").Set("source", after.source).Set("live", after.live).Set("ticks", after.ticks)
+        .Set("readSeconds", after.readSeconds);
+    result.Set("secondsBetween", (double)(after.ticks - std::min(after.ticks, before.ticks)) / 1e7);
+    result.Child("allocated").Set("clusters", s.clustersAllocated).Set("ranges", s.rangesAllocated)
+        .Set("largest", largestAllocated);
+    result.Child("freed").Set("clusters", s.clustersFreed).Set("ranges", s.rangesFreed).Set("largest", largestFreed);
+    result.Set("clustersChanged", s.ClustersChanged()).Set("rangesChanged", s.RangesChanged());
+    result.Set("diffSeconds", diffSeconds).Set("blocksSkipped", s.blocksSkipped).Set("blocksCompared", s.blocksCompared);
+
+    options.WaitForEnter(L"\nDone. Press Enter to exit...");
+    return options.Finish(ok ? TOOL_EXIT_OK : TOOL_EXIT_FAILED);
+}
@@ -0,0 +1,265 @@
+#pragma once
+// Asynchronous console log with a progress status line
+//
+// Lines are formatted straight into a per-thread buffer and a background
+// thread flushes all buffers to the console every FLUSH_INTERVAL, so the
+// walkers never wait on console I/O. LOG() checks the level before any of
+// its arguments are evaluated, so disabled lines cost one compare.
+// LOG_SAMPLED() additionally keeps only every Nth line per thread.
+//
+// While running, the flusher also redraws a throttled status line with
+// throughput and an ETA based on how many allocated clusters have been
+// scanned so far, and, while a staged pass runs, its queue depths and its
+// busiest stage.
+//
+// Before Start() and after Stop() lines are written through, so a tool can
+// log from main before the pass and after it.
+
+#include "staged_pipeline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+enum class LogLevel {
+    Error = 0,
+    Warn = 1,
+    Info = 2,
+    Verbose = 3 // per-move detail
+};
+
+struct ProgressCounters {
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> moves{0};
+    std::atomic<uint64_t> clustersScanned{0};
+    uint64_t clustersTotal = 0; // allocated clusters on the volume, 0 = unknown
+    std::mutex pipelineMutex;                 // held while the status line reads the pipeline
+    const StagedPipeline *pipeline = nullptr; // while a staged pass runs
+};
+
+class AsyncLog {
+public:
+    static AsyncLog &Instance() {
+        static AsyncLog log;
+        return log;
+    }
+
+    bool Enabled(LogLevel l) const { return (int)l <= level; }
+
+    // Keep every sampleEvery-th sampled line of this thread
+    bool Sample() const {
+        static thread_local uint64_t counter = 0;
+        return sampleEvery <= 1 || (counter++ % sampleEvery) == 0;
+    }
+
+    void Start(LogLevel maxLevel, uint64_t sample, bool showProgress) {
+        level = (int)maxLevel;
+        sampleEvery = sample;
+        progressEnabled = showProgress;
+        started = std::chrono::steady_clock::now();
+        running = true;
+        flusher = std::thread([this] { FlushLoop(); });
+    }
+
+    // Stop the flusher and write whatever is still buffered
+    void Stop() {
+        if (!running) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(stopMutex);
+            running = false;
+        }
+        stopSignal.notify_all();
+        flusher.join();
+        FlushAll();
+        if (statusShown) {
+            std::wcerr << L"\n";
+            statusShown = false;
+        }
+        std::wcout.flush();
+    }
+
+    ProgressCounters progress;
+
+private:
+    friend class LogLine;
+
+    struct ThreadBuffer {
+        std::mutex mutex;
+        std::wostringstream out; // Info / Verbose
+        std::wostringstream err; // Error / Warn
+    };
+
+    ThreadBuffer &LocalBuffer() {
+        static thread_local std::shared_ptr<ThreadBuffer> local;
+        if (!local) {
+            local = std::make_shared<ThreadBuffer>();
+            std::lock_guard<std::mutex> lock(buffersMutex);
+            buffers.push_back(local);
+        }
+        return *local;
+    }
+
+    void FlushLoop() {
+        const auto FLUSH_INTERVAL = std::chrono::milliseconds(100);
+        const auto STATUS_INTERVAL = std::chrono::milliseconds(500);
+        auto lastStatus = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(stopMutex);
+        while (running) {
+            stopSignal.wait_for(lock, FLUSH_INTERVAL);
+            lock.unlock();
+            FlushAll();
+            auto now = std::chrono::steady_clock::now();
+            if (progressEnabled && now - lastStatus >= STATUS_INTERVAL) {
+                DrawStatus(now);
+                lastStatus = now;
+            }
+            lock.lock();
+        }
+    }
+
+    void FlushAll() {
+        std::vector<std::shared_ptr<ThreadBuffer>> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(buffersMutex);
+            snapshot = buffers;
+        }
+        std::lock_guard<std::mutex> consoleLock(consoleMutex);
+        for (auto &b : snapshot) {
+            std::wstring outText;
+            std::wstring errText;
+            {
+                std::lock_guard<std::mutex> lock(b->mutex);
+                outText = b->out.str();
+                errText = b->err.str();
+                b->out.str(std::wstring());
+                b->err.str(std::wstring());
+            }
+            if (outText.empty() && errText.empty()) {
+                continue;
+            }
+            ClearStatus();
+            std::wcout << outText;
+            std::wcout.flush();
+            std::wcerr << errText;
+        }
+    }
+
+    void ClearStatus() {
+        if (statusShown) {
+            std::wcerr << L"\r" << std::wstring(statusWidth, L' ') << L"\r";
+            statusShown = false;
+        }
+    }
+
+    void DrawStatus(std::chrono::steady_clock::time_point now) {
+        double seconds = std::chrono::duration<double>(now - started).count();
+        uint64_t files = progress.files.load(std::memory_order_relaxed);
+        uint64_t moves = progress.moves.load(std::memory_order_relaxed);
+        uint64_t scanned = progress.clustersScanned.load(std::memory_order_relaxed);
+
+        std::wostringstream line;
+        line << L"[progress] " << files << L" files, " << moves << L" moves ("
+             << (uint64_t)(seconds > 0 ? moves / seconds : 0) << L"/s)";
+        if (progress.clustersTotal > 0 && scanned > 0) {
+            double fraction = std::min(1.0, (double)scanned / (double)progress.clustersTotal);
+            line << L", " << (int)(fraction * 100) << L"% scanned";
+            double eta = seconds / fraction - seconds;
+            uint64_t etaSec = (uint64_t)eta;
+            line << L", ETA " << etaSec / 3600 << L"h" << (etaSec / 60) % 60 << L"m" << etaSec % 60 << L"s";
+        }
+        {
+            std::lock_guard<std::mutex> pipelineLock(progress.pipelineMutex);
+            if (progress.pipeline) {
+                line << L", queues";
+                for (uint64_t depth : progress.pipeline->Depths()) {
+                    line << L" " << depth;
+                }
+                std::vector<StageReport> stages = progress.pipeline->Stages();
+                const std::string &busiest = stages[StagedPipeline::Bottleneck(stages)].name;
+                line << L", busiest " << std::wstring(busiest.begin(), busiest.end());
+            }
+        }
+
+        std::lock_guard<std::mutex> consoleLock(consoleMutex);
+        std::wstring text = line.str();
+        if (text.size() < statusWidth) {
+            text.append(statusWidth - text.size(), L' ');
+        }
+        statusWidth = text.size();
+        std::wcerr << L"\r" << text;
+        statusShown = true;
+    }
+
+    int level = (int)LogLevel::Info;
+    uint64_t sampleEvery = 1;
+    bool progressEnabled = false;
+    std::atomic<bool> running{false};
+    bool statusShown = false;
+    size_t statusWidth = 0;
+    std::chrono::steady_clock::time_point started;
+    std::thread flusher;
+    std::mutex stopMutex;
+    std::condition_variable stopSignal;
+    std::mutex buffersMutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    std::mutex consoleMutex;
+};
+
+// One log line, formatted in place into the calling thread's buffer
+class LogLine {
+public:
+    explicit LogLine(LogLevel level)
+        : log(AsyncLog::Instance()),
+          buffer(log.LocalBuffer()),
+          lock(buffer.mutex),
+          stream(level <= LogLevel::Warn ? buffer.err : buffer.out) {}
+
+    ~LogLine() {
+        stream << L'\n';
+        if (!log.running) {
+            // Before Start() / after Stop(): write through
+            lock.unlock();
+            log.FlushAll();
+        }
+    }
+
+    template <typename T>
+    LogLine &operator<<(const T &value) {
+        stream << value;
+        return *this;
+    }
+
+private:
+    AsyncLog &log;
+    AsyncLog::ThreadBuffer &buffer;
+    std::unique_lock<std::mutex> lock;
+    std::wostream &stream;
+};
+
+#define LOG(level, expr)                                   \
+    do {                                                   \
+        if (AsyncLog::Instance().Enabled(level)) {         \
+            LogLine logLine_(level);                       \
+            logLine_ << expr;                              \
+        }                                                  \
+    } while (0)
+
+#define LOG_SAMPLED(level, expr)                                                         \
+    do {                                                                                 \
+        if (AsyncLog::Instance().Enabled(level) && AsyncLog::Instance().Sample()) {      \
+            LogLine logLine_(level);                                                     \
+            logLine_ << expr;                                                            \
+        }                                                                                \
+    } while (0)
@@ -0,0 +1,209 @@
+#pragma once
+// Cluster bitmap that several threads can allocate from without a lock
+//
+// The bitmap is held as 64-bit atomic words, bit 0 of word i being cluster
+// 64 * i, the same layout FSCTL_GET_VOLUME_BITMAP returns. A run is claimed
+// word by word with compare-and-swap: a word is only changed when none of
+// the run's bits in it are set, so two threads can never both own a
+// cluster. When a later word of the run turns out to be taken, the words
+// already claimed are given back and the caller learns which cluster was in
+// the way.
+//
+// Searches read the words while other threads change them. A run found
+// that way is only a candidate until TryClaimRun succeeds on it, which is
+// what ClaimFreeRun does in a loop.
+
+#include "free_run.h"
+#include "volume_geometry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class AtomicClusterBitmap {
+public:
+    // All clusters free
+    explicit AtomicClusterBitmap(uint64_t totalClusters)
+        : totalClusters(totalClusters), wordCount((size_t)((totalClusters + 63) / 64)),
+          words(new std::atomic<uint64_t>[wordCount]) {
+        for (size_t i = 0; i < wordCount; i++) {
+            words[i].store(0, std::memory_order_relaxed);
+        }
+        MarkTailAllocated();
+    }
+
+    // From a byte bitmap; bytes past its end count as allocated
+    AtomicClusterBitmap(const uint8_t *bytes, size_t size, uint64_t totalClusters)
+        : AtomicClusterBitmap(totalClusters) {
+        BitmapWords source(bytes, size);
+        for (size_t i = 0; i < wordCount; i++) {
+            words[i].store(source(i), std::memory_order_relaxed);
+        }
+        MarkTailAllocated();
+    }
+
+    AtomicClusterBitmap(const AtomicClusterBitmap &) = delete;
+    AtomicClusterBitmap &operator=(const AtomicClusterBitmap &) = delete;
+
+    uint64_t TotalClusters() const { return totalClusters; }
+
+    // Word source for FindFreeRun. Bits past the end of the volume read as allocated.
+    uint64_t operator()(uint64_t index) const {
+        return index < wordCount ? words[index].load(std::memory_order_acquire) : ~0ULL;
+    }
+
+    bool IsFree(uint64_t lcn) const { return lcn < totalClusters && !(((*this)(lcn / 64) >> (lcn % 64)) & 1); }
+
+    // Mark [start, start + count) allocated if every cluster in it is free.
+    // On failure nothing is left claimed and conflictLcn is the first
+    // cluster of the range found allocated.
+    bool TryClaimRun(uint64_t start, uint64_t count, uint64_t &conflictLcn) {
+        if (count == 0 || start >= totalClusters || count > totalClusters - start) {
+            conflictLcn = start;
+            return false;
+        }
+        uint64_t end = start + count;
+        for (uint64_t c = start; c < end;) {
+            size_t index = (size_t)(c / 64);
+            uint64_t mask = RangeMask(c, end);
+            uint64_t w = words[index].load(std::memory_order_relaxed);
+            do {
+                if (w & mask) {
+                    conflictLcn = (uint64_t)index * 64 + LowestBit(w & mask);
+                    if (c > start) {
+                        ReleaseRun(start, c - start);
+                    }
+                    return false;
+                }
+            } while (!words[index].compare_exchange_weak(w, w | mask, std::memory_order_acq_rel,
+                                                         std::memory_order_relaxed));
+            c = (uint64_t)(index + 1) * 64;
+        }
+        return true;
+    }
+
+    bool TryClaimRun(uint64_t start, uint64_t count) {
+        uint64_t conflictLcn = 0;
+        return TryClaimRun(start, count, conflictLcn);
+    }
+
+    // Mark [start, start + count) free. Returns false if any cluster in it
+    // was already free, which means the caller did not own the whole run;
+    // the range is free afterwards either way.
+    bool ReleaseRun(uint64_t start, uint64_t count) {
+        if (count == 0 || start >= totalClusters || count > totalClusters - start) {
+            return false;
+        }
+        uint64_t end = start + count;
+        bool owned = true;
+        for (uint64_t c = start; c < end;) {
+            size_t index = (size_t)(c / 64);
+            uint64_t mask = RangeMask(c, end);
+            uint64_t before = words[index].fetch_and(~mask, std::memory_order_release);
+            owned = owned && (before & mask) == mask;
+            c = (uint64_t)(index + 1) * 64;
+        }
+        return owned;
+    }
+
+    // Find and claim the first run of `needed` free clusters in
+    // [fromLcn, toLcn) that does not touch a reserved range. A candidate
+    // lost to another thread is searched again past the cluster that was
+    // taken, so every retry starts further on and the loop ends.
+    bool ClaimFreeRun(uint64_t fromLcn,
+                      uint64_t toLcn,
+                      uint64_t needed,
+                      const std::vector<LcnRange> &reserved,
+                      uint64_t &outStart,
+                      uint64_t *conflicts = nullptr) {
+        uint64_t from = fromLcn;
+        while (from < toLcn) {
+            uint64_t start = 0;
+            if (!FindFreeRun(*this, from, toLcn, needed, reserved, start)) {
+                return false;
+            }
+            uint64_t conflictLcn = 0;
+            if (TryClaimRun(start, needed, conflictLcn)) {
+                outStart = start;
+                return true;
+            }
+            if (conflicts) {
+                (*conflicts)++;
+            }
+            from = conflictLcn + 1;
+        }
+        return false;
+    }
+
+    // Same, but prefer a run at or after hintLcn and wrap around to the
+    // start of [0, totalClusters) only if nothing fits past the hint
+    bool ClaimFreeRunNear(uint64_t hintLcn,
+                          uint64_t needed,
+                          const std::vector<LcnRange> &reserved,
+                          uint64_t &outStart,
+                          uint64_t *conflicts = nullptr) {
+        if (hintLcn >= totalClusters) {
+            hintLcn = 0;
+        }
+        if (ClaimFreeRun(hintLcn, totalClusters, needed, reserved, outStart, conflicts)) {
+            return true;
+        }
+        uint64_t wrapEnd = std::min(hintLcn + needed, totalClusters);
+        return hintLcn > 0 && ClaimFreeRun(0, wrapEnd, needed, reserved, outStart, conflicts);
+    }
+
+    // Copy into a byte bitmap as FSCTL_GET_VOLUME_BITMAP lays it out. Only
+    // consistent when no thread is claiming or releasing.
+    void CopyTo(std::vector<uint8_t> &bitmap) const {
+        bitmap.assign((size_t)((totalClusters + 7) / 8), 0);
+        for (size_t i = 0; i < bitmap.size(); i++) {
+            bitmap[i] = (uint8_t)((*this)(i / 8) >> (8 * (i % 8)));
+        }
+    }
+
+    uint64_t FreeClusters() const {
+        uint64_t free = 0;
+        for (size_t i = 0; i < wordCount; i++) {
+            free += 64 - PopCount(words[i].load(std::memory_order_relaxed));
+        }
+        return free;
+    }
+
+private:
+    // Bits of word c / 64 that lie in [c, end)
+    static uint64_t RangeMask(uint64_t c, uint64_t end) {
+        unsigned bit = (unsigned)(c % 64);
+        uint64_t bits = std::min<uint64_t>(64 - bit, end - c);
+        return (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << bit;
+    }
+
+    static unsigned LowestBit(uint64_t w) {
+        unsigned n = 0;
+        while (!(w & 1)) {
+            w >>= 1;
+            n++;
+        }
+        return n;
+    }
+
+    static unsigned PopCount(uint64_t w) {
+        unsigned n = 0;
+        for (; w; w &= w - 1) {
+            n++;
+        }
+        return n;
+    }
+
+    // Clusters past the end of the volume can never be claimed
+    void MarkTailAllocated() {
+        if (totalClusters % 64 != 0) {
+            words[wordCount - 1].fetch_or(~0ULL << (totalClusters % 64), std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t totalClusters;
+    size_t wordCount;
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+};
@@ -0,0 +1,324 @@
+// Concurrent allocation from one cluster bitmap
+//
+//   atomic_bitmap_bench [threads = all cores] [seconds = 2] [clusters-M = 64]
+//
+//   1. replays random claims and releases on one thread against a plain
+//      bit array, including runs that cross word boundaries
+//   2. stress: `threads` workers (at least 4) claim and release runs on a
+//      small, half-allocated bitmap for `seconds`. Every claimed cluster is
+//      recorded in an owner table with its own CAS, so a cluster handed to
+//      two workers at once is caught. At the end the bitmap must equal the
+//      starting bitmap plus the runs still held
+//   3. contention: 1, 2, 4, ... `threads` workers claim and release runs of
+//      8-64 clusters, all starting from the same LCN (hot) or each from its
+//      own part of the volume (spread), on the atomic bitmap and on a byte
+//      bitmap behind one mutex, and reports claims per second
+
+#include "atomic_bitmap.h"
+#include "simulated_volume.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <type_traits>
+
+static bool CrossCheck() {
+    const uint64_t total = 20000 + 37;
+    std::mt19937_64 rng(7);
+    AtomicClusterBitmap bitmap(total);
+    std::vector<bool> model(total, false);
+    std::vector<LcnRange> none;
+    for (int op = 0; op < 200000; op++) {
+        uint64_t start = rng() % total;
+        uint64_t count = 1 + rng() % (rng() % 8 == 0 ? 300 : 20);
+        bool inside = count <= total - start;
+        if (rng() % 3 != 0) {
+            bool expected = inside;
+            uint64_t firstTaken = start;
+            for (uint64_t c = start; inside && c < start + count; c++) {
+                if (model[c]) {
+                    expected = false;
+                    firstTaken = c;
+                    break;
+                }
+            }
+            uint64_t conflict = 0;
+            bool claimed = bitmap.TryClaimRun(start, count, conflict);
+            if (claimed != expected || (!claimed && conflict != firstTaken)) {
+                std::cerr << "MISMATCH claim [" << start << ", +" << count << "): " << claimed << " vs " << expected
+                          << "\n";
+                return false;
+            }
+            for (uint64_t c = start; claimed && c < start + count; c++) {
+                model[c] = true;
+            }
+        } else {
+            bool expected = inside;
+            for (uint64_t c = start; inside && c < start + count; c++) {
+                expected = expected && model[c];
+                model[c] = false;
+            }
+            if (bitmap.ReleaseRun(start, count) != expected) {
+                std::cerr << "MISMATCH release [" << start << ", +" << count << ")\n";
+                return false;
+            }
+        }
+        if (op % 1000 == 0) {
+            uint64_t needed = 1 + rng() % 130;
+            uint64_t a = 0, b = 0;
+            std::vector<uint8_t> bytes;
+            bitmap.CopyTo(bytes);
+            bool fb = FindFreeRun(BitmapWords(bytes), start, total, needed, none, b);
+            bool fa = bitmap.ClaimFreeRun(start, total, needed, none, a);
+            if (fa != fb || (fa && a != b)) {
+                std::cerr << "MISMATCH ClaimFreeRun from " << start << " needed " << needed << "\n";
+                return false;
+            }
+            for (uint64_t c = a; fa && c < a + needed; c++) {
+                model[c] = true;
+            }
+        }
+    }
+    uint64_t free = 0;
+    for (uint64_t c = 0; c < total; c++) {
+        free += model[c] ? 0 : 1;
+        if (bitmap.IsFree(c) == model[c]) {
+            std::cerr << "MISMATCH at cluster " << c << "\n";
+            return false;
+        }
+    }
+    return free == bitmap.FreeClusters();
+}
+
+struct HeldRun {
+    uint64_t start;
+    uint64_t count;
+    bool searched = false; // from ClaimFreeRunNear, so it must avoid the reserved range
+};
+
+static bool Stress(unsigned threads, double seconds) {
+    const uint64_t total = 1ULL << 20;
+    SimulatedVolume volume(total, 0x57E5, 50);
+    std::vector<uint8_t> initial((size_t)(total / 8));
+    volume.ReadBytes(0, initial.data(), initial.size());
+    AtomicClusterBitmap bitmap(initial.data(), initial.size(), total);
+    std::vector<LcnRange> reserved{LcnRange{total / 4, total / 4 + total / 32}};
+
+    std::unique_ptr<std::atomic<uint32_t>[]> owner(new std::atomic<uint32_t>[total]);
+    for (uint64_t c = 0; c < total; c++) {
+        owner[c].store(0, std::memory_order_relaxed);
+    }
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> errors{0}, claims{0}, releases{0}, conflicts{0};
+    std::vector<std::vector<HeldRun>> held(threads);
+
+    auto worker = [&](unsigned id) {
+        std::mt19937_64 rng(id * 7919 + 1);
+        std::vector<HeldRun> &mine = held[id];
+        uint64_t lost = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (mine.size() < 64 && rng() % 4 != 0) {
+                uint64_t needed = 1 + rng() % (rng() % 4 == 0 ? 200 : 16);
+                uint64_t at = 0;
+                bool searched = rng() % 2 != 0;
+                bool claimed = searched ? bitmap.ClaimFreeRunNear(rng() % total, needed, reserved, at, &lost)
+                                        : bitmap.TryClaimRun(at = rng() % (total - needed), needed);
+                if (!claimed) {
+                    continue;
+                }
+                for (uint64_t c = at; c < at + needed; c++) {
+                    uint32_t expected = 0;
+                    if (!owner[c].compare_exchange_strong(expected, id + 1)) {
+                        errors++; // handed out twice
+                    }
+                }
+                mine.push_back(HeldRun{at, needed, searched});
+                claims++;
+            } else if (!mine.empty()) {
+                size_t pick = (size_t)(rng() % mine.size());
+                HeldRun run = mine[pick];
+                mine[pick] = mine.back();
+                mine.pop_back();
+                for (uint64_t c = run.start; c < run.start + run.count; c++) {
+                    if (owner[c].exchange(0) != id + 1) {
+                        errors++;
+                    }
+                }
+                if (!bitmap.ReleaseRun(run.start, run.count)) {
+                    errors++;
+                }
+                releases++;
+            }
+        }
+        conflicts += lost;
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(worker, i);
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (std::thread &t : workers) {
+        t.join();
+    }
+
+    // Bitmap = starting bitmap + runs still held; nothing claimed inside the reserved range
+    BitmapWords start(initial);
+    uint64_t wrong = 0;
+    for (uint64_t c = 0; c < total; c++) {
+        bool wasAllocated = (start(c / 64) >> (c % 64)) & 1;
+        bool heldNow = owner[c].load() != 0;
+        if (heldNow && wasAllocated) {
+            wrong++;
+        }
+        if (bitmap.IsFree(c) != (!wasAllocated && !heldNow)) {
+            wrong++;
+        }
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        for (const HeldRun &run : held[i]) {
+            if (run.searched && run.start < reserved[0].end && run.start + run.count > reserved[0].start) {
+                wrong++;
+            }
+        }
+    }
+    std::cout << "Stress, " << threads << " threads, " << seconds << " s: " << claims.load() << " claims, "
+              << releases.load() << " releases, " << conflicts.load() << " lost candidates, "
+              << errors.load() + wrong << " errors\n";
+    return errors.load() == 0 && wrong == 0;
+}
+
+// The baseline: one lock around every search and every update
+class LockedByteBitmap {
+public:
+    LockedByteBitmap(const std::vector<uint8_t> &bytes) : bytes(bytes) {}
+
+    bool ClaimFreeRun(uint64_t from, uint64_t to, uint64_t needed, const std::vector<LcnRange> &reserved,
+                      uint64_t &out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!FindFreeRun(BitmapWords(bytes), from, to, needed, reserved, out)) {
+            return false;
+        }
+        for (uint64_t c = out; c < out + needed; c++) {
+            bytes[(size_t)(c / 8)] |= (uint8_t)(1 << (c % 8));
+        }
+        return true;
+    }
+
+    void ReleaseRun(uint64_t start, uint64_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint64_t c = start; c < start + count; c++) {
+            bytes[(size_t)(c / 8)] &= (uint8_t)~(1 << (c % 8));
+        }
+    }
+
+private:
+    std::vector<uint8_t> bytes;
+    std::mutex mutex;
+};
+
+// Each worker holds up to 16 runs and releases the oldest before claiming again
+template <typename Bitmap>
+static double Contention(Bitmap &bitmap, uint64_t total, unsigned threads, bool hot, double seconds,
+                         uint64_t &conflictsOut) {
+    std::vector<LcnRange> none;
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> claims{0}, conflicts{0};
+    auto worker = [&](unsigned id) {
+        std::mt19937_64 rng(id + 1);
+        uint64_t hint = hot ? 0 : total / threads * id;
+        std::vector<HeldRun> mine;
+        uint64_t done = 0, lost = 0;
+        size_t oldest = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (mine.size() == 16) {
+                bitmap.ReleaseRun(mine[oldest].start, mine[oldest].count);
+            }
+            uint64_t needed = 8 + rng() % 57;
+            uint64_t at = 0;
+            bool claimed;
+            if constexpr (std::is_same<Bitmap, AtomicClusterBitmap>::value) {
+                claimed = bitmap.ClaimFreeRun(hint, total, needed, none, at, &lost);
+            } else {
+                claimed = bitmap.ClaimFreeRun(hint, total, needed, none, at);
+            }
+            if (mine.size() == 16) {
+                mine[oldest] = HeldRun{at, claimed ? needed : 0};
+                oldest = (oldest + 1) % 16;
+            } else if (claimed) {
+                mine.push_back(HeldRun{at, needed});
+            }
+            done += claimed ? 1 : 0;
+        }
+        for (const HeldRun &run : mine) {
+            if (run.count) {
+                bitmap.ReleaseRun(run.start, run.count);
+            }
+        }
+        claims += done;
+        conflicts += lost;
+    };
+    std::vector<std::thread> workers;
+    auto started = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(worker, i);
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (std::thread &t : workers) {
+        t.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    conflictsOut = conflicts.load();
+    return (double)claims.load() / elapsed;
+}
+
+int main(int argc, char **argv) {
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    unsigned threads = argc > 1 ? (unsigned)std::strtoul(argv[1], nullptr, 10) : cores;
+    double seconds = argc > 2 ? std::strtod(argv[2], nullptr) : 2;
+    uint64_t clusters = (argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 64) << 20;
+    if (threads == 0 || seconds <= 0 || clusters == 0) {
+        std::cerr << "invalid arguments\n";
+        return 1;
+    }
+    if (!CrossCheck()) {
+        return 1;
+    }
+    std::cout << "Cross-check against a plain bit array: OK\n";
+    if (!Stress(std::max(threads, 4u), seconds)) {
+        return 1;
+    }
+
+    SimulatedVolume volume(clusters, 0xC0DE, 60);
+    std::vector<uint8_t> bytes((size_t)((clusters + 7) / 8));
+    volume.ReadBytes(0, bytes.data(), bytes.size());
+    std::cout << "Contention on " << clusters << " clusters (" << cores << " cores), claims/s:\n";
+    for (bool hot : {true, false}) {
+        for (unsigned n = 1;; n = std::min(n * 2, threads)) {
+            AtomicClusterBitmap atomicBitmap(bytes.data(), bytes.size(), clusters);
+            LockedByteBitmap lockedBitmap(bytes);
+            uint64_t conflicts = 0, unused = 0;
+            double lockFree = Contention(atomicBitmap, clusters, n, hot, seconds / 2, conflicts);
+            double locked = Contention(lockedBitmap, clusters, n, hot, seconds / 2, unused);
+            std::vector<uint8_t> after;
+            atomicBitmap.CopyTo(after);
+            if (after != bytes) {
+                std::cerr << "bitmap not restored after all runs were released\n";
+                return 1;
+            }
+            std::cout << "  " << (hot ? "hot   " : "spread") << " threads " << n << ": atomic " << (uint64_t)lockFree
+                      << " (" << conflicts << " lost candidates), mutex " << (uint64_t)locked << "\n";
+            if (n == threads) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
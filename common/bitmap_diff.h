@@ -0,0 +1,206 @@
+#pragma once
+// Comparing two bitmaps of one volume
+//
+// DiffBitmaps walks two byte bitmaps in the FSCTL_GET_VOLUME_BITMAP layout,
+// as fetched or as a snapshot holds them. It reports every maximal LCN range
+// whose clusters changed the same way: newly allocated (0 -> 1) or freed
+// (1 -> 0), in LCN order.
+//
+// Between two runs most of a volume is unchanged. The comparison XORs 64
+// bytes (512 clusters) at a time with SSE2 and skips the block when the
+// result is all zero. Only blocks with a difference are taken a word at a
+// time, and inside a word the ranges are found with count-trailing-zeros,
+// not bit by bit. Each bitmap is read once, so the comparison runs at the
+// speed of memory. Without SSE2 (ARM64, 32-bit builds) the same blocks are
+// tested with eight 64-bit words.
+//
+// The same comparison checks a plan. Diff the bitmap the planner expects
+// after its moves against the one read from the volume afterwards:
+//   - "allocated" ranges are clusters in use that the plan left free
+//   - "freed" ranges are clusters the plan allocated that are free
+// On a quiet volume both are empty. Other writers add their own clusters.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BITMAP_DIFF_SSE2 1
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+enum class BitmapChangeKind { Allocated, Freed };
+
+// Clusters [start, end) all changed the same way
+struct BitmapChange {
+    uint64_t start;
+    uint64_t end;
+    BitmapChangeKind kind;
+};
+
+struct BitmapDiffSummary {
+    uint64_t clustersAllocated = 0;
+    uint64_t clustersFreed = 0;
+    uint64_t rangesAllocated = 0;
+    uint64_t rangesFreed = 0;
+    uint64_t blocksCompared = 0; // 64-byte blocks taken word by word
+    uint64_t blocksSkipped = 0;  // 64-byte blocks found identical
+
+    uint64_t ClustersChanged() const { return clustersAllocated + clustersFreed; }
+    uint64_t RangesChanged() const { return rangesAllocated + rangesFreed; }
+};
+
+namespace bitmap_diff_detail {
+
+// Index of the lowest set bit; w != 0
+inline unsigned TrailingZeros64(uint64_t w) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, w);
+    return (unsigned)index;
+#elif defined(__GNUC__)
+    return (unsigned)__builtin_ctzll(w);
+#else
+    unsigned n = 0;
+    while (!(w & 1)) {
+        w >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+inline uint64_t LoadWord(const uint8_t *p) {
+    uint64_t w;
+    std::memcpy(&w, p, 8); // little-endian, like the bitmap
+    return w;
+}
+
+// Builds ranges across word and block boundaries
+template <typename OnChange>
+class ChangeTracker {
+public:
+    ChangeTracker(BitmapDiffSummary &summary, OnChange &onChange) : summary(summary), onChange(onChange) {}
+
+    // The word of clusters [base, base + 64): bits that became allocated and
+    // bits that became free
+    void Word(uint64_t base, uint64_t allocatedBits, uint64_t freedBits) {
+        uint64_t changed = allocatedBits | freedBits;
+        unsigned pos = 0;
+        while (pos < 64) {
+            if (open) {
+                // ~same has ones above the shifted-out bits, so the run stops there at the latest
+                uint64_t same = (kind == BitmapChangeKind::Allocated ? allocatedBits : freedBits) >> pos;
+                pos += ~same == 0 ? 64 : TrailingZeros64(~same);
+                if (pos >= 64) {
+                    return;
+                }
+                Close(base + pos);
+            }
+            uint64_t rest = changed >> pos;
+            if (rest == 0) {
+                return;
+            }
+            pos += TrailingZeros64(rest);
+            open = true;
+            start = base + pos;
+            kind = ((allocatedBits >> pos) & 1) ? BitmapChangeKind::Allocated : BitmapChangeKind::Freed;
+        }
+    }
+
+    // Clusters from lcn on are unchanged (at least for a while)
+    void Close(uint64_t lcn) {
+        if (!open) {
+            return;
+        }
+        open = false;
+        if (kind == BitmapChangeKind::Allocated) {
+            summary.clustersAllocated += lcn - start;
+            summary.rangesAllocated++;
+        } else {
+            summary.clustersFreed += lcn - start;
+            summary.rangesFreed++;
+        }
+        onChange(BitmapChange{start, lcn, kind});
+    }
+
+private:
+    BitmapDiffSummary &summary;
+    OnChange &onChange;
+    bool open = false;
+    uint64_t start = 0;
+    BitmapChangeKind kind = BitmapChangeKind::Allocated;
+};
+
+// true if the 64-byte blocks are identical
+inline bool SameBlock(const uint8_t *before, const uint8_t *after) {
+#ifdef BITMAP_DIFF_SSE2
+    __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)before), _mm_loadu_si128((const __m128i *)after));
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(before + 16)),
+                               _mm_loadu_si128((const __m128i *)(after + 16)));
+    __m128i x2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(before + 32)),
+                               _mm_loadu_si128((const __m128i *)(after + 32)));
+    __m128i x3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(before + 48)),
+                               _mm_loadu_si128((const __m128i *)(after + 48)));
+    __m128i any = _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xFFFF;
+#else
+    uint64_t any = 0;
+    for (int i = 0; i < 64; i += 8) {
+        any |= LoadWord(before + i) ^ LoadWord(after + i);
+    }
+    return any == 0;
+#endif
+}
+
+} // namespace bitmap_diff_detail
+
+// Compare the first totalClusters bits of two bitmaps of
+// (totalClusters + 7) / 8 bytes each. onChange(const BitmapChange &) is
+// called for every changed range, in LCN order.
+template <typename OnChange>
+BitmapDiffSummary DiffBitmaps(const uint8_t *before, const uint8_t *after, uint64_t totalClusters, OnChange onChange) {
+    using namespace bitmap_diff_detail;
+    BitmapDiffSummary summary;
+    ChangeTracker<OnChange> tracker(summary, onChange);
+
+    // Whole blocks first; the last clusters, which may end inside a byte,
+    // go word by word below
+    uint64_t blocks = totalClusters / 512;
+    for (uint64_t k = 0; k < blocks; k++) {
+        const uint8_t *b = before + k * 64;
+        const uint8_t *a = after + k * 64;
+        if (SameBlock(b, a)) {
+            summary.blocksSkipped++;
+            tracker.Close(k * 512);
+            continue;
+        }
+        summary.blocksCompared++;
+        for (unsigned i = 0; i < 8; i++) {
+            uint64_t wb = LoadWord(b + 8 * i);
+            uint64_t wa = LoadWord(a + 8 * i);
+            tracker.Word(k * 512 + 64 * i, wa & ~wb, wb & ~wa);
+        }
+    }
+
+    uint64_t bytes = (totalClusters + 7) / 8;
+    for (uint64_t lcn = blocks * 512; lcn < totalClusters; lcn += 64) {
+        uint64_t at = lcn / 8;
+        size_t n = (size_t)std::min<uint64_t>(8, bytes - at);
+        uint64_t wb = 0, wa = 0;
+        std::memcpy(&wb, before + at, n);
+        std::memcpy(&wa, after + at, n);
+        uint64_t valid = totalClusters - lcn >= 64 ? ~0ULL : (1ULL << (totalClusters - lcn)) - 1;
+        tracker.Word(lcn, wa & ~wb & valid, wb & ~wa & valid);
+    }
+    tracker.Close(totalClusters);
+    return summary;
+}
+
+// Counts only
+inline BitmapDiffSummary DiffBitmaps(const uint8_t *before, const uint8_t *after, uint64_t totalClusters) {
+    return DiffBitmaps(before, after, totalClusters, [](const BitmapChange &) {});
+}
@@ -0,0 +1,223 @@
+// Comparing two bitmaps of a very large volume
+//
+//   bitmap_diff_bench [clusters = 1073741824]
+//
+//   1. fills a bitmap of `clusters` clusters with allocated and free runs of
+//      random length, then copies it and changes the copy the way a day of
+//      use would: runs of up to 256 clusters allocated and freed at random,
+//      0.1% of the volume in all
+//   2. times one plain pass that reads both bitmaps (the memory bandwidth
+//      the diff aims for), then the diff, and checks its ranges and counts
+//      against a bit-by-bit comparison
+//   3. times the diff of identical bitmaps and of bitmaps that differ in
+//      every other cluster, the best and the worst case
+//   4. applies a plan of moves to the first bitmap, as the defragmenter
+//      keeps its expected state, and "runs" it on a copy where one move
+//      failed and another process allocated a file. The cross-check must
+//      find exactly those two differences
+
+#include "bitmap_diff.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+static double Since(std::chrono::steady_clock::time_point started) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+static void SetRun(std::vector<uint8_t> &bitmap, uint64_t lcn, uint64_t count, bool allocated) {
+    for (uint64_t c = lcn; c < lcn + count; c++) {
+        if (c % 8 == 0 && c + 8 <= lcn + count) {
+            bitmap[(size_t)(c / 8)] = allocated ? 0xFF : 0;
+            c += 7;
+        } else if (allocated) {
+            bitmap[(size_t)(c / 8)] |= (uint8_t)(1 << (c % 8));
+        } else {
+            bitmap[(size_t)(c / 8)] &= (uint8_t)~(1 << (c % 8));
+        }
+    }
+}
+
+static bool Bit(const std::vector<uint8_t> &bitmap, uint64_t lcn) {
+    return (bitmap[(size_t)(lcn / 8)] >> (lcn % 8)) & 1;
+}
+
+// The same ranges, one cluster at a time (equal bytes skipped)
+static std::vector<BitmapChange> SlowDiff(const std::vector<uint8_t> &before, const std::vector<uint8_t> &after,
+                                          uint64_t clusters) {
+    std::vector<BitmapChange> changes;
+    for (uint64_t lcn = 0; lcn < clusters; lcn++) {
+        if (before[(size_t)(lcn / 8)] == after[(size_t)(lcn / 8)] && lcn % 8 == 0 && lcn + 8 <= clusters) {
+            lcn += 7;
+            continue;
+        }
+        bool b = Bit(before, lcn);
+        bool a = Bit(after, lcn);
+        if (a == b) {
+            continue;
+        }
+        BitmapChangeKind kind = a ? BitmapChangeKind::Allocated : BitmapChangeKind::Freed;
+        if (!changes.empty() && changes.back().end == lcn && changes.back().kind == kind) {
+            changes.back().end++;
+        } else {
+            changes.push_back(BitmapChange{lcn, lcn + 1, kind});
+        }
+    }
+    return changes;
+}
+
+static bool SameChanges(const std::vector<BitmapChange> &x, const std::vector<BitmapChange> &y) {
+    if (x.size() != y.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < x.size(); i++) {
+        if (x[i].start != y[i].start || x[i].end != y[i].end || x[i].kind != y[i].kind) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Read both bitmaps once, doing as little as possible with the bytes
+static uint64_t ReadBoth(const std::vector<uint8_t> &x, const std::vector<uint8_t> &y) {
+    uint64_t any = 0;
+    for (size_t i = 0; i + 8 <= x.size(); i += 8) {
+        any |= bitmap_diff_detail::LoadWord(&x[i]) ^ bitmap_diff_detail::LoadWord(&y[i]);
+    }
+    return any;
+}
+
+int main(int argc, char **argv) {
+    uint64_t clusters = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1ULL << 30;
+    if (clusters < 4096) {
+        std::cerr << "invalid arguments: at least 4096 clusters\n";
+        return 1;
+    }
+
+    std::vector<uint8_t> before((size_t)((clusters + 7) / 8), 0);
+    std::mt19937_64 rng(49);
+    for (uint64_t lcn = 0; lcn < clusters;) {
+        uint64_t count = std::min<uint64_t>(1 + rng() % 4096, clusters - lcn);
+        if (rng() % 100 < 60) {
+            SetRun(before, lcn, count, true);
+        }
+        lcn += count;
+    }
+    std::vector<uint8_t> after(before);
+    uint64_t churn = 0;
+    while (churn < clusters / 1000) {
+        uint64_t count = 1 + rng() % 256;
+        uint64_t lcn = rng() % (clusters - count);
+        SetRun(after, lcn, count, rng() % 2 == 0);
+        churn += count;
+    }
+    double mb = (double)before.size() / (1 << 20);
+    std::cout << "Volume: " << clusters << " clusters, two bitmaps of " << mb << " MB, " << churn
+              << " clusters rewritten\n";
+
+    auto started = std::chrono::steady_clock::now();
+    volatile uint64_t sink = ReadBoth(before, after);
+    double readSeconds = Since(started);
+    std::cout << "Plain read of both: " << readSeconds << " s (" << 2 * mb / readSeconds << " MB/s)\n";
+    (void)sink;
+
+    std::vector<BitmapChange> changes;
+    started = std::chrono::steady_clock::now();
+    BitmapDiffSummary s = DiffBitmaps(before.data(), after.data(), clusters,
+                                      [&](const BitmapChange &c) { changes.push_back(c); });
+    double diffSeconds = Since(started);
+    std::cout << "Diff: " << diffSeconds << " s (" << 2 * mb / diffSeconds << " MB/s), " << s.clustersAllocated
+              << " clusters allocated in " << s.rangesAllocated << " ranges, " << s.clustersFreed
+              << " freed in " << s.rangesFreed << ", " << s.blocksSkipped << " of "
+              << s.blocksSkipped + s.blocksCompared << " blocks skipped\n";
+    started = std::chrono::steady_clock::now();
+    std::vector<BitmapChange> expected = SlowDiff(before, after, clusters);
+    std::cout << "Bit-by-bit diff: " << Since(started) << " s\n";
+    uint64_t expectAllocated = 0, expectFreed = 0;
+    for (const BitmapChange &c : expected) {
+        (c.kind == BitmapChangeKind::Allocated ? expectAllocated : expectFreed) += c.end - c.start;
+    }
+    bool sameRanges = SameChanges(changes, expected);
+    bool sameCounts = s.clustersAllocated == expectAllocated && s.clustersFreed == expectFreed &&
+                      s.RangesChanged() == expected.size();
+
+    started = std::chrono::steady_clock::now();
+    BitmapDiffSummary identical = DiffBitmaps(before.data(), before.data(), clusters);
+    double identicalSeconds = Since(started);
+    std::vector<uint8_t> alternating(before);
+    for (uint8_t &byte : alternating) {
+        byte ^= 0x55;
+    }
+    started = std::chrono::steady_clock::now();
+    BitmapDiffSummary worst = DiffBitmaps(before.data(), alternating.data(), clusters);
+    double worstSeconds = Since(started);
+    std::cout << "Identical bitmaps: " << identicalSeconds << " s (" << 2 * mb / identicalSeconds
+              << " MB/s); every other cluster changed: " << worstSeconds << " s, " << worst.RangesChanged()
+              << " ranges\n";
+    alternating.clear();
+    alternating.shrink_to_fit();
+    bool bestAndWorst = identical.RangesChanged() == 0 && worst.ClustersChanged() == (clusters + 1) / 2 &&
+                        worst.RangesChanged() == (clusters + 1) / 2;
+
+    // Cross-check: 1000 planned moves of up to 64 clusters from allocated
+    // runs to free ones. The plan's bitmap has every move done.
+    std::vector<uint8_t> plan(before);
+    struct Move {
+        uint64_t src, dst, count;
+    };
+    std::vector<Move> moves;
+    while (moves.size() < 1000) {
+        uint64_t count = 1 + rng() % 64;
+        uint64_t src = rng() % (clusters - count);
+        uint64_t dst = rng() % (clusters - count);
+        bool ok = true;
+        for (uint64_t i = 0; i < count && ok; i++) {
+            ok = Bit(plan, src + i) && !Bit(plan, dst + i) && (src + i < dst || src + i >= dst + count);
+        }
+        if (ok) {
+            SetRun(plan, dst, count, true);
+            SetRun(plan, src, count, false);
+            moves.push_back(Move{src, dst, count});
+        }
+    }
+    // The volume after the run: move 500 failed (source kept, destination
+    // never written) and another process took 10 free clusters
+    std::vector<uint8_t> actual(plan);
+    const Move &failed = moves[500];
+    SetRun(actual, failed.dst, failed.count, false);
+    SetRun(actual, failed.src, failed.count, true);
+    // Free in the plan, and not touching the failed move, so it stays a range of its own
+    auto apart = [](uint64_t lcn, uint64_t count, uint64_t start, uint64_t length) {
+        return lcn + count < start || lcn > start + length;
+    };
+    uint64_t foreign = 0;
+    bool free = false;
+    while (!free) {
+        foreign = rng() % (clusters - 10);
+        free = apart(foreign, 10, failed.src, failed.count) && apart(foreign, 10, failed.dst, failed.count);
+        for (uint64_t i = 0; i < 10 && free; i++) {
+            free = !Bit(actual, foreign + i);
+        }
+    }
+    SetRun(actual, foreign, 10, true);
+    std::vector<BitmapChange> found;
+    DiffBitmaps(plan.data(), actual.data(), clusters, [&](const BitmapChange &c) { found.push_back(c); });
+    std::vector<BitmapChange> wanted = {{failed.src, failed.src + failed.count, BitmapChangeKind::Allocated},
+                                        {failed.dst, failed.dst + failed.count, BitmapChangeKind::Freed},
+                                        {foreign, foreign + 10, BitmapChangeKind::Allocated}};
+    std::sort(wanted.begin(), wanted.end(), [](const BitmapChange &x, const BitmapChange &y) { return x.start < y.start; });
+    bool crossChecked = SameChanges(found, wanted);
+    std::cout << "Cross-check of " << moves.size() << " planned moves: " << found.size()
+              << " differences (a failed move of " << failed.count << " clusters, 10 clusters taken by another process)\n";
+
+    bool ok = sameRanges && sameCounts && bestAndWorst && crossChecked;
+    std::cout << "Check: " << changes.size() << " ranges, " << (sameRanges ? "same as" : "DIFFERENT from")
+              << " the bit-by-bit diff, counts " << (sameCounts ? "match" : "DIFFER") << ", best and worst case "
+              << (bestAndWorst ? "right" : "WRONG") << ", cross-check " << (crossChecked ? "exact" : "WRONG")
+              << (ok ? "" : "  FAILED") << "\n";
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+#pragma once
+// Range-partitioned volume bitmap fetch
+//
+// FSCTL_GET_VOLUME_BITMAP answers for one starting LCN at a time, so a
+// serial loop over a large volume is a long chain of round trips. Here
+// [0, totalClusters) is split into N ranges, each fetched by its own thread
+// through its own BitmapSource (on Windows: its own volume handle, since
+// calls on one synchronous handle are serialized by the I/O manager).
+//
+// Range bounds are multiples of 64 clusters, so every range owns whole
+// bytes of the output bitmap and the threads write without any locking.
+// Replies are copied byte-wise (the driver rounds the starting LCN down to a
+// multiple of 8, so reply and output bytes line up).
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+enum class IoStatus {
+    Success,  // everything from the starting LCN to the end of the volume fit
+    MoreData, // the output buffer filled up (ERROR_MORE_DATA)
+    Failed
+};
+
+// Layout of VOLUME_BITMAP_BUFFER up to its Buffer member
+struct BitmapReplyHeader {
+    int64_t startingLcn;
+    int64_t bitmapSize; // clusters from startingLcn to the end of the volume
+};
+
+// Anything that can answer FSCTL_GET_VOLUME_BITMAP: a volume handle, a
+// simulated volume, a recorded trace
+class BitmapSource {
+public:
+    virtual ~BitmapSource() {}
+
+    // Fill out with a BitmapReplyHeader followed by bitmap bytes, starting at
+    // startingLcn rounded down to a multiple of 8
+    virtual IoStatus Read(int64_t startingLcn, void *out, uint32_t outSize, uint32_t &bytesReturned) = 0;
+};
+
+// Creates the source used by one range (called once per range, on the
+// fetching thread). Returning nullptr fails the fetch.
+typedef std::function<std::unique_ptr<BitmapSource>(unsigned rangeIndex)> BitmapSourceFactory;
+
+struct BitmapFetchOptions {
+    unsigned ranges = 1;                // concurrent ranges (threads)
+    uint32_t chunkBytes = 1024 * 1024;  // bitmap bytes per call, 1 MB = 8M clusters
+};
+
+struct BitmapFetchStats {
+    uint64_t ioctlCalls = 0;
+    double seconds = 0;                 // until the last range completed
+    double slowestRangeSeconds = 0;
+    double fastestRangeSeconds = 0;
+};
+
+namespace bitmapfetch_detail {
+
+struct RangeResult {
+    bool ok = false;
+    uint64_t calls = 0;
+    double seconds = 0;
+};
+
+inline void FetchRange(BitmapSource &source, uint64_t rangeStart, uint64_t rangeEnd, uint32_t chunkBytes,
+                       uint8_t *out, RangeResult &result) {
+    auto started = std::chrono::steady_clock::now();
+    uint64_t rangeBytes = (rangeEnd - rangeStart + 7) / 8;
+    uint32_t bodyBytes = (uint32_t)std::min<uint64_t>(chunkBytes, rangeBytes);
+    std::vector<uint64_t> buffer((sizeof(BitmapReplyHeader) + bodyBytes + 7) / 8);
+    const uint8_t *body = reinterpret_cast<const uint8_t *>(buffer.data()) + sizeof(BitmapReplyHeader);
+
+    uint64_t lcn = rangeStart;
+    while (lcn < rangeEnd) {
+        uint32_t wantBytes = (uint32_t)std::min<uint64_t>(bodyBytes, (rangeEnd - lcn + 7) / 8);
+        uint32_t returned = 0;
+        IoStatus status = source.Read((int64_t)lcn, buffer.data(),
+                                      (uint32_t)sizeof(BitmapReplyHeader) + wantBytes, returned);
+        result.calls++;
+        if (status == IoStatus::Failed || returned < sizeof(BitmapReplyHeader)) {
+            return;
+        }
+        BitmapReplyHeader header;
+        std::memcpy(&header, buffer.data(), sizeof(header));
+        if (header.startingLcn < 0 || (uint64_t)header.startingLcn > lcn) {
+            return;
+        }
+
+        // Bits actually present in this reply, from lcn on
+        uint64_t skip = lcn - (uint64_t)header.startingLcn; // a multiple of 8
+        uint64_t present = std::min<uint64_t>((uint64_t)header.bitmapSize,
+                                              (uint64_t)(returned - sizeof(BitmapReplyHeader)) * 8);
+        if (present <= skip) {
+            break; // nothing new: end of volume
+        }
+        uint64_t usable = std::min<uint64_t>(present - skip, rangeEnd - lcn);
+        std::memcpy(out + lcn / 8, body + skip / 8, (size_t)((usable + 7) / 8));
+        lcn += usable;
+        if (status == IoStatus::Success && lcn < rangeEnd && usable == present - skip) {
+            break; // the driver says this was the rest of the volume
+        }
+    }
+    result.ok = true;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+} // namespace bitmapfetch_detail
+
+// Fetch the whole bitmap (1 = allocated) into out, which is resized to
+// (totalClusters + 7) / 8 bytes. Returns false if any range failed.
+inline bool FetchVolumeBitmap(uint64_t totalClusters,
+                              std::vector<uint8_t> &out,
+                              const BitmapFetchOptions &options,
+                              const BitmapSourceFactory &makeSource,
+                              BitmapFetchStats *stats = nullptr) {
+    auto started = std::chrono::steady_clock::now();
+    out.assign((size_t)((totalClusters + 7) / 8), 0);
+    if (totalClusters == 0) {
+        return false;
+    }
+
+    // Ranges are multiples of 64 clusters; more ranges than that would be empty
+    uint64_t words = (totalClusters + 63) / 64;
+    unsigned ranges = (unsigned)std::max<uint64_t>(1, std::min<uint64_t>(std::max(options.ranges, 1u), words));
+    uint64_t clustersPerRange = ((words + ranges - 1) / ranges) * 64;
+    uint32_t chunkBytes = std::max<uint32_t>(options.chunkBytes, 8);
+
+    std::vector<bitmapfetch_detail::RangeResult> results(ranges);
+    auto runRange = [&](unsigned r) {
+        uint64_t rangeStart = (uint64_t)r * clustersPerRange;
+        uint64_t rangeEnd = std::min(totalClusters, rangeStart + clustersPerRange);
+        if (rangeStart >= rangeEnd) {
+            results[r].ok = true;
+            return;
+        }
+        std::unique_ptr<BitmapSource> source = makeSource(r);
+        if (source) {
+            bitmapfetch_detail::FetchRange(*source, rangeStart, rangeEnd, chunkBytes, out.data(), results[r]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(ranges - 1);
+    for (unsigned r = 1; r < ranges; r++) {
+        threads.emplace_back(runRange, r);
+    }
+    runRange(0);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    // Bits past the last cluster are not clusters
+    if (totalClusters % 8) {
+        out.back() &= (uint8_t)((1u << (totalClusters % 8)) - 1);
+    }
+
+    bool ok = true;
+    if (stats) {
+        *stats = BitmapFetchStats();
+        stats->fastestRangeSeconds = results[0].seconds;
+    }
+    for (const auto &r : results) {
+        ok = ok && r.ok;
+        if (stats) {
+            stats->ioctlCalls += r.calls;
+            stats->slowestRangeSeconds = std::max(stats->slowestRangeSeconds, r.seconds);
+            stats->fastestRangeSeconds = std::min(stats->fastestRangeSeconds, r.seconds);
+        }
+    }
+    if (stats) {
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    }
+    return ok;
+}
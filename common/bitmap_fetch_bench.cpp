@@ -0,0 +1,71 @@
+// Benchmark for FetchVolumeBitmap against a simulated volume
+//
+//   bitmap_fetch_bench [terabytes = 64] [cluster-KB = 16] [latency-us = 2000]
+//                      [chunk-KB = 1024] [ranges = 1,2,4,8,16]
+//
+// Reports the time until the full bitmap is in memory for each range count.
+// The first run is checked bit for bit against the simulated volume, later
+// runs are compared with the first.
+
+#include "simulated_volume.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+int main(int argc, char **argv) {
+    uint64_t terabytes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 64;
+    uint64_t clusterKB = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 16;
+    long latencyUs = argc > 3 ? std::strtol(argv[3], nullptr, 10) : 2000;
+    uint64_t chunkKB = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 1024;
+    std::string rangeList = argc > 5 ? argv[5] : "1,2,4,8,16";
+    if (terabytes == 0 || clusterKB == 0 || chunkKB == 0 || chunkKB > 1024 * 1024) {
+        std::cerr << "invalid arguments\n";
+        return 1;
+    }
+
+    uint64_t totalClusters = (terabytes << 40) / (clusterKB << 10);
+    SimulatedVolume volume(totalClusters, 0x5EED);
+    std::cout << "Volume: " << terabytes << " TB, " << clusterKB << " KB clusters, " << totalClusters
+              << " clusters, bitmap " << ((totalClusters + 7) / 8) / (1024 * 1024) << " MB\n";
+    std::cout << "Latency " << latencyUs << " us per call, chunk " << chunkKB << " KB\n\n";
+
+    std::vector<uint8_t> reference;
+    std::stringstream ranges(rangeList);
+    std::string item;
+    while (std::getline(ranges, item, ',')) {
+        BitmapFetchOptions options;
+        options.ranges = (unsigned)std::strtoul(item.c_str(), nullptr, 10);
+        options.chunkBytes = (uint32_t)(chunkKB * 1024);
+        auto factory = [&](unsigned) -> std::unique_ptr<BitmapSource> {
+            return std::unique_ptr<BitmapSource>(
+                new SimulatedBitmapSource(volume, std::chrono::microseconds(latencyUs)));
+        };
+
+        std::vector<uint8_t> bitmap;
+        BitmapFetchStats stats;
+        bool ok = FetchVolumeBitmap(totalClusters, bitmap, options, factory, &stats);
+
+        bool same = ok;
+        if (ok && reference.empty()) {
+            std::vector<uint8_t> expected(1024 * 1024);
+            for (uint64_t at = 0; at < bitmap.size() && same; at += expected.size()) {
+                size_t n = (size_t)std::min<uint64_t>(expected.size(), bitmap.size() - at);
+                volume.ReadBytes(at, expected.data(), n);
+                same = std::memcmp(expected.data(), bitmap.data() + at, n) == 0;
+            }
+            reference.swap(bitmap);
+        } else if (ok) {
+            same = bitmap == reference;
+        }
+
+        std::cout << "ranges " << options.ranges << ": " << stats.seconds << " s, " << stats.ioctlCalls
+                  << " calls, range time " << stats.fastestRangeSeconds << " .. " << stats.slowestRangeSeconds
+                  << " s" << (same ? "" : "  MISMATCH") << "\n";
+        if (!same) {
+            return 1;
+        }
+    }
+    return 0;
+}
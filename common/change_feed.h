@@ -0,0 +1,150 @@
+#pragma once
+// File change feeds for incremental re-analysis
+//
+// A change source reports which paths changed since a position it handed
+// out earlier. On Windows that is the NTFS USN journal (the tools implement
+// ChangeSource over FSCTL_READ_USN_JOURNAL); ChangeLogSource reads the same
+// information from a text file, which is how incremental runs are tested
+// and benchmarked without a volume.
+//
+// Positions are only meaningful to the source that issued them: a snapshot
+// stores (kind, id, position) and a later run may only continue from it if
+// the source has the same kind and id and still holds that position.
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum class ChangeSourceKind : uint32_t {
+    None = 0,
+    UsnJournal = 1,
+    ChangeLog = 2
+};
+
+enum class ChangeKind {
+    Modified,         // created, written, truncated or renamed to this path
+    Deleted,          // deleted or renamed away from this path
+    DirectoryAdded,   // a directory appeared (created or renamed): everything below it is new
+    DirectoryDeleted  // a directory went away: everything below it is gone
+};
+
+struct FileChange {
+    ChangeKind kind;
+    std::wstring path;
+};
+
+// Where a source is, in its own terms
+struct ChangePosition {
+    ChangeSourceKind kind = ChangeSourceKind::None;
+    uint64_t id = 0;       // USN journal id; 0 for a change log
+    uint64_t position = 0; // next USN; line number for a change log
+};
+
+enum class ChangeReadStatus {
+    Ok,
+    Unavailable,   // no journal on the volume, cannot read the log
+    Discontinuous  // the source no longer holds the requested position (journal recreated or wrapped)
+};
+
+class ChangeSource {
+public:
+    virtual ~ChangeSource() {}
+
+    // The position changes made from now on will be reported after
+    virtual bool Current(ChangePosition &out) = 0;
+
+    // Append every change after from to out, and where the next read should start
+    virtual ChangeReadStatus Read(const ChangePosition &from, std::vector<FileChange> &out, ChangePosition &next) = 0;
+};
+
+// Change log file: one change per line, "M <path>", "D <path>",
+// "DA <directory>" or "DD <directory>". Positions are line numbers, so an
+// appended log is read from where the last run stopped.
+class ChangeLogSource : public ChangeSource {
+public:
+    explicit ChangeLogSource(const std::wstring &logPath) : logPath(logPath) {}
+
+    bool Current(ChangePosition &out) override {
+        std::vector<FileChange> ignored;
+        ChangePosition start;
+        start.kind = ChangeSourceKind::ChangeLog;
+        return Read(start, ignored, out) == ChangeReadStatus::Ok;
+    }
+
+    ChangeReadStatus Read(const ChangePosition &from, std::vector<FileChange> &out, ChangePosition &next) override {
+        if (from.kind != ChangeSourceKind::ChangeLog) {
+            return ChangeReadStatus::Discontinuous;
+        }
+        std::filesystem::path file(logPath);
+        std::wifstream in(file);
+        if (!in) {
+            return ChangeReadStatus::Unavailable;
+        }
+        uint64_t lineNumber = 0;
+        std::wstring line;
+        while (std::getline(in, line)) {
+            if (lineNumber++ < from.position || line.empty()) {
+                continue;
+            }
+            size_t space = line.find(L' ');
+            if (space == std::wstring::npos) {
+                continue;
+            }
+            std::wstring tag = line.substr(0, space);
+            FileChange c;
+            c.path = line.substr(space + 1);
+            if (tag == L"M") {
+                c.kind = ChangeKind::Modified;
+            } else if (tag == L"D") {
+                c.kind = ChangeKind::Deleted;
+            } else if (tag == L"DA") {
+                c.kind = ChangeKind::DirectoryAdded;
+            } else if (tag == L"DD") {
+                c.kind = ChangeKind::DirectoryDeleted;
+            } else {
+                continue;
+            }
+            out.push_back(c);
+        }
+        if (lineNumber < from.position) {
+            return ChangeReadStatus::Discontinuous; // the log was truncated or replaced
+        }
+        next = from;
+        next.position = lineNumber;
+        return ChangeReadStatus::Ok;
+    }
+
+private:
+    std::wstring logPath;
+};
+
+// Collapse a change list to one change per path, the last one winning, in
+// path order. Directory changes are kept as they are (in order), since they
+// cover paths the list does not name.
+inline void CoalesceChanges(std::vector<FileChange> &changes) {
+    std::unordered_map<std::wstring, size_t> last;
+    last.reserve(changes.size());
+    for (size_t i = 0; i < changes.size(); i++) {
+        if (changes[i].kind == ChangeKind::Modified || changes[i].kind == ChangeKind::Deleted) {
+            last[changes[i].path] = i;
+        }
+    }
+    std::vector<FileChange> files;
+    std::vector<FileChange> directories;
+    for (size_t i = 0; i < changes.size(); i++) {
+        bool isFile = changes[i].kind == ChangeKind::Modified || changes[i].kind == ChangeKind::Deleted;
+        if (!isFile) {
+            directories.push_back(changes[i]);
+        } else if (last[changes[i].path] == i) {
+            files.push_back(changes[i]);
+        }
+    }
+    std::sort(files.begin(), files.end(),
+              [](const FileChange &a, const FileChange &b) { return a.path < b.path; });
+    changes.swap(directories);
+    changes.insert(changes.end(), files.begin(), files.end());
+}
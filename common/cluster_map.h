@@ -0,0 +1,385 @@
+#pragma once
+// Cluster map: the volume bitmap drawn as a picture
+//
+// Pixel p covers clusters [p * clustersPerPixel, (p + 1) * clustersPerPixel),
+// row by row from the top left. clustersPerPixel is the smallest whole number
+// that fits the volume into the width x height asked for, and the height
+// shrinks to what the volume fills. Two maps of one volume at the same size
+// therefore line up pixel for pixel, so images taken before and after a run
+// can be laid over each other, and ScanChanges draws the difference itself.
+//
+// A pixel's shade is its share of allocated clusters. The share is counted a
+// 64-bit word at a time with a popcount, masking the partial words at either
+// edge of the pixel, so every bitmap word is read once and the scan runs at
+// memory speed: a 4G-cluster volume (a 512 MB bitmap) takes well under a
+// second. Pixels are independent, and the scan can split the rows over
+// threads.
+//
+// Two layers can be drawn over the allocation:
+//   - reserved ranges (the MFT zone) tint the free clusters in them amber
+//   - AddFile counts the clusters of fragmented files, which are drawn red in
+//     proportion to their share of the pixel. A file is fragmented as in the
+//     fragmentation report: more than one physically contiguous piece
+//
+// Images are written as binary PPM, or as PNG with stored (uncompressed)
+// deflate blocks, so no zlib is needed. A PNG is then about 3 bytes per
+// pixel (2.3 MB at 1024 x 768); any PNG optimizer shrinks it if it is kept.
+
+#include "free_run.h"
+#include "scratch_arena.h"
+#include "volume_geometry.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+inline unsigned PopCount64(uint64_t w) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    return (unsigned)__popcnt64(w);
+#elif defined(__GNUC__)
+    return (unsigned)__builtin_popcountll(w);
+#else
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (unsigned)((w * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Allocated clusters in [start, end) of a word source, end > start
+template <typename Words>
+uint64_t CountAllocatedClusters(const Words &words, uint64_t start, uint64_t end) {
+    uint64_t first = start / 64;
+    uint64_t last = (end - 1) / 64;
+    uint64_t lowMask = ~0ULL << (start % 64);
+    uint64_t highMask = ~0ULL >> (63 - (end - 1) % 64);
+    if (first == last) {
+        return PopCount64(words(first) & lowMask & highMask);
+    }
+    uint64_t count = PopCount64(words(first) & lowMask);
+    for (uint64_t i = first + 1; i < last; i++) {
+        count += PopCount64(words(i));
+    }
+    return count + PopCount64(words(last) & highMask);
+}
+
+struct Rgb {
+    uint8_t r, g, b;
+};
+
+class ClusterMap {
+public:
+    ClusterMap(uint64_t totalClusters, unsigned width = 1024, unsigned height = 768)
+        : totalClusters(totalClusters), width(std::max(width, 1u)) {
+        uint64_t pixels = (uint64_t)this->width * std::max(height, 1u);
+        clustersPerPixel = std::max<uint64_t>(1, (totalClusters + pixels - 1) / pixels);
+        uint64_t used = (totalClusters + clustersPerPixel - 1) / clustersPerPixel;
+        this->height = (unsigned)std::max<uint64_t>(1, (used + this->width - 1) / this->width);
+        allocated.assign(Pixels(), 0);
+    }
+
+    uint64_t TotalClusters() const { return totalClusters; }
+    uint64_t ClustersPerPixel() const { return clustersPerPixel; }
+    unsigned Width() const { return width; }
+    unsigned Height() const { return height; }
+    size_t Pixels() const { return (size_t)width * height; }
+
+    // Clusters of the volume in pixel p; 0 past the end of the volume
+    uint64_t PixelClusters(size_t p) const {
+        uint64_t start = (uint64_t)p * clustersPerPixel;
+        return start < totalClusters ? std::min(clustersPerPixel, totalClusters - start) : 0;
+    }
+
+    // Allocated clusters in pixel p, or in the changes map: clusters
+    // allocated after the run
+    uint32_t Allocated(size_t p) const { return allocated[p]; }
+    uint32_t Filled(size_t p) const { return filled.empty() ? 0 : filled[p]; }
+    uint32_t Freed(size_t p) const { return freed.empty() ? 0 : freed[p]; }
+    uint32_t Fragmented(size_t p) const { return fragmented.empty() ? 0 : fragmented[p]; }
+
+    // Count the allocated clusters of every pixel
+    template <typename Words>
+    void ScanBitmap(const Words &words, unsigned threads = 1) {
+        ForRows(threads, [&](size_t p, uint64_t start, uint64_t end) {
+            allocated[p] = (uint32_t)CountAllocatedClusters(words, start, end);
+        });
+    }
+
+    // Count what changed between two bitmaps of the volume: clusters
+    // allocated by the run (filled), released by it (freed), and allocated
+    // afterwards. Words at the same index are compared, so both sources must
+    // describe the same volume.
+    template <typename Words>
+    void ScanChanges(const Words &before, const Words &after, unsigned threads = 1) {
+        filled.assign(Pixels(), 0);
+        freed.assign(Pixels(), 0);
+        ForRows(threads, [&](size_t p, uint64_t start, uint64_t end) {
+            uint64_t first = start / 64;
+            uint64_t last = (end - 1) / 64;
+            uint32_t nowAllocated = 0, nowFilled = 0, nowFreed = 0;
+            for (uint64_t i = first; i <= last; i++) {
+                uint64_t mask = ~0ULL;
+                if (i == first) {
+                    mask &= ~0ULL << (start % 64);
+                }
+                if (i == last) {
+                    mask &= ~0ULL >> (63 - (end - 1) % 64);
+                }
+                uint64_t b = before(i) & mask;
+                uint64_t a = after(i) & mask;
+                nowAllocated += PopCount64(a);
+                nowFilled += PopCount64(a & ~b);
+                nowFreed += PopCount64(b & ~a);
+            }
+            allocated[p] = nowAllocated;
+            filled[p] = nowFilled;
+            freed[p] = nowFreed;
+        });
+    }
+
+    void AddReserved(const std::vector<LcnRange> &ranges) {
+        for (const LcnRange &r : ranges) {
+            if (r.end > r.start) {
+                AddRange(reserved, r.start, r.end - r.start);
+            }
+        }
+    }
+
+    // Feed one file's extents; only fragmented files are drawn
+    void AddFile(const ExtentRun *runs, size_t runCount) {
+        uint64_t fragments = 0;
+        int64_t nextLcn = -1;
+        for (size_t i = 0; i < runCount; i++) {
+            if (runs[i].lcn < 0 || runs[i].count <= 0) {
+                continue;
+            }
+            if (runs[i].lcn != nextLcn) {
+                fragments++;
+            }
+            nextLcn = runs[i].lcn + runs[i].count;
+        }
+        if (fragments < 2) {
+            return;
+        }
+        for (size_t i = 0; i < runCount; i++) {
+            if (runs[i].lcn >= 0 && runs[i].count > 0) {
+                AddRange(fragmented, (uint64_t)runs[i].lcn, (uint64_t)runs[i].count);
+            }
+        }
+    }
+
+    // RGB, 3 bytes per pixel, rows top to bottom
+    std::vector<uint8_t> Draw() const {
+        static const Rgb outside = {255, 255, 255};
+        static const Rgb freeColor = {232, 232, 232};
+        static const Rgb reservedColor = {245, 205, 110};
+        static const Rgb allocatedColor = {50, 95, 185};
+        static const Rgb unchangedColor = {150, 150, 150};
+        static const Rgb fragmentedColor = {210, 40, 35};
+        static const Rgb filledColor = {210, 40, 35};
+        static const Rgb freedColor = {40, 170, 70};
+
+        std::vector<uint8_t> rgb(Pixels() * 3);
+        for (size_t p = 0; p < Pixels(); p++) {
+            uint64_t clusters = PixelClusters(p);
+            Rgb c = outside;
+            if (clusters > 0) {
+                double n = (double)clusters;
+                double a = allocated[p] / n;
+                double res = reserved.empty() ? 0 : std::min<uint64_t>(reserved[p], clusters) / n;
+                Rgb background = Mix({{freeColor, 1 - res}, {reservedColor, res}});
+                if (!filled.empty()) {
+                    double f = filled[p] / n;
+                    double r = freed[p] / n;
+                    c = Mix({{background, std::max(0.0, 1 - a - r)}, {unchangedColor, std::max(0.0, a - f)},
+                             {filledColor, f}, {freedColor, r}});
+                } else {
+                    double frag = fragmented.empty() ? 0 : std::min<uint32_t>(fragmented[p], allocated[p]) / n;
+                    c = Mix({{background, 1 - a}, {allocatedColor, a - frag}, {fragmentedColor, frag}});
+                }
+            }
+            rgb[3 * p] = c.r;
+            rgb[3 * p + 1] = c.g;
+            rgb[3 * p + 2] = c.b;
+        }
+        return rgb;
+    }
+
+    // Write the map as PPM if the file name ends in .ppm, otherwise as PNG
+    bool Write(const std::filesystem::path &path) const {
+        std::string extension = path.extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(),
+                       [](unsigned char ch) { return (char)std::tolower(ch); });
+        std::vector<uint8_t> rgb = Draw();
+        std::ofstream out(path, std::ios::binary);
+        if (extension == ".ppm") {
+            out << "P6\n" << width << " " << height << "\n255\n";
+            out.write((const char *)rgb.data(), (std::streamsize)rgb.size());
+        } else {
+            WritePng(out, width, height, rgb);
+        }
+        out.close();
+        return !out.fail();
+    }
+
+    // PNG, 8-bit RGB, no interlace. The image data is a zlib stream of stored
+    // blocks, each row led by filter type 0.
+    static void WritePng(std::ostream &out, unsigned width, unsigned height, const std::vector<uint8_t> &rgb) {
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        out.write((const char *)signature, 8);
+
+        std::vector<uint8_t> header;
+        PutBig32(header, width);
+        PutBig32(header, height);
+        header.insert(header.end(), {8, 2, 0, 0, 0}); // bit depth, RGB, deflate, filter set 0, no interlace
+        WriteChunk(out, "IHDR", header);
+
+        size_t rowBytes = (size_t)width * 3;
+        std::vector<uint8_t> raw;
+        raw.reserve((rowBytes + 1) * height);
+        for (unsigned y = 0; y < height; y++) {
+            raw.push_back(0);
+            raw.insert(raw.end(), rgb.begin() + (std::ptrdiff_t)(y * rowBytes),
+                       rgb.begin() + (std::ptrdiff_t)((y + 1) * rowBytes));
+        }
+        std::vector<uint8_t> zlib = {0x78, 0x01};
+        zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+        size_t at = 0;
+        do {
+            size_t length = std::min<size_t>(raw.size() - at, 65535);
+            zlib.push_back(at + length == raw.size() ? 1 : 0); // BFINAL, BTYPE = stored
+            zlib.push_back((uint8_t)length);
+            zlib.push_back((uint8_t)(length >> 8));
+            zlib.push_back((uint8_t)~length);
+            zlib.push_back((uint8_t)(~length >> 8));
+            zlib.insert(zlib.end(), raw.begin() + (std::ptrdiff_t)at, raw.begin() + (std::ptrdiff_t)(at + length));
+            at += length;
+        } while (at < raw.size());
+        PutBig32(zlib, Adler32(raw.data(), raw.size()));
+        WriteChunk(out, "IDAT", zlib);
+        WriteChunk(out, "IEND", {});
+    }
+
+private:
+    template <typename PixelFunction>
+    void ForRows(unsigned threads, const PixelFunction &countPixel) {
+        size_t usedPixels = (size_t)((totalClusters + clustersPerPixel - 1) / clustersPerPixel);
+        auto countRows = [&](unsigned fromRow, unsigned toRow) {
+            size_t end = std::min<size_t>((size_t)toRow * width, usedPixels);
+            for (size_t p = (size_t)fromRow * width; p < end; p++) {
+                uint64_t start = (uint64_t)p * clustersPerPixel;
+                countPixel(p, start, std::min(start + clustersPerPixel, totalClusters));
+            }
+        };
+        threads = std::max(1u, std::min(threads, height));
+        if (threads == 1) {
+            countRows(0, height);
+            return;
+        }
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back(countRows, height * t / threads, height * (t + 1) / threads);
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+    }
+
+    // Add the clusters of [start, start + count) to the pixels they fall in
+    void AddRange(std::vector<uint32_t> &layer, uint64_t start, uint64_t count) {
+        if (start >= totalClusters) {
+            return;
+        }
+        if (layer.empty()) {
+            layer.assign(Pixels(), 0);
+        }
+        uint64_t end = std::min(totalClusters, start + count);
+        while (start < end) {
+            size_t p = (size_t)(start / clustersPerPixel);
+            uint64_t pixelEnd = std::min(end, (p + 1) * clustersPerPixel);
+            layer[p] += (uint32_t)(pixelEnd - start);
+            start = pixelEnd;
+        }
+    }
+
+    static Rgb Mix(std::initializer_list<std::pair<Rgb, double>> parts) {
+        double r = 0, g = 0, b = 0;
+        for (const auto &part : parts) {
+            double w = std::max(0.0, part.second);
+            r += part.first.r * w;
+            g += part.first.g * w;
+            b += part.first.b * w;
+        }
+        auto channel = [](double v) { return (uint8_t)std::min(255.0, std::max(0.0, v + 0.5)); };
+        return Rgb{channel(r), channel(g), channel(b)};
+    }
+
+    static void PutBig32(std::vector<uint8_t> &out, uint32_t v) {
+        out.insert(out.end(), {(uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v});
+    }
+
+    static uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t size) {
+        static const std::vector<uint32_t> table = [] {
+            std::vector<uint32_t> t(256);
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                t[n] = c;
+            }
+            return t;
+        }();
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++) {
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    static uint32_t Adler32(const uint8_t *data, size_t size) {
+        uint32_t a = 1, b = 0;
+        while (size > 0) {
+            size_t block = std::min<size_t>(size, 5552); // the most bytes before b can overflow
+            for (size_t i = 0; i < block; i++) {
+                a += data[i];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+            data += block;
+            size -= block;
+        }
+        return (b << 16) | a;
+    }
+
+    static void WriteChunk(std::ostream &out, const char *type, const std::vector<uint8_t> &data) {
+        std::vector<uint8_t> chunk;
+        PutBig32(chunk, (uint32_t)data.size());
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        PutBig32(chunk, Crc32(0, chunk.data() + 4, chunk.size() - 4));
+        out.write((const char *)chunk.data(), (std::streamsize)chunk.size());
+    }
+
+    uint64_t totalClusters;
+    uint64_t clustersPerPixel;
+    unsigned width;
+    unsigned height;
+    std::vector<uint32_t> allocated;
+    std::vector<uint32_t> filled;     // changes map only
+    std::vector<uint32_t> freed;      // changes map only
+    std::vector<uint32_t> reserved;   // empty until AddReserved
+    std::vector<uint32_t> fragmented; // empty until AddFile finds a fragmented file
+};
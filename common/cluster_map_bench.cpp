@@ -0,0 +1,197 @@
+// Drawing the cluster map of a very large volume
+//
+//   cluster_map_bench [clusters = 1073741824] [threads = 0] [image directory]
+//
+//   1. fills a bitmap of `clusters` clusters (2^32 is the intended top size,
+//      a 512 MB bitmap) with allocated and free runs of random length, denser
+//      towards the start of the volume like a volume that filled up over time
+//   2. scans it into a 1024 x 768 map with one thread and with `threads`
+//      threads (0 = one per core), reporting the time and the bitmap read
+//      rate of each, and checks that the pixels add up to the bitmap's
+//      allocated clusters and that 1000 random pixels match a bit-by-bit count
+//   3. simulates a defragmentation pass that frees some runs and fills
+//      others, scans the changes and checks the filled and freed counts
+//      against a word-by-word comparison
+//   4. adds fragmented files as a layer and checks that their clusters are
+//      all counted, then draws the maps and, given a directory, writes them
+//      as before.png, after.png and changes.png (and before.ppm)
+
+#include "cluster_map.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+static double Since(std::chrono::steady_clock::time_point started) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+static void SetRun(std::vector<uint8_t> &bitmap, uint64_t lcn, uint64_t count, bool allocated) {
+    for (uint64_t c = lcn; c < lcn + count; c++) {
+        if (c % 8 == 0 && c + 8 <= lcn + count) {
+            bitmap[(size_t)(c / 8)] = allocated ? 0xFF : 0;
+            c += 7;
+        } else if (allocated) {
+            bitmap[(size_t)(c / 8)] |= (uint8_t)(1 << (c % 8));
+        } else {
+            bitmap[(size_t)(c / 8)] &= (uint8_t)~(1 << (c % 8));
+        }
+    }
+}
+
+static uint64_t SlowCount(const std::vector<uint8_t> &bitmap, uint64_t start, uint64_t end) {
+    uint64_t count = 0;
+    for (uint64_t c = start; c < end; c++) {
+        count += (bitmap[(size_t)(c / 8)] >> (c % 8)) & 1;
+    }
+    return count;
+}
+
+int main(int argc, char **argv) {
+    uint64_t clusters = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1ULL << 30;
+    unsigned threads = argc > 2 ? (unsigned)std::strtoul(argv[2], nullptr, 10) : 0;
+    std::string imageDirectory = argc > 3 ? argv[3] : "";
+    if (clusters < 64) {
+        std::cerr << "invalid arguments: at least 64 clusters\n";
+        return 1;
+    }
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Runs of up to 4096 clusters; the chance of a run being allocated falls
+    // from 90% at the start of the volume to 30% at the end
+    auto started = std::chrono::steady_clock::now();
+    std::vector<uint8_t> before((size_t)((clusters + 7) / 8), 0);
+    std::mt19937_64 rng(48);
+    for (uint64_t lcn = 0; lcn < clusters;) {
+        uint64_t count = std::min<uint64_t>(1 + rng() % 4096, clusters - lcn);
+        if ((double)(rng() % 1000) < 1000 * (0.9 - 0.6 * (double)lcn / (double)clusters)) {
+            SetRun(before, lcn, count, true);
+        }
+        lcn += count;
+    }
+    BitmapWords beforeWords(before);
+    uint64_t allocated = 0;
+    for (uint8_t byte : before) {
+        allocated += PopCount64(byte);
+    }
+    std::cout << "Volume: " << clusters << " clusters, " << before.size() / (1 << 20) << " MB bitmap, " << allocated
+              << " allocated, generated in " << Since(started) << " s\n";
+
+    double bitmapMB = (double)before.size() / (1 << 20);
+    ClusterMap map(clusters);
+    started = std::chrono::steady_clock::now();
+    map.ScanBitmap(beforeWords);
+    double oneThread = Since(started);
+    std::cout << "Map: " << map.Width() << " x " << map.Height() << ", " << map.ClustersPerPixel()
+              << " clusters per pixel\n";
+    std::cout << "Scan, 1 thread: " << oneThread << " s (" << bitmapMB / oneThread << " MB/s)\n";
+    ClusterMap threaded(clusters);
+    started = std::chrono::steady_clock::now();
+    threaded.ScanBitmap(beforeWords, threads);
+    double manyThreads = Since(started);
+    std::cout << "Scan, " << threads << " threads: " << manyThreads << " s (" << bitmapMB / manyThreads << " MB/s)\n";
+
+    uint64_t pixelSum = 0;
+    bool sameThreaded = true;
+    for (size_t p = 0; p < map.Pixels(); p++) {
+        pixelSum += map.Allocated(p);
+        sameThreaded = sameThreaded && map.Allocated(p) == threaded.Allocated(p);
+    }
+    uint64_t pixelMismatches = 0;
+    for (int i = 0; i < 1000; i++) {
+        size_t p = (size_t)(rng() % map.Pixels());
+        uint64_t start = (uint64_t)p * map.ClustersPerPixel();
+        uint64_t end = start + map.PixelClusters(p);
+        pixelMismatches += (start < end ? SlowCount(before, start, end) : 0) != map.Allocated(p) ? 1 : 0;
+    }
+
+    // A pass that moves 2% of the allocated clusters: runs are freed at
+    // random and as many clusters are filled at the start of free space
+    std::vector<uint8_t> after(before);
+    uint64_t toMove = allocated / 50;
+    uint64_t freedRuns = 0;
+    for (uint64_t moved = 0; moved < toMove; freedRuns++) {
+        uint64_t lcn = rng() % (clusters - 1);
+        uint64_t count = std::min<uint64_t>({1 + rng() % 256, clusters - lcn, toMove - moved});
+        moved += count;
+        SetRun(after, lcn, count, false);
+    }
+    uint64_t filledTarget = toMove;
+    for (uint64_t lcn = 0; lcn < clusters && filledTarget > 0; lcn++) {
+        if (!((after[(size_t)(lcn / 8)] >> (lcn % 8)) & 1) && ((before[(size_t)(lcn / 8)] >> (lcn % 8)) & 1) == 0) {
+            SetRun(after, lcn, 1, true);
+            filledTarget--;
+        }
+    }
+    BitmapWords afterWords(after);
+    uint64_t expectFilled = 0, expectFreed = 0;
+    for (size_t i = 0; i < before.size(); i++) {
+        expectFilled += PopCount64((uint64_t)(after[i] & ~before[i]));
+        expectFreed += PopCount64((uint64_t)(before[i] & ~after[i]));
+    }
+    ClusterMap changes(clusters);
+    started = std::chrono::steady_clock::now();
+    changes.ScanChanges(beforeWords, afterWords, threads);
+    double changeSeconds = Since(started);
+    uint64_t filled = 0, freed = 0;
+    for (size_t p = 0; p < changes.Pixels(); p++) {
+        filled += changes.Filled(p);
+        freed += changes.Freed(p);
+    }
+    std::cout << "Changes: " << freedRuns << " runs freed, " << expectFreed << " clusters freed, " << expectFilled
+              << " filled; scanned in " << changeSeconds << " s (" << 2 * bitmapMB / changeSeconds << " MB/s)\n";
+
+    // Fragmented files: pieces of up to 64 clusters scattered over the volume
+    uint64_t fragmentedClusters = 0;
+    std::vector<ExtentRun> runs;
+    for (int f = 0; f < 10000; f++) {
+        runs.clear();
+        int64_t vcn = 0;
+        for (int piece = 0; piece < 2 + f % 8; piece++) {
+            int64_t count = 1 + (int64_t)(rng() % 64);
+            int64_t lcn = (int64_t)(rng() % (clusters - 64));
+            runs.push_back({vcn, lcn, count});
+            vcn += count;
+            fragmentedClusters += (uint64_t)count;
+        }
+        runs.push_back({vcn, -1, 16}); // a sparse tail is not drawn
+        map.AddFile(runs.data(), runs.size());
+    }
+    ExtentRun contiguous[2] = {{0, 1000, 10}, {10, 1010, 10}};
+    map.AddFile(contiguous, 2); // one piece, not fragmented
+    map.AddReserved({{clusters / 8, clusters / 8 + clusters / 80}});
+    uint64_t layerSum = 0;
+    for (size_t p = 0; p < map.Pixels(); p++) {
+        layerSum += map.Fragmented(p);
+    }
+
+    started = std::chrono::steady_clock::now();
+    std::vector<uint8_t> rgb = map.Draw();
+    double drawSeconds = Since(started);
+    std::cout << "Draw: " << drawSeconds << " s for " << rgb.size() << " bytes of RGB\n";
+    if (!imageDirectory.empty()) {
+        ClusterMap afterMap(clusters);
+        afterMap.ScanBitmap(afterWords, threads);
+        afterMap.AddReserved({{clusters / 8, clusters / 8 + clusters / 80}});
+        started = std::chrono::steady_clock::now();
+        bool written = map.Write(imageDirectory + "/before.png") && map.Write(imageDirectory + "/before.ppm") &&
+                       afterMap.Write(imageDirectory + "/after.png") && changes.Write(imageDirectory + "/changes.png");
+        std::cout << "Images " << (written ? "written to " : "NOT written to ") << imageDirectory << " in "
+                  << Since(started) << " s\n";
+        if (!written) {
+            return 1;
+        }
+    }
+
+    bool ok = pixelSum == allocated && sameThreaded && pixelMismatches == 0 && filled == expectFilled &&
+              freed == expectFreed && layerSum == fragmentedClusters;
+    std::cout << "Check: pixels sum to " << pixelSum << " of " << allocated << " allocated, threaded scan "
+              << (sameThreaded ? "identical" : "DIFFERENT") << ", " << pixelMismatches
+              << " of 1000 pixels differ from a bit count, changes " << filled << " / " << freed
+              << " filled / freed, fragment layer " << layerSum << " of " << fragmentedClusters << " clusters"
+              << (ok ? "" : "  FAILED") << "\n";
+    return ok ? 0 : 1;
+}
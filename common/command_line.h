@@ -0,0 +1,523 @@
+#pragma once
+// Command-line options for the tools, with the console questions as fallback
+//
+// Each tool lists its options in a table. Started without arguments, a tool
+// asks its questions on the console as it always has. Started with any
+// argument it runs in batch mode: every question is answered by its option,
+// or by the default the question shows when the option is left out, and the
+// tool does not wait for Enter at the end. Either way the answer comes from
+// the same call at the place the tool asks:
+//
+//   int mode = options.Number(L"mode", L"Placement mode? ... (default = 0): ", 0);
+//
+// Options are `--name value` or `--name=value`; --help prints the table.
+// Unknown options, missing values, values that are not numbers and required
+// options left out stop the tool before it opens anything.
+//
+// The tool's outcome is collected in a JSON object: the options as answered
+// (defaults included), the figures the tool adds, whether it succeeded, its
+// exit code and the wall-clock time. `--json <file>` writes it when the tool
+// finishes, `--json -` to standard output after everything else.
+//
+// Exit codes: 0 = done, 1 = failed, 2 = bad command line.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cwchar>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <shellapi.h>
+#endif
+
+static const int TOOL_EXIT_OK = 0;
+static const int TOOL_EXIT_FAILED = 1;
+static const int TOOL_EXIT_USAGE = 2;
+
+enum class OptionKind {
+    Text,
+    Count,  // whole number, 0 or more
+    Number, // any number
+};
+
+struct ToolOption {
+    const wchar_t *name;
+    OptionKind kind;
+    bool required; // in batch mode; on the console it is asked like the others
+    const wchar_t *help;
+};
+
+// A JSON object built up member by member, written with two-space indents.
+// Members keep the order they were first set in; setting one again replaces
+// its value.
+class JsonObject {
+public:
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, JsonObject &>::type
+    Set(const char *key, T value) {
+        return SetScalar(key, std::to_string(value));
+    }
+    JsonObject &Set(const char *key, bool value) { return SetScalar(key, value ? "true" : "false"); }
+    JsonObject &Set(const char *key, double value) { return SetScalar(key, Number(value)); }
+    JsonObject &Set(const char *key, const std::wstring &value) { return SetScalar(key, String(value)); }
+    JsonObject &Set(const char *key, const wchar_t *value) { return SetScalar(key, String(value)); }
+    JsonObject &Set(const char *key, const std::string &value) { return SetScalar(key, String(value)); }
+    JsonObject &Set(const char *key, const char *value) { return SetScalar(key, String(std::string(value))); }
+
+    // The nested object `key`, created on first use
+    JsonObject &Child(const char *key) {
+        Member &m = Find(key);
+        if (!m.object) {
+            m = Member(key);
+            m.object.reset(new JsonObject());
+        }
+        return *m.object;
+    }
+
+    // A new object at the end of the array `key`
+    JsonObject &Append(const char *key) {
+        Member &m = Find(key);
+        if (!m.array) {
+            m = Member(key);
+            m.array = true;
+        }
+        m.objects.emplace_back(new JsonObject());
+        return *m.objects.back();
+    }
+
+    // A number at the end of the array `key`
+    template <typename T>
+    void AppendValue(const char *key, T value) {
+        Member &m = Find(key);
+        if (!m.array) {
+            m = Member(key);
+            m.array = true;
+        }
+        m.values.push_back(std::is_integral<T>::value ? std::to_string(value) : Number((double)value));
+    }
+
+    bool Empty() const { return members.empty(); }
+
+    void Write(std::ostream &out, int indent = 0) const {
+        std::string pad((size_t)indent + 2, ' ');
+        out << "{";
+        for (size_t i = 0; i < members.size(); i++) {
+            const Member &m = members[i];
+            out << (i ? ",\n" : "\n") << pad << String(m.key) << ": ";
+            if (m.object) {
+                m.object->Write(out, indent + 2);
+            } else if (!m.array) {
+                out << m.scalar;
+            } else if (!m.objects.empty()) {
+                out << "[";
+                for (size_t o = 0; o < m.objects.size(); o++) {
+                    out << (o ? ",\n" : "\n") << pad << "  ";
+                    m.objects[o]->Write(out, indent + 4);
+                }
+                out << "\n" << pad << "]";
+            } else {
+                out << "[";
+                for (size_t v = 0; v < m.values.size(); v++) {
+                    out << (v ? ", " : "") << m.values[v];
+                }
+                out << "]";
+            }
+        }
+        out << (members.empty() ? "}" : "\n" + std::string((size_t)indent, ' ') + "}");
+    }
+
+    // JSON string in UTF-8. wchar_t is UTF-16 on Windows and UTF-32 elsewhere.
+    static std::string String(const std::wstring &s) {
+        std::string utf8;
+        utf8.reserve(s.size());
+        for (size_t i = 0; i < s.size(); i++) {
+            uint32_t c = (uint32_t)s[i];
+            if (c >= 0xD800 && c < 0xDC00 && i + 1 < s.size() && (uint32_t)s[i + 1] >= 0xDC00 &&
+                (uint32_t)s[i + 1] < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)s[++i] - 0xDC00);
+            } else if (c >= 0xD800 && c < 0xE000) {
+                c = 0xFFFD; // unpaired surrogate
+            }
+            if (c < 0x80) {
+                utf8 += (char)c;
+            } else if (c < 0x800) {
+                utf8 += (char)(0xC0 | (c >> 6));
+                utf8 += (char)(0x80 | (c & 0x3F));
+            } else if (c < 0x10000) {
+                utf8 += (char)(0xE0 | (c >> 12));
+                utf8 += (char)(0x80 | ((c >> 6) & 0x3F));
+                utf8 += (char)(0x80 | (c & 0x3F));
+            } else {
+                utf8 += (char)(0xF0 | (c >> 18));
+                utf8 += (char)(0x80 | ((c >> 12) & 0x3F));
+                utf8 += (char)(0x80 | ((c >> 6) & 0x3F));
+                utf8 += (char)(0x80 | (c & 0x3F));
+            }
+        }
+        return String(utf8);
+    }
+
+    // JSON string of text that is UTF-8 already
+    static std::string String(const std::string &s) {
+        static const char HEX[] = "0123456789abcdef";
+        std::string out = "\"";
+        for (char ch : s) {
+            unsigned char c = (unsigned char)ch;
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += ch;
+            } else if (c < 0x20) {
+                out += "\\u00";
+                out += HEX[c >> 4];
+                out += HEX[c & 15];
+            } else {
+                out += ch;
+            }
+        }
+        return out + "\"";
+    }
+
+private:
+    struct Member {
+        explicit Member(const char *key) : key(key) {}
+
+        std::string key;
+        std::string scalar;                               // rendered value, when neither object nor array
+        std::unique_ptr<JsonObject> object;
+        bool array = false;
+        std::vector<std::string> values;                  // rendered numbers of a number array
+        std::vector<std::unique_ptr<JsonObject>> objects; // elements of an object array
+    };
+
+    Member &Find(const char *key) {
+        for (Member &m : members) {
+            if (m.key == key) {
+                return m;
+            }
+        }
+        members.push_back(Member(key));
+        return members.back();
+    }
+
+    JsonObject &SetScalar(const char *key, const std::string &rendered) {
+        Member &m = Find(key);
+        m = Member(key);
+        m.scalar = rendered;
+        return *this;
+    }
+
+    // Ten significant digits; JSON has no NaN or infinity
+    static std::string Number(double value) {
+        if (value != value || value > std::numeric_limits<double>::max() ||
+            value < -std::numeric_limits<double>::max()) {
+            return "null";
+        }
+        char text[64];
+        std::snprintf(text, sizeof(text), "%.10g", value);
+        return text;
+    }
+
+    std::vector<Member> members;
+};
+
+class ToolOptions {
+public:
+    ToolOptions(const wchar_t *tool, const std::vector<ToolOption> &table) : tool(tool), table(table) {
+        this->table.push_back(ToolOption{L"json", OptionKind::Text, false,
+                                         L"write the result as JSON to this file, - = standard output"});
+        started = std::chrono::steady_clock::now();
+        // Placeholders, so the summary comes first; Finish fills it in
+        document.Set("tool", this->tool).Set("ok", false).Set("exitCode", 0).Set("seconds", 0.0);
+        document.Child("options");
+        document.Child("result");
+    }
+
+    // false when the tool should stop right away with `exitCode`: after
+    // --help (0) or on a bad command line (2)
+    bool Parse(int argc, char **argv, int &exitCode) {
+        started = std::chrono::steady_clock::now();
+        std::vector<std::wstring> args = Arguments(argc, argv);
+        batch = !args.empty();
+        for (size_t i = 0; i < args.size(); i++) {
+            const std::wstring &arg = args[i];
+            if (arg == L"--help" || arg == L"-h" || arg == L"/?") {
+                PrintHelp();
+                exitCode = TOOL_EXIT_OK;
+                return false;
+            }
+            if (arg.compare(0, 2, L"--") != 0 || arg.size() == 2) {
+                return Usage(L"unexpected argument " + arg, exitCode);
+            }
+            size_t equals = arg.find(L'=');
+            std::wstring name = arg.substr(2, equals == std::wstring::npos ? std::wstring::npos : equals - 2);
+            const ToolOption *option = Lookup(name);
+            if (!option) {
+                return Usage(L"unknown option --" + name, exitCode);
+            }
+            std::wstring value;
+            if (equals != std::wstring::npos) {
+                value = arg.substr(equals + 1);
+            } else if (i + 1 < args.size()) {
+                value = args[++i];
+            } else {
+                return Usage(L"--" + name + L" needs a value", exitCode);
+            }
+            if (option->kind != OptionKind::Text && !IsNumber(value, option->kind == OptionKind::Count)) {
+                return Usage(L"--" + name + L" needs " +
+                                 (option->kind == OptionKind::Count ? L"a whole number" : L"a number") + L", not " +
+                                 value,
+                             exitCode);
+            }
+            Given *g = Find(name);
+            if (!g) {
+                given.push_back(Given{name, value, false});
+            } else {
+                g->value = value;
+            }
+        }
+        for (const ToolOption &o : table) {
+            if (batch && o.required && !Find(o.name)) {
+                return Usage(std::wstring(L"--") + o.name + L" is required", exitCode);
+            }
+        }
+        Given *json = Find(L"json");
+        if (json) {
+            jsonPath = json->value;
+            json->used = true;
+        }
+        return true;
+    }
+
+    bool Batch() const { return batch; }
+    bool Interactive() const { return !batch; }
+
+    // A single word, e.g. a drive letter
+    std::wstring Word(const wchar_t *name, const std::wstring &prompt, const std::wstring &defaultValue = L"") {
+        std::wstring value = defaultValue;
+        if (!batch) {
+            std::wcout << prompt;
+            std::wcin >> value;
+        } else if (Given *g = Use(name)) {
+            value = g->value;
+        }
+        Record(name, value);
+        return value;
+    }
+
+    // The rest of the line, e.g. a path with spaces in it
+    std::wstring Line(const wchar_t *name, const std::wstring &prompt, const std::wstring &defaultValue = L"") {
+        std::wstring value = defaultValue;
+        if (!batch) {
+            std::wcout << prompt;
+            std::getline(std::wcin >> std::ws, value);
+        } else if (Given *g = Use(name)) {
+            value = g->value;
+        }
+        Record(name, value);
+        return value;
+    }
+
+    // A drive letter without the colon and backslash that may follow it
+    std::wstring DriveLetter(const wchar_t *name, const std::wstring &prompt) {
+        std::wstring letter = Word(name, prompt);
+        while (!letter.empty() && (letter.back() == L':' || letter.back() == L'\\')) {
+            letter.pop_back();
+        }
+        Record(name, letter);
+        return letter;
+    }
+
+    template <typename T>
+    T Number(const wchar_t *name, const std::wstring &prompt, T defaultValue) {
+        T value = defaultValue;
+        if (!batch) {
+            std::wcout << prompt;
+            std::wcin >> value;
+        } else if (Given *g = Use(name)) {
+            std::wistringstream in(g->value);
+            in >> value;
+        }
+        Record(name, value);
+        return value;
+    }
+
+    // An option the console does not ask for, e.g. a seed: its value in
+    // batch mode, else the default
+    template <typename T>
+    T Value(const wchar_t *name, T defaultValue) {
+        T value = defaultValue;
+        if (Given *g = Use(name)) {
+            std::wistringstream in(g->value);
+            in >> value;
+        }
+        Record(name, value);
+        return value;
+    }
+    std::wstring Value(const wchar_t *name, const std::wstring &defaultValue) {
+        Given *g = Use(name);
+        std::wstring value = g ? g->value : defaultValue;
+        Record(name, value);
+        return value;
+    }
+
+    // On the console only: the tools' closing "Press Enter" and the like
+    void WaitForEnter(const std::wstring &message) const {
+        if (batch) {
+            return;
+        }
+        std::wcout << message;
+        std::wcin.ignore(std::numeric_limits<std::streamsize>::max(), L'\n');
+        std::wcin.get();
+    }
+
+    // The tool's figures go here
+    JsonObject &Result() { return document.Child("result"); }
+
+    // Completes the result and writes it if --json was given; returns the
+    // exit code to leave main with (1 if the result cannot be written)
+    int Finish(int exitCode) {
+        for (const Given &g : given) {
+            if (!g.used) {
+                std::wcerr << L"--" << g.name << L" was not used by the choices made.\n";
+            }
+        }
+        if (jsonPath.empty()) {
+            return exitCode;
+        }
+        document.Set("ok", exitCode == TOOL_EXIT_OK);
+        document.Set("exitCode", exitCode);
+        document.Set("seconds", std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+        if (jsonPath == L"-") {
+            std::wcout.flush();
+            document.Write(std::cout);
+            std::cout << "\n";
+            std::cout.flush();
+            return exitCode;
+        }
+        std::ofstream out(std::filesystem::path(jsonPath), std::ios::binary | std::ios::trunc);
+        document.Write(out);
+        out << "\n";
+        out.close();
+        if (!out) {
+            std::wcerr << L"Cannot write " << jsonPath << L"\n";
+            return exitCode == TOOL_EXIT_OK ? TOOL_EXIT_FAILED : exitCode;
+        }
+        return exitCode;
+    }
+
+private:
+    struct Given {
+        std::wstring name;
+        std::wstring value;
+        bool used = false;
+    };
+
+    static std::vector<std::wstring> Arguments(int argc, char **argv) {
+        std::vector<std::wstring> args;
+#ifdef _WIN32
+        // The console code page mangles argv; take the UTF-16 command line
+        (void)argc;
+        (void)argv;
+        int count = 0;
+        LPWSTR *wide = CommandLineToArgvW(GetCommandLineW(), &count);
+        if (wide) {
+            for (int i = 1; i < count; i++) {
+                args.push_back(wide[i]);
+            }
+            LocalFree(wide);
+        }
+#else
+        for (int i = 1; i < argc; i++) {
+            std::string narrow = argv[i];
+            args.push_back(std::wstring(narrow.begin(), narrow.end()));
+        }
+#endif
+        return args;
+    }
+
+    static bool IsNumber(const std::wstring &value, bool whole) {
+        if (value.empty()) {
+            return false;
+        }
+        wchar_t *end = nullptr;
+        if (whole) {
+            if (value[0] == L'-') {
+                return false;
+            }
+            std::wcstoull(value.c_str(), &end, 10);
+        } else {
+            std::wcstod(value.c_str(), &end);
+        }
+        return end && *end == 0;
+    }
+
+    const ToolOption *Lookup(const std::wstring &name) const {
+        for (const ToolOption &o : table) {
+            if (name == o.name) {
+                return &o;
+            }
+        }
+        return nullptr;
+    }
+
+    Given *Find(const std::wstring &name) {
+        for (Given &g : given) {
+            if (g.name == name) {
+                return &g;
+            }
+        }
+        return nullptr;
+    }
+
+    Given *Use(const wchar_t *name) {
+        Given *g = Find(name);
+        if (g) {
+            g->used = true;
+        }
+        return g;
+    }
+
+    template <typename T>
+    void Record(const wchar_t *name, const T &value) {
+        std::wstring wide(name);
+        document.Child("options").Set(std::string(wide.begin(), wide.end()).c_str(), value);
+    }
+
+    bool Usage(const std::wstring &problem, int &exitCode) {
+        std::wcerr << tool << L": " << problem << L" (--help lists the options)\n";
+        exitCode = TOOL_EXIT_USAGE;
+        return false;
+    }
+
+    void PrintHelp() const {
+        std::wcout << L"Usage: " << tool << L" [--option value]...\n\n"
+                   << L"Without options the tool asks for each value on the console. With options it asks\n"
+                   << L"nothing: a value left out takes the default the question shows.\n\n";
+        for (const ToolOption &o : table) {
+            std::wstring left = std::wstring(L"  --") + o.name +
+                                (o.kind == OptionKind::Text ? L" <text>" : o.kind == OptionKind::Count ? L" <n>" : L" <x>");
+            std::wcout << left << std::wstring(left.size() < 26 ? 26 - left.size() : 1, L' ') << o.help
+                       << (o.required ? L" (required)" : L"") << L"\n";
+        }
+        std::wcout << L"\nExit codes: 0 = done, 1 = failed, 2 = bad command line.\n";
+    }
+
+    std::wstring tool;
+    std::vector<ToolOption> table;
+    std::vector<Given> given;
+    bool batch = false;
+    std::wstring jsonPath;
+    std::chrono::steady_clock::time_point started;
+    JsonObject document;
+};
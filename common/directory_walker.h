@@ -0,0 +1,285 @@
+#pragma once
+// Iterative directory traversal with a reusable path buffer
+//
+// The walker keeps the current path in one buffer and appends / truncates
+// entry names in place, and it keeps the names of subdirectories still to be
+// visited in a second buffer that works like a stack. Both buffers only grow
+// until they fit the deepest path / widest directory seen, after that the
+// walk does no heap allocation per entry. There is no recursion, so deep
+// trees cannot overflow the call stack.
+//
+// Order: all entries of a directory are reported first (OnFile for files,
+// OnDirectory for subdirectories), then OnDirectoryDone, then the
+// subdirectories are visited depth-first in enumeration order.
+//
+// Backends: FindFirstFileExW on Windows, opendir/readdir/fstatat elsewhere
+// (used for testing and benchmarking on Linux).
+
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+const wchar_t WALK_PATH_SEPARATOR = L'\\';
+#else
+const wchar_t WALK_PATH_SEPARATOR = L'/';
+#endif
+
+// One directory entry, valid only for the duration of the callback
+struct WalkEntry {
+    const wchar_t *path;         // full path, NUL-terminated
+    size_t pathLength;
+    const wchar_t *name;         // last component, points into path
+    bool isDirectory;
+    uint32_t attributes;         // FILE_ATTRIBUTE_* (synthesised on POSIX)
+    uint64_t size;               // bytes
+    uint64_t lastAccessTime;     // 100ns ticks since 1601 (FILETIME scale)
+    uint64_t lastWriteTime;
+};
+
+enum class WalkAction {
+    Continue,
+    SkipDirectory, // from OnDirectory: do not descend
+    Stop           // end the walk
+};
+
+// Default callbacks; visitors derive from this and hide what they need
+struct WalkVisitor {
+    WalkAction OnFile(const WalkEntry &) { return WalkAction::Continue; }
+    WalkAction OnDirectory(const WalkEntry &) { return WalkAction::Continue; }
+    WalkAction OnDirectoryDone(const wchar_t * /*dirPath*/, size_t /*dirPathLength*/) { return WalkAction::Continue; }
+    void OnError(const wchar_t * /*path*/, unsigned long /*errorCode*/) {}
+};
+
+struct WalkStats {
+    uint64_t files = 0;
+    uint64_t directories = 0;
+    uint64_t errors = 0;
+    size_t maxDepth = 0;
+};
+
+class DirectoryWalker {
+public:
+    DirectoryWalker() {
+        path.reserve(1024);
+        pending.reserve(64 * 1024);
+        pendingStarts.reserve(4096);
+        frames.reserve(256);
+    }
+
+    // Walk everything below root. Returns false if the walk was stopped by
+    // the visitor or root itself could not be enumerated.
+    template <typename Visitor>
+    bool Walk(const std::wstring &root, Visitor &visitor) {
+        stats = WalkStats();
+        path.assign(root);
+        if (!path.empty() && path.back() != WALK_PATH_SEPARATOR) {
+            path.push_back(WALK_PATH_SEPARATOR);
+        }
+        pending.clear();
+        pendingStarts.clear();
+        frames.clear();
+
+        if (!Enumerate(visitor, true)) {
+            return false;
+        }
+        while (!frames.empty()) {
+            Frame &f = frames.back();
+            if (f.nextPending == f.endPending) {
+                if (f.firstPending < pendingStarts.size()) {
+                    pending.resize(pendingStarts[f.firstPending]);
+                    pendingStarts.resize(f.firstPending);
+                }
+                frames.pop_back();
+                continue;
+            }
+            // Rebuild "<parent>\<name>\" in place and enumerate it
+            const wchar_t *name = pending.data() + pendingStarts[f.nextPending++];
+            path.resize(f.pathLength);
+            path.append(name);
+            path.push_back(WALK_PATH_SEPARATOR);
+            if (!Enumerate(visitor, false)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    WalkStats stats;
+
+private:
+    struct Frame {
+        size_t pathLength;   // length of this directory's path, separator included
+        size_t firstPending; // index into pendingStarts
+        size_t nextPending;
+        size_t endPending;
+    };
+
+    // Report the entries of the directory in `path` (ending with a separator)
+    // and push a frame for its subdirectories. false = stop the walk.
+    template <typename Visitor>
+    bool Enumerate(Visitor &visitor, bool isRoot) {
+        size_t dirLength = path.size();
+        size_t firstPending = pendingStarts.size();
+        bool stop = false;
+        bool opened = ForEachEntry(visitor, dirLength, stop);
+        if (stop) {
+            return false;
+        }
+        if (!opened) {
+            stats.errors++;
+            path.resize(dirLength);
+            return !isRoot;
+        }
+
+        path.resize(dirLength);
+        if (visitor.OnDirectoryDone(path.c_str(), dirLength) == WalkAction::Stop) {
+            return false;
+        }
+        frames.push_back(Frame{dirLength, firstPending, firstPending, pendingStarts.size()});
+        if (frames.size() > stats.maxDepth) {
+            stats.maxDepth = frames.size();
+        }
+        return true;
+    }
+
+    // Called for each raw entry. false = stop the walk.
+    template <typename Visitor>
+    bool Report(Visitor &visitor, size_t dirLength, const wchar_t *name, WalkEntry &e) {
+        if (name[0] == L'.' && (name[1] == 0 || (name[1] == L'.' && name[2] == 0))) {
+            return true;
+        }
+        path.resize(dirLength);
+        path.append(name);
+        e.path = path.c_str();
+        e.pathLength = path.size();
+        e.name = e.path + dirLength;
+
+        if (e.isDirectory) {
+            stats.directories++;
+            WalkAction a = visitor.OnDirectory(e);
+            if (a == WalkAction::Stop) {
+                return false;
+            }
+            if (a == WalkAction::Continue) {
+                pendingStarts.push_back(pending.size());
+                pending.insert(pending.end(), name, name + (e.pathLength - dirLength) + 1);
+            }
+            return true;
+        }
+        stats.files++;
+        return visitor.OnFile(e) != WalkAction::Stop;
+    }
+
+#ifdef _WIN32
+    template <typename Visitor>
+    bool ForEachEntry(Visitor &visitor, size_t dirLength, bool &stop) {
+        path.push_back(L'*');
+        WIN32_FIND_DATAW ffd;
+        HANDLE hFind = FindFirstFileExW(path.c_str(), FindExInfoBasic, &ffd,
+                                        FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+        if (hFind == INVALID_HANDLE_VALUE) {
+            visitor.OnError(path.c_str(), GetLastError());
+            return false;
+        }
+        do {
+            WalkEntry e;
+            e.isDirectory = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+            e.attributes = ffd.dwFileAttributes;
+            e.size = ((uint64_t)ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow;
+            e.lastAccessTime = ((uint64_t)ffd.ftLastAccessTime.dwHighDateTime << 32) | ffd.ftLastAccessTime.dwLowDateTime;
+            e.lastWriteTime = ((uint64_t)ffd.ftLastWriteTime.dwHighDateTime << 32) | ffd.ftLastWriteTime.dwLowDateTime;
+            if (!Report(visitor, dirLength, ffd.cFileName, e)) {
+                FindClose(hFind);
+                stop = true;
+                return true;
+            }
+        } while (FindNextFileW(hFind, &ffd) != 0);
+
+        DWORD err = GetLastError();
+        FindClose(hFind);
+        if (err != ERROR_NO_MORE_FILES) {
+            path.resize(dirLength);
+            visitor.OnError(path.c_str(), err);
+            stats.errors++;
+        }
+        return true;
+    }
+#else
+    static uint64_t ToFileTimeTicks(const struct timespec &ts) {
+        const uint64_t EPOCH_DIFF_SECONDS = 11644473600ULL; // 1601 -> 1970
+        return ((uint64_t)ts.tv_sec + EPOCH_DIFF_SECONDS) * 10000000ULL + (uint64_t)ts.tv_nsec / 100;
+    }
+
+    template <typename Visitor>
+    bool ForEachEntry(Visitor &visitor, size_t dirLength, bool &stop) {
+        // Narrow copy of the directory path for the POSIX calls
+        narrow.resize(dirLength * MB_LEN_MAX + 1);
+        size_t n = std::wcstombs(&narrow[0], path.c_str(), narrow.size());
+        if (n == (size_t)-1) {
+            visitor.OnError(path.c_str(), EILSEQ);
+            return false;
+        }
+        narrow.resize(n);
+
+        DIR *dir = opendir(narrow.c_str());
+        if (!dir) {
+            visitor.OnError(path.c_str(), (unsigned long)errno);
+            return false;
+        }
+        int dfd = dirfd(dir);
+        while (struct dirent *d = readdir(dir)) {
+            size_t wideLen = std::mbstowcs(wideName, d->d_name, NAME_MAX);
+            if (wideLen == (size_t)-1) {
+                stats.errors++;
+                continue;
+            }
+            wideName[wideLen] = 0;
+
+            struct stat st;
+            if (fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                stats.errors++;
+                continue;
+            }
+            WalkEntry e;
+            e.isDirectory = S_ISDIR(st.st_mode);
+            e.attributes = e.isDirectory ? 0x10u /* FILE_ATTRIBUTE_DIRECTORY */ : 0x80u /* NORMAL */;
+            if (S_ISLNK(st.st_mode)) {
+                e.attributes = 0x400u; // FILE_ATTRIBUTE_REPARSE_POINT
+            }
+            e.size = (uint64_t)st.st_size;
+            e.lastAccessTime = ToFileTimeTicks(st.st_atim);
+            e.lastWriteTime = ToFileTimeTicks(st.st_mtim);
+            if (!Report(visitor, dirLength, wideName, e)) {
+                closedir(dir);
+                stop = true;
+                return true;
+            }
+        }
+        closedir(dir);
+        return true;
+    }
+
+    std::string narrow;
+    wchar_t wideName[NAME_MAX + 1];
+#endif
+
+    std::wstring path;                 // current path, grown and truncated in place
+    std::vector<wchar_t> pending;      // NUL-separated names of subdirectories still to visit
+    std::vector<size_t> pendingStarts; // offset of each pending name
+    std::vector<Frame> frames;         // one per directory on the current branch
+};
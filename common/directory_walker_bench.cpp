@@ -0,0 +1,105 @@
+// Benchmark for DirectoryWalker on a synthetic tree
+//
+//   directory_walker_bench <scratch-dir> [files = 1000000] [files-per-dir = 1000]
+//
+// Builds the tree under <scratch-dir> once (reused on later runs if it is
+// already there), walks it once to warm the caches and the walker's buffers,
+// then times a second walk and counts heap allocations made during it.
+
+#include "directory_walker.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <new>
+#include <string>
+
+static std::atomic<uint64_t> g_allocations{0};
+
+void *operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// Directories form a tree with BRANCHING children each, files spread evenly
+static void BuildTree(const std::filesystem::path &root, uint64_t files, uint64_t filesPerDir) {
+    const uint64_t BRANCHING = 16;
+    uint64_t dirs = (files + filesPerDir - 1) / filesPerDir;
+    std::vector<std::filesystem::path> dirPaths;
+    dirPaths.reserve((size_t)dirs);
+    dirPaths.push_back(root);
+    std::filesystem::create_directories(root);
+    for (uint64_t d = 1; d < dirs; d++) {
+        std::filesystem::path p = dirPaths[(size_t)((d - 1) / BRANCHING)] / ("d" + std::to_string(d));
+        std::filesystem::create_directory(p);
+        dirPaths.push_back(p);
+    }
+    for (uint64_t f = 0; f < files; f++) {
+        std::filesystem::path p = dirPaths[(size_t)(f / filesPerDir)] / ("file" + std::to_string(f) + ".dat");
+        if (FILE *fp = std::fopen(p.string().c_str(), "wb")) {
+            std::fclose(fp);
+        }
+    }
+}
+
+struct CountingVisitor : WalkVisitor {
+    uint64_t bytes = 0;
+    WalkAction OnFile(const WalkEntry &e) {
+        bytes += e.size + e.pathLength;
+        return WalkAction::Continue;
+    }
+};
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: directory_walker_bench <scratch-dir> [files] [files-per-dir]\n";
+        return 1;
+    }
+    std::setlocale(LC_ALL, "");
+    std::filesystem::path root = std::filesystem::absolute(argv[1]);
+    uint64_t files = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+    uint64_t filesPerDir = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 1000;
+    if (files == 0 || filesPerDir == 0) {
+        std::cerr << "files and files-per-dir must be positive\n";
+        return 1;
+    }
+
+    std::filesystem::path marker = root / ("tree-" + std::to_string(files) + "-" + std::to_string(filesPerDir));
+    std::filesystem::path tree = marker / "t";
+    if (!std::filesystem::exists(tree)) {
+        std::cout << "Building " << files << " files under " << tree.string() << "...\n";
+        auto t0 = std::chrono::steady_clock::now();
+        BuildTree(tree, files, filesPerDir);
+        std::cout << "Built in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() << " s\n";
+    }
+
+    DirectoryWalker walker;
+    CountingVisitor warm;
+    std::wstring rootW = tree.wstring();
+    walker.Walk(rootW, warm);
+
+    CountingVisitor visitor;
+    uint64_t allocsBefore = g_allocations.load();
+    auto t0 = std::chrono::steady_clock::now();
+    walker.Walk(rootW, visitor);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    uint64_t allocs = g_allocations.load() - allocsBefore;
+
+    uint64_t entries = walker.stats.files + walker.stats.directories;
+    std::cout << "Entries:        " << entries << " (" << walker.stats.files << " files, "
+              << walker.stats.directories << " directories, " << walker.stats.errors << " errors)\n";
+    std::cout << "Max depth:      " << walker.stats.maxDepth << "\n";
+    std::cout << "Walk time:      " << seconds << " s\n";
+    std::cout << "Entries/second: " << (uint64_t)(entries / seconds) << "\n";
+    std::cout << "Allocations:    " << allocs << " (" << (double)allocs / (double)entries << " per entry)\n";
+    return 0;
+}
@@ -0,0 +1,225 @@
+#pragma once
+// Metadata prefilter for directory entries
+//
+// Decides from what the enumeration already returned (size, attributes,
+// name) whether a file is worth opening at all. Every file rejected here
+// saves a CreateFileW and at least one FSCTL_GET_RETRIEVAL_POINTERS call.
+//
+// Checks run cheapest first: size, then attributes, then globs. Globs are
+// compiled once: lowered, and classified so that the common shapes
+// ("name.ext", "*.ext", "prefix*") are a single comparison.
+
+#include "directory_walker.h"
+
+#include <cstdint>
+#include <cwctype>
+#include <string>
+#include <vector>
+
+// FILE_ATTRIBUTE_* values, spelled out so the header stays portable
+const uint32_t ENTRY_ATTRIBUTE_REPARSE_POINT = 0x00000400;
+const uint32_t ENTRY_ATTRIBUTE_OFFLINE = 0x00001000;
+const uint32_t ENTRY_ATTRIBUTE_RECALL_ON_OPEN = 0x00040000;
+const uint32_t ENTRY_ATTRIBUTE_RECALL_ON_DATA_ACCESS = 0x00400000;
+
+// Data of a file this small normally lives inside its 1 KB MFT record, so it
+// has no clusters. If it does not, it occupies one cluster and is contiguous.
+const uint64_t NTFS_RESIDENT_SIZE_LIMIT = 700;
+
+// Case-insensitive glob list. '*' matches any run of characters (separators
+// included), '?' matches one. A pattern containing a path separator is
+// matched against the full path, otherwise against the entry name.
+class GlobSet {
+public:
+    // Add patterns separated by ';'
+    void AddList(const std::wstring &list) {
+        size_t start = 0;
+        while (start <= list.size()) {
+            size_t end = list.find(L';', start);
+            if (end == std::wstring::npos) {
+                end = list.size();
+            }
+            Add(list.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+
+    void Add(const std::wstring &pattern) {
+        size_t first = pattern.find_first_not_of(L" \t");
+        if (first == std::wstring::npos) {
+            return;
+        }
+        size_t last = pattern.find_last_not_of(L" \t");
+
+        Glob g;
+        g.start = chars.size();
+        g.length = last - first + 1;
+        g.fullPath = false;
+        size_t stars = 0;
+        size_t questions = 0;
+        for (size_t i = first; i <= last; i++) {
+            wchar_t c = (wchar_t)std::towlower(pattern[i]);
+            if (c == L'\\' || c == L'/') {
+                c = WALK_PATH_SEPARATOR;
+                g.fullPath = true;
+            }
+            stars += (c == L'*');
+            questions += (c == L'?');
+            chars.push_back(c);
+        }
+
+        const wchar_t *p = chars.data() + g.start;
+        if (stars == 0 && questions == 0) {
+            g.kind = GlobKind::Literal;
+        } else if (stars == 1 && questions == 0 && p[0] == L'*') {
+            g.kind = GlobKind::Suffix;
+        } else if (stars == 1 && questions == 0 && p[g.length - 1] == L'*') {
+            g.kind = GlobKind::Prefix;
+        } else {
+            g.kind = GlobKind::General;
+        }
+        globs.push_back(g);
+    }
+
+    bool Empty() const { return globs.empty(); }
+
+    bool Matches(const WalkEntry &e) const {
+        size_t nameLength = e.pathLength - (size_t)(e.name - e.path);
+        for (const Glob &g : globs) {
+            const wchar_t *s = g.fullPath ? e.path : e.name;
+            size_t sLength = g.fullPath ? e.pathLength : nameLength;
+            if (Match(g, s, sLength)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    enum class GlobKind {
+        Literal, // no wildcards
+        Suffix,  // "*tail"
+        Prefix,  // "head*"
+        General
+    };
+
+    struct Glob {
+        size_t start;  // into chars
+        size_t length;
+        bool fullPath;
+        GlobKind kind;
+    };
+
+    static bool EqualLowered(const wchar_t *lowered, const wchar_t *s, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (lowered[i] != (wchar_t)std::towlower(s[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Match(const Glob &g, const wchar_t *s, size_t sLength) const {
+        const wchar_t *p = chars.data() + g.start;
+        switch (g.kind) {
+        case GlobKind::Literal:
+            return sLength == g.length && EqualLowered(p, s, sLength);
+        case GlobKind::Suffix:
+            return sLength >= g.length - 1 && EqualLowered(p + 1, s + sLength - (g.length - 1), g.length - 1);
+        case GlobKind::Prefix:
+            return sLength >= g.length - 1 && EqualLowered(p, s, g.length - 1);
+        default:
+            break;
+        }
+
+        // Greedy match with backtracking to the last '*'
+        size_t pi = 0;
+        size_t si = 0;
+        size_t starP = SIZE_MAX;
+        size_t starS = 0;
+        while (si < sLength) {
+            wchar_t c = (wchar_t)std::towlower(s[si]);
+            if (pi < g.length && (p[pi] == L'?' || p[pi] == c)) {
+                pi++;
+                si++;
+            } else if (pi < g.length && p[pi] == L'*') {
+                starP = pi++;
+                starS = si;
+            } else if (starP != SIZE_MAX) {
+                pi = starP + 1;
+                si = ++starS;
+            } else {
+                return false;
+            }
+        }
+        while (pi < g.length && p[pi] == L'*') {
+            pi++;
+        }
+        return pi == g.length;
+    }
+
+    std::wstring chars; // all patterns, lowered, back to back
+    std::vector<Glob> globs;
+};
+
+struct EntryFilterStats {
+    uint64_t filesSeen = 0;
+    uint64_t skippedSize = 0;
+    uint64_t skippedAttributes = 0;
+    uint64_t skippedGlob = 0;
+    uint64_t directoriesSkipped = 0; // whole subtrees, not descended into
+    uint64_t opensAvoided = 0;
+    uint64_t ioctlsAvoided = 0;      // lower bound: one retrieval-pointers call per open
+
+    uint64_t FilesSkipped() const { return skippedSize + skippedAttributes + skippedGlob; }
+};
+
+class EntryFilter {
+public:
+    uint64_t minSize = 1;              // smaller files are skipped (1 = skip empty files)
+    uint64_t maxSize = 0;              // larger files are skipped, 0 = no limit
+    uint64_t residentSizeLimit = NTFS_RESIDENT_SIZE_LIMIT; // files up to this size are skipped, 0 = off
+    uint32_t skipAttributes = ENTRY_ATTRIBUTE_REPARSE_POINT | ENTRY_ATTRIBUTE_OFFLINE |
+                              ENTRY_ATTRIBUTE_RECALL_ON_OPEN | ENTRY_ATTRIBUTE_RECALL_ON_DATA_ACCESS;
+    GlobSet include; // empty = every file
+    GlobSet exclude; // files and directories
+
+    // What the caller would spend on a file that passes, for the avoided counters
+    uint32_t opensPerFile = 1;
+    uint32_t ioctlsPerFile = 1;
+
+    EntryFilterStats stats;
+
+    bool AcceptFile(const WalkEntry &e) {
+        stats.filesSeen++;
+        if (e.size < minSize || (maxSize != 0 && e.size > maxSize) ||
+            (residentSizeLimit != 0 && e.size <= residentSizeLimit)) {
+            return Skip(stats.skippedSize);
+        }
+        if (e.attributes & skipAttributes) {
+            return Skip(stats.skippedAttributes);
+        }
+        if ((!include.Empty() && !include.Matches(e)) || exclude.Matches(e)) {
+            return Skip(stats.skippedGlob);
+        }
+        return true;
+    }
+
+    // Reparse points (junctions, mount points) are not followed, so the walk
+    // never leaves the volume or loops
+    bool AcceptDirectory(const WalkEntry &e) {
+        if ((e.attributes & ENTRY_ATTRIBUTE_REPARSE_POINT) || exclude.Matches(e)) {
+            stats.directoriesSkipped++;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    bool Skip(uint64_t &reason) {
+        reason++;
+        stats.opensAvoided += opensPerFile;
+        stats.ioctlsAvoided += ioctlsPerFile;
+        return false;
+    }
+};
@@ -0,0 +1,147 @@
+#pragma once
+// Extent moves that relocate a file into a free block
+//
+// A file is given by its runs as FSCTL_GET_RETRIEVAL_POINTERS returns them.
+// Holes (sparse runs, and VCN gaps between runs) stay holes: they are not
+// moved and take no destination space, so the allocated clusters are packed
+// back to back in VCN order. Each allocated run is moved with one call.
+//
+// NTFS moves a compressed file a compression unit at a time: StartingVcn
+// and ClusterCount of FSCTL_MOVE_FILE must be multiples of the unit (16
+// clusters, normally). A compressed unit keeps its data in its first
+// clusters and leaves the rest of its VCNs sparse. A move names the whole
+// unit and takes only the unit's allocated clusters at the destination.
+//
+// A cluster-at-a-time plan of the same file issues one call per cluster,
+// and on a compressed file those calls are not unit-aligned. A plan that
+// keeps the holes in place needs the file's whole VCN span of contiguous
+// space. ExtentPlanStats counts both for comparison.
+
+#include "scratch_arena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+struct ExtentMove {
+    int64_t vcn;      // StartingVcn of the call
+    int64_t vcnCount; // ClusterCount of the call: the run, or the whole compression unit
+    int64_t srcLcn;   // first allocated cluster, before the move
+    int64_t dstLcn;
+    int64_t clusters; // allocated clusters moved, to [dstLcn, dstLcn + clusters)
+};
+
+struct ExtentPlanStats {
+    uint64_t files = 0;
+    uint64_t sparseFiles = 0;      // with holes between their first and last allocated cluster
+    uint64_t compressedFiles = 0;
+    uint64_t clusters = 0;         // allocated clusters: the destination space the plans need
+    uint64_t spanClusters = 0;     // first to last allocated VCN: the space if holes were kept in place
+    uint64_t moves = 0;
+    uint64_t unitMoves = 0;        // of the moves, whole compression units
+    uint64_t clusterMoves = 0;     // calls a cluster-at-a-time plan would make
+    uint64_t misalignedMoves = 0;  // of those, on compressed files, where they are not unit-aligned
+
+    void Add(const ExtentPlanStats &s) {
+        files += s.files;
+        sparseFiles += s.sparseFiles;
+        compressedFiles += s.compressedFiles;
+        clusters += s.clusters;
+        spanClusters += s.spanClusters;
+        moves += s.moves;
+        unitMoves += s.unitMoves;
+        clusterMoves += s.clusterMoves;
+        misalignedMoves += s.misalignedMoves;
+    }
+};
+
+// Physically contiguous pieces of the allocated runs (VCN order). Holes
+// between runs do not split a piece, so a sparse file laid out back to
+// back counts as one piece, as PlanExtentMoves would leave it in place.
+inline uint64_t CountPieces(const ExtentRun *runs, size_t runCount) {
+    uint64_t pieces = 0;
+    int64_t nextLcn = -1;
+    for (size_t i = 0; i < runCount; i++) {
+        if (runs[i].lcn < 0 || runs[i].count <= 0) {
+            continue;
+        }
+        if (runs[i].lcn != nextLcn) {
+            pieces++;
+        }
+        nextLcn = runs[i].lcn + runs[i].count;
+    }
+    return pieces;
+}
+
+// Plan moving the allocated clusters of runs (VCN order, sparse runs or not)
+// to [blockStart, blockStart + allocated clusters). Runs and units already
+// in place are left alone. unitClusters is the compression unit of a
+// compressed file, 0 for any other file. Moves are appended to out.
+inline void PlanExtentMoves(const ExtentRun *runs,
+                            size_t runCount,
+                            uint32_t unitClusters,
+                            uint64_t blockStart,
+                            std::vector<ExtentMove> &out,
+                            ExtentPlanStats *stats = nullptr) {
+    bool compressed = unitClusters > 1;
+    size_t firstMove = out.size();
+    int64_t dst = (int64_t)blockStart;
+    int64_t firstVcn = -1;
+    int64_t endVcn = 0;
+    uint64_t clusterMoves = 0;
+
+    // The move being collected: one run, or one compression unit
+    ExtentMove m = {};
+    bool collecting = false;
+    bool inPlace = true;
+    auto flush = [&]() {
+        if (collecting && !inPlace) {
+            out.push_back(m);
+        }
+        collecting = false;
+    };
+
+    for (size_t i = 0; i < runCount; i++) {
+        const ExtentRun &r = runs[i];
+        if (r.lcn < 0 || r.count <= 0) {
+            continue;
+        }
+        if (firstVcn < 0) {
+            firstVcn = r.vcn;
+        }
+        endVcn = r.vcn + r.count;
+        for (int64_t v = r.vcn; v < r.vcn + r.count;) {
+            int64_t lcn = r.lcn + (v - r.vcn);
+            int64_t start = compressed ? v / unitClusters * unitClusters : v;
+            int64_t n = compressed ? std::min(r.vcn + r.count, start + unitClusters) - v : r.count;
+            if (!collecting || !compressed || start != m.vcn) {
+                flush();
+                m = ExtentMove{start, compressed ? (int64_t)unitClusters : n, lcn, dst, 0};
+                collecting = true;
+                inPlace = true;
+            }
+            inPlace = inPlace && lcn == m.dstLcn + m.clusters;
+            if (lcn != dst) {
+                clusterMoves += (uint64_t)n; // every cluster of the piece is off by the same amount
+            }
+            m.clusters += n;
+            dst += n;
+            v += n;
+        }
+    }
+    flush();
+
+    if (stats) {
+        uint64_t clusters = (uint64_t)(dst - (int64_t)blockStart);
+        uint64_t span = firstVcn < 0 ? 0 : (uint64_t)(endVcn - firstVcn);
+        stats->files++;
+        stats->sparseFiles += span > clusters ? 1 : 0;
+        stats->compressedFiles += compressed ? 1 : 0;
+        stats->clusters += clusters;
+        stats->spanClusters += span;
+        stats->moves += out.size() - firstMove;
+        stats->unitMoves += compressed ? out.size() - firstMove : 0;
+        stats->clusterMoves += clusterMoves;
+        stats->misalignedMoves += compressed ? clusterMoves : 0;
+    }
+}
@@ -0,0 +1,371 @@
+#pragma once
+// Running one pass over many volumes at once
+//
+// Volumes that share a physical disk share its heads: two passes over two
+// partitions of one hard disk interleave their reads and each waits for the
+// other's seeks, so together they take longer than one after the other.
+// Volumes on different disks do not slow each other down. FleetScheduler
+// therefore runs a volume only while none of its disks is busy with another
+// one (a volume spanning several disks holds all of them), and runs volumes
+// on different disks side by side, up to a limit.
+//
+// The total time of the pass is at least the busiest disk's share of the
+// work, so a disk is kept busy from the start if it has the most left to
+// do: among the volumes that could start, the one whose disks have the most
+// work left goes first, then the biggest volume. On one disk this is the
+// longest-job-first order.
+//
+// IoBudget caps the bytes per second all passes together read and write, so
+// a fleet-wide run can be kept from starving the machines' own I/O. It is a
+// token bucket shared by every thread: a caller takes its bytes and, when
+// the bucket runs dry, sleeps until the rate has paid for them.
+//
+// FleetProgress holds per-volume counters that the passes bump with relaxed
+// atomics and a status line sums up, so reporting costs the passes nothing.
+//
+// BoundedQueue is the hand-off between a volume's walker and its workers:
+// the walker blocks when the workers fall behind, so memory stays bounded on
+// volumes with millions of files.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One volume of the pass
+struct FleetJob {
+    std::wstring name;
+    std::vector<uint32_t> disks; // physical disks the volume lies on
+    uint64_t work = 0;           // expected work, e.g. allocated clusters
+};
+
+struct FleetOptions {
+    unsigned maxVolumes = 0;      // volumes running at once, 0 = no limit
+    bool serializeDisks = true;   // never two volumes of one disk at once
+    bool largestFirst = true;     // false = in the order given
+};
+
+// When a volume ran, in seconds since Run started
+struct FleetJobResult {
+    double started = 0;
+    double finished = 0;
+    bool ok = false;
+};
+
+class IoBudget {
+public:
+    // 0 bytes per second = unlimited. burstBytes is what may be taken at
+    // once after a quiet period (default: a tenth of a second's worth).
+    explicit IoBudget(uint64_t bytesPerSecond = 0, uint64_t burstBytes = 0) { SetRate(bytesPerSecond, burstBytes); }
+
+    void SetRate(uint64_t bytesPerSecond, uint64_t burstBytes = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        rate = (double)bytesPerSecond;
+        burst = burstBytes ? (double)burstBytes : std::max(rate / 10, 1024.0 * 1024);
+        tokens = burst;
+        last = std::chrono::steady_clock::now();
+    }
+
+    bool Limited() const { return rate > 0; }
+
+    // Take bytes from the budget, sleeping as long as the rate requires.
+    // Requests larger than the burst are granted whole and paid off
+    // afterwards, so a caller never waits for a bucket that cannot fill.
+    void Acquire(uint64_t bytes) {
+        taken.fetch_add(bytes, std::memory_order_relaxed);
+        if (rate <= 0 || bytes == 0) {
+            return;
+        }
+        double wait = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto now = std::chrono::steady_clock::now();
+            tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last).count());
+            last = now;
+            tokens -= (double)bytes;
+            if (tokens < 0) {
+                wait = -tokens / rate; // the callers before this one are paid for first
+            }
+        }
+        if (wait > 0) {
+            waited.fetch_add((uint64_t)(wait * 1e6), std::memory_order_relaxed);
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        }
+    }
+
+    uint64_t BytesTaken() const { return taken.load(std::memory_order_relaxed); }
+    double SecondsWaited() const { return (double)waited.load(std::memory_order_relaxed) / 1e6; }
+
+private:
+    std::mutex mutex;
+    double rate = 0;
+    double burst = 0;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last;
+    std::atomic<uint64_t> taken{0};
+    std::atomic<uint64_t> waited{0}; // microseconds, summed over callers
+};
+
+enum class VolumeState { Waiting, Running, Done, Failed };
+
+struct VolumeProgress {
+    std::atomic<int> state{(int)VolumeState::Waiting};
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> fragmented{0};
+    std::atomic<uint64_t> clustersScanned{0};
+    std::atomic<uint64_t> moves{0};
+    std::atomic<uint64_t> clustersMoved{0};
+    std::atomic<uint64_t> errors{0};
+    uint64_t clustersTotal = 0; // allocated clusters, 0 = unknown
+};
+
+struct FleetTotals {
+    unsigned waiting = 0;
+    unsigned running = 0;
+    unsigned done = 0;
+    unsigned failed = 0;
+    uint64_t files = 0;
+    uint64_t fragmented = 0;
+    uint64_t clustersScanned = 0;
+    uint64_t clustersTotal = 0;
+    uint64_t moves = 0;
+    uint64_t clustersMoved = 0;
+    uint64_t errors = 0;
+};
+
+class FleetProgress {
+public:
+    explicit FleetProgress(size_t volumes) : volumes(volumes) {}
+
+    VolumeProgress &operator[](size_t i) { return volumes[i]; }
+    const VolumeProgress &operator[](size_t i) const { return volumes[i]; }
+    size_t Size() const { return volumes.size(); }
+
+    FleetTotals Sum() const {
+        FleetTotals t;
+        for (const VolumeProgress &v : volumes) {
+            VolumeState state = (VolumeState)v.state.load(std::memory_order_relaxed);
+            t.waiting += state == VolumeState::Waiting ? 1 : 0;
+            t.running += state == VolumeState::Running ? 1 : 0;
+            t.done += state == VolumeState::Done ? 1 : 0;
+            t.failed += state == VolumeState::Failed ? 1 : 0;
+            t.files += v.files.load(std::memory_order_relaxed);
+            t.fragmented += v.fragmented.load(std::memory_order_relaxed);
+            t.clustersScanned += std::min(v.clustersScanned.load(std::memory_order_relaxed), v.clustersTotal);
+            t.clustersTotal += v.clustersTotal;
+            t.moves += v.moves.load(std::memory_order_relaxed);
+            t.clustersMoved += v.clustersMoved.load(std::memory_order_relaxed);
+            t.errors += v.errors.load(std::memory_order_relaxed);
+        }
+        return t;
+    }
+
+private:
+    std::deque<VolumeProgress> volumes; // atomics do not move, a deque never moves them
+};
+
+// Producer / consumer hand-off with a fixed capacity
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(capacity, 1)) {}
+
+    // Blocks while the queue is full. false once the queue is closed.
+    bool Push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        lock.unlock();
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Blocks while the queue is empty. false once it is closed and drained.
+    bool Pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        notFull.notify_one();
+        return true;
+    }
+
+    // No more pushes; poppers drain what is left
+    void Close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+class FleetScheduler {
+public:
+    typedef std::function<bool(size_t jobIndex)> JobFunction;
+
+    // Run every job once and return when all have finished. runJob is called
+    // on a scheduler thread with the job's index and returns its success.
+    std::vector<FleetJobResult> Run(const std::vector<FleetJob> &jobs,
+                                    const FleetOptions &options,
+                                    const JobFunction &runJob,
+                                    FleetProgress *progress = nullptr) {
+        std::vector<FleetJobResult> results(jobs.size());
+        if (jobs.empty()) {
+            return results;
+        }
+        this->jobs = &jobs;
+        this->options = options;
+        started = std::chrono::steady_clock::now();
+        pending.clear();
+        for (size_t i = 0; i < jobs.size(); i++) {
+            pending.push_back(i);
+        }
+        uint32_t diskCount = 0;
+        for (const FleetJob &j : jobs) {
+            for (uint32_t d : j.disks) {
+                diskCount = std::max(diskCount, d + 1);
+            }
+        }
+        diskBusy.assign(diskCount, false);
+        diskWork.assign(diskCount, 0);
+        for (const FleetJob &j : jobs) {
+            for (uint32_t d : j.disks) {
+                diskWork[d] += j.work;
+            }
+        }
+
+        size_t threads = options.maxVolumes ? std::min<size_t>(options.maxVolumes, jobs.size()) : jobs.size();
+        std::vector<std::thread> runners;
+        runners.reserve(threads);
+        for (size_t t = 0; t < threads; t++) {
+            runners.emplace_back([&] {
+                size_t index;
+                while (Next(index)) {
+                    results[index].started = Seconds();
+                    if (progress) {
+                        (*progress)[index].state = (int)VolumeState::Running;
+                    }
+                    bool ok = runJob(index);
+                    results[index].finished = Seconds();
+                    results[index].ok = ok;
+                    if (progress) {
+                        (*progress)[index].state = (int)(ok ? VolumeState::Done : VolumeState::Failed);
+                    }
+                    Finish(index);
+                }
+            });
+        }
+        for (auto &t : runners) {
+            t.join();
+        }
+        return results;
+    }
+
+private:
+    double Seconds() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(); }
+
+    bool CanStart(const FleetJob &j) const {
+        if (!options.serializeDisks) {
+            return true;
+        }
+        for (uint32_t d : j.disks) {
+            if (diskBusy[d]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Work left on the busiest of the job's disks
+    uint64_t DiskWorkLeft(const FleetJob &j) const {
+        uint64_t most = 0;
+        for (uint32_t d : j.disks) {
+            most = std::max(most, diskWork[d]);
+        }
+        return most;
+    }
+
+    // Wait for a job that can start and claim its disks. false when none is left.
+    bool Next(size_t &index) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            if (pending.empty()) {
+                return false;
+            }
+            size_t best = pending.size();
+            for (size_t p = 0; p < pending.size(); p++) {
+                const FleetJob &j = (*jobs)[pending[p]];
+                if (!CanStart(j)) {
+                    continue;
+                }
+                if (!options.largestFirst) {
+                    best = p;
+                    break;
+                }
+                if (best == pending.size()) {
+                    best = p;
+                    continue;
+                }
+                const FleetJob &b = (*jobs)[pending[best]];
+                uint64_t jLeft = DiskWorkLeft(j);
+                uint64_t bLeft = DiskWorkLeft(b);
+                if (jLeft > bLeft || (jLeft == bLeft && j.work > b.work)) {
+                    best = p;
+                }
+            }
+            if (best < pending.size()) {
+                index = pending[best];
+                pending.erase(pending.begin() + (std::ptrdiff_t)best);
+                for (uint32_t d : (*jobs)[index].disks) {
+                    diskBusy[d] = true;
+                }
+                return true;
+            }
+            changed.wait(lock);
+        }
+    }
+
+    void Finish(size_t index) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (uint32_t d : (*jobs)[index].disks) {
+                diskBusy[d] = false;
+                diskWork[d] -= std::min(diskWork[d], (*jobs)[index].work);
+            }
+        }
+        changed.notify_all();
+    }
+
+    const std::vector<FleetJob> *jobs = nullptr;
+    FleetOptions options;
+    std::chrono::steady_clock::time_point started;
+    std::vector<size_t> pending;
+    std::vector<bool> diskBusy;
+    std::vector<uint64_t> diskWork; // work of the jobs not yet finished, per disk
+    std::mutex mutex;
+    std::condition_variable changed;
+};
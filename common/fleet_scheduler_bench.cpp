@@ -0,0 +1,205 @@
+// Scheduling a pass over a fleet of volumes
+//
+//   fleet_scheduler_bench [volumes = 24] [disks = 10]
+//
+//   1. lays out `volumes` volumes on `disks` simulated hard disks: some disks
+//      hold one volume, some are split into several partitions, and the last
+//      volume spans the last two disks. A volume's pass is a sequence of 1 MB
+//      reads of 0.5 ms each; a disk serves one read at a time, in arrival
+//      order, and a read from another volume than the previous one first
+//      pays a 0.5 ms seek
+//   2. runs the whole fleet several ways and reports the wall-clock time of
+//      each against the busiest disk's share of the work (no schedule can
+//      beat it): one volume at a time, all volumes at once, one volume per
+//      disk in the order given or with the disk that has the most left going
+//      first, and the same two with at most half as many volumes as disks
+//      running at once
+//   3. checks that the disk-aware runs never had two volumes on one disk at
+//      once, and runs the last schedule again with an I/O budget of 40% of
+//      its unthrottled rate, checking that the rate stays within the budget
+//      and that the aggregated progress adds up
+
+#include "fleet_scheduler.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+
+static const double READ_SECONDS = 0.0005;
+static const double SEEK_SECONDS = 0.0005;
+static const uint64_t READ_BYTES = 1 << 20;
+
+// A disk serving one read at a time, first come first served
+class SimulatedDisk {
+public:
+    void Read(size_t volume) {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t ticket = nextTicket++;
+        turn.wait(lock, [&] { return serving == ticket; });
+        bool seek = lastVolume != volume;
+        lastVolume = volume;
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::duration<double>(READ_SECONDS + (seek ? SEEK_SECONDS : 0)));
+        lock.lock();
+        serving++;
+        seeks += seek ? 1 : 0;
+        lock.unlock();
+        turn.notify_all();
+    }
+
+    uint64_t Seeks() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return seeks;
+    }
+
+    std::atomic<int> volumesActive{0};
+
+private:
+    std::mutex mutex;
+    std::condition_variable turn;
+    uint64_t nextTicket = 0;
+    uint64_t serving = 0;
+    size_t lastVolume = SIZE_MAX;
+    uint64_t seeks = 0;
+};
+
+struct FleetRun {
+    double seconds = 0;
+    uint64_t seeks = 0;
+    uint64_t overlaps = 0; // a volume started on a disk another volume was using
+    uint64_t bytes = 0;
+    FleetTotals totals;
+    bool ok = true;
+};
+
+static FleetRun RunFleet(const std::vector<FleetJob> &jobs, unsigned disks, const FleetOptions &options,
+                         uint64_t budgetBytesPerSecond) {
+    std::vector<std::unique_ptr<SimulatedDisk>> disk;
+    for (unsigned d = 0; d < disks; d++) {
+        disk.emplace_back(new SimulatedDisk());
+    }
+    IoBudget budget(budgetBytesPerSecond);
+    FleetProgress progress(jobs.size());
+    std::atomic<uint64_t> overlaps{0};
+    for (size_t i = 0; i < jobs.size(); i++) {
+        progress[i].clustersTotal = jobs[i].work * (READ_BYTES / 4096);
+    }
+
+    auto pass = [&](size_t index) {
+        const FleetJob &j = jobs[index];
+        for (uint32_t d : j.disks) {
+            overlaps += disk[d]->volumesActive++ > 0 ? 1 : 0;
+        }
+        VolumeProgress &p = progress[index];
+        for (uint64_t r = 0; r < j.work; r++) {
+            budget.Acquire(READ_BYTES);
+            disk[j.disks[r % j.disks.size()]]->Read(index); // a spanned volume alternates its disks
+            p.files++;
+            p.clustersScanned += READ_BYTES / 4096;
+        }
+        for (uint32_t d : j.disks) {
+            disk[d]->volumesActive--;
+        }
+        return true;
+    };
+
+    FleetScheduler scheduler;
+    std::vector<FleetJobResult> results = scheduler.Run(jobs, options, pass, &progress);
+    FleetRun run;
+    for (const FleetJobResult &r : results) {
+        run.seconds = std::max(run.seconds, r.finished);
+        run.ok = run.ok && r.ok;
+    }
+    for (auto &d : disk) {
+        run.seeks += d->Seeks();
+    }
+    run.overlaps = overlaps;
+    run.bytes = budget.BytesTaken();
+    run.totals = progress.Sum();
+    return run;
+}
+
+static void PrintRun(const char *what, const FleetRun &run, double bound) {
+    std::cout << what << ": " << run.seconds << " s (" << run.seconds / bound << "x the busiest disk), " << run.seeks
+              << " seeks, " << (double)run.bytes / run.seconds / (1 << 20) << " MB/s\n";
+}
+
+int main(int argc, char **argv) {
+    unsigned volumes = argc > 1 ? (unsigned)std::strtoul(argv[1], nullptr, 10) : 24;
+    unsigned disks = argc > 2 ? (unsigned)std::strtoul(argv[2], nullptr, 10) : 10;
+    if (disks < 2 || volumes < disks) {
+        std::cerr << "invalid arguments: at least 2 disks and one volume per disk\n";
+        return 1;
+    }
+
+    // Every disk gets a volume, the rest go to the first half of the disks;
+    // the last volume spans the last two disks
+    std::mt19937_64 rng(46);
+    std::vector<FleetJob> jobs(volumes);
+    std::vector<uint64_t> diskWork(disks, 0);
+    for (unsigned i = 0; i < volumes; i++) {
+        FleetJob &j = jobs[i];
+        j.name = L"V" + std::to_wstring(i);
+        if (i == volumes - 1) {
+            j.disks = {disks - 2, disks - 1};
+        } else {
+            j.disks = {i < disks ? i : (unsigned)(rng() % (disks / 2))};
+        }
+        j.work = 50 + rng() % 550;
+        for (uint32_t d : j.disks) {
+            diskWork[d] += (j.work + j.disks.size() - 1) / j.disks.size();
+        }
+    }
+    uint64_t busiest = *std::max_element(diskWork.begin(), diskWork.end());
+    uint64_t totalWork = 0;
+    for (const FleetJob &j : jobs) {
+        totalWork += j.work;
+    }
+    std::cout << volumes << " volumes on " << disks << " disks, " << totalWork << " MB to read, "
+              << busiest << " MB of it on the busiest disk\n";
+
+    FleetOptions sequential;
+    sequential.maxVolumes = 1;
+    FleetOptions allAtOnce;
+    allAtOnce.serializeDisks = false;
+    FleetOptions inOrder;
+    inOrder.largestFirst = false;
+    FleetOptions busiestFirst;
+
+    // Sleeps overshoot, so the bound uses the read time the sequential run measured
+    FleetRun one = RunFleet(jobs, disks, sequential, 0);
+    double bound = (double)busiest * one.seconds / (double)totalWork;
+    PrintRun("One volume at a time", one, bound);
+    FleetRun all = RunFleet(jobs, disks, allAtOnce, 0);
+    PrintRun("All volumes at once", all, bound);
+    FleetRun ordered = RunFleet(jobs, disks, inOrder, 0);
+    PrintRun("One per disk, in order", ordered, bound);
+    FleetRun best = RunFleet(jobs, disks, busiestFirst, 0);
+    PrintRun("One per disk, busiest disk first", best, bound);
+    inOrder.maxVolumes = busiestFirst.maxVolumes = disks / 2;
+    FleetRun orderedHalf = RunFleet(jobs, disks, inOrder, 0);
+    PrintRun("Half the disks at a time, in order", orderedHalf, bound);
+    FleetRun bestHalf = RunFleet(jobs, disks, busiestFirst, 0);
+    PrintRun("Half the disks at a time, busiest disk first", bestHalf, bound);
+    busiestFirst.maxVolumes = 0;
+
+    uint64_t budget = (uint64_t)((double)best.bytes / best.seconds * 0.4);
+    FleetRun capped = RunFleet(jobs, disks, busiestFirst, budget);
+    PrintRun("Same, with a budget of 40%", capped, bound);
+    double cappedRate = (double)capped.bytes / capped.seconds;
+    double allowed = (double)budget + std::max((double)budget / 10, 1024.0 * 1024) / capped.seconds;
+
+    bool ok = one.ok && all.ok && ordered.ok && best.ok && orderedHalf.ok && bestHalf.ok && capped.ok;
+    uint64_t overlaps = ordered.overlaps + best.overlaps + orderedHalf.overlaps + bestHalf.overlaps + capped.overlaps;
+    bool disjoint = overlaps == 0;
+    bool withinBudget = cappedRate <= allowed * 1.02;
+    const FleetTotals &t = capped.totals;
+    bool added = t.done == volumes && t.running == 0 && t.files == totalWork && t.clustersScanned == t.clustersTotal;
+    std::cout << "Check: " << overlaps
+              << " times two volumes shared a disk in the disk-aware runs (" << all.overlaps
+              << " when all run at once); budgeted rate " << cappedRate / (1 << 20) << " MB/s of "
+              << (double)budget / (1 << 20) << " MB/s; progress " << t.done << " volumes done, " << t.files
+              << " reads of " << totalWork << (ok && disjoint && withinBudget && added ? "" : "  FAILED") << "\n";
+    return ok && disjoint && withinBudget && added ? 0 : 1;
+}
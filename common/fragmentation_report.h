@@ -0,0 +1,413 @@
+#pragma once
+// One-pass fragmentation report of a volume
+//
+// Files and free runs are fed in one at a time and folded into accumulators
+// whose size does not depend on the volume: log2 histograms, running sums
+// and a bounded heap of the most fragmented files. Only those K files keep
+// their path, so a report over tens of millions of files takes a few KB.
+//
+// A file's fragment count is the number of physically contiguous pieces of
+// its allocated clusters: two runs that follow each other on disk count as
+// one, sparse and unallocated runs are ignored. A file with no allocated
+// clusters (resident in the MFT, or fully sparse) is counted but has no
+// fragments.
+//
+// The score is a single number for dashboards, 0 = perfect, 100 = worst:
+//
+//   score = 50 * (clusters of fragmented files / clusters of all files)
+//         + 50 * (1 - sqrt(sum of free run length^2) / free clusters)
+//
+// The second term is 0 when the free space is one run and approaches 1 as it
+// splits into many small ones.
+//
+// With a read-cost model, each fragmented file's read time is also estimated
+// as it is and as it would be contiguous, and the files whose read would get
+// faster by at least the threshold are counted as worth moving.
+
+#include "read_cost.h"
+#include "scratch_arena.h"
+#include "volume_geometry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Counts and totals per power of two: bucket 0 holds 0 and 1, bucket i
+// holds [2^i, 2^(i+1))
+struct Log2Histogram {
+    static const unsigned BUCKETS = 64;
+
+    uint64_t count[BUCKETS] = {};
+    uint64_t total[BUCKETS] = {}; // sum of the weights added to the bucket
+
+    static unsigned Bucket(uint64_t value) {
+        unsigned b = 0;
+        while (value > 1) {
+            value >>= 1;
+            b++;
+        }
+        return b;
+    }
+
+    void Add(uint64_t value, uint64_t weight) {
+        unsigned b = Bucket(value);
+        count[b]++;
+        total[b] += weight;
+    }
+
+    // One past the highest bucket in use
+    unsigned Used() const {
+        unsigned used = BUCKETS;
+        while (used > 0 && count[used - 1] == 0) {
+            used--;
+        }
+        return used;
+    }
+};
+
+struct FragmentedFile {
+    uint64_t fragments = 0;
+    uint64_t clusters = 0;
+    uint64_t size = 0;
+    std::wstring path;
+};
+
+class FragmentationReport {
+public:
+    explicit FragmentationReport(size_t topFiles = 20) : topFiles(topFiles) { top.reserve(topFiles); }
+
+    void SetVolume(const std::wstring &name, uint64_t totalClusters, uint32_t bytesPerCluster) {
+        volumeName = name;
+        this->totalClusters = totalClusters;
+        this->bytesPerCluster = bytesPerCluster;
+    }
+
+    void SetReadCost(const ReadCostModel *model, double thresholdSeconds) {
+        readCost = model;
+        readThresholdSeconds = thresholdSeconds;
+    }
+
+    // Runs in VCN order, as FSCTL_GET_RETRIEVAL_POINTERS returns them
+    void AddFile(const wchar_t *path, size_t pathLength, uint64_t size, const ExtentRun *runs, size_t runCount) {
+        uint64_t fragments = 0;
+        uint64_t clusters = 0;
+        int64_t nextLcn = -1;
+        for (size_t i = 0; i < runCount; i++) {
+            if (runs[i].lcn < 0 || runs[i].count <= 0) {
+                continue;
+            }
+            if (runs[i].lcn != nextLcn) {
+                fragments++;
+            }
+            clusters += (uint64_t)runs[i].count;
+            nextLcn = runs[i].lcn + runs[i].count;
+        }
+
+        files++;
+        fileBytes += size;
+        fileClusters += clusters;
+        extents += fragments;
+        if (fragments == 0) {
+            filesWithoutClusters++;
+            return;
+        }
+        if (fragments > 1) {
+            fragmentedFiles++;
+            fragmentedClusters += clusters;
+        }
+        fragmentHistogram.Add(fragments, clusters);
+        unsigned sizeClass = Log2Histogram::Bucket(size);
+        sizeClassFiles[sizeClass]++;
+        sizeClassExtents[sizeClass] += fragments;
+        sizeClassBytes[sizeClass] += size;
+        if (fragments > 1) {
+            KeepIfTop(path, pathLength, fragments, clusters, size);
+        }
+        if (readCost && fragments > 1) {
+            double now = readCost->FileReadSeconds(runs, runCount);
+            double contiguous = readCost->ContiguousReadSeconds(clusters);
+            readSecondsNow += now;
+            readSecondsContiguous += contiguous;
+            if (now - contiguous >= readThresholdSeconds) {
+                filesWorthMoving++;
+                readSecondsSaved += now - contiguous;
+            }
+        }
+    }
+
+    // A free run, already cut around reserved ranges
+    void AddFreeRun(uint64_t start, uint64_t length) {
+        if (length == 0) {
+            return;
+        }
+        freeRuns++;
+        freeClusters += length;
+        freeSquares += (double)length * (double)length;
+        freeHistogram.Add(length, length);
+        if (length > largestFree.length) {
+            largestFree.start = start;
+            largestFree.length = length;
+        }
+    }
+
+    // Walk the bitmap once and add every free run outside the reserved
+    // ranges. Free clusters inside them are only counted.
+    template <typename WordSource>
+    void ScanFreeSpace(const WordSource &words, uint64_t total, const std::vector<LcnRange> &reserved) {
+        uint64_t runStart = 0;
+        bool inRun = false;
+        uint64_t c = 0;
+        while (c < total) {
+            uint64_t w = words(c / 64);
+            uint64_t bitsHere = std::min<uint64_t>(64, total - c);
+            if (bitsHere == 64 && (w == 0 || w == ~0ULL)) {
+                if (w == 0 && !inRun) {
+                    runStart = c;
+                    inRun = true;
+                } else if (w != 0 && inRun) {
+                    AddFreeRange(runStart, c, reserved);
+                    inRun = false;
+                }
+                c += 64;
+                continue;
+            }
+            for (uint64_t i = 0; i < bitsHere; i++, c++) {
+                bool allocated = (w >> i) & 1;
+                if (!allocated && !inRun) {
+                    runStart = c;
+                    inRun = true;
+                } else if (allocated && inRun) {
+                    AddFreeRange(runStart, c, reserved);
+                    inRun = false;
+                }
+            }
+        }
+        if (inRun) {
+            AddFreeRange(runStart, total, reserved);
+        }
+    }
+
+    // 0 .. 100, see the top of the file
+    double Score() const {
+        double data = fileClusters ? (double)fragmentedClusters / (double)fileClusters : 0.0;
+        double free = freeClusters ? 1.0 - std::sqrt(freeSquares) / (double)freeClusters : 0.0;
+        return 50.0 * data + 50.0 * free;
+    }
+
+    // Most fragmented first
+    std::vector<FragmentedFile> TopFiles() const {
+        std::vector<FragmentedFile> sorted(top);
+        std::sort_heap(sorted.begin(), sorted.end(), MoreFragmented);
+        return sorted;
+    }
+
+    uint64_t Files() const { return files; }
+    uint64_t FragmentedFiles() const { return fragmentedFiles; }
+    uint64_t Extents() const { return extents; }
+    uint64_t FreeClusters() const { return freeClusters; }
+    uint64_t FreeRuns() const { return freeRuns; }
+    uint64_t FilesWorthMoving() const { return filesWorthMoving; }
+    double ReadSecondsSaved() const { return readSecondsSaved; }
+    LcnRange LargestFreeRun() const { return LcnRange{largestFree.start, largestFree.start + largestFree.length}; }
+
+    void WriteJson(std::ostream &out, uint64_t createdTicks) const {
+        const double GB = 1024.0 * 1024.0 * 1024.0;
+        out << "{\n";
+        out << "  \"volume\": ";
+        WriteString(out, volumeName.data(), volumeName.size());
+        out << ",\n  \"createdTicks\": " << createdTicks;
+        out << ",\n  \"totalClusters\": " << totalClusters << ",\n  \"bytesPerCluster\": " << bytesPerCluster;
+        out << ",\n  \"score\": " << Fixed(Score());
+
+        out << ",\n  \"files\": {\"count\": " << files << ", \"fragmented\": " << fragmentedFiles
+            << ", \"withoutClusters\": " << filesWithoutClusters << ", \"extents\": " << extents
+            << ", \"bytes\": " << fileBytes << ", \"clusters\": " << fileClusters
+            << ", \"fragmentedClusters\": " << fragmentedClusters
+            << ", \"extentsPerGB\": " << Fixed(fileBytes ? (double)extents * GB / (double)fileBytes : 0.0)
+            << "}";
+
+        if (readCost) {
+            out << ",\n  \"readCost\": {\"profile\": \"" << readCost->Profile().name
+                << "\", \"thresholdSeconds\": " << readThresholdSeconds
+                << ", \"fragmentedSecondsNow\": " << Fixed(readSecondsNow)
+                << ", \"fragmentedSecondsContiguous\": " << Fixed(readSecondsContiguous)
+                << ", \"filesWorthMoving\": " << filesWorthMoving << ", \"secondsSaved\": " << Fixed(readSecondsSaved)
+                << "}";
+        }
+
+        out << ",\n  \"fragmentHistogram\": [";
+        unsigned used = fragmentHistogram.Used();
+        for (unsigned b = 0; b < used; b++) {
+            out << (b ? ",\n    " : "\n    ") << "{\"minFragments\": " << (b ? 1ULL << b : 1)
+                << ", \"files\": " << fragmentHistogram.count[b] << ", \"clusters\": " << fragmentHistogram.total[b]
+                << "}";
+        }
+        out << (used ? "\n  ]" : "]");
+
+        out << ",\n  \"extentsPerGBBySize\": [";
+        bool first = true;
+        for (unsigned b = 0; b < Log2Histogram::BUCKETS; b++) {
+            if (!sizeClassFiles[b]) {
+                continue;
+            }
+            double perGB = sizeClassBytes[b] ? (double)sizeClassExtents[b] * GB / (double)sizeClassBytes[b] : 0.0;
+            out << (first ? "\n    " : ",\n    ") << "{\"minBytes\": " << (b ? 1ULL << b : 0)
+                << ", \"files\": " << sizeClassFiles[b] << ", \"extents\": " << sizeClassExtents[b]
+                << ", \"bytes\": " << sizeClassBytes[b] << ", \"extentsPerGB\": " << Fixed(perGB) << "}";
+            first = false;
+        }
+        out << (first ? "]" : "\n  ]");
+
+        out << ",\n  \"freeSpace\": {\"clusters\": " << freeClusters << ", \"runs\": " << freeRuns
+            << ", \"reservedFreeClusters\": " << reservedFreeClusters << ", \"largestRun\": {\"lcn\": "
+            << largestFree.start << ", \"clusters\": " << largestFree.length << "}";
+        out << ",\n    \"histogram\": [";
+        used = freeHistogram.Used();
+        for (unsigned b = 0; b < used; b++) {
+            out << (b ? ",\n      " : "\n      ") << "{\"minClusters\": " << (b ? 1ULL << b : 1)
+                << ", \"runs\": " << freeHistogram.count[b] << ", \"clusters\": " << freeHistogram.total[b] << "}";
+        }
+        out << (used ? "\n    ]}" : "]}");
+
+        out << ",\n  \"mostFragmented\": [";
+        std::vector<FragmentedFile> sorted = TopFiles();
+        for (size_t i = 0; i < sorted.size(); i++) {
+            out << (i ? ",\n    " : "\n    ") << "{\"path\": ";
+            WriteString(out, sorted[i].path.data(), sorted[i].path.size());
+            out << ", \"fragments\": " << sorted[i].fragments << ", \"clusters\": " << sorted[i].clusters
+                << ", \"bytes\": " << sorted[i].size << "}";
+        }
+        out << (sorted.empty() ? "]" : "\n  ]") << "\n}\n";
+    }
+
+private:
+    struct FreeRun {
+        uint64_t start = 0;
+        uint64_t length = 0;
+    };
+
+    // Heap order: the least fragmented of the kept files on top, ties broken
+    // towards keeping the file seen first
+    static bool MoreFragmented(const FragmentedFile &a, const FragmentedFile &b) {
+        return a.fragments > b.fragments || (a.fragments == b.fragments && a.clusters > b.clusters);
+    }
+
+    void KeepIfTop(const wchar_t *path, size_t pathLength, uint64_t fragments, uint64_t clusters, uint64_t size) {
+        if (topFiles == 0) {
+            return;
+        }
+        FragmentedFile candidate;
+        candidate.fragments = fragments;
+        candidate.clusters = clusters;
+        if (top.size() == topFiles) {
+            if (!MoreFragmented(candidate, top.front())) {
+                return;
+            }
+            // Reuse the evicted entry's path buffer
+            std::pop_heap(top.begin(), top.end(), MoreFragmented);
+            FragmentedFile &slot = top.back();
+            slot.fragments = fragments;
+            slot.clusters = clusters;
+            slot.size = size;
+            slot.path.assign(path, pathLength);
+        } else {
+            candidate.size = size;
+            candidate.path.assign(path, pathLength);
+            top.push_back(std::move(candidate));
+        }
+        std::push_heap(top.begin(), top.end(), MoreFragmented);
+    }
+
+    // Add [start, end) minus the reserved ranges
+    void AddFreeRange(uint64_t start, uint64_t end, const std::vector<LcnRange> &reserved) {
+        for (const LcnRange &r : reserved) {
+            if (r.end <= start || r.start >= end) {
+                continue;
+            }
+            uint64_t cutEnd = std::min(end, (uint64_t)r.end);
+            reservedFreeClusters += cutEnd - std::max(start, (uint64_t)r.start);
+            if (r.start > start) {
+                AddFreeRun(start, r.start - start);
+            }
+            start = cutEnd;
+            if (start >= end) {
+                return;
+            }
+        }
+        AddFreeRun(start, end - start);
+    }
+
+    // Two decimals, without touching the stream's format flags
+    static std::string Fixed(double value) {
+        char text[64];
+        std::snprintf(text, sizeof(text), "%.2f", value);
+        return text;
+    }
+
+    // JSON string in UTF-8. wchar_t is UTF-16 on Windows and UTF-32 elsewhere.
+    static void WriteString(std::ostream &out, const wchar_t *s, size_t length) {
+        static const char HEX[] = "0123456789abcdef";
+        out << '"';
+        for (size_t i = 0; i < length; i++) {
+            uint32_t c = (uint32_t)s[i];
+            if (c >= 0xD800 && c < 0xDC00 && i + 1 < length && (uint32_t)s[i + 1] >= 0xDC00 &&
+                (uint32_t)s[i + 1] < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)s[++i] - 0xDC00);
+            } else if (c >= 0xD800 && c < 0xE000) {
+                c = 0xFFFD; // unpaired surrogate
+            }
+            if (c == '"' || c == '\\') {
+                out << '\\' << (char)c;
+            } else if (c < 0x20) {
+                out << "\\u00" << HEX[c >> 4] << HEX[c & 15];
+            } else if (c < 0x80) {
+                out << (char)c;
+            } else if (c < 0x800) {
+                out << (char)(0xC0 | (c >> 6)) << (char)(0x80 | (c & 0x3F));
+            } else if (c < 0x10000) {
+                out << (char)(0xE0 | (c >> 12)) << (char)(0x80 | ((c >> 6) & 0x3F)) << (char)(0x80 | (c & 0x3F));
+            } else {
+                out << (char)(0xF0 | (c >> 18)) << (char)(0x80 | ((c >> 12) & 0x3F))
+                    << (char)(0x80 | ((c >> 6) & 0x3F)) << (char)(0x80 | (c & 0x3F));
+            }
+        }
+        out << '"';
+    }
+
+    std::wstring volumeName;
+    uint64_t totalClusters = 0;
+    uint32_t bytesPerCluster = 0;
+
+    uint64_t files = 0;
+    uint64_t filesWithoutClusters = 0;
+    uint64_t fragmentedFiles = 0;
+    uint64_t extents = 0;
+    uint64_t fileBytes = 0;
+    uint64_t fileClusters = 0;
+    uint64_t fragmentedClusters = 0;
+    Log2Histogram fragmentHistogram; // files per fragment count, weighted by clusters
+    uint64_t sizeClassFiles[Log2Histogram::BUCKETS] = {};
+    uint64_t sizeClassExtents[Log2Histogram::BUCKETS] = {};
+    uint64_t sizeClassBytes[Log2Histogram::BUCKETS] = {};
+
+    uint64_t freeRuns = 0;
+    uint64_t freeClusters = 0;
+    uint64_t reservedFreeClusters = 0;
+    double freeSquares = 0;
+    FreeRun largestFree;
+    Log2Histogram freeHistogram; // free runs per length, weighted by clusters
+
+    const ReadCostModel *readCost = nullptr;
+    double readThresholdSeconds = 0;
+    double readSecondsNow = 0;        // fragmented files, as they are
+    double readSecondsContiguous = 0; // the same files, contiguous
+    uint64_t filesWorthMoving = 0;
+    double readSecondsSaved = 0;      // by moving the files worth moving
+
+    size_t topFiles;
+    std::vector<FragmentedFile> top; // heap, at most topFiles entries
+};
@@ -0,0 +1,187 @@
+// Fragmentation report over millions of synthetic files
+//
+//   fragmentation_report_bench [million-files = 10] [top = 20] [json-path = -]
+//
+//   1. checks the report on 100K files against a full sort and plain sums,
+//      and its free-space scan against a bit-by-bit walk of a simulated
+//      volume with a reserved zone
+//   2. streams `million-files` files with 1-2000 extents each through one
+//      report, generating each file's runs in a reused buffer, scans the
+//      free space of a 1 TB simulated volume, and reports the rate and how
+//      much the process grew. The JSON goes to json-path (- = stdout).
+
+#include "fragmentation_report.h"
+#include "free_run.h"
+#include "simulated_volume.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sys/resource.h>
+
+static long MaxResidentKB() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Runs of one synthetic file; most files are contiguous, some are split
+// into many pieces and a few have sparse runs or physically adjacent runs
+static void MakeFile(std::mt19937_64 &rng, uint64_t totalClusters, std::vector<ExtentRun> &runs, uint64_t &size) {
+    runs.clear();
+    unsigned kind = (unsigned)(rng() % 1000);
+    unsigned pieces = kind < 850 ? 1 : kind < 990 ? 2 + (unsigned)(rng() % 30) : 30 + (unsigned)(rng() % 1970);
+    if (kind < 20) {
+        pieces = 0; // resident
+    }
+    int64_t vcn = 0;
+    int64_t lcn = (int64_t)(rng() % (totalClusters - 1000000));
+    for (unsigned p = 0; p < pieces; p++) {
+        int64_t count = 1 + (int64_t)(rng() % 256);
+        bool sparse = rng() % 50 == 0;
+        runs.push_back(ExtentRun{vcn, sparse ? -1 : lcn, count});
+        vcn += count;
+        if (!sparse) {
+            lcn += count;
+        }
+        lcn += rng() % 8 == 0 ? 0 : 1 + (int64_t)(rng() % 100000); // 0 = the next run follows on disk
+    }
+    size = pieces ? (uint64_t)vcn * 4096 - rng() % 4096 : rng() % 700;
+}
+
+static uint64_t Fragments(const std::vector<ExtentRun> &runs, uint64_t &clusters) {
+    uint64_t fragments = 0;
+    clusters = 0;
+    int64_t next = -1;
+    for (const ExtentRun &r : runs) {
+        if (r.lcn >= 0) {
+            fragments += r.lcn != next ? 1 : 0;
+            clusters += (uint64_t)r.count;
+            next = r.lcn + r.count;
+        }
+    }
+    return fragments;
+}
+
+static bool CrossCheck() {
+    const uint64_t total = 1ULL << 28;
+    std::mt19937_64 rng(11);
+    FragmentationReport report(25);
+    struct Seen {
+        uint64_t fragments, clusters, order;
+    };
+    std::vector<Seen> all;
+    std::vector<ExtentRun> runs;
+    uint64_t extents = 0;
+    for (uint64_t i = 0; i < 100000; i++) {
+        uint64_t size = 0, clusters = 0;
+        MakeFile(rng, total, runs, size);
+        std::wstring path = L"f" + std::to_wstring(i);
+        report.AddFile(path.data(), path.size(), size, runs.data(), runs.size());
+        uint64_t fragments = Fragments(runs, clusters);
+        extents += fragments;
+        if (fragments > 1) {
+            all.push_back(Seen{fragments, clusters, i});
+        }
+    }
+    std::stable_sort(all.begin(), all.end(), [](const Seen &a, const Seen &b) {
+        return a.fragments > b.fragments || (a.fragments == b.fragments && a.clusters > b.clusters);
+    });
+    std::vector<FragmentedFile> top = report.TopFiles();
+    if (top.size() != 25 || report.FragmentedFiles() != all.size() || report.Extents() != extents) {
+        std::cerr << "MISMATCH totals\n";
+        return false;
+    }
+    for (size_t i = 0; i < top.size(); i++) {
+        if (top[i].path != L"f" + std::to_wstring(all[i].order)) {
+            std::cerr << "MISMATCH top file " << i << "\n";
+            return false;
+        }
+    }
+
+    SimulatedVolume volume(3000000 + 17, 5, 55);
+    std::vector<LcnRange> reserved{LcnRange{100000, 400000}, LcnRange{2000000, 2000100}};
+    FragmentationReport freeSpace;
+    freeSpace.ScanFreeSpace([&volume](uint64_t i) { return volume.Word(i); }, volume.TotalClusters(), reserved);
+    uint64_t runsSeen = 0, clusters = 0, largest = 0, runLength = 0;
+    for (uint64_t c = 0; c <= volume.TotalClusters(); c++) {
+        bool usable = c < volume.TotalClusters() && !volume.IsAllocated(c) && !IsReservedLcn(reserved, c);
+        if (usable) {
+            runLength++;
+            clusters++;
+        } else if (runLength) {
+            runsSeen++;
+            largest = std::max(largest, runLength);
+            runLength = 0;
+        }
+    }
+    LcnRange largestRun = freeSpace.LargestFreeRun();
+    if (freeSpace.FreeRuns() != runsSeen || freeSpace.FreeClusters() != clusters || largestRun.end - largestRun.start != largest) {
+        std::cerr << "MISMATCH free space: " << freeSpace.FreeRuns() << " runs vs " << runsSeen << "\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint64_t millions = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10;
+    size_t topFiles = argc > 2 ? (size_t)std::strtoull(argv[2], nullptr, 10) : 20;
+    std::string jsonPath = argc > 3 ? argv[3] : "-";
+    if (millions == 0) {
+        std::cerr << "invalid arguments\n";
+        return 1;
+    }
+    if (!CrossCheck()) {
+        return 1;
+    }
+    std::cout << "Cross-check against a full sort and a bit-by-bit scan: OK\n";
+
+    const uint64_t totalClusters = (1ULL << 40) / 4096;
+    FragmentationReport report(topFiles);
+    report.SetVolume(L"simulated été \"1 TB\"", totalClusters, 4096);
+    long residentBefore = MaxResidentKB();
+
+    std::mt19937_64 rng(42);
+    std::vector<ExtentRun> runs;
+    std::wstring path = L"\\data\\";
+    size_t prefix = path.size();
+    uint64_t files = millions * 1000000;
+    auto started = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < files; i++) {
+        uint64_t size = 0;
+        MakeFile(rng, totalClusters, runs, size);
+        path.resize(prefix);
+        path += std::to_wstring(i % 1000);
+        path += L"\\file";
+        path += std::to_wstring(i);
+        report.AddFile(path.data(), path.size(), size, runs.data(), runs.size());
+    }
+    double fileSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    SimulatedVolume volume(totalClusters, 0xF4A6, 60);
+    std::vector<LcnRange> reserved{LcnRange{786432, 786432 + totalClusters / 8}};
+    started = std::chrono::steady_clock::now();
+    report.ScanFreeSpace([&volume](uint64_t i) { return volume.Word(i); }, totalClusters, reserved);
+    double freeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::cout << files << " files (" << report.Extents() << " extents) in " << fileSeconds << " s, "
+              << (uint64_t)((double)files / fileSeconds) << " files/s, including generating them\n";
+    std::cout << "Free space of " << totalClusters << " clusters: " << report.FreeRuns() << " runs in " << freeSeconds
+              << " s\n";
+    std::cout << "Report object: " << sizeof(FragmentationReport) << " bytes + " << topFiles
+              << " paths; peak resident size grew by " << MaxResidentKB() - residentBefore << " KB\n";
+
+    if (jsonPath == "-") {
+        report.WriteJson(std::cout, 0);
+    } else {
+        std::ofstream out(jsonPath);
+        report.WriteJson(out, 0);
+        if (!out) {
+            std::cerr << "cannot write " << jsonPath << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
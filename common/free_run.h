@@ -0,0 +1,127 @@
+#pragma once
+// Word-at-a-time search for runs of free clusters
+//
+// The bitmap is read 64 clusters at a time: a fully allocated word is
+// skipped and a fully free word extends the current run in one step, so
+// only mixed words are looked at bit by bit. Reserved ranges (the MFT zone)
+// are jumped over and never become part of a run.
+//
+// Bitmaps are read through a word source, a callable returning the 64 bits
+// of clusters [64 * i, 64 * i + 64) with bit 0 first. BitmapWords adapts an
+// in-memory byte bitmap; SimulatedVolume::Word fits the same shape.
+
+#include "volume_geometry.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Word source over a byte bitmap as returned by FSCTL_GET_VOLUME_BITMAP
+// (in memory, or mapped from a snapshot)
+class BitmapWords {
+public:
+    explicit BitmapWords(const std::vector<uint8_t> &bitmap) : bytes(bitmap.data()), size(bitmap.size()) {}
+    BitmapWords(const uint8_t *bytes, size_t size) : bytes(bytes), size(size) {}
+
+    uint64_t operator()(uint64_t index) const {
+        size_t at = (size_t)(index * 8);
+        if (at + 8 <= size) {
+            uint64_t w;
+            std::memcpy(&w, bytes + at, 8); // the bitmap is little-endian, like x86 / ARM64 Windows
+            return w;
+        }
+        uint64_t w = ~0ULL; // past the end counts as allocated
+        for (size_t i = 0; at + i < size; i++) {
+            w &= ~(0xFFULL << (8 * i));
+            w |= (uint64_t)bytes[at + i] << (8 * i);
+        }
+        return w;
+    }
+
+private:
+    const uint8_t *bytes;
+    size_t size;
+};
+
+// Find the first run of `needed` free clusters inside [fromLcn, toLcn) that
+// does not touch a reserved range (sorted, as from ReservedRanges)
+template <typename WordSource>
+bool FindFreeRun(const WordSource &words,
+                 uint64_t fromLcn,
+                 uint64_t toLcn,
+                 uint64_t needed,
+                 const std::vector<LcnRange> &reserved,
+                 uint64_t &outStart) {
+    if (needed == 0) {
+        return false;
+    }
+    size_t nextReserved = 0;
+    uint64_t c = fromLcn;
+    while (c < toLcn) {
+        // The segment up to the next reserved range
+        while (nextReserved < reserved.size() && reserved[nextReserved].end <= c) {
+            nextReserved++;
+        }
+        uint64_t segmentEnd = toLcn;
+        if (nextReserved < reserved.size()) {
+            if (reserved[nextReserved].start <= c) {
+                c = reserved[nextReserved].end;
+                continue;
+            }
+            segmentEnd = std::min(segmentEnd, reserved[nextReserved].start);
+        }
+        if (segmentEnd - c < needed) {
+            c = segmentEnd;
+            continue;
+        }
+
+        uint64_t runStart = c;
+        uint64_t runLen = 0;
+        while (c < segmentEnd) {
+            uint64_t w = words(c / 64);
+            unsigned bit = (unsigned)(c % 64);
+            uint64_t bitsHere = std::min<uint64_t>(64 - bit, segmentEnd - c);
+            if (bit == 0 && bitsHere == 64 && (w == ~0ULL || w == 0)) {
+                if (w == 0) {
+                    if (runLen == 0) {
+                        runStart = c;
+                    }
+                    runLen += 64;
+                    if (runLen >= needed) {
+                        outStart = runStart;
+                        return true;
+                    }
+                } else {
+                    runLen = 0;
+                }
+                c += 64;
+                continue;
+            }
+            for (uint64_t i = 0; i < bitsHere; i++, c++) {
+                if ((w >> (bit + i)) & 1) {
+                    runLen = 0;
+                } else {
+                    if (runLen == 0) {
+                        runStart = c;
+                    }
+                    if (++runLen == needed) {
+                        outStart = runStart;
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Is lcn inside one of the reserved ranges?
+inline bool IsReservedLcn(const std::vector<LcnRange> &reserved, uint64_t lcn) {
+    for (const LcnRange &r : reserved) {
+        if (lcn >= r.start && lcn < r.end) {
+            return true;
+        }
+    }
+    return false;
+}
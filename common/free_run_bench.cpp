@@ -0,0 +1,119 @@
+// Free-run search on a petabyte-scale simulated volume
+//
+//   free_run_bench [petabytes = 1] [cluster-KB = 4]
+//
+// First cross-checks FindFreeRun against a plain bit-by-bit search on small
+// simulated volumes (with and without a reserved zone), then runs searches
+// on the big volume with an NTFS-like MFT zone and times them. The volume
+// has far more than 2^32 clusters, the count a DWORD would have kept.
+
+#include "free_run.h"
+#include "simulated_volume.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+static bool NaiveFindFreeRun(const SimulatedVolume &v, uint64_t from, uint64_t to, uint64_t needed,
+                             const std::vector<LcnRange> &reserved, uint64_t &out) {
+    uint64_t runLen = 0;
+    for (uint64_t c = from; c < to; c++) {
+        if (v.IsAllocated(c) || IsReservedLcn(reserved, c)) {
+            runLen = 0;
+        } else if (++runLen == needed) {
+            out = c + 1 - needed;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool CrossCheck() {
+    auto words = [](const SimulatedVolume &v) { return [&v](uint64_t i) { return v.Word(i); }; };
+    for (uint64_t seed = 1; seed <= 20; seed++) {
+        SimulatedVolume v(100000 + seed * 37, seed, (unsigned)(40 + seed * 2));
+        std::vector<LcnRange> reserved;
+        if (seed % 2) {
+            reserved.push_back(LcnRange{1000 + seed * 13, 20000 + seed * 101});
+            reserved.push_back(LcnRange{50000, 50001 + seed});
+        }
+        for (uint64_t needed : {1, 3, 17, 64, 65, 130, 300}) {
+            for (uint64_t from : {0ULL, 7ULL, 1001ULL, 5000ULL, 33333ULL}) {
+                uint64_t a = 0, b = 0;
+                bool fa = FindFreeRun(words(v), from, v.TotalClusters(), needed, reserved, a);
+                bool fb = NaiveFindFreeRun(v, from, v.TotalClusters(), needed, reserved, b);
+                if (fa != fb || (fa && a != b)) {
+                    std::cerr << "MISMATCH seed " << seed << " needed " << needed << " from " << from << ": "
+                              << fa << "@" << a << " vs " << fb << "@" << b << "\n";
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint64_t petabytes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1;
+    uint64_t clusterKB = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 4;
+    if (petabytes == 0 || clusterKB == 0) {
+        std::cerr << "invalid arguments\n";
+        return 1;
+    }
+    if (!CrossCheck()) {
+        return 1;
+    }
+    std::cout << "Cross-check against bit-by-bit search: OK\n";
+
+    VolumeGeometry g;
+    g.isNtfs = true;
+    g.bytesPerCluster = (uint32_t)(clusterKB * 1024);
+    g.totalClusters = (petabytes << 50) / g.bytesPerCluster;
+    g.mftStartLcn = 786432;
+    g.mftZoneStart = g.mftStartLcn;
+    g.mftZoneEnd = g.mftZoneStart + g.totalClusters / 8; // default MftZoneReservation: 12.5%
+    std::cout << "Volume: " << petabytes << " PB, " << g.totalClusters << " clusters ("
+              << (uint32_t)g.totalClusters << " if read as a DWORD)\n";
+    std::cout << "MFT zone: [" << g.mftZoneStart << ", " << g.mftZoneEnd << ")\n";
+
+    SimulatedVolume volume(g.totalClusters, 0xD15C);
+    auto words = [&volume](uint64_t i) { return volume.Word(i); };
+    std::vector<LcnRange> reserved = g.ReservedRanges();
+
+    struct Search {
+        const char *what;
+        uint64_t from;
+        uint64_t needed;
+    } searches[] = {
+        {"first fit, 16 clusters", 0, 16},
+        {"first fit, 192 clusters", 0, 192},
+        {"hint inside the MFT zone, 16 clusters", g.mftZoneStart + 12345, 16},
+        {"hint 2^32 clusters past the zone, 128 clusters", g.mftZoneEnd + (1ULL << 32), 128},
+        {"near the end, 64 clusters", g.totalClusters - (1ULL << 20), 64},
+    };
+    for (const Search &s : searches) {
+        auto started = std::chrono::steady_clock::now();
+        uint64_t at = 0;
+        bool found = FindFreeRun(words, s.from, g.totalClusters, s.needed, reserved, at);
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count();
+        bool valid = found && !(at < g.mftZoneEnd && at + s.needed > g.mftZoneStart);
+        for (uint64_t c = at; found && c < at + s.needed; c++) {
+            valid = valid && !volume.IsAllocated(c);
+        }
+        std::cout << s.what << ": " << (found ? "LCN " + std::to_string(at) : std::string("none")) << " in " << us
+                  << " us" << (found && !valid ? "  INVALID" : "") << "\n";
+        if (found && !valid) {
+            return 1;
+        }
+    }
+
+    // Worst case: a run that does not exist, so every word of a 2^32-cluster window is read
+    uint64_t window = 1ULL << 32;
+    auto started = std::chrono::steady_clock::now();
+    uint64_t at = 0;
+    bool found = FindFreeRun(words, g.mftZoneEnd, g.mftZoneEnd + window, 1ULL << 20, reserved, at);
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "Full scan of " << window << " clusters for a 1M-cluster run: " << (found ? "found" : "none")
+              << " in " << s << " s (" << (double)window / s / 1e9 << " G clusters/s)\n";
+    return 0;
+}
@@ -0,0 +1,194 @@
+#pragma once
+// Incremental re-analysis from a snapshot and a change feed
+//
+// Instead of walking the volume and querying every file, a run starts from
+// the previous snapshot and the changes reported since it was taken:
+//
+//   1. DropDirectory for every deleted / renamed-away directory: its files
+//      leave the map
+//   2. SetFile for every changed path, with what the file looks like now
+//      (the caller opens it and asks for its retrieval pointers; a file that
+//      cannot be found is passed with exists = false)
+//   3. ApplyToBitmap: the clusters of every dropped or changed file, as the
+//      snapshot had them, are freed, then the clusters the changed files
+//      have now are allocated
+//   4. The caller may move changed files and update their runs
+//   5. Write: unchanged records are copied over, changed files are added
+//
+// Volume I/O is proportional to the number of changes. Writing the new
+// snapshot still copies every record, but that is a sequential pass over a
+// mapped file, not an ioctl per file.
+
+#include "snapshot.h"
+#include "volume_geometry.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct ChangedFile {
+    std::wstring path;
+    bool exists = false;
+    uint64_t size = 0;
+    uint64_t lastWriteTicks = 0;
+    std::vector<ExtentRun> runs;
+};
+
+struct IncrementalStats {
+    uint64_t directoriesDropped = 0;
+    uint64_t filesDropped = 0;     // records removed with their directory
+    uint64_t filesQueried = 0;     // SetFile calls
+    uint64_t filesGone = 0;        // queried, but no longer there
+    uint64_t filesCarried = 0;     // copied from the previous snapshot unchanged
+    uint64_t clustersFreed = 0;
+    uint64_t clustersAllocated = 0;
+};
+
+// Set or clear count bits of a bitmap from bit start on
+inline void MarkBitmapRange(std::vector<uint8_t> &bitmap, uint64_t start, uint64_t count, bool allocated) {
+    uint64_t end = std::min<uint64_t>(start + count, (uint64_t)bitmap.size() * 8);
+    uint64_t c = start;
+    for (; c < end && (c % 8) != 0; c++) {
+        bitmap[(size_t)(c / 8)] = allocated ? (uint8_t)(bitmap[(size_t)(c / 8)] | (1u << (c % 8)))
+                                            : (uint8_t)(bitmap[(size_t)(c / 8)] & ~(1u << (c % 8)));
+    }
+    if (end - c >= 8) {
+        uint64_t bytes = (end - c) / 8;
+        std::fill(bitmap.begin() + (size_t)(c / 8), bitmap.begin() + (size_t)(c / 8 + bytes), allocated ? 0xFF : 0x00);
+        c += bytes * 8;
+    }
+    for (; c < end; c++) {
+        bitmap[(size_t)(c / 8)] = allocated ? (uint8_t)(bitmap[(size_t)(c / 8)] | (1u << (c % 8)))
+                                            : (uint8_t)(bitmap[(size_t)(c / 8)] & ~(1u << (c % 8)));
+    }
+}
+
+class IncrementalUpdate {
+public:
+    // previous is only read, through the lookups that leave it shareable
+    // with other threads (the volume-map service answers queries from it
+    // while it refreshes)
+    explicit IncrementalUpdate(const SnapshotReader &previous) : previous(previous) {}
+
+    // Drop every record below directory (with or without a trailing separator)
+    void DropDirectory(const std::wstring &directory, wchar_t separator) {
+        std::wstring prefix = directory;
+        if (prefix.empty() || prefix.back() != separator) {
+            prefix.push_back(separator);
+        }
+        key.clear();
+        snapshot_detail::AppendUtf16(key, prefix.data(), prefix.size());
+        uint64_t first = previous.LowerBoundUtf16(key.data(), key.size());
+        uint64_t last = first;
+        while (last < previous.FileCount() && HasKeyAsPrefix(previous.FileAt(last))) {
+            last++;
+        }
+        stats.directoriesDropped++;
+        stats.filesDropped += last - first;
+        if (first < last) {
+            dropped.push_back(std::make_pair(first, last));
+        }
+    }
+
+    // Record what a changed path looks like now
+    void SetFile(ChangedFile &&file) {
+        stats.filesQueried++;
+        if (!file.exists) {
+            stats.filesGone++;
+        }
+        key.clear();
+        snapshot_detail::AppendUtf16(key, file.path.data(), file.path.size());
+        if (const SnapshotFileRecord *r = previous.FindUtf16(key.data(), key.size())) {
+            uint64_t i = (uint64_t)(r - &previous.FileAt(0));
+            dropped.push_back(std::make_pair(i, i + 1));
+        }
+        files.push_back(std::move(file));
+    }
+
+    // The changed files, in SetFile order; their runs may be updated after moves
+    std::vector<ChangedFile> &Files() { return files; }
+
+    // touched, if given, receives every LCN range whose bits were set or
+    // cleared (unsorted, may overlap)
+    void ApplyToBitmap(std::vector<uint8_t> &bitmap, std::vector<LcnRange> *touched = nullptr) {
+        NormalizeDropped();
+        std::vector<ExtentRun> runs;
+        for (const auto &range : dropped) {
+            for (uint64_t i = range.first; i < range.second; i++) {
+                if (!previous.DecodeExtents(previous.FileAt(i), runs)) {
+                    continue;
+                }
+                for (const ExtentRun &run : runs) {
+                    if (run.lcn >= 0) {
+                        MarkBitmapRange(bitmap, (uint64_t)run.lcn, (uint64_t)run.count, false);
+                        stats.clustersFreed += (uint64_t)run.count;
+                        if (touched) {
+                            touched->push_back(LcnRange{(uint64_t)run.lcn, (uint64_t)(run.lcn + run.count)});
+                        }
+                    }
+                }
+            }
+        }
+        for (const ChangedFile &f : files) {
+            for (const ExtentRun &run : f.runs) {
+                if (f.exists && run.lcn >= 0) {
+                    MarkBitmapRange(bitmap, (uint64_t)run.lcn, (uint64_t)run.count, true);
+                    stats.clustersAllocated += (uint64_t)run.count;
+                    if (touched) {
+                        touched->push_back(LcnRange{(uint64_t)run.lcn, (uint64_t)(run.lcn + run.count)});
+                    }
+                }
+            }
+        }
+    }
+
+    // Fill writer with the unchanged records and the changed files that still exist
+    void Write(SnapshotWriter &writer) {
+        NormalizeDropped();
+        size_t d = 0;
+        for (uint64_t i = 0; i < previous.FileCount(); i++) {
+            while (d < dropped.size() && dropped[d].second <= i) {
+                d++;
+            }
+            if (d < dropped.size() && dropped[d].first <= i) {
+                i = dropped[d].second - 1;
+                continue;
+            }
+            writer.CopyFile(previous, previous.FileAt(i));
+            stats.filesCarried++;
+        }
+        for (const ChangedFile &f : files) {
+            if (f.exists) {
+                writer.AddFile(f.path.data(), f.path.size(), f.size, f.lastWriteTicks, f.runs.data(), f.runs.size());
+            }
+        }
+    }
+
+    IncrementalStats stats;
+
+private:
+    bool HasKeyAsPrefix(const SnapshotFileRecord &r) const {
+        return previous.NameLengthOf(r) >= key.size() && std::equal(key.begin(), key.end(), previous.NameOf(r));
+    }
+
+    // Sort and merge the dropped index ranges
+    void NormalizeDropped() {
+        std::sort(dropped.begin(), dropped.end());
+        size_t out = 0;
+        for (size_t i = 0; i < dropped.size(); i++) {
+            if (out > 0 && dropped[i].first <= dropped[out - 1].second) {
+                dropped[out - 1].second = std::max(dropped[out - 1].second, dropped[i].second);
+            } else {
+                dropped[out++] = dropped[i];
+            }
+        }
+        dropped.resize(out);
+    }
+
+    const SnapshotReader &previous;
+    std::vector<uint16_t> key; // lookup key, reused
+    std::vector<std::pair<uint64_t, uint64_t>> dropped; // index ranges of the previous snapshot
+    std::vector<ChangedFile> files;
+};
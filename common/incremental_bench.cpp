@@ -0,0 +1,242 @@
+// Incremental re-analysis benchmark on a simulated volume
+//
+//   incremental_bench <scratch-dir> [files = 1000000] [changed-per-mille = 1]
+//
+// Takes a full snapshot of a synthetic file set, then changes a fraction of
+// it (rewrites that move the data, deletions, one deleted directory, one new
+// directory full of files) and records the changes in a change log. The
+// incremental run consumes the log, "queries" only the changed files and
+// writes a new snapshot; it is compared, record by record and bit by bit,
+// with a snapshot rebuilt from scratch.
+
+#include "incremental.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+
+struct SyntheticFile {
+    std::wstring path;
+    bool alive = true;
+    uint64_t size = 0;
+    uint64_t lastWriteTicks = 0;
+    std::vector<ExtentRun> runs;
+};
+
+// Hands out clusters from the start of the volume, never reusing any, so
+// files never overlap and the bitmap is exactly the union of their runs
+struct BumpAllocator {
+    std::mt19937_64 rng{0xA110C};
+    int64_t next = 0;
+
+    void Fill(SyntheticFile &f, uint64_t ticks) {
+        f.runs.clear();
+        unsigned pieces = (rng() % 100 < 70) ? 1 : 2 + (unsigned)(rng() % 20);
+        int64_t vcn = 0;
+        for (unsigned p = 0; p < pieces; p++) {
+            int64_t count = 1 + (int64_t)(rng() % 32);
+            next += (int64_t)(rng() % 16);
+            f.runs.push_back(ExtentRun{vcn, next, count});
+            next += count;
+            vcn += count;
+        }
+        f.size = (uint64_t)vcn * 4096 - rng() % 4096;
+        f.lastWriteTicks = ticks;
+    }
+};
+
+static std::wstring Widen(const std::string &s) { return std::wstring(s.begin(), s.end()); }
+
+static bool WriteFull(const std::wstring &path, const std::vector<SyntheticFile> &files, uint64_t totalClusters,
+                      const ChangePosition &position, std::vector<uint8_t> &bitmap) {
+    bitmap.assign((size_t)((totalClusters + 7) / 8), 0);
+    SnapshotWriter writer(1, totalClusters, 4096);
+    writer.SetChangePosition(position);
+    for (const SyntheticFile &f : files) {
+        if (!f.alive) {
+            continue;
+        }
+        for (const ExtentRun &r : f.runs) {
+            MarkBitmapRange(bitmap, (uint64_t)r.lcn, (uint64_t)r.count, true);
+        }
+        writer.AddFile(f.path.data(), f.path.size(), f.size, f.lastWriteTicks, f.runs.data(), f.runs.size());
+    }
+    return writer.Write(path, bitmap.data(), 1);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: incremental_bench <scratch-dir> [files] [changed-per-mille]\n";
+        return 1;
+    }
+    std::string dir = argv[1];
+    uint64_t fileCount = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+    uint64_t perMille = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 1;
+    if (fileCount < 2000) {
+        std::cerr << "at least 2000 files\n";
+        return 1;
+    }
+    const uint64_t FILES_PER_DIR = 1000;
+    const uint64_t totalClusters = 1ULL << 30;
+    std::string logPath = dir + "/changes.log";
+    std::wstring basePath = Widen(dir + "/base.snap");
+    std::wstring incrementalPath = Widen(dir + "/incremental.snap");
+    std::wstring fullPath = Widen(dir + "/full.snap");
+
+    // Full pass
+    BumpAllocator alloc;
+    std::vector<SyntheticFile> files((size_t)fileCount);
+    for (uint64_t i = 0; i < fileCount; i++) {
+        files[(size_t)i].path = L"C:\\d" + std::to_wstring(i / FILES_PER_DIR) + L"\\f" + std::to_wstring(i) + L".dat";
+        alloc.Fill(files[(size_t)i], 100);
+    }
+    std::remove(logPath.c_str());
+    std::ofstream(logPath).close();
+    ChangeLogSource source(Widen(logPath));
+    ChangePosition start;
+    std::vector<uint8_t> bitmap;
+    auto started = std::chrono::steady_clock::now();
+    if (!source.Current(start) || !WriteFull(basePath, files, totalClusters, start, bitmap)) {
+        std::cerr << "cannot write the base snapshot\n";
+        return 1;
+    }
+    double fullSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    // Changes: rewrites and deletions spread over the volume, one directory
+    // deleted, one directory added
+    std::mt19937_64 rng(42);
+    std::wofstream log(logPath, std::ios::app);
+    uint64_t changes = std::max<uint64_t>(1, fileCount * perMille / 1000);
+    for (uint64_t c = 0; c < changes; c++) {
+        SyntheticFile &f = files[(size_t)(rng() % fileCount)];
+        if (!f.alive) {
+            continue;
+        }
+        if (rng() % 4 == 0) {
+            f.alive = false;
+            log << L"D " << f.path << L"\n";
+        } else {
+            alloc.Fill(f, 200 + c);
+            log << L"M " << f.path << L"\n";
+        }
+    }
+    std::wstring deletedDir = L"C:\\d1";
+    for (uint64_t i = FILES_PER_DIR; i < 2 * FILES_PER_DIR; i++) {
+        files[(size_t)i].alive = false;
+    }
+    log << L"DD " << deletedDir << L"\n";
+    std::wstring addedDir = L"C:\\new";
+    size_t firstAdded = files.size();
+    for (uint64_t i = 0; i < 100; i++) {
+        SyntheticFile f;
+        f.path = addedDir + L"\\n" + std::to_wstring(i) + L".dat";
+        alloc.Fill(f, 300);
+        files.push_back(f);
+    }
+    log << L"DA " << addedDir << L"\n";
+    log.close();
+
+    std::unordered_map<std::wstring, size_t> truth; // what opening a path would find
+    for (size_t i = 0; i < files.size(); i++) {
+        if (files[i].alive) {
+            truth[files[i].path] = i;
+        }
+    }
+
+    // Incremental pass
+    started = std::chrono::steady_clock::now();
+    SnapshotReader previous;
+    if (previous.Open(basePath) != SnapshotStatus::Ok) {
+        std::cerr << "cannot load the base snapshot\n";
+        return 1;
+    }
+    std::vector<FileChange> feed;
+    ChangePosition next;
+    if (source.Read(previous.ChangeFeedPosition(), feed, next) != ChangeReadStatus::Ok) {
+        std::cerr << "cannot read the change log\n";
+        return 1;
+    }
+    size_t feedSize = feed.size();
+    CoalesceChanges(feed);
+
+    IncrementalUpdate update(previous);
+    std::vector<std::wstring> paths;
+    for (const FileChange &c : feed) {
+        if (c.kind == ChangeKind::DirectoryDeleted) {
+            update.DropDirectory(c.path, L'\\');
+        } else if (c.kind == ChangeKind::DirectoryAdded) {
+            for (size_t i = firstAdded; i < files.size(); i++) { // stands in for walking the directory
+                paths.push_back(files[i].path);
+            }
+        } else {
+            paths.push_back(c.path);
+        }
+    }
+    for (const std::wstring &p : paths) {
+        ChangedFile cf;
+        cf.path = p;
+        auto it = truth.find(p);
+        if (it != truth.end()) {
+            const SyntheticFile &f = files[it->second];
+            cf.exists = true;
+            cf.size = f.size;
+            cf.lastWriteTicks = f.lastWriteTicks;
+            cf.runs = f.runs;
+        }
+        update.SetFile(std::move(cf));
+    }
+    std::vector<uint8_t> incrementalBitmap(previous.Bitmap(), previous.Bitmap() + previous.Header().bitmapBytes);
+    update.ApplyToBitmap(incrementalBitmap);
+    SnapshotWriter writer(1, totalClusters, 4096);
+    writer.SetChangePosition(next);
+    update.Write(writer);
+    previous.Close();
+    if (!writer.Write(incrementalPath, incrementalBitmap.data(), 1)) {
+        std::cerr << "cannot write the incremental snapshot\n";
+        return 1;
+    }
+    double incrementalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    // Rebuild from scratch and compare
+    std::vector<uint8_t> fullBitmap;
+    if (!WriteFull(fullPath, files, totalClusters, next, fullBitmap)) {
+        std::cerr << "cannot write the full snapshot\n";
+        return 1;
+    }
+    SnapshotReader a;
+    SnapshotReader b;
+    if (a.Open(incrementalPath) != SnapshotStatus::Ok || b.Open(fullPath) != SnapshotStatus::Ok) {
+        std::cerr << "cannot load the snapshots to compare\n";
+        return 1;
+    }
+    uint64_t mismatches = a.FileCount() == b.FileCount() ? 0 : 1;
+    std::vector<ExtentRun> ra;
+    std::vector<ExtentRun> rb;
+    for (uint64_t i = 0; i < b.FileCount(); i++) {
+        const SnapshotFileRecord &fb = b.FileAt(i);
+        std::wstring p = b.PathOf(fb);
+        const SnapshotFileRecord *fa = a.Find(p.data(), p.size());
+        bool same = fa && fa->size == fb.size && fa->lastWriteTicks == fb.lastWriteTicks && a.DecodeExtents(*fa, ra) &&
+                    b.DecodeExtents(fb, rb) && ra.size() == rb.size();
+        for (size_t r = 0; same && r < ra.size(); r++) {
+            same = ra[r].vcn == rb[r].vcn && ra[r].lcn == rb[r].lcn && ra[r].count == rb[r].count;
+        }
+        mismatches += same ? 0 : 1;
+    }
+    bool bitmapOk = std::memcmp(a.Bitmap(), b.Bitmap(), (size_t)b.Header().bitmapBytes) == 0;
+    bool positionOk = a.ChangeFeedPosition().position == next.position && next.position == feedSize;
+
+    const IncrementalStats &s = update.stats;
+    std::cout << "Files: " << fileCount << ", change log: " << feedSize << " lines, " << s.filesQueried
+              << " files queried (" << s.filesGone << " gone), " << s.filesDropped << " dropped with "
+              << s.directoriesDropped << " directory, " << s.filesCarried << " carried over\n";
+    std::cout << "Clusters freed: " << s.clustersFreed << ", allocated: " << s.clustersAllocated << "\n";
+    std::cout << "Full pass: " << fileCount << " files queried, snapshot in " << fullSeconds << " s\n";
+    std::cout << "Incremental pass: " << s.filesQueried << " files queried, snapshot in " << incrementalSeconds << " s\n";
+    std::cout << "Check against a full rebuild: " << mismatches << " mismatched files, bitmap "
+              << (bitmapOk ? "identical" : "DIFFERS") << ", change position " << (positionOk ? "ok" : "WRONG") << "\n";
+    return (mismatches == 0 && bitmapOk && positionOk) ? 0 : 1;
+}
@@ -0,0 +1,855 @@
+#pragma once
+// Record and replay of volume operation traces
+//
+// A trace keeps every FSCTL_GET_VOLUME_BITMAP, FSCTL_GET_RETRIEVAL_POINTERS
+// and FSCTL_MOVE_FILE a tool issued, request and reply, plus the files it
+// opened, in the order the calls completed. It holds no file contents, so a
+// trace of a production volume can be taken home and replayed on any
+// machine: TraceVolume rebuilds the volume as the trace first saw it (its
+// bitmap and the extents of every file that was queried) and answers the
+// same three calls from it, deterministically.
+//
+// Layout (little-endian):
+//
+//   IoTraceHeader
+//   records         kind (1 byte), varint payload length, payload
+//
+//   File            varint id, varint size, varint length, UTF-16 code units,
+//                   then optionally varint compression unit in clusters
+//   Bitmap          zigzag starting LCN, varint error, 1 byte has-reply, then
+//                   when set: zigzag reply LCN, varint bitmap size, varint
+//                   body bytes, body as byte runs (see PutByteRuns)
+//   Retrieval       varint file id, zigzag starting VCN, varint error,
+//                   varint run count, runs as in snapshots (EncodeRuns)
+//   Move            varint file id, varint VCN, varint LCN, varint count,
+//                   varint error
+//   Reserved        varint count, then varint start and end of each range
+//                   that placement never allocates from (the MFT zone)
+//
+// Errors are Win32 error codes (0 = success), so a trace reads the same on
+// any platform. Unknown record kinds are skipped by their length.
+
+#include "bitmap_fetch.h"
+#include "snapshot.h"
+#include "volume_geometry.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+const char IO_TRACE_MAGIC[8] = {'N', 'T', 'F', 'S', 'T', 'R', 'C', 'E'};
+const uint32_t IO_TRACE_VERSION = 1;
+
+// The Win32 error codes a trace records and a replay answers with
+const uint32_t TRACE_ERROR_SUCCESS = 0;
+const uint32_t TRACE_ERROR_ACCESS_DENIED = 5;      // FSCTL_MOVE_FILE onto clusters in use
+const uint32_t TRACE_ERROR_HANDLE_EOF = 38;        // no extents at or past the starting VCN
+const uint32_t TRACE_ERROR_INVALID_PARAMETER = 87;
+const uint32_t TRACE_ERROR_MORE_DATA = 234;
+
+const uint32_t TRACE_NO_FILE = 0xFFFFFFFF;
+
+struct IoTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;     // sizeof(IoTraceHeader) when written
+    uint64_t volumeSerial;
+    uint64_t createdTicks;    // FILETIME ticks (100 ns since 1601, UTC)
+    uint64_t totalClusters;
+    uint32_t bytesPerCluster;
+    uint32_t reserved;
+};
+
+enum class IoTraceKind : uint8_t {
+    File = 1,
+    Bitmap = 2,
+    Retrieval = 3,
+    Move = 4,
+    Reserved = 5
+};
+
+// One decoded record; fields that do not belong to its kind are left alone
+struct IoTraceRecord {
+    IoTraceKind kind = IoTraceKind::File;
+    uint32_t error = 0;
+    uint32_t fileId = TRACE_NO_FILE; // File, Retrieval, Move
+    // File
+    uint64_t size = 0;
+    std::wstring path;
+    uint32_t unitClusters = 0;       // compression unit, 0 when not compressed
+    // Bitmap
+    int64_t startingLcn = 0;         // as requested
+    bool hasReply = false;
+    BitmapReplyHeader reply = {};
+    std::vector<uint8_t> bitmap;     // reply body
+    // Retrieval (runs as returned, sparse ones with lcn = -1)
+    int64_t startingVcn = 0;
+    std::vector<ExtentRun> runs;
+    // Move
+    int64_t vcn = 0;
+    int64_t lcn = 0;
+    int64_t clusterCount = 0;
+    // Reserved
+    std::vector<LcnRange> reserved;
+};
+
+namespace io_trace_detail {
+
+#ifdef _WIN32
+inline FILE *Open(const std::wstring &path, bool write) { return _wfopen(path.c_str(), write ? L"wb" : L"rb"); }
+#else
+inline FILE *Open(const std::wstring &path, bool write) {
+    return std::fopen(std::string(path.begin(), path.end()).c_str(), write ? "wb" : "rb");
+}
+#endif
+
+// Bitmaps are mostly long stretches of 0x00 and 0xFF bytes:
+//   varint(length << 1 | 1) value      a run of one byte value
+//   varint(length << 1) bytes          literal bytes
+inline void PutByteRuns(std::vector<uint8_t> &out, const uint8_t *p, size_t n) {
+    const size_t MIN_RUN = 4;
+    size_t literalStart = 0;
+    size_t i = 0;
+    while (i < n) {
+        size_t j = i + 1;
+        while (j < n && p[j] == p[i]) {
+            j++;
+        }
+        if (j - i >= MIN_RUN) {
+            if (i > literalStart) {
+                snapshot_detail::PutVarint(out, (uint64_t)(i - literalStart) << 1);
+                out.insert(out.end(), p + literalStart, p + i);
+            }
+            snapshot_detail::PutVarint(out, ((uint64_t)(j - i) << 1) | 1);
+            out.push_back(p[i]);
+            literalStart = j;
+        }
+        i = j;
+    }
+    if (n > literalStart) {
+        snapshot_detail::PutVarint(out, (uint64_t)(n - literalStart) << 1);
+        out.insert(out.end(), p + literalStart, p + n);
+    }
+}
+
+inline bool GetByteRuns(const uint8_t *&p, const uint8_t *end, uint64_t n, std::vector<uint8_t> &out) {
+    out.clear();
+    while (out.size() < n) {
+        uint64_t head = 0;
+        if (!snapshot_detail::GetVarint(p, end, head)) {
+            return false;
+        }
+        uint64_t length = head >> 1;
+        if (length == 0 || length > n - out.size()) {
+            return false;
+        }
+        if (head & 1) {
+            if (p >= end) {
+                return false;
+            }
+            out.insert(out.end(), (size_t)length, *p++);
+        } else {
+            if ((uint64_t)(end - p) < length) {
+                return false;
+            }
+            out.insert(out.end(), p, p + length);
+            p += length;
+        }
+    }
+    return true;
+}
+
+} // namespace io_trace_detail
+
+// ---------------------------------------------------------------------------
+// Recording
+// ---------------------------------------------------------------------------
+
+// Thread-safe: every Add appends one whole record under a lock, so records
+// of concurrent calls interleave but never mix. Records are buffered and
+// written 1 MB at a time; a write error is remembered and reported by Close.
+class IoTraceWriter {
+public:
+    ~IoTraceWriter() { Close(); }
+
+    bool Open(const std::wstring &path, uint64_t volumeSerial, uint64_t totalClusters, uint32_t bytesPerCluster,
+              uint64_t createdTicks) {
+        std::lock_guard<std::mutex> lock(mutex);
+        file = io_trace_detail::Open(path, true);
+        if (!file) {
+            return false;
+        }
+        IoTraceHeader h = {};
+        std::memcpy(h.magic, IO_TRACE_MAGIC, sizeof(h.magic));
+        h.version = IO_TRACE_VERSION;
+        h.headerBytes = sizeof(IoTraceHeader);
+        h.volumeSerial = volumeSerial;
+        h.createdTicks = createdTicks;
+        h.totalClusters = totalClusters;
+        h.bytesPerCluster = bytesPerCluster;
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(&h);
+        buffer.assign(p, p + sizeof(h));
+        failed = false;
+        return true;
+    }
+
+    bool IsOpen() const { return file != nullptr; }
+    uint64_t Records() const { return records; }
+    uint64_t Bytes() const { return bytesWritten + buffer.size(); }
+
+    // Id of the file at path; the first call for a path records it.
+    // unitClusters is the compression unit of a compressed file, else 0.
+    uint32_t AddFile(const wchar_t *path, size_t pathLength, uint64_t size, uint32_t unitClusters = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto inserted = fileIds.emplace(std::wstring(path, pathLength), (uint32_t)fileIds.size());
+        uint32_t id = inserted.first->second;
+        if (inserted.second) {
+            using namespace snapshot_detail;
+            payload.clear();
+            PutVarint(payload, id);
+            PutVarint(payload, size);
+            name.clear();
+            AppendUtf16(name, path, pathLength);
+            PutVarint(payload, name.size());
+            for (uint16_t unit : name) {
+                payload.push_back((uint8_t)unit);
+                payload.push_back((uint8_t)(unit >> 8));
+            }
+            PutVarint(payload, unitClusters);
+            Append(IoTraceKind::File);
+        }
+        return id;
+    }
+
+    // Handles are how the calls name files; a handle is bound when its file
+    // is opened and stays bound until the value is reused for another file
+    void BindHandle(uint64_t handle, uint32_t fileId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        handles[handle] = fileId;
+    }
+
+    uint32_t HandleFile(uint64_t handle) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = handles.find(handle);
+        return it == handles.end() ? TRACE_NO_FILE : it->second;
+    }
+
+    // reply = the output buffer of FSCTL_GET_VOLUME_BITMAP, replyBytes as returned
+    void AddBitmap(int64_t startingLcn, uint32_t error, const void *reply, uint32_t replyBytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        using namespace snapshot_detail;
+        payload.clear();
+        PutVarint(payload, ZigZag(startingLcn));
+        PutVarint(payload, error);
+        bool hasReply = replyBytes >= sizeof(BitmapReplyHeader);
+        payload.push_back(hasReply ? 1 : 0);
+        if (hasReply) {
+            BitmapReplyHeader h;
+            std::memcpy(&h, reply, sizeof(h));
+            const uint8_t *body = static_cast<const uint8_t *>(reply) + sizeof(h);
+            size_t bodyBytes = replyBytes - sizeof(h);
+            PutVarint(payload, ZigZag(h.startingLcn));
+            PutVarint(payload, (uint64_t)h.bitmapSize);
+            PutVarint(payload, bodyBytes);
+            io_trace_detail::PutByteRuns(payload, body, bodyBytes);
+        }
+        Append(IoTraceKind::Bitmap);
+    }
+
+    void AddRetrieval(uint32_t fileId, int64_t startingVcn, uint32_t error, const ExtentRun *runs, size_t runCount) {
+        std::lock_guard<std::mutex> lock(mutex);
+        using namespace snapshot_detail;
+        payload.clear();
+        PutVarint(payload, fileId);
+        PutVarint(payload, ZigZag(startingVcn));
+        PutVarint(payload, error);
+        PutVarint(payload, runCount);
+        EncodeRuns(runs, runCount, payload);
+        Append(IoTraceKind::Retrieval);
+    }
+
+    void AddMove(uint32_t fileId, int64_t vcn, int64_t lcn, int64_t clusterCount, uint32_t error) {
+        std::lock_guard<std::mutex> lock(mutex);
+        using namespace snapshot_detail;
+        payload.clear();
+        PutVarint(payload, fileId);
+        PutVarint(payload, (uint64_t)vcn);
+        PutVarint(payload, (uint64_t)lcn);
+        PutVarint(payload, (uint64_t)clusterCount);
+        PutVarint(payload, error);
+        Append(IoTraceKind::Move);
+    }
+
+    // The ranges placement keeps out of, once before the first call
+    void AddReserved(const std::vector<LcnRange> &ranges) {
+        std::lock_guard<std::mutex> lock(mutex);
+        using namespace snapshot_detail;
+        payload.clear();
+        PutVarint(payload, ranges.size());
+        for (const LcnRange &r : ranges) {
+            PutVarint(payload, r.start);
+            PutVarint(payload, r.end);
+        }
+        Append(IoTraceKind::Reserved);
+    }
+
+    // Flush and close; false if any write failed
+    bool Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!file) {
+            return !failed;
+        }
+        Flush();
+        failed = (std::fclose(file) != 0) || failed;
+        file = nullptr;
+        return !failed;
+    }
+
+private:
+    void Append(IoTraceKind kind) {
+        if (!file) {
+            return;
+        }
+        buffer.push_back((uint8_t)kind);
+        snapshot_detail::PutVarint(buffer, payload.size());
+        buffer.insert(buffer.end(), payload.begin(), payload.end());
+        records++;
+        if (buffer.size() >= FLUSH_BYTES) {
+            Flush();
+        }
+    }
+
+    void Flush() {
+        if (!buffer.empty() && std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+            failed = true;
+        }
+        bytesWritten += buffer.size();
+        buffer.clear();
+    }
+
+    static const size_t FLUSH_BYTES = 1 << 20;
+
+    mutable std::mutex mutex;
+    FILE *file = nullptr;
+    bool failed = false;
+    uint64_t records = 0;
+    uint64_t bytesWritten = 0;
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> payload;
+    std::vector<uint16_t> name;
+    std::unordered_map<std::wstring, uint32_t> fileIds;
+    std::unordered_map<uint64_t, uint32_t> handles;
+};
+
+// ---------------------------------------------------------------------------
+// Reading
+// ---------------------------------------------------------------------------
+
+// Reads the whole trace into memory and decodes one record at a time
+class IoTraceReader {
+public:
+    bool Open(const std::wstring &path) {
+        data.clear();
+        FILE *f = io_trace_detail::Open(path, false);
+        if (!f) {
+            return false;
+        }
+        uint8_t chunk[1 << 16];
+        size_t n;
+        while ((n = std::fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            data.insert(data.end(), chunk, chunk + n);
+        }
+        bool readError = std::ferror(f) != 0;
+        std::fclose(f);
+        if (readError || data.size() < sizeof(IoTraceHeader)) {
+            return false;
+        }
+        std::memcpy(&header, data.data(), sizeof(header));
+        if (std::memcmp(header.magic, IO_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != IO_TRACE_VERSION || header.headerBytes < sizeof(IoTraceHeader) ||
+            header.headerBytes > data.size()) {
+            return false;
+        }
+        Rewind();
+        return true;
+    }
+
+    const IoTraceHeader &Header() const { return header; }
+    uint64_t SizeBytes() const { return data.size(); }
+
+    void Rewind() {
+        at = header.headerBytes;
+        corrupt = false;
+    }
+
+    // False at the end of the trace or at a malformed record (Corrupt() tells which)
+    bool Next(IoTraceRecord &r) {
+        using namespace snapshot_detail;
+        while (at < data.size()) {
+            const uint8_t *p = data.data() + at;
+            const uint8_t *end = data.data() + data.size();
+            IoTraceKind kind = (IoTraceKind)*p++;
+            uint64_t length = 0;
+            if (!GetVarint(p, end, length) || length > (uint64_t)(end - p)) {
+                corrupt = true;
+                return false;
+            }
+            const uint8_t *payloadEnd = p + length;
+            at = (size_t)(payloadEnd - data.data());
+            r.kind = kind;
+            bool ok = true;
+            uint64_t a = 0, b = 0, c = 0, d = 0;
+            switch (kind) {
+            case IoTraceKind::File:
+                ok = GetVarint(p, payloadEnd, a) && GetVarint(p, payloadEnd, r.size) && GetVarint(p, payloadEnd, b) &&
+                     b * 2 <= (uint64_t)(payloadEnd - p);
+                if (ok) {
+                    r.fileId = (uint32_t)a;
+                    name.clear();
+                    for (uint64_t i = 0; i < b; i++, p += 2) {
+                        name.push_back((uint16_t)(p[0] | (p[1] << 8)));
+                    }
+                    r.path.clear();
+                    AppendWide(r.path, name.data(), name.size());
+                    // Traces written before the unit was recorded end here
+                    r.unitClusters = 0;
+                    if (p < payloadEnd) {
+                        ok = GetVarint(p, payloadEnd, c);
+                        r.unitClusters = (uint32_t)c;
+                    }
+                }
+                break;
+            case IoTraceKind::Bitmap:
+                ok = GetVarint(p, payloadEnd, a) && GetVarint(p, payloadEnd, b) && p < payloadEnd;
+                if (ok) {
+                    r.startingLcn = UnZigZag(a);
+                    r.error = (uint32_t)b;
+                    r.hasReply = *p++ != 0;
+                    r.bitmap.clear();
+                    if (r.hasReply) {
+                        ok = GetVarint(p, payloadEnd, a) && GetVarint(p, payloadEnd, b) && GetVarint(p, payloadEnd, c) &&
+                             io_trace_detail::GetByteRuns(p, payloadEnd, c, r.bitmap);
+                        r.reply.startingLcn = UnZigZag(a);
+                        r.reply.bitmapSize = (int64_t)b;
+                    }
+                }
+                break;
+            case IoTraceKind::Retrieval:
+                ok = GetVarint(p, payloadEnd, a) && GetVarint(p, payloadEnd, b) && GetVarint(p, payloadEnd, c) &&
+                     GetVarint(p, payloadEnd, d) && d <= (uint64_t)(payloadEnd - p) &&
+                     DecodeRuns(p, payloadEnd, (uint32_t)d, r.runs);
+                r.fileId = (uint32_t)a;
+                r.startingVcn = UnZigZag(b);
+                r.error = (uint32_t)c;
+                break;
+            case IoTraceKind::Move:
+                ok = GetVarint(p, payloadEnd, a) && GetVarint(p, payloadEnd, b) && GetVarint(p, payloadEnd, c) &&
+                     GetVarint(p, payloadEnd, d);
+                r.fileId = (uint32_t)a;
+                r.vcn = (int64_t)b;
+                r.lcn = (int64_t)c;
+                r.clusterCount = (int64_t)d;
+                ok = ok && GetVarint(p, payloadEnd, a);
+                r.error = (uint32_t)a;
+                break;
+            case IoTraceKind::Reserved:
+                ok = GetVarint(p, payloadEnd, a) && a <= (uint64_t)(payloadEnd - p);
+                r.reserved.clear();
+                for (uint64_t i = 0; ok && i < a; i++) {
+                    ok = GetVarint(p, payloadEnd, b) && GetVarint(p, payloadEnd, c) && b <= c;
+                    r.reserved.push_back(LcnRange{b, c});
+                }
+                break;
+            default:
+                continue; // written by a newer version
+            }
+            if (!ok) {
+                corrupt = true;
+                return false;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool Corrupt() const { return corrupt; }
+
+private:
+    std::vector<uint8_t> data;
+    IoTraceHeader header = {};
+    size_t at = 0;
+    bool corrupt = false;
+    std::vector<uint16_t> name;
+};
+
+// ---------------------------------------------------------------------------
+// Replay backend
+// ---------------------------------------------------------------------------
+
+// A volume that answers the three calls the way NTFS does, in memory. Load
+// builds it as a trace first saw it: the bitmap from the bitmap replies
+// recorded before the first move, each file's extents from its first
+// complete chain of retrieval replies, the reserved ranges from the first
+// Reserved record. It can also be filled directly (Reset, AddFile,
+// SetReserved), which is how the benchmark makes a volume to record.
+class TraceVolume {
+public:
+    struct File {
+        std::wstring path;
+        uint64_t size = 0;
+        uint32_t unitClusters = 0;   // compression unit, 0 when not compressed
+        bool known = false;          // a complete extent list was recorded
+        std::vector<ExtentRun> runs; // in VCN order, sparse runs with lcn = -1
+    };
+
+    void Reset(uint64_t clusters) {
+        totalClusters = clusters;
+        bitmap.assign((size_t)((clusters + 63) / 64 * 8), 0);
+        files.clear();
+        reserved.clear();
+        MarkPastEnd();
+    }
+
+    // Add a file whose runs are known, marking its clusters allocated
+    uint32_t AddFile(const std::wstring &path, uint64_t size, const std::vector<ExtentRun> &runs,
+                     uint32_t unitClusters = 0) {
+        File f;
+        f.path = path;
+        f.size = size;
+        f.unitClusters = unitClusters;
+        f.known = true;
+        f.runs = runs;
+        Normalize(f.runs);
+        for (const ExtentRun &r : f.runs) {
+            if (r.lcn >= 0) {
+                Mark(r.lcn, r.count, true);
+            }
+        }
+        files.push_back(std::move(f));
+        return (uint32_t)(files.size() - 1);
+    }
+
+    bool Load(IoTraceReader &trace) {
+        Reset(trace.Header().totalClusters);
+        bytesPerCluster = trace.Header().bytesPerCluster;
+        trace.Rewind();
+        IoTraceRecord r;
+        bool moved = false;
+        bool haveReserved = false;
+        std::vector<bool> collecting;
+        while (trace.Next(r)) {
+            if (r.kind == IoTraceKind::Move) {
+                moved = true;
+            } else if (r.kind == IoTraceKind::File) {
+                FileAt(r.fileId).path = r.path;
+                FileAt(r.fileId).size = r.size;
+                FileAt(r.fileId).unitClusters = r.unitClusters;
+            } else if (r.kind == IoTraceKind::Reserved && !haveReserved) {
+                reserved = r.reserved;
+                haveReserved = true;
+            } else if (r.kind == IoTraceKind::Bitmap && !moved && r.hasReply &&
+                       (r.error == TRACE_ERROR_SUCCESS || r.error == TRACE_ERROR_MORE_DATA) && r.reply.startingLcn >= 0) {
+                size_t first = (size_t)(r.reply.startingLcn / 8);
+                size_t n = std::min(r.bitmap.size(), first < bitmap.size() ? bitmap.size() - first : 0);
+                std::memcpy(bitmap.data() + first, r.bitmap.data(), n);
+            } else if (r.kind == IoTraceKind::Retrieval && r.fileId != TRACE_NO_FILE) {
+                File &f = FileAt(r.fileId);
+                collecting.resize(files.size(), false);
+                if (f.known) {
+                    continue;
+                }
+                if (r.startingVcn == 0) {
+                    f.runs.clear();
+                    collecting[r.fileId] = true;
+                } else if (!collecting[r.fileId]) {
+                    continue; // the start of this chain was not recorded
+                }
+                if (r.error == TRACE_ERROR_SUCCESS || r.error == TRACE_ERROR_MORE_DATA) {
+                    f.runs.insert(f.runs.end(), r.runs.begin(), r.runs.end());
+                }
+                if (r.error == TRACE_ERROR_SUCCESS || r.error == TRACE_ERROR_HANDLE_EOF) {
+                    f.known = true;
+                    Normalize(f.runs);
+                } else if (r.error != TRACE_ERROR_MORE_DATA) {
+                    f.runs.clear();
+                    collecting[r.fileId] = false;
+                }
+            }
+        }
+        MarkPastEnd(); // the replies end with zero bits
+        return !trace.Corrupt();
+    }
+
+    uint64_t TotalClusters() const { return totalClusters; }
+    uint32_t BytesPerCluster() const { return bytesPerCluster; }
+    size_t FileCount() const { return files.size(); }
+    const File &FileInfo(uint32_t id) const { return files[id]; }
+    const std::vector<uint8_t> &Bitmap() const { return bitmap; }
+
+    // Clusters placement never allocates from (the MFT zone), sorted
+    const std::vector<LcnRange> &Reserved() const { return reserved; }
+    void SetReserved(const std::vector<LcnRange> &ranges) { reserved = ranges; }
+
+    bool IsAllocated(uint64_t lcn) const { return (bitmap[(size_t)(lcn / 8)] >> (lcn % 8)) & 1; }
+
+    // Allocation bits of clusters [64 * index, 64 * index + 64), for FindFreeRun
+    uint64_t Word(uint64_t index) const {
+        uint64_t w;
+        std::memcpy(&w, bitmap.data() + index * 8, 8);
+        return w;
+    }
+
+    // FSCTL_GET_RETRIEVAL_POINTERS: the runs from startingVcn on, the first one cut at startingVcn
+    uint32_t Query(uint32_t fileId, int64_t startingVcn, std::vector<ExtentRun> &out) const {
+        out.clear();
+        if (fileId >= files.size() || !files[fileId].known || startingVcn < 0) {
+            return TRACE_ERROR_INVALID_PARAMETER;
+        }
+        for (const ExtentRun &r : files[fileId].runs) {
+            if (r.vcn + r.count <= startingVcn) {
+                continue;
+            }
+            int64_t skip = std::max<int64_t>(0, startingVcn - r.vcn);
+            out.push_back(ExtentRun{r.vcn + skip, r.lcn < 0 ? -1 : r.lcn + skip, r.count - skip});
+        }
+        return out.empty() ? TRACE_ERROR_HANDLE_EOF : TRACE_ERROR_SUCCESS;
+    }
+
+    // FSCTL_MOVE_FILE: every VCN of [vcn, vcn + count) must be allocated and
+    // the destination free. A compressed file moves whole compression units:
+    // their allocated clusters go to [lcn, ...) back to back, and their
+    // sparse VCNs stay sparse.
+    uint32_t Move(uint32_t fileId, int64_t vcn, int64_t lcn, int64_t count) {
+        if (fileId >= files.size() || !files[fileId].known || count <= 0 || vcn < 0 || lcn < 0) {
+            return TRACE_ERROR_INVALID_PARAMETER;
+        }
+        File &f = files[fileId];
+        bool compressed = f.unitClusters > 1;
+        if (compressed && (vcn % f.unitClusters != 0 || count % f.unitClusters != 0)) {
+            return TRACE_ERROR_INVALID_PARAMETER;
+        }
+        int64_t covered = 0; // allocated VCNs of the range
+        for (const ExtentRun &r : f.runs) {
+            int64_t from = std::max(r.vcn, vcn);
+            int64_t to = std::min(r.vcn + r.count, vcn + count);
+            if (from < to) {
+                if (r.lcn < 0 && !compressed) {
+                    return TRACE_ERROR_INVALID_PARAMETER;
+                }
+                covered += r.lcn < 0 ? 0 : to - from;
+            }
+        }
+        if ((compressed ? covered == 0 : covered != count) || (uint64_t)(lcn + covered) > totalClusters) {
+            return TRACE_ERROR_INVALID_PARAMETER;
+        }
+        for (int64_t c = lcn; c < lcn + covered; c++) {
+            if (IsAllocated((uint64_t)c)) {
+                return TRACE_ERROR_ACCESS_DENIED;
+            }
+        }
+
+        scratch.clear();
+        int64_t dst = lcn;
+        for (const ExtentRun &r : f.runs) {
+            int64_t from = std::max(r.vcn, vcn);
+            int64_t to = std::min(r.vcn + r.count, vcn + count);
+            if (from >= to) {
+                scratch.push_back(r);
+                continue;
+            }
+            if (from > r.vcn) {
+                scratch.push_back(ExtentRun{r.vcn, r.lcn, from - r.vcn});
+            }
+            if (r.lcn < 0) {
+                scratch.push_back(ExtentRun{from, -1, to - from});
+            } else {
+                Mark(r.lcn + (from - r.vcn), to - from, false);
+                scratch.push_back(ExtentRun{from, dst, to - from});
+                dst += to - from;
+            }
+            if (to < r.vcn + r.count) {
+                scratch.push_back(ExtentRun{to, r.lcn < 0 ? -1 : r.lcn + (to - r.vcn), r.vcn + r.count - to});
+            }
+        }
+        Mark(lcn, covered, true);
+        Normalize(scratch);
+        f.runs.swap(scratch);
+        return TRACE_ERROR_SUCCESS;
+    }
+
+    // FNV-1a over the bitmap and every file's runs, to compare two replays.
+    // With `only`, the runs of just those files in that order: the files a
+    // trace recorded, which a volume rebuilt from it numbers 0, 1, ...
+    uint64_t Digest(const std::vector<uint32_t> *only = nullptr) const {
+        uint64_t h = 0xCBF29CE484222325ULL;
+        auto mix = [&h](const void *p, size_t n) {
+            const uint8_t *b = static_cast<const uint8_t *>(p);
+            for (size_t i = 0; i < n; i++) {
+                h = (h ^ b[i]) * 0x100000001B3ULL;
+            }
+        };
+        auto mixRuns = [&mix](const File &f) {
+            for (const ExtentRun &r : f.runs) {
+                mix(&r, sizeof(r));
+            }
+        };
+        mix(bitmap.data(), bitmap.size());
+        if (only) {
+            for (uint32_t id : *only) {
+                mixRuns(files[id]);
+            }
+        } else {
+            for (const File &f : files) {
+                mixRuns(f);
+            }
+        }
+        return h;
+    }
+
+    // Runs as NTFS reports them: adjacent runs that continue each other are one
+    static void Normalize(std::vector<ExtentRun> &runs) {
+        size_t out = 0;
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (runs[i].count <= 0) {
+                continue;
+            }
+            if (out > 0) {
+                ExtentRun &last = runs[out - 1];
+                bool bothSparse = last.lcn < 0 && runs[i].lcn < 0;
+                bool follows = last.lcn >= 0 && runs[i].lcn == last.lcn + last.count;
+                if (runs[i].vcn == last.vcn + last.count && (bothSparse || follows)) {
+                    last.count += runs[i].count;
+                    continue;
+                }
+            }
+            runs[out++] = runs[i];
+        }
+        runs.resize(out);
+    }
+
+private:
+    File &FileAt(uint32_t id) {
+        if (id >= files.size()) {
+            files.resize((size_t)id + 1);
+        }
+        return files[id];
+    }
+
+    // Clusters past the end of the volume count as allocated, as in BitmapWords
+    void MarkPastEnd() {
+        for (uint64_t c = totalClusters; c < (uint64_t)bitmap.size() * 8; c++) {
+            bitmap[(size_t)(c / 8)] |= (uint8_t)(1 << (c % 8));
+        }
+    }
+
+    void Mark(int64_t lcn, int64_t count, bool allocated) {
+        for (int64_t c = lcn; c < lcn + count; c++) {
+            uint8_t bit = (uint8_t)(1 << (c % 8));
+            if (allocated) {
+                bitmap[(size_t)(c / 8)] |= bit;
+            } else {
+                bitmap[(size_t)(c / 8)] &= (uint8_t)~bit;
+            }
+        }
+    }
+
+    uint64_t totalClusters = 0;
+    uint32_t bytesPerCluster = 4096;
+    std::vector<uint8_t> bitmap; // padded to whole words
+    std::vector<File> files;
+    std::vector<LcnRange> reserved;
+    std::vector<ExtentRun> scratch;
+};
+
+// Answers FSCTL_GET_VOLUME_BITMAP from a TraceVolume, like the driver
+class TraceBitmapSource : public BitmapSource {
+public:
+    explicit TraceBitmapSource(const TraceVolume &volume) : volume(volume) {}
+
+    IoStatus Read(int64_t startingLcn, void *out, uint32_t outSize, uint32_t &bytesReturned) override {
+        bytesReturned = 0;
+        if (startingLcn < 0 || outSize < sizeof(BitmapReplyHeader) || (uint64_t)startingLcn >= volume.TotalClusters()) {
+            return IoStatus::Failed;
+        }
+        uint64_t start = (uint64_t)startingLcn & ~7ULL;
+        BitmapReplyHeader header;
+        header.startingLcn = (int64_t)start;
+        header.bitmapSize = (int64_t)(volume.TotalClusters() - start);
+        uint64_t neededBytes = (volume.TotalClusters() - start + 7) / 8;
+        uint64_t bytes = std::min<uint64_t>(neededBytes, outSize - sizeof(BitmapReplyHeader));
+        std::memcpy(out, &header, sizeof(header));
+        std::memcpy(static_cast<uint8_t *>(out) + sizeof(header), volume.Bitmap().data() + start / 8, (size_t)bytes);
+        bytesReturned = (uint32_t)(sizeof(header) + bytes);
+        return bytes < neededBytes ? IoStatus::MoreData : IoStatus::Success;
+    }
+
+private:
+    const TraceVolume &volume;
+};
+
+// ---------------------------------------------------------------------------
+// Replaying the recorded operations
+// ---------------------------------------------------------------------------
+struct ReplayStats {
+    uint64_t records = 0;
+    uint64_t moves = 0;
+    uint64_t movesApplied = 0;
+    uint64_t movesDiverged = 0;       // succeeded in the trace and failed in the replay, or the other way
+    uint64_t bitmapChecks = 0;        // bitmap replies recorded after a move, compared with the replay
+    uint64_t bitmapBytesDiffering = 0;
+    uint64_t retrievalChecks = 0;     // complete extent lists, compared with the replay
+    uint64_t retrievalMismatches = 0;
+};
+
+// Issue every recorded move against volume (loaded from the same trace) in
+// the recorded order, and check the replies recorded along the way against
+// the state the replay has reached. On a volume nothing else wrote to while
+// it was recorded, nothing diverges.
+inline bool ReplayRecordedOperations(IoTraceReader &trace, TraceVolume &volume, ReplayStats &stats) {
+    trace.Rewind();
+    IoTraceRecord r;
+    std::vector<ExtentRun> expected;
+    std::vector<ExtentRun> actual;
+    bool moved = false;
+    while (trace.Next(r)) {
+        stats.records++;
+        if (r.kind == IoTraceKind::Move) {
+            moved = true;
+            uint32_t error = volume.Move(r.fileId, r.vcn, r.lcn, r.clusterCount);
+            stats.moves++;
+            stats.movesApplied += error == TRACE_ERROR_SUCCESS ? 1 : 0;
+            stats.movesDiverged += (error == TRACE_ERROR_SUCCESS) != (r.error == TRACE_ERROR_SUCCESS) ? 1 : 0;
+        } else if (r.kind == IoTraceKind::Bitmap && moved && r.hasReply && r.reply.startingLcn >= 0 &&
+                   (r.error == TRACE_ERROR_SUCCESS || r.error == TRACE_ERROR_MORE_DATA)) {
+            const std::vector<uint8_t> &now = volume.Bitmap();
+            size_t first = (size_t)(r.reply.startingLcn / 8);
+            size_t volumeBytes = (size_t)((volume.TotalClusters() + 7) / 8);
+            size_t n = std::min(r.bitmap.size(), first < volumeBytes ? volumeBytes - first : 0);
+            stats.bitmapChecks++;
+            for (size_t i = 0; i < n; i++) {
+                uint8_t mask = first + i + 1 == volumeBytes && volume.TotalClusters() % 8
+                                   ? (uint8_t)((1 << (volume.TotalClusters() % 8)) - 1)
+                                   : 0xFF;
+                stats.bitmapBytesDiffering += ((now[first + i] ^ r.bitmap[i]) & mask) ? 1 : 0;
+            }
+        } else if (r.kind == IoTraceKind::Retrieval && r.startingVcn == 0 && r.error == TRACE_ERROR_SUCCESS &&
+                   r.fileId < volume.FileCount() && volume.FileInfo(r.fileId).known) {
+            expected = r.runs;
+            TraceVolume::Normalize(expected);
+            volume.Query(r.fileId, 0, actual);
+            stats.retrievalChecks++;
+            bool same = expected.size() == actual.size();
+            for (size_t i = 0; same && i < expected.size(); i++) {
+                same = expected[i].vcn == actual[i].vcn && expected[i].lcn == actual[i].lcn &&
+                       expected[i].count == actual[i].count;
+            }
+            stats.retrievalMismatches += same ? 0 : 1;
+        }
+    }
+    return !trace.Corrupt();
+}
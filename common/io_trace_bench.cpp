@@ -0,0 +1,377 @@
+// Operation trace record / replay benchmark
+//
+//   io_trace_bench record <trace-file> [files = 20000] [pass = first-fit]
+//   io_trace_bench replay <trace-file> [pass = first-fit]
+//
+// pass: first-fit is defragment's first-fit mode, hdd and ssd the same with
+// its read-cost gate (1 ms) for that device, and a number is fragment's run
+// with that seed (5 random single-cluster moves per file). Every pass goes
+// through move_engine.h, the planners and executor the tools run, with
+// TraceVolumeOps answering the volume calls in place of the FSCTLs.
+//
+// record: lays out `files` files on a 256 GB volume (4 KB clusters) around
+// an MFT zone, some of them fragmented, a few with sparse runs and a few
+// compressed, runs the pass over it while recording every bitmap read,
+// extent query and move, and writes the trace. It then replays the trace
+// twice:
+//   1. the recorded moves in recorded order, checking every reply recorded
+//      along the way, which must end in the state the recording left
+//   2. the pass again, on the volume rebuilt from the trace, which must make
+//      the same decisions and end in the same state
+// and checks that no pass placed a cluster in the MFT zone.
+//
+// replay: the same two replays on a trace recorded elsewhere, for example by
+// defragment on a real volume. The state digests identify the outcome, so
+// two builds replaying one trace can be compared for speed and for result.
+
+#include "move_engine.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+struct PassStats {
+    uint64_t files = 0;
+    uint64_t fragmented = 0;
+    uint64_t moved = 0;
+    uint64_t notWorthIt = 0;
+    uint64_t noRoom = 0;
+    uint64_t moves = 0;
+    uint64_t movesFailed = 0;
+    uint64_t unitMoves = 0;
+    uint64_t clustersMoved = 0;
+    uint64_t extentMismatches = 0; // files whose extents differ from the executor's map after a batch
+};
+
+// Counts what the moves did and, for first fit, queries every file a batch
+// moved again, as defragment's verification does
+class PassObserver : public MoveObserver {
+public:
+    PassObserver(VolumeOps &ops, PassStats &stats, bool requery) : ops(ops), stats(stats), requery(requery) {}
+
+    void BeforeMoves(const std::vector<PlannedMove> &batch) override {
+        touched.clear();
+        for (const PlannedMove &m : batch) {
+            if (touched.empty() || touched.back().owner != m.owner) {
+                touched.push_back(Touched{m.file, m.owner});
+            }
+        }
+    }
+
+    void Moved(const PlannedMove &m) override { stats.clustersMoved += m.clusterCount; }
+
+    void AfterMoves() override {
+        if (!requery) {
+            return;
+        }
+        for (const Touched &t : touched) {
+            if (ReadFileClusters(ops, t.file, actual) != TRACE_ERROR_SUCCESS || actual.lcns != t.owner->lcns ||
+                actual.vcns != t.owner->vcns) {
+                stats.extentMismatches++;
+            }
+        }
+    }
+
+private:
+    struct Touched {
+        uint64_t file;
+        FileClusters *owner;
+    };
+
+    VolumeOps &ops;
+    PassStats &stats;
+    bool requery;
+    std::vector<Touched> touched;
+    FileClusters actual;
+};
+
+static bool FetchWholeBitmap(VolumeOps &ops, uint64_t totalClusters, std::vector<uint8_t> &bitmap) {
+    BitmapFetchOptions options;
+    options.chunkBytes = 256 * 1024;
+    return FetchBitmap(ops, totalClusters, bitmap, options);
+}
+
+// A pass as one of the tools runs it: read the bitmap, then for every file
+// query its extents, plan and move, and read the bitmap once more at the end
+struct PassSpec {
+    bool random = false;             // fragment, else defragment's first fit
+    uint64_t seed = 0;               // fragment
+    const DeviceProfile *profile = nullptr; // first fit with the read-cost gate
+};
+
+// `opened` collects the files the pass opened, the ones its trace records
+static bool RunPass(TraceVolume &volume, IoTraceWriter *trace, const PassSpec &spec, PassStats &stats,
+                    std::vector<uint32_t> *opened = nullptr) {
+    TraceVolumeOps ops(volume, trace);
+    uint64_t totalClusters = volume.TotalClusters();
+    std::vector<uint8_t> bitmap;
+    if (!FetchWholeBitmap(ops, totalClusters, bitmap)) {
+        return false;
+    }
+
+    FirstFitPlanner firstFit;
+    firstFit.reserved = volume.Reserved();
+    std::unique_ptr<ReadCostModel> readCost;
+    if (spec.profile) {
+        readCost.reset(new ReadCostModel(*spec.profile, totalClusters, volume.BytesPerCluster()));
+        firstFit.readCost = readCost.get();
+        firstFit.thresholdSeconds = 1e-3;
+    }
+    RandomMovePlanner random;
+    random.reserved = volume.Reserved();
+    random.random.seed(spec.seed);
+
+    PassObserver observer(ops, stats, !spec.random);
+    MoveExecutor executor;
+    executor.ops = &ops;
+    executor.observer = &observer;
+    executor.order = spec.random ? MoveOrder::Planned : MoveOrder::DestinationLcn;
+    const int MOVES_PER_FILE = 5;
+
+    FileClusters fc;
+    std::vector<PlannedMove> batch;
+    for (uint32_t id = 0; id < (uint32_t)volume.FileCount(); id++) {
+        const TraceVolume::File &f = volume.FileInfo(id);
+        if (!f.known) {
+            continue; // in a trace, a file that was opened but never queried
+        }
+        if (spec.random && f.size <= volume.BytesPerCluster()) {
+            continue; // fragment skips these without opening them
+        }
+        ops.Opened(id);
+        if (opened) {
+            opened->push_back(id);
+        }
+        if (ReadFileClusters(ops, id, fc) != TRACE_ERROR_SUCCESS) {
+            continue;
+        }
+        stats.files++;
+        if (spec.random) {
+            if (fc.lcns.empty()) {
+                continue;
+            }
+            stats.moved++;
+            for (int i = 0; i < MOVES_PER_FILE; i++) {
+                if (!PlanRandomMove(random, id, &f.path, fc, bitmap, totalClusters, batch)) {
+                    stats.noRoom++;
+                    break;
+                }
+                ExecuteMoveBatch(executor, batch, bitmap);
+            }
+            continue;
+        }
+        FirstFitDecision d = PlanFirstFit(firstFit, id, &f.path, f.unitClusters, fc, bitmap, totalClusters, batch);
+        stats.fragmented += d.outcome != PlanOutcome::Contiguous ? 1 : 0;
+        stats.notWorthIt += d.outcome == PlanOutcome::NotWorthIt ? 1 : 0;
+        stats.noRoom += d.outcome == PlanOutcome::NoRoom ? 1 : 0;
+        stats.moved += d.outcome == PlanOutcome::Found ? 1 : 0;
+        ExecuteMoveBatch(executor, batch, bitmap);
+    }
+    stats.moves = executor.movesDone + executor.movesFailed;
+    stats.movesFailed = executor.movesFailed;
+    stats.unitMoves = firstFit.extentStats.unitMoves;
+    // A last bitmap read, as a later run would start with
+    return FetchWholeBitmap(ops, totalClusters, bitmap);
+}
+
+// Clusters of files inside the reserved ranges
+static uint64_t ReservedClustersInUse(const TraceVolume &volume) {
+    uint64_t clusters = 0;
+    for (uint32_t id = 0; id < (uint32_t)volume.FileCount(); id++) {
+        for (const ExtentRun &r : volume.FileInfo(id).runs) {
+            for (const LcnRange &z : volume.Reserved()) {
+                if (r.lcn >= 0 && (uint64_t)r.lcn < z.end && (uint64_t)(r.lcn + r.count) > z.start) {
+                    clusters += std::min(z.end, (uint64_t)(r.lcn + r.count)) - std::max(z.start, (uint64_t)r.lcn);
+                }
+            }
+        }
+    }
+    return clusters;
+}
+
+// Files laid out front to back with small gaps, stepping over an MFT zone
+// near the start: most in one piece, some in a few pieces, a few in many,
+// now and then with a sparse run; one in 200 compressed, every compression
+// unit an allocated head and a sparse tail
+static void MakeVolume(TraceVolume &volume, uint64_t files) {
+    const uint64_t totalClusters = 1ULL << 26;
+    const uint32_t unitClusters = 16;
+    volume.Reset(totalClusters);
+    LcnRange zone = {1ULL << 20, (1ULL << 20) + (1ULL << 23)};
+    volume.SetReserved(std::vector<LcnRange>{zone});
+    std::mt19937_64 rng(0x7ACE);
+    std::vector<ExtentRun> runs;
+    int64_t cursor = 0;
+    int64_t limit = (int64_t)(totalClusters * 3 / 4);
+    auto place = [&](int64_t count) {
+        if (cursor + count > (int64_t)zone.start && cursor < (int64_t)zone.end) {
+            cursor = (int64_t)zone.end;
+        }
+        int64_t lcn = cursor;
+        cursor += count + (rng() % 8 == 0 ? 0 : 1 + (int64_t)(rng() % 32));
+        return lcn;
+    };
+    for (uint64_t i = 0; i < files && cursor < limit; i++) {
+        unsigned kind = (unsigned)(rng() % 1000);
+        runs.clear();
+        int64_t vcn = 0;
+        bool compressed = kind >= 995;
+        if (compressed) {
+            unsigned units = 2 + (unsigned)(rng() % 40);
+            for (unsigned u = 0; u < units; u++) {
+                int64_t head = 1 + (int64_t)(rng() % unitClusters);
+                runs.push_back(ExtentRun{vcn, place(head), head});
+                if (head < unitClusters) {
+                    runs.push_back(ExtentRun{vcn + head, -1, unitClusters - head});
+                }
+                vcn += unitClusters;
+            }
+        } else {
+            unsigned pieces = kind < 850 ? 1 : kind < 990 ? 2 + (unsigned)(rng() % 30) : 30 + (unsigned)(rng() % 270);
+            for (unsigned p = 0; p < pieces; p++) {
+                int64_t count = 1 + (int64_t)(rng() % 64);
+                if (p > 0 && rng() % 40 == 0) {
+                    runs.push_back(ExtentRun{vcn, -1, count});
+                } else {
+                    runs.push_back(ExtentRun{vcn, place(count), count});
+                }
+                vcn += count;
+            }
+        }
+        std::wstring path = L"\\data\\d" + std::to_wstring(i % 1000) + L"\\file" + std::to_wstring(i);
+        volume.AddFile(path, (uint64_t)vcn * 4096 - rng() % 4096, runs, compressed ? unitClusters : 0);
+    }
+}
+
+static double Since(std::chrono::steady_clock::time_point started) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+static void PrintPass(const char *what, const PassSpec &spec, const PassStats &s, double seconds, uint64_t digest) {
+    std::cout << what << ": " << s.files << " files, ";
+    if (spec.random) {
+        std::cout << s.moved << " fragmented";
+    } else {
+        std::cout << s.fragmented << " fragmented, " << s.moved << " moved (" << s.notWorthIt << " not worth it, "
+                  << s.noRoom << " without room)";
+    }
+    std::cout << ", " << s.moves << " moves (" << s.movesFailed << " failed, " << s.unitMoves
+              << " of compression units), " << s.clustersMoved << " clusters, " << s.extentMismatches
+              << " extent lists differ, in " << seconds << " s, state " << std::hex << digest << std::dec << "\n";
+}
+
+// Both replays of one trace; false when the trace is unreadable or a replay
+// does not end where `expectedDigest` (if non-zero) says it should
+static bool Replay(const std::wstring &path, const PassSpec &spec, uint64_t expectedDigest) {
+    IoTraceReader reader;
+    auto started = std::chrono::steady_clock::now();
+    if (!reader.Open(path)) {
+        std::cerr << "cannot read the trace\n";
+        return false;
+    }
+    TraceVolume volume;
+    if (!volume.Load(reader)) {
+        std::cerr << "corrupt trace\n";
+        return false;
+    }
+    double loadSeconds = Since(started);
+    std::cout << "Trace: " << reader.SizeBytes() << " bytes, " << volume.TotalClusters() << " clusters, "
+              << volume.FileCount() << " files, " << volume.Reserved().size() << " reserved ranges; read and rebuilt in "
+              << loadSeconds << " s\n";
+
+    ReplayStats rs;
+    started = std::chrono::steady_clock::now();
+    bool ok = ReplayRecordedOperations(reader, volume, rs);
+    double replaySeconds = Since(started);
+    uint64_t replayed = volume.Digest();
+    std::cout << "Recorded moves: " << rs.records << " records, " << rs.moves << " moves (" << rs.movesApplied
+              << " applied, " << rs.movesDiverged << " diverged), " << rs.bitmapChecks << " bitmap replies ("
+              << rs.bitmapBytesDiffering << " bytes differ), " << rs.retrievalChecks << " extent lists ("
+              << rs.retrievalMismatches << " differ) in " << replaySeconds << " s, state " << std::hex << replayed
+              << std::dec << "\n";
+
+    TraceVolume again;
+    again.Load(reader);
+    PassStats ps;
+    started = std::chrono::steady_clock::now();
+    ok = RunPass(again, nullptr, spec, ps) && ok;
+    PrintPass("Pass again", spec, ps, Since(started), again.Digest());
+
+    if (expectedDigest) {
+        bool same = replayed == expectedDigest && again.Digest() == expectedDigest && rs.movesDiverged == 0 &&
+                    rs.bitmapBytesDiffering == 0 && rs.retrievalMismatches == 0 && ps.extentMismatches == 0;
+        uint64_t inZone = ReservedClustersInUse(again);
+        std::cout << "Check: " << (same ? "both replays end in the recorded state" : "MISMATCH") << ", "
+                  << inZone << " clusters in the MFT zone\n";
+        ok = ok && same && inZone == 0;
+    }
+    return ok;
+}
+
+static bool ParsePass(const char *text, PassSpec &spec) {
+    static const DeviceProfile hdd = DeviceProfile::Hdd7200();
+    static const DeviceProfile ssd = DeviceProfile::Ssd();
+    std::string pass = text ? text : "first-fit";
+    if (pass == "hdd" || pass == "ssd") {
+        spec.profile = pass == "hdd" ? &hdd : &ssd;
+        return true;
+    }
+    if (pass != "first-fit") {
+        char *end = nullptr;
+        spec.seed = std::strtoull(pass.c_str(), &end, 10);
+        spec.random = true;
+        return !pass.empty() && *end == 0;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    std::string mode = argc > 1 ? argv[1] : "";
+    PassSpec spec;
+    int passArg = mode == "record" ? 4 : 3;
+    if (argc < 3 || (mode != "record" && mode != "replay") ||
+        !ParsePass(argc > passArg ? argv[passArg] : nullptr, spec)) {
+        std::cerr << "usage: io_trace_bench record <trace-file> [files] [first-fit | hdd | ssd | seed]\n"
+                     "       io_trace_bench replay <trace-file> [first-fit | hdd | ssd | seed]\n";
+        return 1;
+    }
+    std::string narrowPath = argv[2];
+    std::wstring path(narrowPath.begin(), narrowPath.end());
+    if (mode == "replay") {
+        return Replay(path, spec, 0) ? 0 : 1;
+    }
+
+    uint64_t files = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 20000;
+    TraceVolume live;
+    MakeVolume(live, files);
+    uint64_t liveBefore = live.Digest();
+    IoTraceWriter writer;
+    if (!writer.Open(path, 0x1234ABCD, live.TotalClusters(), 4096, 0)) {
+        std::cerr << "cannot create the trace\n";
+        return 1;
+    }
+    writer.AddReserved(live.Reserved());
+    PassStats ps;
+    std::vector<uint32_t> opened;
+    auto started = std::chrono::steady_clock::now();
+    bool ok = RunPass(live, &writer, spec, ps, &opened);
+    double seconds = Since(started);
+    uint64_t records = writer.Records();
+    if (!writer.Close() || !ok) {
+        std::cerr << "recording failed\n";
+        return 1;
+    }
+    // The state as the trace knows it: files fragment skipped are not in it
+    uint64_t recorded = live.Digest(&opened);
+    PrintPass("Recorded pass", spec, ps, seconds, recorded);
+    std::cout << "Trace: " << records << " records, " << writer.Bytes() << " bytes ("
+              << (double)writer.Bytes() / (double)records << " per record; the bitmap alone is "
+              << (live.TotalClusters() + 7) / 8 << " bytes per read)\n";
+    if (live.Digest() == liveBefore) {
+        std::cerr << "nothing moved\n";
+        return 1;
+    }
+    return Replay(path, spec, recorded) ? 0 : 1;
+}
@@ -0,0 +1,200 @@
+#pragma once
+// Local (AF_UNIX) stream sockets
+//
+// The volume-map service and its clients talk over a Unix domain socket
+// bound to a file path: Winsock has supported AF_UNIX since Windows 10 1803,
+// so the same code runs on Windows and on Linux, where the benchmarks run.
+// Only processes on the same machine can connect, and access is governed by
+// the permissions of the socket file.
+//
+// On Windows this header includes winsock2.h, which has to come before
+// windows.h: include it before any other header that includes windows.h.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib") // MinGW: link with -lws2_32
+#endif
+typedef SOCKET LocalSocketHandle;
+const LocalSocketHandle INVALID_LOCAL_SOCKET = INVALID_SOCKET;
+#else
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int LocalSocketHandle;
+const LocalSocketHandle INVALID_LOCAL_SOCKET = -1;
+#endif
+
+class LocalSocket {
+public:
+    LocalSocket() {}
+    explicit LocalSocket(LocalSocketHandle handle) : handle(handle) {}
+    ~LocalSocket() { Close(); }
+
+    LocalSocket(const LocalSocket &) = delete;
+    LocalSocket &operator=(const LocalSocket &) = delete;
+    LocalSocket(LocalSocket &&other) : handle(other.handle) { other.handle = INVALID_LOCAL_SOCKET; }
+    LocalSocket &operator=(LocalSocket &&other) {
+        if (this != &other) {
+            Close();
+            handle = other.handle;
+            other.handle = INVALID_LOCAL_SOCKET;
+        }
+        return *this;
+    }
+
+    // Once per process before any socket is created (WSAStartup on Windows)
+    static bool Startup() {
+#ifdef _WIN32
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+        return true;
+#endif
+    }
+
+    bool IsOpen() const { return handle != INVALID_LOCAL_SOCKET; }
+
+    // Bind to path and listen. A socket file left behind by an earlier
+    // process is removed first.
+    bool Listen(const std::string &path, int backlog = 64) {
+        sockaddr_un address;
+        if (!MakeAddress(path, address)) {
+            return false;
+        }
+#ifdef _WIN32
+        DeleteFileA(path.c_str());
+#else
+        ::unlink(path.c_str());
+#endif
+        handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (handle == INVALID_LOCAL_SOCKET) {
+            return false;
+        }
+        if (::bind(handle, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::listen(handle, backlog) != 0) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    // Wait for a client. Returns a closed socket when the listener was shut down.
+    LocalSocket Accept() const {
+        while (true) {
+            LocalSocketHandle client = ::accept(handle, nullptr, nullptr);
+#ifndef _WIN32
+            if (client == INVALID_LOCAL_SOCKET && errno == EINTR) {
+                continue;
+            }
+#endif
+            return LocalSocket(client);
+        }
+    }
+
+    bool Connect(const std::string &path) {
+        sockaddr_un address;
+        if (!MakeAddress(path, address)) {
+            return false;
+        }
+        handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (handle == INVALID_LOCAL_SOCKET) {
+            return false;
+        }
+        if (::connect(handle, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    bool SendAll(const void *data, size_t bytes) {
+        const char *p = static_cast<const char *>(data);
+        while (bytes > 0) {
+            int chunk = (int)std::min<size_t>(bytes, 1 << 30);
+#ifdef _WIN32
+            int sent = ::send(handle, p, chunk, 0);
+#else
+            ssize_t sent = ::send(handle, p, (size_t)chunk, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+#endif
+            if (sent <= 0) {
+                return false;
+            }
+            p += sent;
+            bytes -= (size_t)sent;
+        }
+        return true;
+    }
+
+    // False when the peer closed the connection or on error
+    bool ReceiveAll(void *data, size_t bytes) {
+        char *p = static_cast<char *>(data);
+        while (bytes > 0) {
+            int chunk = (int)std::min<size_t>(bytes, 1 << 30);
+#ifdef _WIN32
+            int received = ::recv(handle, p, chunk, 0);
+#else
+            ssize_t received = ::recv(handle, p, (size_t)chunk, 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+#endif
+            if (received <= 0) {
+                return false;
+            }
+            p += received;
+            bytes -= (size_t)received;
+        }
+        return true;
+    }
+
+    // Wake up whoever is blocked in Accept / ReceiveAll on this socket; they
+    // return failure. The socket still has to be closed.
+    void Shutdown() {
+        if (handle != INVALID_LOCAL_SOCKET) {
+#ifdef _WIN32
+            ::shutdown(handle, SD_BOTH);
+#else
+            ::shutdown(handle, SHUT_RDWR);
+#endif
+        }
+    }
+
+    void Close() {
+        if (handle != INVALID_LOCAL_SOCKET) {
+#ifdef _WIN32
+            ::closesocket(handle);
+#else
+            ::close(handle);
+#endif
+            handle = INVALID_LOCAL_SOCKET;
+        }
+    }
+
+    LocalSocketHandle Handle() const { return handle; }
+
+private:
+    static bool MakeAddress(const std::string &path, sockaddr_un &address) {
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            return false; // 107 bytes at most
+        }
+        std::memcpy(address.sun_path, path.data(), path.size());
+        return true;
+    }
+
+    LocalSocketHandle handle = INVALID_LOCAL_SOCKET;
+};
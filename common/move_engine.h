@@ -0,0 +1,687 @@
+#pragma once
+// Planning and issuing file moves through three volume calls
+//
+// A move pass touches the volume through three calls only: the bitmap
+// (FSCTL_GET_VOLUME_BITMAP), a file's extents (FSCTL_GET_RETRIEVAL_POINTERS)
+// and a move (FSCTL_MOVE_FILE). VolumeOps is that interface. The tools
+// implement it with the FSCTLs (volume_ops_win32.h), TraceVolumeOps with a
+// TraceVolume. The planners and the executor below are the ones defragment
+// and fragment run, so replaying a trace runs the code that recorded it.
+//
+// Planning and execution are split. A planner appends PlannedMoves to a
+// batch and reserves each destination in its bitmap right away, so later
+// planning cannot hand it out twice. ExecuteMoveBatch issues the batch, in
+// elevator order if asked, marks the old locations free and updates the
+// file's cluster map. A MoveObserver hears about each batch and each move,
+// for what only the tool knows about: progress, messages, verification.
+//
+// Files are named by a uint64_t: the handle for the FSCTLs, the file id for
+// a trace. Errors are Win32 error codes, as in traces (TRACE_ERROR_*).
+
+#include "bitmap_fetch.h"
+#include "extent_plan.h"
+#include "free_run.h"
+#include "io_trace.h"
+#include "read_cost.h"
+#include "scratch_arena.h"
+#include "volume_geometry.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+// ---------------------------------------------------------------------------
+// Volume calls
+// ---------------------------------------------------------------------------
+class VolumeOps {
+public:
+    virtual ~VolumeOps() {}
+
+    // FSCTL_GET_VOLUME_BITMAP: the source for range `range` of a parallel
+    // fetch (see FetchVolumeBitmap); nullptr when it cannot be opened
+    virtual std::unique_ptr<BitmapSource> Bitmap(unsigned range) = 0;
+
+    // FSCTL_GET_RETRIEVAL_POINTERS: the runs of file from startingVcn on, as
+    // many as one reply holds, sparse runs with lcn = -1.
+    // TRACE_ERROR_MORE_DATA asks for another call past the last run,
+    // TRACE_ERROR_HANDLE_EOF means nothing is at or past startingVcn.
+    virtual uint32_t Retrieval(uint64_t file, int64_t startingVcn, std::vector<ExtentRun> &runs) = 0;
+
+    // FSCTL_MOVE_FILE of the VCNs [vcn, vcn + count) to the clusters from lcn on
+    virtual uint32_t Move(uint64_t file, int64_t vcn, int64_t lcn, int64_t count) = 0;
+};
+
+// Read the whole bitmap through ops. Bits: 1 = allocated, 0 = free
+inline bool FetchBitmap(VolumeOps &ops,
+                        uint64_t totalClusters,
+                        std::vector<uint8_t> &out,
+                        const BitmapFetchOptions &options = BitmapFetchOptions(),
+                        BitmapFetchStats *stats = nullptr) {
+    return FetchVolumeBitmap(totalClusters, out, options, [&ops](unsigned range) { return ops.Bitmap(range); },
+                             stats);
+}
+
+// The three calls answered by a TraceVolume and, when trace is set, recorded
+// the way the tools record theirs. Files are the volume's file ids.
+class TraceVolumeOps : public VolumeOps {
+public:
+    explicit TraceVolumeOps(TraceVolume &volume, IoTraceWriter *trace = nullptr) : volume(volume), trace(trace) {}
+
+    // Record the file before its first call, as the tools do when they open it
+    void Opened(uint32_t fileId) {
+        if (trace) {
+            const TraceVolume::File &f = volume.FileInfo(fileId);
+            trace->BindHandle(fileId, trace->AddFile(f.path.data(), f.path.size(), f.size, f.unitClusters));
+        }
+    }
+
+    std::unique_ptr<BitmapSource> Bitmap(unsigned) override {
+        return std::unique_ptr<BitmapSource>(new Source(volume, trace));
+    }
+
+    uint32_t Retrieval(uint64_t file, int64_t startingVcn, std::vector<ExtentRun> &runs) override {
+        uint32_t error = volume.Query((uint32_t)file, startingVcn, runs);
+        if (trace) {
+            trace->AddRetrieval(trace->HandleFile(file), startingVcn, error, runs.data(), runs.size());
+        }
+        return error;
+    }
+
+    uint32_t Move(uint64_t file, int64_t vcn, int64_t lcn, int64_t count) override {
+        uint32_t error = volume.Move((uint32_t)file, vcn, lcn, count);
+        if (trace) {
+            trace->AddMove(trace->HandleFile(file), vcn, lcn, count, error);
+        }
+        return error;
+    }
+
+private:
+    class Source : public BitmapSource {
+    public:
+        Source(const TraceVolume &volume, IoTraceWriter *trace) : inner(volume), trace(trace) {}
+
+        IoStatus Read(int64_t startingLcn, void *out, uint32_t outSize, uint32_t &bytesReturned) override {
+            IoStatus status = inner.Read(startingLcn, out, outSize, bytesReturned);
+            if (trace) {
+                uint32_t error = status == IoStatus::Success    ? TRACE_ERROR_SUCCESS
+                                 : status == IoStatus::MoreData ? TRACE_ERROR_MORE_DATA
+                                                                : TRACE_ERROR_INVALID_PARAMETER;
+                trace->AddBitmap(startingLcn, error, out, bytesReturned);
+            }
+            return status;
+        }
+
+    private:
+        TraceBitmapSource inner;
+        IoTraceWriter *trace;
+    };
+
+    TraceVolume &volume;
+    IoTraceWriter *trace;
+};
+
+// ---------------------------------------------------------------------------
+// Extents
+// ---------------------------------------------------------------------------
+
+// A file's allocated clusters, one entry per cluster in VCN order
+struct FileClusters {
+    std::vector<int64_t> vcns; // logical offsets within the file
+    std::vector<int64_t> lcns; // physical disk positions
+};
+
+// Read all extents of a file (even if very fragmented) into the thread
+// arena's runs, calling again while a reply is TRACE_ERROR_MORE_DATA.
+// Sparse runs are left out. Returns 0, or the error of the call that failed.
+inline uint32_t ReadFileRuns(VolumeOps &ops, uint64_t file, size_t &clusterCount) {
+    static thread_local std::vector<ExtentRun> reply;
+    ScratchArena &arena = ScratchArena::ForThread();
+    arena.BeginFile();
+    clusterCount = 0;
+    int64_t startingVcn = 0;
+    while (true) {
+        uint32_t error = ops.Retrieval(file, startingVcn, reply);
+        if (error == TRACE_ERROR_HANDLE_EOF) {
+            // No more extents
+            arena.NoteIoctl(false);
+            break;
+        }
+        if (error != TRACE_ERROR_SUCCESS && error != TRACE_ERROR_MORE_DATA) {
+            return error;
+        }
+        bool moreData = error == TRACE_ERROR_MORE_DATA;
+        arena.NoteIoctl(moreData);
+        if (reply.empty()) {
+            break;
+        }
+        for (const ExtentRun &r : reply) {
+            if (r.lcn >= 0) {
+                arena.Push(arena.runs, r);
+                clusterCount += (size_t)r.count;
+            }
+        }
+        int64_t nextVcn = reply.back().vcn + reply.back().count;
+        if (!moreData || nextVcn <= startingVcn) {
+            break; // a successful reply holds every remaining extent
+        }
+        startingVcn = nextVcn;
+    }
+    return TRACE_ERROR_SUCCESS;
+}
+
+// All extents of a file as one entry per cluster. The extents are staged in
+// the thread's arena, so the cluster vectors are sized once instead of
+// growing one push_back at a time.
+inline uint32_t ReadFileClusters(VolumeOps &ops, uint64_t file, FileClusters &out) {
+    out.vcns.clear();
+    out.lcns.clear();
+    size_t clusterCount = 0;
+    uint32_t error = ReadFileRuns(ops, file, clusterCount);
+    if (error != TRACE_ERROR_SUCCESS) {
+        return error;
+    }
+    ScratchArena &arena = ScratchArena::ForThread();
+    arena.Reserve(out.vcns, clusterCount);
+    arena.Reserve(out.lcns, clusterCount);
+    for (const ExtentRun &run : arena.runs) {
+        for (int64_t c = 0; c < run.count; c++) {
+            out.vcns.push_back(run.vcn + c);
+            out.lcns.push_back(run.lcn + c);
+        }
+    }
+    return TRACE_ERROR_SUCCESS;
+}
+
+// Do the file's clusters already form one ascending run?
+inline bool IsFileContiguous(const FileClusters &fc) {
+    for (size_t i = 1; i < fc.lcns.size(); i++) {
+        if (fc.lcns[i] != fc.lcns[i - 1] + 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Collapse a per-cluster map back into runs
+inline void ClustersToRuns(const FileClusters &fc, std::vector<ExtentRun> &runs) {
+    runs.clear();
+    for (size_t i = 0; i < fc.lcns.size(); i++) {
+        if (!runs.empty() && fc.vcns[i] == runs.back().vcn + runs.back().count &&
+            fc.lcns[i] == runs.back().lcn + runs.back().count) {
+            runs.back().count++;
+        } else {
+            runs.push_back(ExtentRun{fc.vcns[i], fc.lcns[i], 1});
+        }
+    }
+}
+
+inline void MarkCluster(std::vector<uint8_t> &bitmap, int64_t lcn, bool allocated) {
+    size_t byteIndex = (size_t)(lcn / 8);
+    int bitOffset = (int)(lcn % 8);
+    if (allocated) {
+        bitmap[byteIndex] |= (uint8_t)(1 << bitOffset);
+    } else {
+        bitmap[byteIndex] &= (uint8_t)~(1 << bitOffset);
+    }
+}
+
+inline void MarkClusters(std::vector<uint8_t> &bitmap, int64_t lcn, size_t count, bool allocated) {
+    for (size_t i = 0; i < count; i++) {
+        MarkCluster(bitmap, lcn + (int64_t)i, allocated);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Execution
+//   The executor runs a batch in elevator (SCAN) order: it sweeps up from
+//   the current head position and back down, issuing every move whose
+//   destination is already free, instead of jumping between distant LCNs
+//   in VCN order. A move whose destination is still occupied by the source
+//   of another move in the batch waits for that move.
+// ---------------------------------------------------------------------------
+enum class MoveOrder {
+    Planned,        // as planned (file order, then VCN order)
+    SourceLcn,      // elevator over source LCNs
+    DestinationLcn  // elevator over destination LCNs
+};
+
+struct PlannedMove {
+    uint64_t file;                // as VolumeOps names it
+    const std::wstring *filePath; // for messages
+    FileClusters *owner;          // cluster map updated once the move succeeds
+    size_t clusterIndex;          // first moved cluster, index into owner->vcns / owner->lcns
+    size_t clusterCount;          // allocated clusters moved, consecutive from clusterIndex
+    int64_t srcVcn;               // StartingVcn of the move
+    int64_t vcnCount;             // its ClusterCount: the run, or the whole compression unit
+    int64_t srcLcn;               // first moved cluster's current location
+    int64_t dstLcn;
+};
+
+// Told about every batch and move. BeforeMoves comes after the batch is
+// ordered and before its first move, AfterMoves once the batch is done and
+// the cluster maps are up to date.
+class MoveObserver {
+public:
+    virtual ~MoveObserver() {}
+    virtual void BeforeMoves(const std::vector<PlannedMove> & /*batch*/) {}
+    virtual void Moved(const PlannedMove & /*move*/) {}
+    virtual void MoveFailed(const PlannedMove & /*move*/, uint32_t /*error*/) {}
+    virtual void AfterMoves() {}
+};
+
+// Clusters the moves gave back while the planner owns the bitmap on another
+// thread: the old locations of moved clusters and the reservations of moves
+// that failed. The executor collects a batch's runs and publishes them at
+// its end; the planner marks them free before it plans the next file.
+struct ClusterReleases {
+    struct Run {
+        int64_t lcn;
+        size_t count;
+    };
+
+    // Executor thread
+    void Add(int64_t lcn, size_t count) {
+        if (!batch.empty() && batch.back().lcn + (int64_t)batch.back().count == lcn) {
+            batch.back().count += count;
+        } else {
+            batch.push_back(Run{lcn, count});
+        }
+    }
+
+    void Publish() {
+        if (batch.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        published.insert(published.end(), batch.begin(), batch.end());
+        batch.clear();
+    }
+
+    // Planner thread
+    void Apply(std::vector<uint8_t> &bitmap) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (published.empty()) {
+                return;
+            }
+            applying.swap(published);
+        }
+        for (const Run &r : applying) {
+            MarkClusters(bitmap, r.lcn, r.count, false);
+        }
+        applying.clear();
+    }
+
+private:
+    std::vector<Run> batch;
+    std::mutex mutex;
+    std::vector<Run> published;
+    std::vector<Run> applying;
+};
+
+struct MoveExecutor {
+    VolumeOps *ops = nullptr;
+    MoveOrder order = MoveOrder::DestinationLcn;
+    int64_t headLcn = 0;           // simulated head position, carried across batches
+    uint64_t seekPlanned = 0;      // simulated head travel had the batches run as planned
+    uint64_t seekExecuted = 0;     // simulated head travel in the order actually used
+    uint64_t movesDone = 0;
+    uint64_t movesFailed = 0;
+    MoveObserver *observer = nullptr;    // optional
+    ClusterReleases *releases = nullptr; // set when the planner runs on another thread
+};
+
+// Mark clusters free, or hand them to the planner's thread
+inline void ReleaseClusters(MoveExecutor &executor, std::vector<uint8_t> &bitmap, int64_t lcn, size_t count) {
+    if (executor.releases) {
+        executor.releases->Add(lcn, count);
+    } else {
+        MarkClusters(bitmap, lcn, count, false);
+    }
+}
+
+// Simulated HDD: the head seeks to the source to read, then to the destination to write
+inline uint64_t SimulateHeadTravel(const std::vector<PlannedMove> &batch,
+                                   const std::vector<size_t> &order,
+                                   int64_t &headLcn) {
+    uint64_t travel = 0;
+    for (size_t idx : order) {
+        const PlannedMove &m = batch[idx];
+        travel += (uint64_t)std::llabs(m.srcLcn - headLcn);
+        travel += (uint64_t)std::llabs(m.dstLcn - m.srcLcn);
+        headLcn = m.dstLcn;
+    }
+    return travel;
+}
+
+// Elevator order that respects "destination must be vacated first" dependencies
+inline std::vector<size_t> ElevatorOrder(const std::vector<PlannedMove> &batch, MoveOrder order, int64_t headLcn) {
+    std::vector<size_t> result;
+    result.reserve(batch.size());
+    if (order == MoveOrder::Planned) {
+        for (size_t i = 0; i < batch.size(); i++) {
+            result.push_back(i);
+        }
+        return result;
+    }
+
+    auto key = [&](size_t i) { return order == MoveOrder::SourceLcn ? batch[i].srcLcn : batch[i].dstLcn; };
+    std::vector<size_t> sorted(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        sorted[i] = i;
+    }
+    std::sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b) { return key(a) < key(b); });
+
+    // Move i waits for every other move whose source clusters overlap
+    // [dstLcn, dstLcn + clusterCount), not just one whose source starts at
+    // dstLcn. Sources are taken from the cluster map, so a compression unit
+    // whose allocated clusters are scattered counts as all its pieces.
+    struct SourceRun {
+        int64_t start;
+        int64_t end;
+        size_t move;
+    };
+    std::vector<SourceRun> sources;
+    for (size_t i = 0; i < batch.size(); i++) {
+        const PlannedMove &m = batch[i];
+        for (size_t c = 0; c < m.clusterCount; c++) {
+            int64_t lcn = m.owner->lcns[m.clusterIndex + c];
+            if (c > 0 && sources.back().end == lcn) {
+                sources.back().end++;
+            } else {
+                sources.push_back(SourceRun{lcn, lcn + 1, i});
+            }
+        }
+    }
+    std::sort(sources.begin(), sources.end(), [](const SourceRun &a, const SourceRun &b) { return a.start < b.start; });
+    std::vector<size_t> pending(batch.size(), 0);           // blockers of move i not yet issued
+    std::vector<std::vector<size_t>> waiting(batch.size()); // moves blocked by move i
+    for (size_t i = 0; i < batch.size(); i++) {
+        int64_t dstEnd = batch[i].dstLcn + (int64_t)batch[i].clusterCount;
+        auto it = std::upper_bound(sources.begin(), sources.end(), batch[i].dstLcn,
+                                   [](int64_t lcn, const SourceRun &r) { return lcn < r.start; });
+        if (it != sources.begin()) {
+            --it; // the run starting at or before dstLcn may reach into it
+        }
+        for (; it != sources.end() && it->start < dstEnd; ++it) {
+            if (it->end > batch[i].dstLcn && it->move != i &&
+                (waiting[it->move].empty() || waiting[it->move].back() != i)) {
+                waiting[it->move].push_back(i);
+                pending[i]++;
+            }
+        }
+    }
+
+    std::vector<bool> done(batch.size(), false);
+    auto issue = [&](size_t i) {
+        done[i] = true;
+        result.push_back(i);
+        for (size_t w : waiting[i]) {
+            pending[w]--;
+        }
+    };
+    size_t start = std::lower_bound(sorted.begin(), sorted.end(), headLcn,
+                                    [&](size_t i, int64_t lcn) { return key(i) < lcn; }) - sorted.begin();
+    bool up = true;
+    while (result.size() < batch.size()) {
+        size_t before = result.size();
+        if (up) {
+            for (size_t p = start; p < sorted.size(); p++) {
+                size_t i = sorted[p];
+                if (!done[i] && pending[i] == 0) {
+                    issue(i);
+                }
+            }
+            start = sorted.size();
+        } else {
+            for (size_t p = start; p-- > 0;) {
+                size_t i = sorted[p];
+                if (!done[i] && pending[i] == 0) {
+                    issue(i);
+                }
+            }
+            start = 0;
+        }
+        up = !up;
+        if (result.size() == before && start == 0 && up) {
+            // Two empty sweeps in a row: the rest is a dependency cycle, which needs a
+            // scratch cluster to break. Issue it as planned and let the moves fail.
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (!done[i]) {
+                    issue(i);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+// Run a batch of planned moves and keep bitmap and cluster maps in sync
+inline void ExecuteMoveBatch(MoveExecutor &executor, std::vector<PlannedMove> &batch, std::vector<uint8_t> &bitmap) {
+    if (batch.empty()) {
+        return;
+    }
+    std::vector<size_t> order = ElevatorOrder(batch, executor.order, executor.headLcn);
+
+    std::vector<size_t> planned(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        planned[i] = i;
+    }
+    int64_t plannedHead = executor.headLcn;
+    executor.seekPlanned += SimulateHeadTravel(batch, planned, plannedHead);
+    executor.seekExecuted += SimulateHeadTravel(batch, order, executor.headLcn);
+
+    if (executor.observer) {
+        executor.observer->BeforeMoves(batch);
+    }
+    for (size_t idx : order) {
+        PlannedMove &m = batch[idx];
+        uint32_t error = executor.ops->Move(m.file, m.srcVcn, m.dstLcn, m.vcnCount);
+        if (error != TRACE_ERROR_SUCCESS) {
+            if (executor.observer) {
+                executor.observer->MoveFailed(m, error);
+            }
+            // Drop the reservation, we continue to attempt the rest anyway
+            ReleaseClusters(executor, bitmap, m.dstLcn, m.clusterCount);
+            executor.movesFailed++;
+            continue;
+        }
+
+        // Mark old locations free (the new ones were reserved when planning)
+        for (size_t i = 0; i < m.clusterCount; i++) {
+            ReleaseClusters(executor, bitmap, m.owner->lcns[m.clusterIndex + i], 1);
+            m.owner->lcns[m.clusterIndex + i] = m.dstLcn + (int64_t)i;
+        }
+        executor.movesDone++;
+        if (executor.observer) {
+            executor.observer->Moved(m);
+        }
+    }
+    batch.clear();
+    if (executor.releases) {
+        executor.releases->Publish();
+    }
+    if (executor.observer) {
+        executor.observer->AfterMoves();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// First fit (defragment)
+//   A file in more than one piece is moved into the first free block that
+//   holds all of it, outside the reserved ranges. It is moved one run at a
+//   time, or one compression unit at a time when compressed; holes stay
+//   holes and take no room (see extent_plan.h). With a read-cost model, a
+//   file is only moved when reading it would get faster by at least the
+//   threshold.
+// ---------------------------------------------------------------------------
+struct ReadCostStats {
+    uint64_t filesMoved = 0;
+    uint64_t filesSkipped = 0;    // fragmented, but below the threshold
+    double secondsBefore = 0;     // projected read time of the moved files, as they were
+    double secondsAfter = 0;      // the same files once contiguous
+    double secondsNotSaved = 0;   // what moving the skipped files would have saved
+};
+
+struct FirstFitPlanner {
+    std::vector<LcnRange> reserved;          // never allocated from (the MFT zone), sorted
+    const ReadCostModel *readCost = nullptr; // optional read-cost gate
+    double thresholdSeconds = 0;
+    ReadCostStats readCostStats;
+    ExtentPlanStats extentStats;
+    std::vector<ExtentRun> runs;   // scratch
+    std::vector<ExtentMove> moves; // scratch
+};
+
+enum class PlanOutcome {
+    Contiguous, // already in one piece
+    NotWorthIt, // the read-cost gate said no
+    NoRoom,     // no free block holds the file
+    Found       // blockStart holds it
+};
+
+struct FirstFitDecision {
+    PlanOutcome outcome = PlanOutcome::Contiguous;
+    uint64_t clusters = 0;
+    uint64_t blockStart = 0;    // when found
+    double secondsSaved = 0;    // per read, with a read-cost model
+};
+
+// Scan [fromLcn, toLcn) for a run of free clusters outside the reserved ranges
+inline bool FindFreeBlock(const FirstFitPlanner &planner,
+                          const std::vector<uint8_t> &bitmap,
+                          uint64_t fromLcn,
+                          uint64_t toLcn,
+                          uint64_t clusters,
+                          uint64_t &blockStart) {
+    return FindFreeRun(BitmapWords(bitmap), fromLcn, toLcn, clusters, planner.reserved, blockStart);
+}
+
+// Whether the file is moved, and where to: the first free block from LCN 0
+// that holds all of its allocated clusters. The read-cost counts are kept
+// here, so a file found a block counts as moved.
+inline FirstFitDecision ChooseFirstFitBlock(FirstFitPlanner &planner,
+                                            const FileClusters &fc,
+                                            const std::vector<uint8_t> &bitmap,
+                                            uint64_t totalClusters) {
+    FirstFitDecision d;
+    d.clusters = (uint64_t)fc.lcns.size();
+    if (IsFileContiguous(fc)) {
+        return d;
+    }
+    double before = 0;
+    double after = 0;
+    if (planner.readCost) {
+        ClustersToRuns(fc, planner.runs);
+        before = planner.readCost->FileReadSeconds(planner.runs.data(), planner.runs.size());
+        after = planner.readCost->ContiguousReadSeconds(d.clusters);
+        d.secondsSaved = before - after;
+        if (d.secondsSaved < planner.thresholdSeconds) {
+            planner.readCostStats.filesSkipped++;
+            planner.readCostStats.secondsNotSaved += d.secondsSaved;
+            d.outcome = PlanOutcome::NotWorthIt;
+            return d;
+        }
+    }
+    if (!FindFreeBlock(planner, bitmap, 0, totalClusters, d.clusters, d.blockStart)) {
+        d.outcome = PlanOutcome::NoRoom;
+        return d;
+    }
+    planner.readCostStats.filesMoved++;
+    planner.readCostStats.secondsBefore += before;
+    planner.readCostStats.secondsAfter += after;
+    d.outcome = PlanOutcome::Found;
+    return d;
+}
+
+// Plan moving the file's allocated clusters, in ascending file order, into
+// [blockStart ... blockStart + count - 1]: one move per run, or per
+// compression unit (unitClusters, 0 when not compressed). Holes take no
+// space. Each destination is reserved in the bitmap.
+inline void PlanRelocation(FirstFitPlanner &planner,
+                           uint64_t file,
+                           const std::wstring *filePath,
+                           uint32_t unitClusters,
+                           FileClusters &fc,
+                           std::vector<uint8_t> &bitmap,
+                           uint64_t blockStart,
+                           std::vector<PlannedMove> &batch) {
+    ClustersToRuns(fc, planner.runs);
+    planner.moves.clear();
+    PlanExtentMoves(planner.runs.data(), planner.runs.size(), unitClusters, blockStart, planner.moves,
+                    &planner.extentStats);
+    size_t clusterIndex = 0;
+    for (const ExtentMove &m : planner.moves) {
+        // A unit's first allocated cluster may come after the unit's start
+        while (fc.vcns[clusterIndex] < m.vcn) {
+            clusterIndex++;
+        }
+        MarkClusters(bitmap, m.dstLcn, (size_t)m.clusters, true);
+        batch.push_back(PlannedMove{file, filePath, &fc, clusterIndex, (size_t)m.clusters, m.vcn, m.vcnCount,
+                                    m.srcLcn, m.dstLcn});
+        clusterIndex += (size_t)m.clusters;
+    }
+}
+
+// Both steps for one file, the moves appended to batch; none if the file is
+// contiguous, not worth moving or has no block to go to
+inline FirstFitDecision PlanFirstFit(FirstFitPlanner &planner,
+                                     uint64_t file,
+                                     const std::wstring *filePath,
+                                     uint32_t unitClusters,
+                                     FileClusters &fc,
+                                     std::vector<uint8_t> &bitmap,
+                                     uint64_t totalClusters,
+                                     std::vector<PlannedMove> &batch) {
+    FirstFitDecision d = ChooseFirstFitBlock(planner, fc, bitmap, totalClusters);
+    if (d.outcome == PlanOutcome::Found) {
+        PlanRelocation(planner, file, filePath, unitClusters, fc, bitmap, d.blockStart, batch);
+    }
+    return d;
+}
+
+// ---------------------------------------------------------------------------
+// Random single-cluster moves (fragment)
+//   A randomly picked cluster of the file goes to a random free cluster
+//   outside the reserved ranges. Clusters and destinations are drawn from
+//   the generator with a plain modulo, so one seed gives the same moves on
+//   every platform and standard library.
+// ---------------------------------------------------------------------------
+struct RandomMovePlanner {
+    std::vector<LcnRange> reserved; // never a destination (the MFT zone), sorted
+    std::mt19937_64 random;
+};
+
+// Plan one move of a random cluster of the file (which has clusters),
+// reserving its destination. false when the volume has no free cluster.
+inline bool PlanRandomMove(RandomMovePlanner &planner,
+                           uint64_t file,
+                           const std::wstring *filePath,
+                           FileClusters &fc,
+                           std::vector<uint8_t> &bitmap,
+                           uint64_t totalClusters,
+                           std::vector<PlannedMove> &batch) {
+    size_t index = (size_t)(planner.random() % fc.vcns.size());
+    uint64_t newLcn = 0;
+    bool found = false;
+    const int RANDOM_ATTEMPTS = 2000;
+    for (int attempt = 0; attempt < RANDOM_ATTEMPTS && !found; attempt++) {
+        uint64_t candidate = planner.random() % totalClusters;
+        if (!((bitmap[(size_t)(candidate / 8)] >> (candidate % 8)) & 1) && !IsReservedLcn(planner.reserved, candidate)) {
+            newLcn = candidate;
+            found = true;
+        }
+    }
+    // Fallback linear search
+    if (!found && !FindFreeRun(BitmapWords(bitmap), 0, totalClusters, 1, planner.reserved, newLcn)) {
+        return false;
+    }
+    MarkCluster(bitmap, (int64_t)newLcn, true);
+    batch.push_back(PlannedMove{file, filePath, &fc, index, 1, fc.vcns[index], 1, fc.lcns[index], (int64_t)newLcn});
+    return true;
+}
@@ -0,0 +1,302 @@
+// Move ordering in the shared move executor
+//
+//   move_engine_bench [moves = 200000] [batch = 256]
+//
+//   1. checks the order of hand-made batches: a move waits for every move
+//      whose source clusters overlap its destination, also when they only
+//      partly overlap, when the destination starts inside a source, and when
+//      the source is a compression unit in scattered pieces; clusters that
+//      only touch do not block, and a cycle is issued as planned
+//   2. lays out `moves` files on a volume and plans one move per file, in
+//      batches of `batch`, whose destinations often reuse, in part, clusters
+//      that earlier moves of the batch vacate. Each batch is shuffled and run
+//      through ExecuteMoveBatch against a TraceVolume, which refuses a move
+//      onto clusters still in use as NTFS does. Elevator orders must not
+//      fail a single move; the planned order shows how many would fail
+//      without the dependencies.
+
+#include "move_engine.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+// ---------------------------------------------------------------------------
+// Hand-made batches
+// ---------------------------------------------------------------------------
+
+struct HandMove {
+    std::vector<int64_t> lcns; // source clusters, in VCN order
+    int64_t dstLcn;
+};
+
+static std::vector<size_t> OrderOf(const std::vector<HandMove> &moves, MoveOrder order,
+                                   std::vector<FileClusters> &owners, std::vector<PlannedMove> &batch) {
+    owners.assign(moves.size(), FileClusters());
+    batch.clear();
+    for (size_t i = 0; i < moves.size(); i++) {
+        for (size_t c = 0; c < moves[i].lcns.size(); c++) {
+            owners[i].vcns.push_back((int64_t)c);
+            owners[i].lcns.push_back(moves[i].lcns[c]);
+        }
+    }
+    for (size_t i = 0; i < moves.size(); i++) {
+        batch.push_back(PlannedMove{i, nullptr, &owners[i], 0, moves[i].lcns.size(), 0,
+                                    (int64_t)moves[i].lcns.size(), moves[i].lcns[0], moves[i].dstLcn});
+    }
+    return ElevatorOrder(batch, order, 0);
+}
+
+// No move is issued before a move whose sources overlap its destination
+static bool Respects(const std::vector<HandMove> &moves, const std::vector<size_t> &order) {
+    for (size_t p = 0; p < order.size(); p++) {
+        const HandMove &m = moves[order[p]];
+        for (size_t q = p + 1; q < order.size(); q++) {
+            for (int64_t lcn : moves[order[q]].lcns) {
+                if (lcn >= m.dstLcn && lcn < m.dstLcn + (int64_t)m.lcns.size()) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static std::vector<int64_t> Run(int64_t lcn, int64_t count) {
+    std::vector<int64_t> lcns;
+    for (int64_t c = 0; c < count; c++) {
+        lcns.push_back(lcn + c);
+    }
+    return lcns;
+}
+
+static bool CheckHandMade() {
+    std::vector<FileClusters> owners;
+    std::vector<PlannedMove> batch;
+    bool ok = true;
+
+    // Partial overlap: move 0's destination [2000, 2008) holds the tail of
+    // move 1's source [1996, 2004) and all of move 2's source [2005, 2007);
+    // neither source starts at 2000
+    std::vector<HandMove> partial = {{Run(1000, 8), 2000}, {Run(1996, 8), 5000}, {Run(2005, 2), 6000}};
+    for (MoveOrder order : {MoveOrder::SourceLcn, MoveOrder::DestinationLcn}) {
+        std::vector<size_t> o = OrderOf(partial, order, owners, batch);
+        ok = ok && o.size() == 3 && o.back() == 0 && Respects(partial, o);
+    }
+
+    // The destination starts inside a source: [1004, 1008) is the tail of move 0's [1000, 1008)
+    std::vector<HandMove> inside = {{Run(1000, 8), 3000}, {Run(500, 4), 1004}};
+    std::vector<size_t> o = OrderOf(inside, MoveOrder::DestinationLcn, owners, batch);
+    ok = ok && o.size() == 2 && o[0] == 0 && Respects(inside, o);
+
+    // A compression unit whose clusters are scattered: move 1 goes to the
+    // unit's third piece, not to its first cluster
+    std::vector<HandMove> unit = {{{3000, 3001, 3010}, 7000}, {{500}, 3010}};
+    o = OrderOf(unit, MoveOrder::DestinationLcn, owners, batch);
+    ok = ok && o.size() == 2 && o[0] == 0 && Respects(unit, o);
+
+    // Exact match, and a destination that only touches a source
+    std::vector<HandMove> exact = {{Run(100, 1), 200}, {Run(200, 1), 300}};
+    o = OrderOf(exact, MoveOrder::DestinationLcn, owners, batch);
+    ok = ok && o.size() == 2 && o[0] == 1 && Respects(exact, o);
+    std::vector<HandMove> touching = {{Run(400, 4), 600}, {Run(596, 4), 900}};
+    o = OrderOf(touching, MoveOrder::DestinationLcn, owners, batch);
+    ok = ok && o.size() == 2 && o[0] == 0 && o[1] == 1;
+
+    // A cycle through partial overlaps is issued as planned
+    std::vector<HandMove> cycle = {{Run(100, 2), 201}, {Run(200, 3), 99}};
+    o = OrderOf(cycle, MoveOrder::DestinationLcn, owners, batch);
+    ok = ok && o.size() == 2 && o[0] == 0 && o[1] == 1;
+    return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Batches with chained moves
+// ---------------------------------------------------------------------------
+
+struct ChainMove {
+    uint32_t file;
+    int64_t srcLcn;
+    int64_t dstLcn;
+    int64_t count;
+};
+
+struct Layout {
+    uint64_t totalClusters = 0;
+    std::vector<ExtentRun> files;                // one run per file, vcn 0
+    std::vector<std::vector<ChainMove>> batches; // in planned (shuffled) order
+    uint64_t blocked = 0;                        // moves whose destination a move of the same batch vacates
+    uint64_t partlyBlocked = 0;                  // ... and no such source starts at the destination
+};
+
+// Files of 1-16 clusters with small gaps in the lower half of the volume.
+// Moves are planned in a random sequence: each destination is free at the
+// time, and is often placed to cover part of the clusters an earlier move
+// of its batch has just vacated. The batches are then shuffled, so only the
+// dependencies tell a working order.
+static void MakeLayout(Layout &layout, uint64_t moves, size_t batchSize) {
+    std::mt19937_64 rng(0x0E1E);
+    int64_t cursor = 0;
+    for (uint64_t i = 0; i < moves; i++) {
+        int64_t count = 1 + (int64_t)(rng() % 16);
+        layout.files.push_back(ExtentRun{0, cursor, count});
+        cursor += count + (int64_t)(rng() % 4);
+    }
+    layout.totalClusters = (uint64_t)(cursor * 2 + 63) / 64 * 64;
+
+    std::vector<int32_t> owner((size_t)layout.totalClusters, -1); // file in each cluster now
+    std::vector<int64_t> vacatedBy((size_t)layout.totalClusters, -1); // sequence position of the move that left it
+    for (uint32_t f = 0; f < (uint32_t)layout.files.size(); f++) {
+        for (int64_t c = 0; c < layout.files[f].count; c++) {
+            owner[(size_t)(layout.files[f].lcn + c)] = (int32_t)f;
+        }
+    }
+    auto isFree = [&](int64_t lcn, int64_t count) {
+        if (lcn < 0 || lcn + count > (int64_t)layout.totalClusters) {
+            return false;
+        }
+        for (int64_t c = lcn; c < lcn + count; c++) {
+            if (owner[(size_t)c] >= 0) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    std::vector<uint32_t> sequence(layout.files.size());
+    for (uint32_t f = 0; f < (uint32_t)sequence.size(); f++) {
+        sequence[f] = f;
+    }
+    std::shuffle(sequence.begin(), sequence.end(), rng);
+    for (size_t first = 0; first < sequence.size(); first += batchSize) {
+        size_t last = std::min(sequence.size(), first + batchSize);
+        std::vector<ChainMove> batch;
+        std::vector<int64_t> batchStarts; // sources vacated so far in this batch
+        for (size_t s = first; s < last; s++) {
+            uint32_t f = sequence[s];
+            int64_t src = layout.files[f].lcn;
+            int64_t count = layout.files[f].count;
+            int64_t dst = -1;
+            for (int attempt = 0; attempt < 8 && dst < 0 && !batchStarts.empty(); attempt++) {
+                // Straddle the start of a vacated source, or start inside it
+                int64_t base = batchStarts[(size_t)(rng() % batchStarts.size())];
+                int64_t candidate = base - count + 1 + (int64_t)(rng() % (uint64_t)(count + 8));
+                if (isFree(candidate, count)) {
+                    dst = candidate;
+                }
+            }
+            while (dst < 0) {
+                int64_t candidate = (int64_t)(rng() % (layout.totalClusters - (uint64_t)count));
+                if (isFree(candidate, count)) {
+                    dst = candidate;
+                }
+            }
+            bool blocked = false;
+            bool exact = false;
+            for (int64_t c = dst; c < dst + count; c++) {
+                if (vacatedBy[(size_t)c] >= (int64_t)first) {
+                    blocked = true;
+                    exact = exact || layout.files[sequence[(size_t)vacatedBy[(size_t)c]]].lcn == dst;
+                }
+                owner[(size_t)c] = (int32_t)f;
+            }
+            for (int64_t c = src; c < src + count; c++) {
+                owner[(size_t)c] = -1;
+                vacatedBy[(size_t)c] = (int64_t)s;
+            }
+            layout.blocked += blocked ? 1 : 0;
+            layout.partlyBlocked += blocked && !exact ? 1 : 0;
+            batch.push_back(ChainMove{f, src, dst, count});
+            batchStarts.push_back(src);
+        }
+        std::shuffle(batch.begin(), batch.end(), rng);
+        layout.batches.push_back(std::move(batch));
+    }
+}
+
+struct RunResult {
+    uint64_t moves = 0;
+    uint64_t failed = 0;
+    uint64_t misplaced = 0; // files not in one piece at their planned destination
+    double seconds = 0;
+};
+
+static void RunBatches(const Layout &layout, MoveOrder order, RunResult &result) {
+    TraceVolume volume;
+    volume.Reset(layout.totalClusters);
+    std::vector<ExtentRun> runs(1);
+    for (const ExtentRun &f : layout.files) {
+        runs[0] = f;
+        volume.AddFile(L"f", (uint64_t)f.count * 4096, runs);
+    }
+    TraceVolumeOps ops(volume);
+    std::vector<uint8_t> bitmap = volume.Bitmap();
+    std::vector<FileClusters> clusters(layout.files.size());
+    for (uint32_t f = 0; f < (uint32_t)layout.files.size(); f++) {
+        ReadFileClusters(ops, f, clusters[f]);
+    }
+
+    MoveExecutor executor;
+    executor.ops = &ops;
+    executor.order = order;
+    std::vector<PlannedMove> batch;
+    auto started = std::chrono::steady_clock::now();
+    for (const std::vector<ChainMove> &planned : layout.batches) {
+        for (const ChainMove &m : planned) {
+            MarkClusters(bitmap, m.dstLcn, (size_t)m.count, true); // reserved, as a planner does
+            batch.push_back(PlannedMove{m.file, nullptr, &clusters[m.file], 0, (size_t)m.count, 0, m.count, m.srcLcn,
+                                        m.dstLcn});
+        }
+        ExecuteMoveBatch(executor, batch, bitmap);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    result.moves = executor.movesDone + executor.movesFailed;
+    result.failed = executor.movesFailed;
+    for (const std::vector<ChainMove> &planned : layout.batches) {
+        for (const ChainMove &m : planned) {
+            const std::vector<ExtentRun> &now = volume.FileInfo(m.file).runs;
+            if (now.size() != 1 || now[0].lcn != m.dstLcn) {
+                result.misplaced++;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    uint64_t moves = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+    size_t batchSize = argc > 2 ? (size_t)std::strtoull(argv[2], nullptr, 10) : 256;
+    if (moves == 0 || batchSize == 0) {
+        std::cerr << "usage: move_engine_bench [moves] [batch]\n";
+        return 1;
+    }
+
+    bool handMade = CheckHandMade();
+    std::cout << "Order checks: " << (handMade ? "OK" : "FAILED") << "\n";
+
+    Layout layout;
+    MakeLayout(layout, moves, batchSize);
+    std::cout << "Layout: " << layout.files.size() << " moves in " << layout.batches.size() << " batches of up to "
+              << batchSize << " on " << layout.totalClusters << " clusters; " << layout.blocked
+              << " wait for a move of their batch, " << layout.partlyBlocked
+              << " of them for sources that only partly overlap the destination\n";
+
+    struct Pass {
+        const char *name;
+        MoveOrder order;
+    } passes[] = {{"Planned", MoveOrder::Planned},
+                  {"Source elevator", MoveOrder::SourceLcn},
+                  {"Destination elevator", MoveOrder::DestinationLcn}};
+    bool ok = handMade;
+    for (const Pass &pass : passes) {
+        RunResult r;
+        RunBatches(layout, pass.order, r);
+        std::cout << pass.name << ": " << r.moves << " moves, " << r.failed << " failed, " << r.misplaced
+                  << " files not where planned, in " << r.seconds << " s\n";
+        if (pass.order != MoveOrder::Planned) {
+            ok = ok && r.failed == 0 && r.misplaced == 0;
+        }
+    }
+    std::cout << "Check: " << (ok ? "no elevator move was issued onto clusters still in use" : "FAILED") << "\n";
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,225 @@
+#pragma once
+// Read-cost model: how long reading a file front to back takes, given where
+// its extents lie and what kind of device holds them
+//
+// A read of one physically contiguous piece costs one request per
+// maxRequestBytes plus the transfer time. Every break between pieces adds a
+// positioning delay: on a rotating disk a seek that grows with the square
+// root of the distance plus, on average, half a revolution; on an SSD
+// nothing beyond the extra request. Defragmenting a file is worth it when
+// the time saved is above a threshold, which on an SSD it rarely is.
+//
+// The seek to the first cluster is left out: it is paid wherever the file
+// lies, so it cancels out of before/after comparisons.
+//
+// Profiles can be measured: CalibrateProfile times reads through a ReadProbe
+// (the volume, opened unbuffered, in the tools) and fits the parameters.
+
+#include "scratch_arena.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+struct DeviceProfile {
+    const char *name;
+    bool rotational;
+    double requestSeconds;    // fixed cost of one read request
+    double bytesPerSecond;    // sequential transfer rate
+    double seekMinSeconds;    // shortest seek, rotational only
+    double seekAvgSeconds;    // seek across a third of the volume, the average random seek
+    double revolutionSeconds; // one revolution; a seek waits half of it on average
+    uint32_t maxRequestBytes; // larger reads are split into requests of this size
+
+    static DeviceProfile Hdd7200() { return DeviceProfile{"hdd-7200", true, 50e-6, 160e6, 0.8e-3, 8.5e-3, 60.0 / 7200, 1 << 20}; }
+    static DeviceProfile Ssd() { return DeviceProfile{"ssd", false, 80e-6, 500e6, 0, 0, 0, 1 << 20}; }
+};
+
+class ReadCostModel {
+public:
+    ReadCostModel(const DeviceProfile &profile, uint64_t totalClusters, uint32_t bytesPerCluster)
+        : profile(profile), bytesPerCluster(bytesPerCluster), thirdOfVolume(std::max<double>(1.0, (double)totalClusters / 3)) {}
+
+    const DeviceProfile &Profile() const { return profile; }
+
+    // Delay between finishing one piece and starting the next, `distance`
+    // clusters away (either direction)
+    double Positioning(uint64_t distance) const {
+        if (!profile.rotational || distance == 0) {
+            return 0;
+        }
+        double seek = profile.seekMinSeconds +
+                      (profile.seekAvgSeconds - profile.seekMinSeconds) * std::sqrt((double)distance / thirdOfVolume);
+        return seek + profile.revolutionSeconds / 2;
+    }
+
+    // Requests and transfer of one contiguous piece
+    double PieceSeconds(uint64_t clusters) const {
+        double bytes = (double)clusters * bytesPerCluster;
+        double requests = std::ceil(bytes / profile.maxRequestBytes);
+        return requests * profile.requestSeconds + bytes / profile.bytesPerSecond;
+    }
+
+    // Runs in VCN order, as FSCTL_GET_RETRIEVAL_POINTERS returns them.
+    // Sparse runs are not read; runs that follow each other on disk are one piece.
+    double FileReadSeconds(const ExtentRun *runs, size_t runCount) const {
+        double seconds = 0;
+        uint64_t pieceClusters = 0;
+        int64_t nextLcn = -1;
+        for (size_t i = 0; i < runCount; i++) {
+            if (runs[i].lcn < 0 || runs[i].count <= 0) {
+                continue;
+            }
+            if (runs[i].lcn != nextLcn && pieceClusters > 0) {
+                seconds += PieceSeconds(pieceClusters);
+                uint64_t from = (uint64_t)nextLcn;
+                uint64_t to = (uint64_t)runs[i].lcn;
+                seconds += Positioning(from > to ? from - to : to - from);
+                pieceClusters = 0;
+            }
+            pieceClusters += (uint64_t)runs[i].count;
+            nextLcn = runs[i].lcn + runs[i].count;
+        }
+        return pieceClusters ? seconds + PieceSeconds(pieceClusters) : seconds;
+    }
+
+    // The same file once it is contiguous
+    double ContiguousReadSeconds(uint64_t clusters) const { return clusters ? PieceSeconds(clusters) : 0; }
+
+private:
+    DeviceProfile profile;
+    uint32_t bytesPerCluster;
+    double thirdOfVolume;
+};
+
+// Source of timed reads for calibration
+class ReadProbe {
+public:
+    virtual ~ReadProbe() {}
+    virtual uint64_t SizeBytes() const = 0;
+    // Read `bytes` at `offset` (both multiples of the probe's alignment) and
+    // return how long it took
+    virtual bool Read(uint64_t offset, uint32_t bytes, double &seconds) = 0;
+};
+
+struct CalibrationOptions {
+    uint32_t smallBytes = 4096;        // size of the latency probes; also the offset alignment
+    uint32_t largeBytes = 1 << 20;     // size of the sequential reads
+    uint32_t sequentialReads = 64;     // 64 MB by default
+    uint32_t latencyReads = 64;        // of each kind: adjacent, short seek, random
+    uint64_t seed = 1;
+    DeviceProfile fallback = DeviceProfile::Hdd7200(); // revolution time and request size for rotational disks
+};
+
+struct CalibrationSamples {
+    double sequentialBytesPerSecond = 0;
+    double adjacentSeconds = 0; // median small read right after the previous one (read-ahead, no positioning)
+    double shortSeconds = 0;    // median small read about 1/1000 of the volume away
+    double randomSeconds = 0;   // median small read anywhere
+};
+
+namespace read_cost_detail {
+inline double Median(std::vector<double> &v) {
+    if (v.empty()) {
+        return 0;
+    }
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+}
+} // namespace read_cost_detail
+
+// Time sequential, adjacent, short-seek and random reads and fit a profile.
+// A device whose random reads take half a millisecond more than adjacent
+// ones is taken to be rotational; on it the positioning time is split into
+// seek and half a revolution using the fallback's revolution time.
+inline bool CalibrateProfile(ReadProbe &probe, const CalibrationOptions &o, DeviceProfile &out,
+                             CalibrationSamples *samplesOut = nullptr) {
+    uint64_t size = probe.SizeBytes();
+    uint64_t sequentialBytes = (uint64_t)o.largeBytes * o.sequentialReads;
+    if (o.smallBytes == 0 || o.largeBytes % o.smallBytes != 0 || size < 2 * sequentialBytes + 1000ULL * o.smallBytes) {
+        return false;
+    }
+    std::mt19937_64 rng(o.seed);
+    uint64_t slots = size / o.smallBytes;
+    auto randomOffset = [&](uint64_t limit) { return rng() % (limit / o.smallBytes) * o.smallBytes; };
+
+    CalibrationSamples s;
+    double seconds = 0;
+    double total = 0;
+    uint64_t offset = randomOffset(size - sequentialBytes) / o.largeBytes * o.largeBytes;
+    if (!probe.Read(offset, o.largeBytes, seconds)) { // positions the head; not counted
+        return false;
+    }
+    for (uint32_t i = 0; i < o.sequentialReads; i++) {
+        offset += o.largeBytes;
+        if (!probe.Read(offset, o.largeBytes, seconds)) {
+            return false;
+        }
+        total += seconds;
+    }
+    s.sequentialBytesPerSecond = total > 0 ? (double)sequentialBytes / total : 0;
+
+    std::vector<double> adjacent, shortSeek, random;
+    offset = randomOffset(size / 2);
+    uint64_t shortStep = std::max<uint64_t>(1, slots / 1000) * o.smallBytes;
+    for (uint32_t i = 0; i < o.latencyReads; i++) {
+        offset += o.smallBytes;
+        if (!probe.Read(offset, o.smallBytes, seconds)) {
+            return false;
+        }
+        adjacent.push_back(seconds);
+    }
+    for (uint32_t i = 0; i < o.latencyReads; i++) {
+        offset = (offset + shortStep) % (size - o.smallBytes) / o.smallBytes * o.smallBytes;
+        if (!probe.Read(offset, o.smallBytes, seconds)) {
+            return false;
+        }
+        shortSeek.push_back(seconds);
+    }
+    for (uint32_t i = 0; i < o.latencyReads; i++) {
+        if (!probe.Read(randomOffset(size), o.smallBytes, seconds)) {
+            return false;
+        }
+        random.push_back(seconds);
+    }
+    s.adjacentSeconds = read_cost_detail::Median(adjacent);
+    s.shortSeconds = read_cost_detail::Median(shortSeek);
+    s.randomSeconds = read_cost_detail::Median(random);
+    if (samplesOut) {
+        *samplesOut = s;
+    }
+    if (s.sequentialBytesPerSecond <= 0) {
+        return false;
+    }
+
+    DeviceProfile p = o.fallback;
+    p.name = "measured";
+    double smallTransfer = o.smallBytes / s.sequentialBytesPerSecond;
+    p.requestSeconds = std::max(1e-6, s.adjacentSeconds - smallTransfer);
+    // The sequential reads paid one request each as well
+    double sequentialTransfer = (double)sequentialBytes / s.sequentialBytesPerSecond - o.sequentialReads * p.requestSeconds;
+    p.bytesPerSecond = sequentialTransfer > 0 ? (double)sequentialBytes / sequentialTransfer : s.sequentialBytesPerSecond;
+    p.maxRequestBytes = o.largeBytes;
+    p.rotational = s.randomSeconds - s.adjacentSeconds > 0.5e-3;
+    if (p.rotational) {
+        // Seek = min + (avg - min) * sqrt(distance / third of the volume). The
+        // short reads are 1/1000 of the volume apart, and the median distance
+        // between two random offsets is (1 - 1/sqrt(2)) of it.
+        const double SHORT_FACTOR = std::sqrt(3.0 / 1000);
+        const double RANDOM_FACTOR = std::sqrt(3.0 * (1 - 1 / std::sqrt(2.0)));
+        double halfRevolution = p.revolutionSeconds / 2;
+        double shortSeek = std::max(0.0, s.shortSeconds - s.adjacentSeconds - halfRevolution);
+        double randomSeek = std::max(shortSeek, s.randomSeconds - s.adjacentSeconds - halfRevolution);
+        double range = (randomSeek - shortSeek) / (RANDOM_FACTOR - SHORT_FACTOR);
+        p.seekMinSeconds = std::max(0.0, shortSeek - SHORT_FACTOR * range);
+        p.seekAvgSeconds = p.seekMinSeconds + range;
+    } else {
+        // A break costs a request the device cannot serve from read-ahead
+        p.requestSeconds = std::max(p.requestSeconds, s.randomSeconds - smallTransfer);
+        p.seekMinSeconds = p.seekAvgSeconds = p.revolutionSeconds = 0;
+    }
+    out = p;
+    return true;
+}
@@ -0,0 +1,159 @@
+// Read-cost model: calibration and move decisions on simulated devices
+//
+//   read_cost_bench [threshold-ms = 1] [files = 1000000]
+//
+//   1. checks the model on hand-made extent lists: runs that follow each
+//      other on disk cost the same as one run, every break costs more, a
+//      contiguous file costs the least
+//   2. calibrates against simulated HDD and SSD devices (the model itself,
+//      with a read-ahead window and +-5% noise per read) and checks that the
+//      fitted profile is close to the one the device was built from
+//   3. runs `files` synthetic files through the planner's decision on both
+//      profiles and reports how many moves pass the threshold and the read
+//      time they would save
+
+#include "read_cost.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+class SimulatedDevice : public ReadProbe {
+public:
+    SimulatedDevice(const DeviceProfile &profile, uint64_t sizeBytes, uint64_t seed)
+        : model(profile, sizeBytes, 1), sizeBytes(sizeBytes), rng(seed) {}
+
+    uint64_t SizeBytes() const override { return sizeBytes; }
+
+    bool Read(uint64_t offset, uint32_t bytes, double &seconds) override {
+        if (offset + bytes > sizeBytes) {
+            return false;
+        }
+        // Reads that start within 1 MB after the previous one come from the drive's read-ahead
+        bool readAhead = offset >= head && offset - head < (1 << 20);
+        seconds = model.PieceSeconds(bytes) + (readAhead ? 0 : model.Positioning(offset > head ? offset - head : head - offset));
+        seconds *= 0.95 + 0.1 * (double)(rng() % 1000) / 1000;
+        head = offset + bytes;
+        return true;
+    }
+
+private:
+    ReadCostModel model;
+    uint64_t sizeBytes;
+    uint64_t head = 0;
+    std::mt19937_64 rng;
+};
+
+static bool Near(double measured, double truth, double tolerance) {
+    return std::fabs(measured - truth) <= tolerance * std::max(truth, 1e-9);
+}
+
+static bool CheckModel() {
+    ReadCostModel hdd(DeviceProfile::Hdd7200(), 1ULL << 28, 4096);
+    ExtentRun one[] = {{0, 1000, 300}};
+    ExtentRun adjacent[] = {{0, 1000, 100}, {100, 1100, 200}};
+    ExtentRun split[] = {{0, 1000, 100}, {100, 5000, 200}};
+    ExtentRun splitFar[] = {{0, 1000, 100}, {100, 100000000, 200}};
+    ExtentRun sparse[] = {{0, 1000, 100}, {100, -1, 50}, {150, 1100, 200}};
+    double contiguous = hdd.ContiguousReadSeconds(300);
+    return hdd.FileReadSeconds(one, 1) == contiguous && hdd.FileReadSeconds(adjacent, 2) == contiguous &&
+           hdd.FileReadSeconds(sparse, 3) == contiguous && hdd.FileReadSeconds(split, 2) > contiguous &&
+           hdd.FileReadSeconds(splitFar, 2) > hdd.FileReadSeconds(split, 2);
+}
+
+static bool Calibrate(const DeviceProfile &truth) {
+    SimulatedDevice device(truth, 1ULL << 40, 3);
+    CalibrationOptions options;
+    DeviceProfile fitted;
+    CalibrationSamples samples;
+    if (!CalibrateProfile(device, options, fitted, &samples)) {
+        std::cerr << "calibration failed\n";
+        return false;
+    }
+    bool ok = fitted.rotational == truth.rotational && Near(fitted.bytesPerSecond, truth.bytesPerSecond, 0.1) &&
+              Near(fitted.requestSeconds, truth.requestSeconds, 0.3);
+    if (truth.rotational) {
+        ok = ok && Near(fitted.seekAvgSeconds, truth.seekAvgSeconds, 0.15) &&
+             std::fabs(fitted.seekMinSeconds - truth.seekMinSeconds) < 0.5e-3;
+    }
+    std::cout << "Calibrated " << truth.name << ": " << (fitted.rotational ? "rotational" : "solid state") << ", "
+              << fitted.bytesPerSecond / 1e6 << " MB/s (" << truth.bytesPerSecond / 1e6 << "), request "
+              << fitted.requestSeconds * 1e6 << " us (" << truth.requestSeconds * 1e6 << "), seek "
+              << fitted.seekMinSeconds * 1e3 << " / " << fitted.seekAvgSeconds * 1e3 << " ms ("
+              << truth.seekMinSeconds * 1e3 << " / " << truth.seekAvgSeconds * 1e3 << ")"
+              << (ok ? "" : "  OUT OF TOLERANCE") << "\n";
+    return ok;
+}
+
+// Files as in fragmentation_report_bench: mostly contiguous, some split in a few pieces, a few in many
+static void MakeFile(std::mt19937_64 &rng, uint64_t totalClusters, std::vector<ExtentRun> &runs) {
+    runs.clear();
+    unsigned kind = (unsigned)(rng() % 1000);
+    unsigned pieces = kind < 850 ? 1 : kind < 990 ? 2 + (unsigned)(rng() % 30) : 30 + (unsigned)(rng() % 1970);
+    int64_t vcn = 0;
+    int64_t lcn = (int64_t)(rng() % (totalClusters - 1000000));
+    for (unsigned p = 0; p < pieces; p++) {
+        int64_t count = 1 + (int64_t)(rng() % 256);
+        runs.push_back(ExtentRun{vcn, lcn, count});
+        vcn += count;
+        lcn += count + (rng() % 8 == 0 ? 0 : 1 + (int64_t)(rng() % 100000));
+    }
+}
+
+static void Decide(const DeviceProfile &profile, double thresholdSeconds, uint64_t files) {
+    const uint64_t totalClusters = (1ULL << 40) / 4096;
+    ReadCostModel model(profile, totalClusters, 4096);
+    std::mt19937_64 rng(42);
+    std::vector<ExtentRun> runs;
+    uint64_t fragmented = 0, moved = 0, clustersMoved = 0, clustersSkipped = 0;
+    double before = 0, after = 0, skippedSavings = 0;
+    auto started = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < files; i++) {
+        MakeFile(rng, totalClusters, runs);
+        uint64_t clusters = 0;
+        for (const ExtentRun &r : runs) {
+            clusters += (uint64_t)r.count;
+        }
+        double now = model.FileReadSeconds(runs.data(), runs.size());
+        double contiguous = model.ContiguousReadSeconds(clusters);
+        if (now == contiguous) {
+            continue;
+        }
+        fragmented++;
+        if (now - contiguous < thresholdSeconds) {
+            skippedSavings += now - contiguous;
+            clustersSkipped += clusters;
+            continue;
+        }
+        moved++;
+        clustersMoved += clusters;
+        before += now;
+        after += contiguous;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << profile.name << ": " << fragmented << " fragmented files, " << moved << " worth moving ("
+              << clustersMoved << " clusters), read time " << before << " s -> " << after << " s; "
+              << fragmented - moved << " skipped (" << clustersSkipped << " clusters, would save " << skippedSavings
+              << " s) [" << (uint64_t)((double)files / seconds) << " files/s]\n";
+}
+
+int main(int argc, char **argv) {
+    double thresholdMs = argc > 1 ? std::strtod(argv[1], nullptr) : 1;
+    uint64_t files = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+    if (thresholdMs < 0 || files == 0) {
+        std::cerr << "invalid arguments\n";
+        return 1;
+    }
+    if (!CheckModel()) {
+        std::cerr << "model check failed\n";
+        return 1;
+    }
+    std::cout << "Model checks: OK\n";
+    if (!Calibrate(DeviceProfile::Hdd7200()) || !Calibrate(DeviceProfile::Ssd())) {
+        return 1;
+    }
+    std::cout << "Threshold " << thresholdMs << " ms per file read:\n";
+    Decide(DeviceProfile::Hdd7200(), thresholdMs / 1e3, files);
+    Decide(DeviceProfile::Ssd(), thresholdMs / 1e3, files);
+    return 0;
+}
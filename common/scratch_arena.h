@@ -0,0 +1,120 @@
+#pragma once
+// Per-thread scratch buffers for ioctl output and extent staging
+//
+// FSCTL_GET_RETRIEVAL_POINTERS and FSCTL_GET_VOLUME_BITMAP are called in
+// loops, once per file or once per bitmap chunk. Instead of a fresh vector
+// per call, each thread keeps one output buffer and one extent list that are
+// reset between files but keep their capacity, so after the first few files
+// a scan allocates nothing here.
+//
+// The output buffer adapts: when a single file needs ERROR_MORE_DATA round
+// trips repeatedly, the buffer is doubled (up to MAX_IOCTL_BUFFER) and stays
+// that size, so later heavily fragmented files need fewer calls.
+//
+// Every (re)allocation made through the arena is counted, which makes the
+// allocations per file measurable.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+const uint32_t MIN_IOCTL_BUFFER = 16 * 1024;
+const uint32_t MAX_IOCTL_BUFFER = 4 * 1024 * 1024;
+
+// One run of clusters as returned by FSCTL_GET_RETRIEVAL_POINTERS
+struct ExtentRun {
+    int64_t vcn;
+    int64_t lcn;   // -1 for sparse / unallocated runs
+    int64_t count;
+};
+
+struct ArenaStats {
+    uint64_t files = 0;            // BeginFile calls
+    uint64_t allocations = 0;      // buffer and vector (re)allocations made through the arena
+    uint64_t ioctlCalls = 0;
+    uint64_t moreDataReplies = 0;  // calls answered with ERROR_MORE_DATA
+    uint64_t bufferGrowths = 0;
+
+    // Fold in the counts of another thread's arena
+    void Add(const ArenaStats &other) {
+        files += other.files;
+        allocations += other.allocations;
+        ioctlCalls += other.ioctlCalls;
+        moreDataReplies += other.moreDataReplies;
+        bufferGrowths += other.bufferGrowths;
+    }
+};
+
+class ScratchArena {
+public:
+    static ScratchArena &ForThread() {
+        thread_local ScratchArena arena;
+        return arena;
+    }
+
+    // Output buffer for the next ioctl. 8-byte aligned, contents undefined.
+    void *IoctlBuffer() { return output.data(); }
+    uint32_t IoctlBufferSize() const { return (uint32_t)(output.size() * sizeof(uint64_t)); }
+
+    // Reset the per-file state; capacity is kept
+    void BeginFile() {
+        stats.files++;
+        runs.clear();
+        BeginRequest();
+    }
+
+    // Start a new ioctl loop that is not about one file
+    void BeginRequest() { moreDataInRequest = 0; }
+
+    // Record one ioctl call and whether it returned ERROR_MORE_DATA. A loop
+    // that keeps needing more round trips doubles the buffer for the rest of
+    // the run.
+    void NoteIoctl(bool moreData) {
+        stats.ioctlCalls++;
+        if (!moreData) {
+            return;
+        }
+        stats.moreDataReplies++;
+        if (++moreDataInRequest >= 2 && IoctlBufferSize() < maxBufferSize) {
+            Resize(IoctlBufferSize() * 2);
+            stats.bufferGrowths++;
+        }
+    }
+
+    // push_back that counts reallocations
+    template <typename T>
+    void Push(std::vector<T> &v, const T &value) {
+        if (v.size() == v.capacity()) {
+            stats.allocations++;
+        }
+        v.push_back(value);
+    }
+
+    // reserve that counts reallocations
+    template <typename T>
+    void Reserve(std::vector<T> &v, size_t n) {
+        if (n > v.capacity()) {
+            stats.allocations++;
+            v.reserve(n);
+        }
+    }
+
+    std::vector<ExtentRun> runs; // extents of the current file
+    uint32_t maxBufferSize = MAX_IOCTL_BUFFER;
+    ArenaStats stats;
+
+private:
+    ScratchArena() {
+        Resize(MIN_IOCTL_BUFFER);
+        runs.reserve(256);
+        stats.allocations++;
+    }
+
+    void Resize(uint32_t bytes) {
+        output.resize((bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        stats.allocations++;
+    }
+
+    std::vector<uint64_t> output; // uint64_t for alignment of the LARGE_INTEGER fields
+    uint32_t moreDataInRequest = 0;
+};
@@ -0,0 +1,120 @@
+#pragma once
+// Simulated NTFS volume for benchmarks
+//
+// The allocation bitmap is not stored: every 64-cluster word is a pure
+// function of (seed, word index), so a volume of any size costs no memory
+// and any range can be produced in any order, by any thread. Words come in
+// three kinds, weighted by fillPercent: fully allocated, fully free, and
+// mixed (random bits), which gives both long runs and fragmented areas.
+//
+// SimulatedBitmapSource answers FSCTL_GET_VOLUME_BITMAP like the driver
+// does (starting LCN rounded down to 8, ERROR_MORE_DATA when the buffer is
+// full) after sleeping for a configurable per-call latency.
+
+#include "bitmap_fetch.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+class SimulatedVolume {
+public:
+    SimulatedVolume(uint64_t totalClusters, uint64_t seed, unsigned fillPercent = 60)
+        : totalClusters(totalClusters), seed(seed), fillPercent(fillPercent) {}
+
+    uint64_t TotalClusters() const { return totalClusters; }
+
+    // Allocation bits of clusters [64 * index, 64 * index + 64), bit 0 first.
+    // Bits past the end of the volume are 0.
+    uint64_t Word(uint64_t index) const {
+        uint64_t h = Mix(seed ^ (index * 0x9E3779B97F4A7C15ULL));
+        unsigned kind = (unsigned)(h % 100);
+        uint64_t w;
+        if (kind < fillPercent * 3 / 4) {
+            w = ~0ULL;
+        } else if (kind >= 100 - (100 - fillPercent) * 3 / 4) {
+            w = 0;
+        } else {
+            w = Mix(h);
+        }
+        uint64_t firstCluster = index * 64;
+        if (firstCluster + 64 > totalClusters) {
+            w = firstCluster >= totalClusters ? 0 : (w & ((1ULL << (totalClusters - firstCluster)) - 1));
+        }
+        return w;
+    }
+
+    bool IsAllocated(uint64_t lcn) const { return (Word(lcn / 64) >> (lcn % 64)) & 1; }
+
+    // Copy bitmap bytes [firstByte, firstByte + count) into out
+    void ReadBytes(uint64_t firstByte, uint8_t *out, size_t count) const {
+        while (count >= 8 && firstByte % 8 == 0) {
+            uint64_t word = Word(firstByte / 8);
+            for (size_t i = 0; i < 8; i++) {
+                out[i] = (uint8_t)(word >> (8 * i));
+            }
+            out += 8;
+            firstByte += 8;
+            count -= 8;
+        }
+        while (count > 0) {
+            uint64_t word = Word(firstByte / 8);
+            size_t offset = (size_t)(firstByte % 8);
+            size_t n = std::min<size_t>(8 - offset, count);
+            for (size_t i = 0; i < n; i++) {
+                out[i] = (uint8_t)(word >> (8 * (offset + i))); // little-endian, like the NTFS bitmap
+            }
+            out += n;
+            firstByte += n;
+            count -= n;
+        }
+    }
+
+private:
+    static uint64_t Mix(uint64_t x) { // splitmix64 finalizer
+        x ^= x >> 30;
+        x *= 0xBF58476D1CE4E5B9ULL;
+        x ^= x >> 27;
+        x *= 0x94D049BB133111EBULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    uint64_t totalClusters;
+    uint64_t seed;
+    unsigned fillPercent;
+};
+
+class SimulatedBitmapSource : public BitmapSource {
+public:
+    SimulatedBitmapSource(const SimulatedVolume &volume, std::chrono::microseconds latency)
+        : volume(volume), latency(latency) {}
+
+    IoStatus Read(int64_t startingLcn, void *out, uint32_t outSize, uint32_t &bytesReturned) override {
+        bytesReturned = 0;
+        if (latency.count() > 0) {
+            std::this_thread::sleep_for(latency);
+        }
+        if (startingLcn < 0 || outSize < sizeof(BitmapReplyHeader) ||
+            (uint64_t)startingLcn >= volume.TotalClusters()) {
+            return IoStatus::Failed; // ERROR_INVALID_PARAMETER
+        }
+        uint64_t start = (uint64_t)startingLcn & ~7ULL;
+        BitmapReplyHeader header;
+        header.startingLcn = (int64_t)start;
+        header.bitmapSize = (int64_t)(volume.TotalClusters() - start);
+
+        uint64_t neededBytes = (volume.TotalClusters() - start + 7) / 8;
+        uint64_t roomBytes = outSize - sizeof(BitmapReplyHeader);
+        uint64_t bytes = std::min(neededBytes, roomBytes);
+        std::memcpy(out, &header, sizeof(header));
+        volume.ReadBytes(start / 8, static_cast<uint8_t *>(out) + sizeof(header), (size_t)bytes);
+        bytesReturned = (uint32_t)(sizeof(header) + bytes);
+        return bytes < neededBytes ? IoStatus::MoreData : IoStatus::Success;
+    }
+
+private:
+    const SimulatedVolume &volume;
+    std::chrono::microseconds latency;
+};
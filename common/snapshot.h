@@ -0,0 +1,798 @@
+#pragma once
+// Persistent snapshot of the volume bitmap and the file -> extents map
+//
+// An analysis pass spends most of its time on FSCTL_GET_VOLUME_BITMAP and
+// one FSCTL_GET_RETRIEVAL_POINTERS per file. A snapshot keeps the result on
+// disk so the next run can start from it: the file is memory-mapped and used
+// in place, nothing is parsed up front beyond the header.
+//
+// Layout (little-endian, every section 8-byte aligned):
+//
+//   SnapshotHeader
+//   bitmap          (totalClusters + 7) / 8 bytes, as FSCTL_GET_VOLUME_BITMAP returns it
+//   file index      fileCount SnapshotFileRecord, sorted by path (ordinal)
+//   names           paths as UTF-16 code units, back to back, not terminated
+//   extents         per file, its runs encoded as varints (see EncodeRuns)
+//
+// Staleness: a snapshot names the volume it was taken on (serial number,
+// cluster count, cluster size) and when it was taken, and every file record
+// keeps the size and last write time its extents belong to. The caller
+// decides how old is too old (CheckVolume) and whether a file changed since
+// (IsUnchanged). It also keeps the position of the volume's change feed at
+// the time the scan started, so a later run can re-examine only what changed
+// since (see incremental.h).
+
+#include "change_feed.h"
+#include "scratch_arena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const char SNAPSHOT_MAGIC[8] = {'N', 'T', 'F', 'S', 'S', 'N', 'A', 'P'};
+const uint32_t SNAPSHOT_VERSION = 2; // 2: change feed position
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;     // sizeof(SnapshotHeader) when written
+    uint64_t volumeSerial;
+    uint64_t createdTicks;    // FILETIME ticks (100 ns since 1601, UTC)
+    uint64_t totalClusters;
+    uint32_t bytesPerCluster;
+    uint32_t reserved;
+    uint64_t bitmapOffset;
+    uint64_t bitmapBytes;
+    uint64_t fileCount;
+    uint64_t indexOffset;
+    uint64_t namesOffset;
+    uint64_t namesBytes;
+    uint64_t extentsOffset;
+    uint64_t extentsBytes;
+    uint32_t changeSourceKind; // ChangeSourceKind
+    uint32_t reserved2;
+    uint64_t changeSourceId;
+    uint64_t changePosition;
+};
+
+struct SnapshotFileRecord {
+    uint64_t nameOffset;      // in code units, into the names section
+    uint32_t nameLength;      // code units
+    uint32_t runCount;        // allocated and sparse runs
+    uint64_t extentsOffset;   // bytes, into the extents section
+    uint64_t clusterCount;    // allocated clusters
+    uint64_t size;            // file size the extents belong to
+    uint64_t lastWriteTicks;
+};
+
+// ---------------------------------------------------------------------------
+// Run encoding
+//
+// Each run is stored relative to the previous one, which makes the common
+// cases (a contiguous file, a file whose pieces are close together) a few
+// bytes:
+//
+//   varint((vcn - expectedVcn) << 1 | sparse)   expectedVcn = end of the previous run
+//   zigzag varint(lcn - previousLcnEnd)         only when not sparse
+//   varint(count)
+// ---------------------------------------------------------------------------
+namespace snapshot_detail {
+
+inline void PutVarint(std::vector<uint8_t> &out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+inline bool GetVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (unsigned shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false; // truncated or longer than 10 bytes
+}
+
+inline uint64_t ZigZag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+inline int64_t UnZigZag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+// wchar_t is 16 bits on Windows and 32 elsewhere; the file always holds UTF-16
+inline void AppendUtf16(std::vector<uint16_t> &out, const wchar_t *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t c = (uint32_t)s[i];
+        if (c > 0xFFFF) {
+            c -= 0x10000;
+            out.push_back((uint16_t)(0xD800 + (c >> 10)));
+            out.push_back((uint16_t)(0xDC00 + (c & 0x3FF)));
+        } else {
+            out.push_back((uint16_t)c);
+        }
+    }
+}
+
+inline int CompareUtf16(const uint16_t *a, size_t aLength, const uint16_t *b, size_t bLength) {
+    size_t n = std::min(aLength, bLength);
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return aLength < bLength ? -1 : (aLength > bLength ? 1 : 0);
+}
+
+// Inverse of AppendUtf16
+inline void AppendWide(std::wstring &out, const uint16_t *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t c = s[i];
+        if (sizeof(wchar_t) > 2 && c >= 0xD800 && c < 0xDC00 && i + 1 < n && s[i + 1] >= 0xDC00 && s[i + 1] < 0xE000) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (s[++i] - 0xDC00);
+        }
+        out.push_back((wchar_t)c);
+    }
+}
+
+inline uint64_t AlignUp(uint64_t v) { return (v + 7) & ~7ULL; }
+
+} // namespace snapshot_detail
+
+inline void EncodeRuns(const ExtentRun *runs, size_t count, std::vector<uint8_t> &out) {
+    using namespace snapshot_detail;
+    int64_t expectedVcn = 0;
+    int64_t previousLcnEnd = 0;
+    for (size_t i = 0; i < count; i++) {
+        const ExtentRun &r = runs[i];
+        bool sparse = r.lcn < 0;
+        PutVarint(out, ((uint64_t)(r.vcn - expectedVcn) << 1) | (sparse ? 1 : 0));
+        if (!sparse) {
+            PutVarint(out, ZigZag(r.lcn - previousLcnEnd));
+            previousLcnEnd = r.lcn + r.count;
+        }
+        PutVarint(out, (uint64_t)r.count);
+        expectedVcn = r.vcn + r.count;
+    }
+}
+
+// Decode runCount runs from [p, end). Returns false on malformed input.
+inline bool DecodeRuns(const uint8_t *p, const uint8_t *end, uint32_t runCount, std::vector<ExtentRun> &out) {
+    using namespace snapshot_detail;
+    out.clear();
+    int64_t expectedVcn = 0;
+    int64_t previousLcnEnd = 0;
+    for (uint32_t i = 0; i < runCount; i++) {
+        uint64_t head = 0;
+        uint64_t lcnDelta = 0;
+        uint64_t count = 0;
+        if (!GetVarint(p, end, head)) {
+            return false;
+        }
+        ExtentRun r;
+        r.vcn = expectedVcn + (int64_t)(head >> 1);
+        r.lcn = -1;
+        if (!(head & 1)) {
+            if (!GetVarint(p, end, lcnDelta)) {
+                return false;
+            }
+            r.lcn = previousLcnEnd + UnZigZag(lcnDelta);
+        }
+        if (!GetVarint(p, end, count)) {
+            return false;
+        }
+        r.count = (int64_t)count;
+        if (r.lcn >= 0) {
+            previousLcnEnd = r.lcn + r.count;
+        }
+        expectedVcn = r.vcn + r.count;
+        out.push_back(r);
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Writing
+// ---------------------------------------------------------------------------
+namespace snapshot_detail {
+
+// Write n bytes at the current position, then zero-pad up to padTo
+inline bool Put(FILE *f, uint64_t &at, const void *data, size_t n, uint64_t padTo) {
+    static const uint8_t zeros[8] = {};
+    if (n > 0 && std::fwrite(data, 1, n, f) != n) {
+        return false;
+    }
+    at += n;
+    while (at < padTo) {
+        size_t pad = (size_t)std::min<uint64_t>(padTo - at, sizeof(zeros));
+        if (std::fwrite(zeros, 1, pad, f) != pad) {
+            return false;
+        }
+        at += pad;
+    }
+    return true;
+}
+
+#ifdef _WIN32
+inline FILE *OpenForWrite(const std::wstring &path) { return _wfopen(path.c_str(), L"wb"); }
+inline FILE *OpenForUpdate(const std::wstring &path) { return _wfopen(path.c_str(), L"w+b"); }
+inline void RemoveFile(const std::wstring &path) { DeleteFileW(path.c_str()); }
+inline bool MoveIntoPlace(const std::wstring &from, const std::wstring &to) {
+    return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+inline bool Seek(FILE *f, uint64_t offset) { return _fseeki64(f, (long long)offset, SEEK_SET) == 0; }
+#else
+inline std::string Narrow(const std::wstring &path) { return std::string(path.begin(), path.end()); }
+inline FILE *OpenForWrite(const std::wstring &path) { return std::fopen(Narrow(path).c_str(), "wb"); }
+inline FILE *OpenForUpdate(const std::wstring &path) { return std::fopen(Narrow(path).c_str(), "w+b"); }
+inline void RemoveFile(const std::wstring &path) { std::remove(Narrow(path).c_str()); }
+inline bool MoveIntoPlace(const std::wstring &from, const std::wstring &to) {
+    return std::rename(Narrow(from).c_str(), Narrow(to).c_str()) == 0;
+}
+inline bool Seek(FILE *f, uint64_t offset) { return fseeko(f, (off_t)offset, SEEK_SET) == 0; }
+#endif
+
+// Header of a snapshot with these section sizes, sections laid out in order
+inline SnapshotHeader LayoutHeader(uint64_t volumeSerial, uint64_t totalClusters, uint32_t bytesPerCluster,
+                                   uint64_t fileCount, uint64_t namesBytes, uint64_t extentsBytes) {
+    SnapshotHeader h = {};
+    std::memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.headerBytes = sizeof(SnapshotHeader);
+    h.volumeSerial = volumeSerial;
+    h.totalClusters = totalClusters;
+    h.bytesPerCluster = bytesPerCluster;
+    h.bitmapOffset = AlignUp(sizeof(SnapshotHeader));
+    h.bitmapBytes = (totalClusters + 7) / 8;
+    h.fileCount = fileCount;
+    h.indexOffset = AlignUp(h.bitmapOffset + h.bitmapBytes);
+    h.namesOffset = AlignUp(h.indexOffset + h.fileCount * sizeof(SnapshotFileRecord));
+    h.namesBytes = namesBytes;
+    h.extentsOffset = AlignUp(h.namesOffset + h.namesBytes);
+    h.extentsBytes = extentsBytes;
+    return h;
+}
+
+} // namespace snapshot_detail
+
+class SnapshotReader;
+
+class SnapshotWriter {
+public:
+    SnapshotWriter(uint64_t volumeSerial, uint64_t totalClusters, uint32_t bytesPerCluster)
+        : volumeSerial(volumeSerial), totalClusters(totalClusters), bytesPerCluster(bytesPerCluster) {}
+
+    void AddFile(const wchar_t *path, size_t pathLength, uint64_t size, uint64_t lastWriteTicks,
+                 const ExtentRun *runs, size_t runCount) {
+        SnapshotFileRecord rec = {};
+        rec.nameOffset = names.size();
+        snapshot_detail::AppendUtf16(names, path, pathLength);
+        rec.nameLength = (uint32_t)(names.size() - rec.nameOffset);
+        rec.runCount = (uint32_t)runCount;
+        rec.extentsOffset = extents.size();
+        for (size_t i = 0; i < runCount; i++) {
+            if (runs[i].lcn >= 0) {
+                rec.clusterCount += (uint64_t)runs[i].count;
+            }
+        }
+        rec.size = size;
+        rec.lastWriteTicks = lastWriteTicks;
+        EncodeRuns(runs, runCount, extents);
+        records.push_back(rec);
+    }
+
+    // Copy a record of another snapshot unchanged
+    void CopyFile(const SnapshotReader &from, const SnapshotFileRecord &r);
+
+    // Changes after this position are not reflected in the snapshot
+    void SetChangePosition(const ChangePosition &p) { changePosition = p; }
+
+    size_t FileCount() const { return records.size(); }
+
+    // Write the snapshot to path (through path + ".tmp", so a reader never
+    // sees a half-written file). bitmap holds (totalClusters + 7) / 8 bytes.
+    bool Write(const std::wstring &path, const uint8_t *bitmap, uint64_t createdTicks) {
+        using namespace snapshot_detail;
+        // The index is sorted by path; names and extents stay in insertion order
+        std::vector<size_t> order(records.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            const SnapshotFileRecord &ra = records[a];
+            const SnapshotFileRecord &rb = records[b];
+            return snapshot_detail::CompareUtf16(names.data() + ra.nameOffset, ra.nameLength,
+                                                 names.data() + rb.nameOffset, rb.nameLength) < 0;
+        });
+
+        SnapshotHeader h = LayoutHeader(volumeSerial, totalClusters, bytesPerCluster, records.size(),
+                                        names.size() * sizeof(uint16_t), extents.size());
+        h.createdTicks = createdTicks;
+        h.changeSourceKind = (uint32_t)changePosition.kind;
+        h.changeSourceId = changePosition.id;
+        h.changePosition = changePosition.position;
+
+        std::wstring tempPath = path + L".tmp";
+        FILE *f = OpenForWrite(tempPath);
+        if (!f) {
+            return false;
+        }
+        uint64_t at = 0;
+        bool ok = Put(f, at, &h, sizeof(h), h.bitmapOffset) &&
+                  Put(f, at, bitmap, (size_t)h.bitmapBytes, h.indexOffset);
+        for (size_t i = 0; ok && i < order.size(); i++) {
+            ok = Put(f, at, &records[order[i]], sizeof(SnapshotFileRecord), at + sizeof(SnapshotFileRecord));
+        }
+        ok = ok && Put(f, at, nullptr, 0, h.namesOffset) &&
+             Put(f, at, names.data(), (size_t)h.namesBytes, h.extentsOffset) &&
+             Put(f, at, extents.data(), extents.size(), h.extentsOffset + h.extentsBytes);
+        ok = (std::fclose(f) == 0) && ok;
+        if (!ok) {
+            RemoveFile(tempPath);
+            return false;
+        }
+        return MoveIntoPlace(tempPath, path);
+    }
+
+private:
+    uint64_t volumeSerial;
+    uint64_t totalClusters;
+    uint32_t bytesPerCluster;
+    ChangePosition changePosition;
+    std::vector<SnapshotFileRecord> records;
+    std::vector<uint16_t> names;
+    std::vector<uint8_t> extents;
+    std::vector<ExtentRun> copyRuns; // CopyFile's scratch
+};
+
+// Writes a snapshot without holding it in memory, for producers that make
+// files in path order and the bitmap piece by piece (the volume generator).
+// Bitmap pieces go straight to their place in path + ".tmp"; index, names
+// and extents are spooled to temporary files next to it and copied after
+// the bitmap by Finish, once their sizes are known.
+class SnapshotStreamWriter {
+public:
+    SnapshotStreamWriter() {}
+    SnapshotStreamWriter(const SnapshotStreamWriter &) = delete;
+    SnapshotStreamWriter &operator=(const SnapshotStreamWriter &) = delete;
+    ~SnapshotStreamWriter() { Abandon(); }
+
+    bool Open(const std::wstring &snapshotPath, uint64_t serial, uint64_t clusters, uint32_t clusterBytes) {
+        using namespace snapshot_detail;
+        Abandon();
+        path = snapshotPath;
+        volumeSerial = serial;
+        totalClusters = clusters;
+        bytesPerCluster = clusterBytes;
+        fileCount = namesUnits = extentsBytes = 0;
+        lastName.clear();
+        main = OpenForWrite(path + L".tmp");
+        for (int i = 0; i < SPOOLS; i++) {
+            spools[i] = OpenForUpdate(SpoolPath(i));
+        }
+        failed = !main || !spools[INDEX] || !spools[NAMES] || !spools[EXTENTS];
+        return !failed;
+    }
+
+    // Bitmap bytes [firstByte, firstByte + n). Any thread, any order; every
+    // byte must be written once before Finish.
+    bool WriteBitmap(uint64_t firstByte, const uint8_t *bytes, size_t n) {
+        std::lock_guard<std::mutex> lock(mainMutex);
+        bool ok = snapshot_detail::Seek(main, snapshot_detail::AlignUp(sizeof(SnapshotHeader)) + firstByte) &&
+                  std::fwrite(bytes, 1, n, main) == n;
+        failed = failed || !ok;
+        return ok;
+    }
+
+    // One thread only, files in ascending path order (ordinal, as the index is searched)
+    bool AddFile(const wchar_t *filePath, size_t pathLength, uint64_t size, uint64_t lastWriteTicks,
+                 const ExtentRun *runs, size_t runCount) {
+        using namespace snapshot_detail;
+        name.clear();
+        AppendUtf16(name, filePath, pathLength);
+        if (fileCount > 0 && CompareUtf16(lastName.data(), lastName.size(), name.data(), name.size()) >= 0) {
+            failed = true; // out of order: the index could not be searched
+            return false;
+        }
+        lastName.swap(name);
+        SnapshotFileRecord rec = {};
+        rec.nameOffset = namesUnits;
+        rec.nameLength = (uint32_t)lastName.size();
+        rec.runCount = (uint32_t)runCount;
+        rec.extentsOffset = extentsBytes;
+        for (size_t i = 0; i < runCount; i++) {
+            if (runs[i].lcn >= 0) {
+                rec.clusterCount += (uint64_t)runs[i].count;
+            }
+        }
+        rec.size = size;
+        rec.lastWriteTicks = lastWriteTicks;
+        encoded.clear();
+        EncodeRuns(runs, runCount, encoded);
+        bool ok = std::fwrite(&rec, sizeof(rec), 1, spools[INDEX]) == 1 &&
+                  std::fwrite(lastName.data(), sizeof(uint16_t), lastName.size(), spools[NAMES]) == lastName.size() &&
+                  std::fwrite(encoded.data(), 1, encoded.size(), spools[EXTENTS]) == encoded.size();
+        fileCount++;
+        namesUnits += lastName.size();
+        extentsBytes += encoded.size();
+        failed = failed || !ok;
+        return ok;
+    }
+
+    uint64_t FileCount() const { return fileCount; }
+
+    // Write the header and the spooled sections, then replace path
+    bool Finish(uint64_t createdTicks) {
+        using namespace snapshot_detail;
+        if (!main) {
+            return false;
+        }
+        SnapshotHeader h = LayoutHeader(volumeSerial, totalClusters, bytesPerCluster, fileCount,
+                                        namesUnits * sizeof(uint16_t), extentsBytes);
+        h.createdTicks = createdTicks;
+        uint64_t at = h.bitmapOffset + h.bitmapBytes;
+        bool ok = !failed && Seek(main, at) && Put(main, at, nullptr, 0, h.indexOffset) &&
+                  Append(spools[INDEX], at, h.namesOffset) && Append(spools[NAMES], at, h.extentsOffset) &&
+                  Append(spools[EXTENTS], at, h.extentsOffset + h.extentsBytes) && Seek(main, 0) &&
+                  std::fwrite(&h, sizeof(h), 1, main) == 1;
+        ok = (std::fclose(main) == 0) && ok;
+        main = nullptr;
+        CloseSpools();
+        if (!ok) {
+            RemoveFile(path + L".tmp");
+            return false;
+        }
+        return MoveIntoPlace(path + L".tmp", path);
+    }
+
+private:
+    enum { INDEX, NAMES, EXTENTS, SPOOLS };
+
+    std::wstring SpoolPath(int i) const {
+        static const wchar_t *const suffix[SPOOLS] = {L".index.tmp", L".names.tmp", L".extents.tmp"};
+        return path + suffix[i];
+    }
+
+    // Copy a spool to the end of the main file, then pad up to padTo
+    bool Append(FILE *spool, uint64_t &at, uint64_t padTo) {
+        if (std::fflush(spool) != 0 || !snapshot_detail::Seek(spool, 0)) {
+            return false;
+        }
+        std::vector<uint8_t> chunk(1 << 20);
+        size_t n;
+        while ((n = std::fread(chunk.data(), 1, chunk.size(), spool)) > 0) {
+            if (!snapshot_detail::Put(main, at, chunk.data(), n, 0)) {
+                return false;
+            }
+        }
+        return !std::ferror(spool) && snapshot_detail::Put(main, at, nullptr, 0, padTo);
+    }
+
+    void CloseSpools() {
+        for (int i = 0; i < SPOOLS; i++) {
+            if (spools[i]) {
+                std::fclose(spools[i]);
+                spools[i] = nullptr;
+                snapshot_detail::RemoveFile(SpoolPath(i));
+            }
+        }
+    }
+
+    // Drop a snapshot that was opened and not finished
+    void Abandon() {
+        if (main) {
+            std::fclose(main);
+            main = nullptr;
+            snapshot_detail::RemoveFile(path + L".tmp");
+        }
+        CloseSpools();
+    }
+
+    std::wstring path;
+    uint64_t volumeSerial = 0;
+    uint64_t totalClusters = 0;
+    uint32_t bytesPerCluster = 0;
+    FILE *main = nullptr;
+    FILE *spools[SPOOLS] = {};
+    std::mutex mainMutex;
+    bool failed = false;
+    uint64_t fileCount = 0;
+    uint64_t namesUnits = 0;
+    uint64_t extentsBytes = 0;
+    std::vector<uint16_t> name;
+    std::vector<uint16_t> lastName;
+    std::vector<uint8_t> encoded;
+};
+
+// ---------------------------------------------------------------------------
+// Reading
+// ---------------------------------------------------------------------------
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile() { Close(); }
+
+    bool Open(const std::wstring &path) {
+        Close();
+#ifdef _WIN32
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            CloseHandle(file);
+            return false;
+        }
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(file); // the mapping keeps the file open
+        if (!mapping) {
+            return false;
+        }
+        data = static_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!data) {
+            Close();
+            return false;
+        }
+        size = (uint64_t)fileSize.QuadPart;
+#else
+        int fd = ::open(std::string(path.begin(), path.end()).c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd); // the mapping keeps the file open
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<const uint8_t *>(p);
+        size = (uint64_t)st.st_size;
+#endif
+        return true;
+    }
+
+    void Close() {
+#ifdef _WIN32
+        if (data) {
+            UnmapViewOfFile(data);
+        }
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        mapping = NULL;
+#else
+        if (data) {
+            munmap(const_cast<uint8_t *>(data), (size_t)size);
+        }
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+    const uint8_t *Data() const { return data; }
+    uint64_t Size() const { return size; }
+
+private:
+#ifdef _WIN32
+    HANDLE mapping = NULL;
+#endif
+    const uint8_t *data = nullptr;
+    uint64_t size = 0;
+};
+
+enum class SnapshotStatus {
+    Ok,
+    CannotOpen,
+    NotASnapshot,   // bad magic
+    WrongVersion,
+    Corrupt         // sections out of bounds
+};
+
+enum class SnapshotFreshness {
+    Fresh,
+    OtherVolume,    // serial, cluster count or cluster size differ
+    TooOld
+};
+
+class SnapshotReader {
+public:
+    // Map the file and check the header and section bounds. Nothing else is
+    // read until it is asked for.
+    SnapshotStatus Open(const std::wstring &path) {
+        if (!file.Open(path)) {
+            return SnapshotStatus::CannotOpen;
+        }
+        const uint8_t *base = file.Data();
+        uint64_t size = file.Size();
+        if (size < sizeof(SnapshotHeader) || std::memcmp(base, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+            file.Close();
+            return SnapshotStatus::NotASnapshot;
+        }
+        header = reinterpret_cast<const SnapshotHeader *>(base);
+        if (header->version != SNAPSHOT_VERSION || header->headerBytes != sizeof(SnapshotHeader)) {
+            file.Close();
+            return SnapshotStatus::WrongVersion;
+        }
+        const SnapshotHeader &h = *header;
+        if (!Within(h.bitmapOffset, h.bitmapBytes, size) || h.bitmapBytes != (h.totalClusters + 7) / 8 ||
+            h.fileCount > size / sizeof(SnapshotFileRecord) ||
+            !Within(h.indexOffset, h.fileCount * sizeof(SnapshotFileRecord), size) ||
+            !Within(h.namesOffset, h.namesBytes, size) || !Within(h.extentsOffset, h.extentsBytes, size) ||
+            h.indexOffset % 8 != 0 || h.namesOffset % 2 != 0) {
+            file.Close();
+            return SnapshotStatus::Corrupt;
+        }
+        index = reinterpret_cast<const SnapshotFileRecord *>(base + h.indexOffset);
+        names = reinterpret_cast<const uint16_t *>(base + h.namesOffset);
+        extents = base + h.extentsOffset;
+        return SnapshotStatus::Ok;
+    }
+
+    // Unmap the file (it cannot be replaced on Windows while it is mapped)
+    void Close() {
+        file.Close();
+        header = nullptr;
+        index = nullptr;
+        names = nullptr;
+        extents = nullptr;
+    }
+
+    const SnapshotHeader &Header() const { return *header; }
+
+    // The bitmap as stored, (totalClusters + 7) / 8 bytes, valid while the reader lives
+    const uint8_t *Bitmap() const { return file.Data() + header->bitmapOffset; }
+
+    SnapshotFreshness CheckVolume(uint64_t volumeSerial, uint64_t totalClusters, uint32_t bytesPerCluster,
+                                  uint64_t nowTicks, uint64_t maxAgeTicks) const {
+        if (header->volumeSerial != volumeSerial || header->totalClusters != totalClusters ||
+            header->bytesPerCluster != bytesPerCluster) {
+            return SnapshotFreshness::OtherVolume;
+        }
+        if (nowTicks < header->createdTicks || nowTicks - header->createdTicks > maxAgeTicks) {
+            return SnapshotFreshness::TooOld; // also when the clock went backwards
+        }
+        return SnapshotFreshness::Fresh;
+    }
+
+    ChangePosition ChangeFeedPosition() const {
+        ChangePosition p;
+        p.kind = (ChangeSourceKind)header->changeSourceKind;
+        p.id = header->changeSourceId;
+        p.position = header->changePosition;
+        return p;
+    }
+
+    uint64_t FileCount() const { return header->fileCount; }
+    const SnapshotFileRecord &FileAt(uint64_t i) const { return index[i]; }
+
+    // Binary search of the index. Returns nullptr when the path is not in the snapshot.
+    const SnapshotFileRecord *Find(const wchar_t *path, size_t pathLength) {
+        key.clear();
+        snapshot_detail::AppendUtf16(key, path, pathLength);
+        return FindUtf16(key.data(), key.size());
+    }
+
+    // Index of the first record whose path is not less than path. The
+    // records of the files below a directory "dir\" are the ones from
+    // LowerBound("dir\") on that still start with it.
+    uint64_t LowerBound(const wchar_t *path, size_t pathLength) {
+        key.clear();
+        snapshot_detail::AppendUtf16(key, path, pathLength);
+        return LowerBoundUtf16(key.data(), key.size());
+    }
+
+    // Find / LowerBound with a UTF-16 key the caller owns. These do not
+    // touch the reader's own key, so any number of threads may call them
+    // on one reader.
+    const SnapshotFileRecord *FindUtf16(const uint16_t *path, size_t pathLength) const {
+        uint64_t i = LowerBoundUtf16(path, pathLength);
+        if (i < header->fileCount &&
+            snapshot_detail::CompareUtf16(NameOf(index[i]), NameLengthOf(index[i]), path, pathLength) == 0) {
+            return &index[i];
+        }
+        return nullptr;
+    }
+
+    uint64_t LowerBoundUtf16(const uint16_t *path, size_t pathLength) const {
+        uint64_t lo = 0;
+        uint64_t hi = header->fileCount;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            const SnapshotFileRecord &r = index[mid];
+            if (snapshot_detail::CompareUtf16(NameOf(r), NameLengthOf(r), path, pathLength) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // Whether the record's path starts with the key of the last Find / LowerBound
+    bool HasLastKeyAsPrefix(const SnapshotFileRecord &r) const {
+        return NameLengthOf(r) >= key.size() && std::equal(key.begin(), key.end(), NameOf(r));
+    }
+
+    // The record's path as UTF-16 code units, NameLengthOf(r) of them (0 if out of bounds)
+    const uint16_t *NameOf(const SnapshotFileRecord &r) const { return NameInBounds(r) ? names + r.nameOffset : names; }
+    uint32_t NameLengthOf(const SnapshotFileRecord &r) const { return NameInBounds(r) ? r.nameLength : 0; }
+
+    // Whether the file still has the size and last write time its extents were recorded with
+    static bool IsUnchanged(const SnapshotFileRecord &r, uint64_t size, uint64_t lastWriteTicks) {
+        return r.size == size && r.lastWriteTicks == lastWriteTicks;
+    }
+
+    // One allocated run (or none) is a contiguous file
+    static bool IsContiguous(const SnapshotFileRecord &r) { return r.runCount <= 1; }
+
+    bool DecodeExtents(const SnapshotFileRecord &r, std::vector<ExtentRun> &out) const {
+        if (r.extentsOffset > header->extentsBytes) {
+            return false;
+        }
+        return DecodeRuns(extents + r.extentsOffset, extents + header->extentsBytes, r.runCount, out);
+    }
+
+    std::wstring PathOf(const SnapshotFileRecord &r) const {
+        std::wstring path;
+        if (NameInBounds(r)) {
+            snapshot_detail::AppendWide(path, names + r.nameOffset, r.nameLength);
+        }
+        return path;
+    }
+
+private:
+    static bool Within(uint64_t offset, uint64_t bytes, uint64_t size) {
+        return offset <= size && bytes <= size - offset;
+    }
+
+    bool NameInBounds(const SnapshotFileRecord &r) const {
+        uint64_t units = header->namesBytes / sizeof(uint16_t);
+        return r.nameOffset <= units && r.nameLength <= units - r.nameOffset;
+    }
+
+    MappedFile file;
+    const SnapshotHeader *header = nullptr;
+    const SnapshotFileRecord *index = nullptr;
+    const uint16_t *names = nullptr;
+    const uint8_t *extents = nullptr;
+    std::vector<uint16_t> key; // Find's search key, reused
+};
+
+inline void SnapshotWriter::CopyFile(const SnapshotReader &from, const SnapshotFileRecord &r) {
+    SnapshotFileRecord rec = r;
+    rec.nameOffset = names.size();
+    const uint16_t *name = from.NameOf(r);
+    rec.nameLength = from.NameLengthOf(r);
+    names.insert(names.end(), name, name + rec.nameLength);
+    rec.extentsOffset = extents.size();
+    if (!from.DecodeExtents(r, copyRuns)) {
+        copyRuns.clear();
+        rec.runCount = 0;
+        rec.clusterCount = 0;
+    }
+    EncodeRuns(copyRuns.data(), copyRuns.size(), extents);
+    records.push_back(rec);
+}
@@ -0,0 +1,159 @@
+// Snapshot write / load benchmark on a simulated volume
+//
+//   snapshot_bench <snapshot-file> [files = 1000000] [terabytes = 4]
+//
+// Builds a file -> extents map with a seeded mix of contiguous and
+// fragmented files (4 KB clusters), writes it together with the simulated
+// volume's bitmap, maps the snapshot back and looks up and decodes every
+// file, checking each against what was written. Reports the load time
+// (mapping + header checks), the lookup rate and the bytes spent per run.
+
+#include "simulated_volume.h"
+#include "snapshot.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+struct SyntheticFile {
+    std::wstring path;
+    uint64_t size;
+    uint64_t lastWriteTicks;
+    std::vector<ExtentRun> runs;
+};
+
+static void MakeFiles(uint64_t count, uint64_t totalClusters, std::vector<SyntheticFile> &files) {
+    std::mt19937_64 rng(0x5EED);
+    files.resize((size_t)count);
+    for (uint64_t i = 0; i < count; i++) {
+        SyntheticFile &f = files[(size_t)i];
+        f.path = L"\\dir" + std::to_wstring(i / 1000) + L"\\file" + std::to_wstring(i) + L".dat";
+        f.lastWriteTicks = 133000000000000000ULL + rng() % 10000000000000ULL;
+        unsigned pieces = (rng() % 100 < 70) ? 1 : 2 + (unsigned)(rng() % 40);
+        int64_t vcn = 0;
+        int64_t lcn = (int64_t)(rng() % (totalClusters - 100000));
+        for (unsigned p = 0; p < pieces; p++) {
+            int64_t count = 1 + (int64_t)(rng() % 64);
+            if (p > 0 && rng() % 10 == 0) {
+                f.runs.push_back(ExtentRun{vcn, -1, count}); // sparse
+                vcn += count;
+                continue;
+            }
+            f.runs.push_back(ExtentRun{vcn, lcn, count});
+            vcn += count;
+            // Most pieces land nearby, some anywhere on the volume
+            lcn = (rng() % 4 == 0) ? (int64_t)(rng() % (totalClusters - 100000))
+                                   : lcn + count + (int64_t)(rng() % 2048);
+        }
+        f.size = (uint64_t)vcn * 4096 - rng() % 4096;
+    }
+}
+
+static bool SameRuns(const std::vector<ExtentRun> &a, const std::vector<ExtentRun> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].vcn != b[i].vcn || a[i].lcn != b[i].lcn || a[i].count != b[i].count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: snapshot_bench <snapshot-file> [files] [terabytes]\n";
+        return 1;
+    }
+    std::string narrowPath = argv[1];
+    std::wstring path(narrowPath.begin(), narrowPath.end());
+    uint64_t fileCount = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+    uint64_t terabytes = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 4;
+    if (fileCount == 0 || terabytes == 0) {
+        std::cerr << "files and terabytes must be positive\n";
+        return 1;
+    }
+    uint64_t totalClusters = (terabytes << 40) / 4096;
+    const uint64_t serial = 0x1234ABCD5678EF00ULL;
+    const uint64_t created = 133500000000000000ULL;
+
+    SimulatedVolume volume(totalClusters, 0x5A4F);
+    std::vector<uint8_t> bitmap((size_t)((totalClusters + 7) / 8));
+    volume.ReadBytes(0, bitmap.data(), bitmap.size());
+
+    std::vector<SyntheticFile> files;
+    MakeFiles(fileCount, totalClusters, files);
+    uint64_t runCount = 0;
+    for (const SyntheticFile &f : files) {
+        runCount += f.runs.size();
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    SnapshotWriter writer(serial, totalClusters, 4096);
+    for (const SyntheticFile &f : files) {
+        writer.AddFile(f.path.data(), f.path.size(), f.size, f.lastWriteTicks, f.runs.data(), f.runs.size());
+    }
+    if (!writer.Write(path, bitmap.data(), created)) {
+        std::cerr << "cannot write " << narrowPath << "\n";
+        return 1;
+    }
+    double writeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    started = std::chrono::steady_clock::now();
+    SnapshotReader reader;
+    SnapshotStatus status = reader.Open(path);
+    double openMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    if (status != SnapshotStatus::Ok) {
+        std::cerr << "cannot load the snapshot (status " << (int)status << ")\n";
+        return 1;
+    }
+    const SnapshotHeader &h = reader.Header();
+
+    // Staleness checks
+    const uint64_t hour = 36000000000ULL;
+    bool staleOk = reader.CheckVolume(serial, totalClusters, 4096, created + hour, 2 * hour) == SnapshotFreshness::Fresh &&
+                   reader.CheckVolume(serial, totalClusters, 4096, created + 3 * hour, 2 * hour) == SnapshotFreshness::TooOld &&
+                   reader.CheckVolume(serial + 1, totalClusters, 4096, created, 2 * hour) == SnapshotFreshness::OtherVolume;
+    if (!staleOk) {
+        std::cerr << "staleness checks failed\n";
+        return 1;
+    }
+
+    // Every file, looked up in a shuffled order
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(7));
+    std::vector<ExtentRun> decoded;
+    uint64_t mismatches = 0;
+    started = std::chrono::steady_clock::now();
+    for (size_t i : order) {
+        const SyntheticFile &f = files[i];
+        const SnapshotFileRecord *r = reader.Find(f.path.data(), f.path.size());
+        if (!r || !SnapshotReader::IsUnchanged(*r, f.size, f.lastWriteTicks) || !reader.DecodeExtents(*r, decoded) ||
+            !SameRuns(decoded, f.runs)) {
+            mismatches++;
+        }
+    }
+    double lookupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    bool bitmapOk = std::memcmp(reader.Bitmap(), bitmap.data(), bitmap.size()) == 0;
+    std::wstring missing = L"\\not\\there.dat";
+    bool missOk = reader.Find(missing.data(), missing.size()) == nullptr;
+
+    std::cout << "Files: " << fileCount << ", runs: " << runCount << ", volume: " << terabytes << " TB ("
+              << totalClusters << " clusters)\n";
+    std::cout << "Snapshot: " << (h.extentsOffset + h.extentsBytes) / (1024 * 1024) << " MB (bitmap "
+              << h.bitmapBytes / (1024 * 1024) << " MB, index " << h.fileCount * sizeof(SnapshotFileRecord) / (1024 * 1024)
+              << " MB, names " << h.namesBytes / (1024 * 1024) << " MB, extents " << h.extentsBytes / 1024 << " KB = "
+              << (double)h.extentsBytes / (double)runCount << " bytes per run)\n";
+    std::cout << "Write: " << writeSeconds << " s\n";
+    std::cout << "Load (map + header checks): " << openMs << " ms\n";
+    std::cout << "Lookup + decode of every file: " << lookupSeconds << " s ("
+              << (double)fileCount / lookupSeconds / 1e6 << " M files/s)\n";
+    std::cout << "Check: " << mismatches << " mismatched files, bitmap " << (bitmapOk ? "identical" : "DIFFERS")
+              << ", unknown path " << (missOk ? "not found" : "FOUND") << "\n";
+    return (mismatches == 0 && bitmapOk && missOk) ? 0 : 1;
+}
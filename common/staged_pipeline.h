@@ -0,0 +1,293 @@
+#pragma once
+// Running a per-file job as stages that overlap
+//
+// A pass over a volume does four things per file: finds it (directory
+// enumeration), reads its extents (FSCTL_GET_RETRIEVAL_POINTERS), plans
+// where it goes (CPU and the bitmap) and moves it (FSCTL_MOVE_FILE). Done
+// one file at a time, the disk waits while the CPU plans and the CPU waits
+// while the disk moves. StagedPipeline runs every step on a thread of its
+// own and connects neighbours with a StageQueue of fixed capacity. A stage
+// blocks when the next one falls behind, so no more files are in flight
+// than the queues hold, and all stages work at the same time. The pass then
+// takes as long as its slowest stage instead of the sum of all of them.
+//
+// One thread per stage keeps each stage's items in order and its state
+// private: a stage that owns a resource (the bitmap, the snapshot writer)
+// is its only user. A stage that stops early cancels its input queue, so
+// the stages before it stop too instead of blocking forever.
+//
+// Every stage records where its time goes: working (busy), waiting for
+// input (starved) and waiting for room downstream (blocked). Every queue
+// records its depth. The stage with the highest busy share is the
+// bottleneck; the queues in front of it run full and the ones behind it
+// empty. The counters are relaxed atomics, so a status line can read them
+// while the pipeline runs, and the clock is only read when a stage waits.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Where a stage's time went, updated while it runs
+struct StageCounters {
+    std::atomic<uint64_t> items{0};     // items the stage finished
+    std::atomic<uint64_t> starvedNs{0}; // waiting for input
+    std::atomic<uint64_t> blockedNs{0}; // waiting for room in the next queue
+    std::atomic<uint64_t> elapsedNs{0}; // from the start of the pipeline to the stage's end, once it ended
+};
+
+// Depth of a queue, updated while it is used
+struct QueueCounters {
+    size_t capacity = 0;
+    std::atomic<uint64_t> depth{0};
+    std::atomic<uint64_t> maxDepth{0};
+    std::atomic<uint64_t> pushes{0};
+    std::atomic<uint64_t> depthSum{0}; // depth seen by each push, itself included
+    std::atomic<uint64_t> fullPushes{0}; // pushes that found the queue full
+};
+
+struct StageReport {
+    std::string name;
+    uint64_t items = 0;
+    double busySeconds = 0;
+    double starvedSeconds = 0;
+    double blockedSeconds = 0;
+    double utilization = 0; // busy share of the whole pipeline's time
+};
+
+struct QueueReport {
+    std::string name;
+    size_t capacity = 0;
+    uint64_t maxDepth = 0;
+    double meanDepth = 0;   // as seen by an arriving item
+    double fullShare = 0;   // share of pushes that had to wait
+};
+
+namespace staged_pipeline_detail {
+
+inline uint64_t NowNs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+inline void RaiseTo(std::atomic<uint64_t> &value, uint64_t candidate) {
+    uint64_t seen = value.load(std::memory_order_relaxed);
+    while (candidate > seen && !value.compare_exchange_weak(seen, candidate, std::memory_order_relaxed)) {
+    }
+}
+
+} // namespace staged_pipeline_detail
+
+// Bounded hand-off between two stages. The stage passes its counters, so
+// the time it waits is charged to it.
+template <typename T>
+class StageQueue {
+public:
+    explicit StageQueue(size_t capacity) : capacity(std::max<size_t>(capacity, 1)) {
+        counters.capacity = this->capacity;
+    }
+
+    // Blocks while the queue is full. false once the queue is cancelled.
+    bool Push(T item, StageCounters &stage) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!cancelled && items.size() >= capacity) {
+            counters.fullPushes.fetch_add(1, std::memory_order_relaxed);
+            uint64_t waitStarted = staged_pipeline_detail::NowNs();
+            notFull.wait(lock, [this] { return cancelled || items.size() < capacity; });
+            stage.blockedNs.fetch_add(staged_pipeline_detail::NowNs() - waitStarted, std::memory_order_relaxed);
+        }
+        if (cancelled) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        uint64_t depth = items.size();
+        lock.unlock();
+        notEmpty.notify_one();
+        counters.depth.store(depth, std::memory_order_relaxed);
+        counters.pushes.fetch_add(1, std::memory_order_relaxed);
+        counters.depthSum.fetch_add(depth, std::memory_order_relaxed);
+        staged_pipeline_detail::RaiseTo(counters.maxDepth, depth);
+        return true;
+    }
+
+    // Blocks while the queue is empty. false once it is closed and drained,
+    // or cancelled.
+    bool Pop(T &item, StageCounters &stage) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!closed && !cancelled && items.empty()) {
+            uint64_t waitStarted = staged_pipeline_detail::NowNs();
+            notEmpty.wait(lock, [this] { return closed || cancelled || !items.empty(); });
+            stage.starvedNs.fetch_add(staged_pipeline_detail::NowNs() - waitStarted, std::memory_order_relaxed);
+        }
+        if (cancelled || items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        uint64_t depth = items.size();
+        lock.unlock();
+        notFull.notify_one();
+        counters.depth.store(depth, std::memory_order_relaxed);
+        return true;
+    }
+
+    // The producer is done; the consumer drains what is left
+    void Close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        notEmpty.notify_all();
+    }
+
+    // The consumer stopped: pushes fail and what is queued is dropped
+    void Cancel() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cancelled = true;
+            items.clear();
+        }
+        notEmpty.notify_all();
+        notFull.notify_all();
+        counters.depth.store(0, std::memory_order_relaxed);
+    }
+
+    QueueCounters counters;
+
+private:
+    size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    bool cancelled = false;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+class StagedPipeline {
+public:
+    typedef std::function<void(StageCounters &)> StageFunction;
+
+    // A stage runs body once, on its own thread. body pops its input queue
+    // until Pop returns false, pushes to its output queue, and closes the
+    // output queue before it returns.
+    void AddStage(const std::string &name, StageFunction body) {
+        stages.emplace_back(new Stage{name, std::move(body), {}});
+    }
+
+    // A queue to report on; it must outlive the pipeline's reports
+    template <typename T>
+    void AddQueue(const std::string &name, StageQueue<T> &queue) {
+        queues.push_back(NamedQueue{name, &queue.counters});
+    }
+
+    // Run every stage and return when all have ended
+    void Run() {
+        started.store(staged_pipeline_detail::NowNs(), std::memory_order_relaxed);
+        running.store(true, std::memory_order_relaxed);
+        std::vector<std::thread> threads;
+        for (auto &stage : stages) {
+            Stage *s = stage.get();
+            threads.emplace_back([this, s] {
+                s->body(s->counters);
+                s->counters.elapsedNs.store(staged_pipeline_detail::NowNs() - started.load(std::memory_order_relaxed),
+                                            std::memory_order_relaxed);
+            });
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+        finished.store(staged_pipeline_detail::NowNs(), std::memory_order_relaxed);
+        running.store(false, std::memory_order_relaxed);
+    }
+
+    double Seconds() const {
+        uint64_t end = running.load(std::memory_order_relaxed) ? staged_pipeline_detail::NowNs()
+                                                               : finished.load(std::memory_order_relaxed);
+        return (double)(end - started.load(std::memory_order_relaxed)) / 1e9;
+    }
+
+    // Safe to call while the pipeline runs; a running stage counts as busy
+    // up to now
+    std::vector<StageReport> Stages() const {
+        std::vector<StageReport> reports;
+        double total = Seconds();
+        for (const auto &stage : stages) {
+            const StageCounters &c = stage->counters;
+            uint64_t elapsedNs = c.elapsedNs.load(std::memory_order_relaxed);
+            double elapsed = elapsedNs ? (double)elapsedNs / 1e9 : total;
+            StageReport r;
+            r.name = stage->name;
+            r.items = c.items.load(std::memory_order_relaxed);
+            r.starvedSeconds = (double)c.starvedNs.load(std::memory_order_relaxed) / 1e9;
+            r.blockedSeconds = (double)c.blockedNs.load(std::memory_order_relaxed) / 1e9;
+            r.busySeconds = std::max(0.0, elapsed - r.starvedSeconds - r.blockedSeconds);
+            r.utilization = total > 0 ? std::min(1.0, r.busySeconds / total) : 0;
+            reports.push_back(r);
+        }
+        return reports;
+    }
+
+    std::vector<QueueReport> Queues() const {
+        std::vector<QueueReport> reports;
+        for (const NamedQueue &q : queues) {
+            QueueReport r;
+            r.name = q.name;
+            r.capacity = q.counters->capacity;
+            r.maxDepth = q.counters->maxDepth.load(std::memory_order_relaxed);
+            uint64_t pushes = q.counters->pushes.load(std::memory_order_relaxed);
+            if (pushes > 0) {
+                r.meanDepth = (double)q.counters->depthSum.load(std::memory_order_relaxed) / (double)pushes;
+                r.fullShare = (double)q.counters->fullPushes.load(std::memory_order_relaxed) / (double)pushes;
+            }
+            reports.push_back(r);
+        }
+        return reports;
+    }
+
+    // Current depth of every queue, in the order they were added
+    std::vector<uint64_t> Depths() const {
+        std::vector<uint64_t> depths;
+        for (const NamedQueue &q : queues) {
+            depths.push_back(q.counters->depth.load(std::memory_order_relaxed));
+        }
+        return depths;
+    }
+
+    // Index of the stage with the most busy time
+    static size_t Bottleneck(const std::vector<StageReport> &reports) {
+        size_t busiest = 0;
+        for (size_t i = 1; i < reports.size(); i++) {
+            if (reports[i].busySeconds > reports[busiest].busySeconds) {
+                busiest = i;
+            }
+        }
+        return busiest;
+    }
+
+private:
+    struct Stage {
+        std::string name;
+        StageFunction body;
+        StageCounters counters;
+    };
+    struct NamedQueue {
+        std::string name;
+        const QueueCounters *counters;
+    };
+
+    std::vector<std::unique_ptr<Stage>> stages; // counters are atomics and must not move
+    std::vector<NamedQueue> queues;
+    std::atomic<uint64_t> started{0};
+    std::atomic<uint64_t> finished{0};
+    std::atomic<bool> running{false};
+};
@@ -0,0 +1,207 @@
+// Overlapping the steps of a defragmentation pass
+//
+//   staged_pipeline_bench [files = 4000]
+//
+//   1. simulates the four steps of a first-fit pass per file: enumeration
+//      (50 us of waiting on the disk), reading the extents (250 us of
+//      waiting), planning (100 us of CPU) and, for every 4th file, moving it
+//      (600 us of waiting). Waits sleep and planning spins, as on a volume
+//      where only planning needs the CPU
+//   2. runs them one file at a time, then as a StagedPipeline, and checks
+//      that every file reaches the last stage once and in order, that no
+//      queue held more than its capacity, and that the pipeline names the
+//      extent reads as the bottleneck
+//   3. stops the last stage early and checks that the pipeline ends and
+//      the first stage stops producing
+//   4. passes a million empty items through four stages to measure the
+//      cost of one hand-off
+
+#include "staged_pipeline.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+static double Since(std::chrono::steady_clock::time_point started) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+static void Wait(int us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+static void Spin(int us) {
+    auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+    while (std::chrono::steady_clock::now() < until) {
+    }
+}
+
+struct Costs {
+    int enumerateUs = 50;
+    int analyzeUs = 250;
+    int planUs = 100;
+    int moveUs = 600;
+    int moveEvery = 4;
+};
+
+struct FileItem {
+    uint64_t index = 0;
+    bool planned = false;
+};
+
+struct RunResult {
+    double seconds = 0;
+    uint64_t produced = 0;
+    uint64_t arrived = 0;
+    bool inOrder = true;
+    std::vector<StageReport> stages;
+    std::vector<QueueReport> queues;
+};
+
+// All four steps in one thread, one file after the other
+static RunResult RunSequential(uint64_t files, const Costs &costs) {
+    RunResult r;
+    auto started = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < files; i++) {
+        Wait(costs.enumerateUs);
+        Wait(costs.analyzeUs);
+        Spin(costs.planUs);
+        if (i % costs.moveEvery == 0) {
+            Wait(costs.moveUs);
+        }
+        r.produced++;
+        r.arrived++;
+    }
+    r.seconds = Since(started);
+    return r;
+}
+
+// The same steps as stages. The last stage stops after stopAfter files.
+static RunResult RunStaged(uint64_t files, const Costs &costs, uint64_t stopAfter = ~0ULL) {
+    RunResult r;
+    StageQueue<FileItem> found(256), analyzed(64), planned(16);
+    StagedPipeline pipeline;
+    pipeline.AddQueue("found", found);
+    pipeline.AddQueue("analyzed", analyzed);
+    pipeline.AddQueue("planned", planned);
+    pipeline.AddStage("enumerate", [&](StageCounters &c) {
+        for (uint64_t i = 0; i < files; i++) {
+            Wait(costs.enumerateUs);
+            if (!found.Push(FileItem{i, false}, c)) {
+                break;
+            }
+            r.produced++;
+            c.items++;
+        }
+        found.Close();
+    });
+    pipeline.AddStage("analyze", [&](StageCounters &c) {
+        FileItem item;
+        while (found.Pop(item, c)) {
+            Wait(costs.analyzeUs);
+            c.items++;
+            if (!analyzed.Push(item, c)) {
+                found.Cancel();
+                break;
+            }
+        }
+        analyzed.Close();
+    });
+    pipeline.AddStage("plan", [&](StageCounters &c) {
+        FileItem item;
+        while (analyzed.Pop(item, c)) {
+            Spin(costs.planUs);
+            item.planned = true;
+            c.items++;
+            if (!planned.Push(item, c)) {
+                analyzed.Cancel();
+                break;
+            }
+        }
+        planned.Close();
+    });
+    pipeline.AddStage("move", [&](StageCounters &c) {
+        FileItem item;
+        uint64_t expected = 0;
+        while (planned.Pop(item, c)) {
+            if (item.index % costs.moveEvery == 0) {
+                Wait(costs.moveUs);
+            }
+            r.inOrder = r.inOrder && item.index == expected && item.planned;
+            expected++;
+            r.arrived++;
+            c.items++;
+            if (r.arrived == stopAfter) {
+                planned.Cancel();
+                break;
+            }
+        }
+    });
+    pipeline.Run();
+    r.seconds = pipeline.Seconds();
+    r.stages = pipeline.Stages();
+    r.queues = pipeline.Queues();
+    return r;
+}
+
+int main(int argc, char **argv) {
+    uint64_t files = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 4000;
+    if (files < 1000) {
+        std::cerr << "invalid arguments: at least 1000 files\n";
+        return 1;
+    }
+    Costs costs;
+    double perFile = costs.enumerateUs + costs.analyzeUs + costs.planUs + (double)costs.moveUs / costs.moveEvery;
+    std::cout << "Files: " << files << ", per file: enumerate " << costs.enumerateUs << " us, analyze "
+              << costs.analyzeUs << " us, plan " << costs.planUs << " us (CPU), move " << costs.moveUs
+              << " us every " << costs.moveEvery << "th file; " << perFile << " us in all\n";
+
+    RunResult sequential = RunSequential(files, costs);
+    std::cout << "One file at a time: " << sequential.seconds << " s\n";
+    RunResult staged = RunStaged(files, costs);
+    std::cout << "Staged: " << staged.seconds << " s (" << sequential.seconds / staged.seconds << "x)\n";
+    std::cout << std::fixed << std::setprecision(3);
+    for (const StageReport &s : staged.stages) {
+        std::cout << "  stage " << std::left << std::setw(10) << s.name << std::right << std::setw(6) << s.items
+                  << " items, busy " << s.busySeconds << " s (" << std::setprecision(0) << s.utilization * 100
+                  << "%), starved " << std::setprecision(3) << s.starvedSeconds << " s, blocked " << s.blockedSeconds
+                  << " s\n";
+    }
+    bool depthsBounded = true;
+    for (const QueueReport &q : staged.queues) {
+        std::cout << "  queue " << std::left << std::setw(10) << q.name << std::right << " capacity " << std::setw(3)
+                  << q.capacity << ", max " << std::setw(3) << q.maxDepth << ", mean " << std::setprecision(1)
+                  << q.meanDepth << ", pushes that waited " << std::setprecision(0) << q.fullShare * 100 << "%\n"
+                  << std::setprecision(3);
+        depthsBounded = depthsBounded && q.maxDepth <= q.capacity;
+    }
+    std::cout << std::defaultfloat << std::setprecision(6);
+    size_t bottleneck = StagedPipeline::Bottleneck(staged.stages);
+    std::cout << "Bottleneck: " << staged.stages[bottleneck].name << "\n";
+
+    // The last stage gives up after 100 files
+    uint64_t stopAfter = 100;
+    RunResult stopped = RunStaged(files, costs, stopAfter);
+    std::cout << "Stopped after " << stopped.arrived << " files: ended in " << stopped.seconds << " s, "
+              << stopped.produced << " of " << files << " files enumerated\n";
+
+    // Hand-off cost: no work in any stage
+    uint64_t handOffs = 1000000;
+    Costs none;
+    none.enumerateUs = none.analyzeUs = none.planUs = 0;
+    none.moveEvery = (int)handOffs + 1; // only the first item "moves", for 600 us
+    RunResult empty = RunStaged(handOffs, none);
+    std::cout << "Empty stages: " << handOffs << " items in " << empty.seconds << " s, "
+              << empty.seconds / (double)handOffs * 1e9 << " ns per item\n";
+
+    bool ok = staged.arrived == files && staged.inOrder && depthsBounded && bottleneck == 1 &&
+              staged.seconds < sequential.seconds * 0.6 && stopped.arrived == stopAfter && stopped.produced < files &&
+              empty.arrived == handOffs && empty.inOrder;
+    std::cout << "Check: " << staged.arrived << " of " << files << " files arrived "
+              << (staged.inOrder ? "in order" : "OUT OF ORDER") << ", queues " << (depthsBounded ? "" : "NOT ")
+              << "within capacity, bottleneck " << (bottleneck == 1 ? "found" : "WRONG") << ", overlap "
+              << (staged.seconds < sequential.seconds * 0.6 ? "real" : "MISSING") << ", early stop "
+              << (stopped.arrived == stopAfter && stopped.produced < files ? "clean" : "BROKEN")
+              << (ok ? "" : "  FAILED") << "\n";
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,391 @@
+#pragma once
+// Synthetic volume generator: writes a snapshot (bitmap and file → extents
+// map) of a volume that never existed, straight from statistical parameters
+//
+// The volume is cut into stripes of stripeClusters. Each stripe is filled on
+// its own, from a random generator seeded with (seed, stripe), so the result
+// depends only on the options, not on the number of threads:
+//
+//   1. files are drawn until the stripe's share of fillPercent is used:
+//      sizes follow a bounded Pareto (power law) distribution, a share of
+//      the files is resident (no clusters), fragmented (a geometric number
+//      of pieces) or sparse (a hole in the middle of a piece)
+//   2. pieces are laid out front to back. Up to `interleave` files are
+//      being written at the same time, and the next piece comes from a
+//      random one of them, which is how concurrent writers fragment files
+//   3. the stripe's free clusters are spread over the gaps between pieces
+//      with heavy-tailed weights: most pieces follow each other, a few gaps
+//      are large
+//
+// Files never cross a stripe. Paths are "\sNNNNN\dNNNNNNN\fNNNNNNNNNN.dat"
+// (stripe, directory of 1024 files, file), so they come out in index order
+// and go to a SnapshotStreamWriter as they are made. Memory is a stripe's
+// bitmap and file table per thread.
+
+#include "snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+struct GeneratorOptions {
+    uint64_t totalClusters = 1ULL << 32;
+    uint32_t bytesPerCluster = 4096;
+    uint64_t seed = 1;
+    unsigned threads = 0;                  // 0 = one per hardware thread
+    uint64_t stripeClusters = 1ULL << 26;  // multiple of 64, at most 2^30
+    unsigned fillPercent = 50;             // allocated share of each stripe, 1..95
+    double sizeAlpha = 0.7;                // Pareto shape of file sizes in clusters; smaller = heavier tail
+    uint32_t minFileClusters = 1;
+    uint32_t maxFileClusters = 1 << 18;    // at most a quarter of a stripe
+    unsigned residentPercent = 10;         // files with their data in the MFT record
+    unsigned fragmentedPercent = 10;       // files written in more than one piece
+    double meanFragments = 8;              // pieces of a fragmented file, on average (> 2)
+    unsigned sparsePercent = 2;            // files with a sparse run
+    unsigned interleave = 8;               // files written at the same time
+    unsigned adjacentPercent = 70;         // pieces that follow the previous one without a gap
+    uint64_t volumeSerial = 0x5E7E4A7EULL;
+    uint64_t createdTicks = 133485408000000000ULL; // 2024-01-01; last write times are up to a year before
+};
+
+struct GeneratorStats {
+    uint64_t stripes = 0;
+    uint64_t files = 0;
+    uint64_t residentFiles = 0;
+    uint64_t fragmentedFiles = 0; // drawn with more than one piece
+    uint64_t sparseFiles = 0;
+    uint64_t pieces = 0;
+    uint64_t runs = 0;
+    uint64_t allocatedClusters = 0;
+
+    void Add(const GeneratorStats &s) {
+        stripes += s.stripes;
+        files += s.files;
+        residentFiles += s.residentFiles;
+        fragmentedFiles += s.fragmentedFiles;
+        sparseFiles += s.sparseFiles;
+        pieces += s.pieces;
+        runs += s.runs;
+        allocatedClusters += s.allocatedClusters;
+    }
+};
+
+// One generated stripe. Buffers are reused from stripe to stripe.
+struct GeneratedStripe {
+    struct File {
+        uint64_t size;
+        uint64_t lastWriteTicks;
+        uint32_t firstRun;
+        uint32_t runCount;
+        uint32_t firstPiece; // into pieceClusters
+        uint32_t pieces;
+        uint32_t nextPiece;  // while laying out
+        uint32_t sparsePiece; // piece holding the sparse run, or pieces
+        uint32_t sparseSplit; // clusters of that piece before the hole
+        uint32_t sparseClusters;
+    };
+
+    uint64_t index = 0;
+    uint64_t firstCluster = 0;
+    uint64_t clusters = 0;
+    std::vector<uint64_t> words; // allocation bits of the stripe, bit 0 = firstCluster
+    std::vector<File> files;
+    std::vector<ExtentRun> runs;
+    std::vector<uint32_t> pieceClusters;
+    std::vector<uint32_t> order;  // file of each piece, in disk order
+    std::vector<float> gapWeights; // before each piece, and one after the last
+    std::vector<uint32_t> open;
+    GeneratorStats stats;
+};
+
+namespace volume_generator_detail {
+
+inline uint64_t Mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Uniform in (0, 1)
+inline double Unit(std::mt19937_64 &rng) { return ((double)(rng() >> 11) + 0.5) * (1.0 / 9007199254740992.0); }
+
+// Bounded Pareto by inverse CDF
+inline uint32_t ParetoClusters(std::mt19937_64 &rng, double alpha, uint32_t lo, uint32_t hi) {
+    double ratio = std::pow((double)lo / hi, alpha);
+    double x = lo / std::pow(1 - Unit(rng) * (1 - ratio), 1 / alpha);
+    return (uint32_t)std::min<double>(hi, std::max<double>(lo, std::floor(x)));
+}
+
+// Failures before the first success, with the given mean
+inline uint64_t Geometric(std::mt19937_64 &rng, double mean) {
+    if (mean <= 0) {
+        return 0;
+    }
+    return (uint64_t)std::floor(std::log(Unit(rng)) / std::log(mean / (mean + 1)));
+}
+
+inline void SetBits(std::vector<uint64_t> &words, uint64_t from, uint64_t count) {
+    uint64_t to = from + count;
+    while (from < to) {
+        uint64_t bit = from % 64;
+        uint64_t n = std::min<uint64_t>(64 - bit, to - from);
+        words[(size_t)(from / 64)] |= (n == 64 ? ~0ULL : ((1ULL << n) - 1) << bit);
+        from += n;
+    }
+}
+
+// Write `value` as `width` decimal digits
+inline wchar_t *PutDigits(wchar_t *out, uint64_t value, unsigned width) {
+    for (unsigned i = width; i > 0; i--) {
+        out[i - 1] = (wchar_t)(L'0' + value % 10);
+        value /= 10;
+    }
+    return out + width;
+}
+
+} // namespace volume_generator_detail
+
+inline bool ValidGeneratorOptions(const GeneratorOptions &o) {
+    return o.totalClusters > 0 && o.bytesPerCluster > 0 && o.stripeClusters >= 64 && o.stripeClusters % 64 == 0 &&
+           o.stripeClusters <= (1ULL << 30) && (o.totalClusters + o.stripeClusters - 1) / o.stripeClusters < 100000 &&
+           o.fillPercent >= 1 && o.fillPercent <= 95 && o.sizeAlpha > 0 && o.minFileClusters >= 1 &&
+           o.minFileClusters <= o.maxFileClusters && o.maxFileClusters <= o.stripeClusters / 4 &&
+           o.residentPercent < 100 && o.fragmentedPercent <= 100 && o.meanFragments > 2 && o.sparsePercent <= 100 &&
+           o.interleave >= 1 && o.adjacentPercent <= 100;
+}
+
+// Path of a generated file, "\sNNNNN\dNNNNNNN\fNNNNNNNNNN.dat"; returns its length
+inline size_t GeneratedPath(uint64_t stripe, uint64_t file, wchar_t (&out)[40]) {
+    using volume_generator_detail::PutDigits;
+    wchar_t *p = out;
+    *p++ = L'\\';
+    *p++ = L's';
+    p = PutDigits(p, stripe, 5);
+    *p++ = L'\\';
+    *p++ = L'd';
+    p = PutDigits(p, file / 1024, 7);
+    *p++ = L'\\';
+    *p++ = L'f';
+    p = PutDigits(p, file, 10);
+    for (const wchar_t *ext = L".dat"; *ext; ext++) {
+        *p++ = *ext;
+    }
+    *p = 0;
+    return (size_t)(p - out);
+}
+
+// Fill one stripe
+inline void GenerateStripe(const GeneratorOptions &o, uint64_t stripe, GeneratedStripe &out) {
+    using namespace volume_generator_detail;
+    typedef GeneratedStripe::File File;
+    std::mt19937_64 rng(Mix(o.seed ^ Mix(stripe + 1)));
+    out.index = stripe;
+    out.firstCluster = stripe * o.stripeClusters;
+    out.clusters = std::min(o.stripeClusters, o.totalClusters - out.firstCluster);
+    out.words.assign((size_t)((out.clusters + 63) / 64), 0);
+    out.files.clear();
+    out.runs.clear();
+    out.pieceClusters.clear();
+    out.order.clear();
+    out.gapWeights.clear();
+    out.open.clear();
+    out.stats = GeneratorStats();
+    out.stats.stripes = 1;
+
+    // 1. Files and their pieces
+    const uint64_t yearTicks = 365ULL * 24 * 3600 * 10000000;
+    uint64_t budget = out.clusters * o.fillPercent / 100;
+    uint64_t allocated = 0;
+    while (allocated < budget) {
+        File f = {};
+        f.lastWriteTicks = o.createdTicks - rng() % yearTicks;
+        f.firstPiece = (uint32_t)out.pieceClusters.size();
+        if (rng() % 100 < o.residentPercent) {
+            f.size = rng() % 700 + 1;
+            f.sparsePiece = 0;
+            out.files.push_back(f);
+            out.stats.residentFiles++;
+            continue;
+        }
+        uint32_t clusters = ParetoClusters(rng, o.sizeAlpha, o.minFileClusters, o.maxFileClusters);
+        clusters = (uint32_t)std::min<uint64_t>(clusters, budget - allocated);
+        allocated += clusters;
+        uint32_t pieces = 1;
+        if (clusters > 1 && rng() % 100 < o.fragmentedPercent) {
+            pieces = (uint32_t)std::min<uint64_t>(clusters, 2 + Geometric(rng, o.meanFragments - 2));
+            out.stats.fragmentedFiles++;
+        }
+        // Piece sizes: 1 each plus the rest split at random cut points
+        size_t first = out.pieceClusters.size();
+        uint32_t spare = clusters - pieces;
+        for (uint32_t p = 1; p < pieces; p++) {
+            out.pieceClusters.push_back(spare ? (uint32_t)(rng() % (spare + 1)) : 0);
+        }
+        std::sort(out.pieceClusters.begin() + first, out.pieceClusters.end());
+        out.pieceClusters.push_back(spare);
+        uint32_t previousCut = 0;
+        for (size_t p = first; p < out.pieceClusters.size(); p++) {
+            uint32_t cut = out.pieceClusters[p];
+            out.pieceClusters[p] = 1 + cut - previousCut;
+            previousCut = cut;
+        }
+        f.pieces = pieces;
+        f.runCount = pieces;
+        f.sparsePiece = pieces;
+        if (rng() % 100 < o.sparsePercent) {
+            for (uint32_t p = 0; p < pieces; p++) {
+                uint32_t n = out.pieceClusters[first + p];
+                if (n > 1) {
+                    f.sparsePiece = p;
+                    f.sparseSplit = 1 + (uint32_t)(rng() % (n - 1));
+                    f.sparseClusters = 1 + (uint32_t)std::min<uint64_t>(Geometric(rng, 16), 1 << 20);
+                    f.runCount += 2;
+                    out.stats.sparseFiles++;
+                    break;
+                }
+            }
+        }
+        uint64_t vcns = (uint64_t)clusters + f.sparseClusters;
+        f.size = vcns * o.bytesPerCluster - rng() % o.bytesPerCluster;
+        out.files.push_back(f);
+    }
+    uint32_t runs = 0;
+    for (File &f : out.files) {
+        f.firstRun = runs;
+        runs += f.runCount;
+    }
+    out.runs.resize(runs);
+
+    // 2. Disk order of the pieces, from `interleave` files at a time
+    size_t nextFile = 0;
+    while (nextFile < out.files.size() || !out.open.empty()) {
+        while (out.open.size() < o.interleave && nextFile < out.files.size()) {
+            if (out.files[nextFile].pieces) {
+                out.open.push_back((uint32_t)nextFile);
+            }
+            nextFile++;
+        }
+        if (out.open.empty()) {
+            break;
+        }
+        size_t pick = (size_t)(rng() % out.open.size());
+        uint32_t file = out.open[pick];
+        out.order.push_back(file);
+        if (++out.files[file].nextPiece == out.files[file].pieces) {
+            out.open[pick] = out.open.back();
+            out.open.pop_back();
+        }
+    }
+    double totalWeight = 0;
+    for (size_t i = 0; i <= out.order.size(); i++) {
+        float w = (i > 0 && i < out.order.size() && rng() % 100 < o.adjacentPercent)
+                      ? 0.0f
+                      : (float)std::min(1e6, std::pow(Unit(rng), -1 / 1.2));
+        out.gapWeights.push_back(w);
+        totalWeight += w;
+    }
+
+    // 3. Place the pieces, spreading the free clusters over the gaps
+    double freePerWeight = (double)(out.clusters - allocated) / totalWeight;
+    uint64_t freeLeft = out.clusters - allocated;
+    uint64_t cursor = 0;
+    for (File &f : out.files) {
+        f.nextPiece = 0;
+    }
+    for (size_t i = 0; i < out.order.size(); i++) {
+        uint64_t gap = std::min(freeLeft, (uint64_t)(out.gapWeights[i] * freePerWeight));
+        freeLeft -= gap;
+        cursor += gap;
+        File &f = out.files[out.order[i]];
+        uint32_t p = f.nextPiece++;
+        uint32_t count = out.pieceClusters[f.firstPiece + p];
+        ExtentRun *run = &out.runs[f.firstRun + p + (p > f.sparsePiece ? 2 : 0)];
+        int64_t vcn = p == 0 ? 0 : run[-1].vcn + run[-1].count;
+        int64_t lcn = (int64_t)(out.firstCluster + cursor);
+        if (p == f.sparsePiece) {
+            run[0] = ExtentRun{vcn, lcn, (int64_t)f.sparseSplit};
+            run[1] = ExtentRun{vcn + f.sparseSplit, -1, (int64_t)f.sparseClusters};
+            run[2] = ExtentRun{vcn + f.sparseSplit + f.sparseClusters, lcn + f.sparseSplit,
+                               (int64_t)(count - f.sparseSplit)};
+        } else {
+            run[0] = ExtentRun{vcn, lcn, (int64_t)count};
+        }
+        SetBits(out.words, cursor, count);
+        cursor += count;
+    }
+    out.stats.files = out.files.size();
+    out.stats.pieces = out.order.size();
+    out.stats.runs = out.runs.size();
+    out.stats.allocatedClusters = allocated;
+}
+
+// Generate every stripe on `threads` threads and stream them, in order, into
+// a snapshot at `path`. At most one stripe per thread is held at a time.
+inline bool GenerateVolume(const GeneratorOptions &o, const std::wstring &path, GeneratorStats &stats) {
+    if (!ValidGeneratorOptions(o)) {
+        return false;
+    }
+    SnapshotStreamWriter writer;
+    if (!writer.Open(path, o.volumeSerial, o.totalClusters, o.bytesPerCluster)) {
+        return false;
+    }
+    uint64_t stripes = (o.totalClusters + o.stripeClusters - 1) / o.stripeClusters;
+    unsigned threads = o.threads ? o.threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = (unsigned)std::min<uint64_t>(threads, stripes);
+
+    std::atomic<uint64_t> nextStripe(0);
+    std::mutex commitMutex;
+    std::condition_variable committed;
+    uint64_t nextCommit = 0;
+    bool ok = true;
+    GeneratorStats total;
+
+    auto worker = [&]() {
+        GeneratedStripe s;
+        std::vector<uint8_t> bytes;
+        for (;;) {
+            uint64_t stripe = nextStripe.fetch_add(1);
+            if (stripe >= stripes) {
+                return;
+            }
+            GenerateStripe(o, stripe, s);
+            // Bitmap pieces may be written in any order, files only in path order
+            bytes.resize((size_t)((s.clusters + 7) / 8));
+            for (size_t i = 0; i < bytes.size(); i++) {
+                bytes[i] = (uint8_t)(s.words[i / 8] >> (8 * (i % 8)));
+            }
+            bool written = writer.WriteBitmap(s.firstCluster / 8, bytes.data(), bytes.size());
+
+            std::unique_lock<std::mutex> lock(commitMutex);
+            committed.wait(lock, [&] { return nextCommit == stripe; });
+            wchar_t name[40];
+            for (size_t i = 0; written && ok && i < s.files.size(); i++) {
+                const GeneratedStripe::File &f = s.files[i];
+                written = writer.AddFile(name, GeneratedPath(stripe, i, name), f.size, f.lastWriteTicks,
+                                         s.runs.data() + f.firstRun, f.runCount);
+            }
+            ok = ok && written;
+            total.Add(s.stats);
+            nextCommit++;
+            committed.notify_all();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : pool) {
+        t.join();
+    }
+    stats = total;
+    return ok && writer.Finish(o.createdTicks);
+}
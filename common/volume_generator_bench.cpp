@@ -0,0 +1,195 @@
+// Synthetic volume generation at billion-cluster scale
+//
+//   volume_generator_bench <snapshot-file> [clusters = 1073741824] [threads = 0]
+//
+//   1. generates a volume of `clusters` 4 KB clusters (2^32 = 16 TB is the
+//      intended size) into a snapshot and reports the rate and how much
+//      memory the process used while doing it
+//   2. maps the snapshot and checks it: every allocated run lies on set
+//      bits and together the runs cover exactly the set bits (so no two
+//      files share a cluster), the first and last stripes are regenerated
+//      and compared byte for byte, each file looked up by path
+//   3. feeds it to the free-cluster-finder search and to a fragmentation
+//      report, the paths the tools take with a snapshot
+
+#include "fragmentation_report.h"
+#include "free_run.h"
+#include "volume_generator.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sys/resource.h>
+
+static long MaxResidentKB() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static double Since(std::chrono::steady_clock::time_point started) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+static bool RunIsAllocated(const uint8_t *bitmap, uint64_t lcn, uint64_t count) {
+    BitmapWords words(bitmap, (size_t)((lcn + count + 7) / 8));
+    uint64_t end = lcn + count;
+    while (lcn < end) {
+        uint64_t bit = lcn % 64;
+        uint64_t n = std::min<uint64_t>(64 - bit, end - lcn);
+        uint64_t mask = n == 64 ? ~0ULL : ((1ULL << n) - 1) << bit;
+        if ((words(lcn / 64) & mask) != mask) {
+            return false;
+        }
+        lcn += n;
+    }
+    return true;
+}
+
+static uint64_t SetBitCount(const uint8_t *bitmap, uint64_t bytes) {
+    BitmapWords words(bitmap, (size_t)bytes);
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < bytes / 8; i++) {
+        count += (uint64_t)__builtin_popcountll(words(i));
+    }
+    for (uint64_t i = bytes / 8 * 8; i < bytes; i++) {
+        count += (uint64_t)__builtin_popcount(bitmap[i]);
+    }
+    return count;
+}
+
+// Regenerate a stripe and compare it with what the snapshot holds
+static bool SameAsSnapshot(const GeneratorOptions &o, uint64_t stripe, SnapshotReader &reader) {
+    GeneratedStripe s;
+    GenerateStripe(o, stripe, s);
+    const uint8_t *bitmap = reader.Bitmap() + s.firstCluster / 8;
+    for (uint64_t i = 0; i < (s.clusters + 7) / 8; i++) {
+        if (bitmap[i] != (uint8_t)(s.words[(size_t)(i / 8)] >> (8 * (i % 8)))) {
+            return false;
+        }
+    }
+    wchar_t name[40];
+    std::vector<ExtentRun> decoded;
+    for (size_t i = 0; i < s.files.size(); i++) {
+        const GeneratedStripe::File &f = s.files[i];
+        const SnapshotFileRecord *r = reader.Find(name, GeneratedPath(stripe, i, name));
+        if (!r || !SnapshotReader::IsUnchanged(*r, f.size, f.lastWriteTicks) || !reader.DecodeExtents(*r, decoded) ||
+            decoded.size() != f.runCount) {
+            return false;
+        }
+        for (size_t k = 0; k < decoded.size(); k++) {
+            const ExtentRun &a = decoded[k];
+            const ExtentRun &b = s.runs[f.firstRun + k];
+            if (a.vcn != b.vcn || a.lcn != b.lcn || a.count != b.count) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: volume_generator_bench <snapshot-file> [clusters] [threads]\n";
+        return 1;
+    }
+    std::string narrowPath = argv[1];
+    std::wstring path(narrowPath.begin(), narrowPath.end());
+    GeneratorOptions o;
+    o.totalClusters = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1ULL << 30;
+    o.threads = argc > 3 ? (unsigned)std::strtoul(argv[3], nullptr, 10) : 0;
+    if (!ValidGeneratorOptions(o)) {
+        std::cerr << "invalid options\n";
+        return 1;
+    }
+
+    // 1. Generate
+    GeneratorStats stats;
+    auto started = std::chrono::steady_clock::now();
+    if (!GenerateVolume(o, path, stats)) {
+        std::cerr << "cannot generate " << narrowPath << "\n";
+        return 1;
+    }
+    double seconds = Since(started);
+    long generateKB = MaxResidentKB();
+    std::cout << "Generated: " << o.totalClusters << " clusters in " << stats.stripes << " stripes, " << stats.files
+              << " files (" << stats.residentFiles << " resident, " << stats.fragmentedFiles << " fragmented, "
+              << stats.sparseFiles << " sparse), " << stats.pieces << " pieces, " << stats.runs << " runs, "
+              << stats.allocatedClusters << " clusters allocated\n";
+    std::cout << "Time: " << seconds << " s (" << (double)o.totalClusters / seconds / 1e6 << " M clusters/s, "
+              << (double)stats.files / seconds / 1e6 << " M files/s), peak memory " << generateKB / 1024 << " MB\n";
+
+    // 2. Check
+    SnapshotReader reader;
+    SnapshotStatus status = reader.Open(path);
+    if (status != SnapshotStatus::Ok) {
+        std::cerr << "cannot load the snapshot (status " << (int)status << ")\n";
+        return 1;
+    }
+    const SnapshotHeader &h = reader.Header();
+    std::cout << "Snapshot: " << (h.extentsOffset + h.extentsBytes) / (1 << 20) << " MB (bitmap "
+              << h.bitmapBytes / (1 << 20) << " MB, index " << h.fileCount * sizeof(SnapshotFileRecord) / (1 << 20)
+              << " MB, names " << h.namesBytes / (1 << 20) << " MB, extents " << h.extentsBytes / (1 << 20)
+              << " MB)\n";
+    started = std::chrono::steady_clock::now();
+    std::vector<ExtentRun> runs;
+    uint64_t runClusters = 0;
+    uint64_t badFiles = 0;
+    for (uint64_t i = 0; i < reader.FileCount(); i++) {
+        const SnapshotFileRecord &r = reader.FileAt(i);
+        bool ok = reader.DecodeExtents(r, runs);
+        for (size_t k = 0; ok && k < runs.size(); k++) {
+            if (runs[k].lcn >= 0) {
+                ok = (uint64_t)(runs[k].lcn + runs[k].count) <= h.totalClusters &&
+                     RunIsAllocated(reader.Bitmap(), (uint64_t)runs[k].lcn, (uint64_t)runs[k].count);
+                runClusters += (uint64_t)runs[k].count;
+            }
+        }
+        badFiles += ok ? 0 : 1;
+    }
+    uint64_t setBits = SetBitCount(reader.Bitmap(), h.bitmapBytes);
+    uint64_t lastStripe = stats.stripes - 1;
+    bool regenerated = SameAsSnapshot(o, 0, reader) && SameAsSnapshot(o, lastStripe, reader);
+    bool ok = reader.FileCount() == stats.files && badFiles == 0 && runClusters == setBits &&
+              setBits == stats.allocatedClusters && regenerated;
+    std::cout << "Check: " << badFiles << " files off the bitmap, run clusters " << runClusters << " / set bits "
+              << setBits << ", stripes 0 and " << lastStripe << (regenerated ? " regenerate identically" : " DIFFER")
+              << " (" << Since(started) << " s)" << (ok ? "" : "  FAILED") << "\n";
+    if (!ok) {
+        return 1;
+    }
+
+    // 3. The free-cluster finder's search and the analysis report
+    BitmapWords words(reader.Bitmap(), (size_t)h.bitmapBytes);
+    std::vector<LcnRange> reserved;
+    for (uint64_t needed : {16ULL, 4096ULL, 65536ULL, 1ULL << 20}) {
+        uint64_t start = 0;
+        started = std::chrono::steady_clock::now();
+        bool found = FindFreeRun(words, 0, h.totalClusters, needed, reserved, start);
+        std::cout << "First free run of " << needed << " clusters: ";
+        if (found) {
+            std::cout << "LCN " << start;
+        } else {
+            std::cout << "none";
+        }
+        std::cout << " (" << Since(started) * 1e3 << " ms)\n";
+    }
+    FragmentationReport report;
+    report.SetVolume(L"generated", h.totalClusters, h.bytesPerCluster);
+    std::wstring name;
+    started = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < reader.FileCount(); i++) {
+        const SnapshotFileRecord &r = reader.FileAt(i);
+        reader.DecodeExtents(r, runs);
+        name.clear();
+        snapshot_detail::AppendWide(name, reader.NameOf(r), reader.NameLengthOf(r));
+        report.AddFile(name.data(), name.size(), r.size, runs.data(), runs.size());
+    }
+    report.ScanFreeSpace(words, h.totalClusters, reserved);
+    LcnRange largest = report.LargestFreeRun();
+    std::cout << "Report: " << report.Files() << " files, " << report.FragmentedFiles() << " fragmented, "
+              << report.Extents() << " extents; " << report.FreeClusters() << " free clusters in "
+              << report.FreeRuns() << " runs, largest " << largest.end - largest.start << " (" << Since(started)
+              << " s)\n";
+    return 0;
+}
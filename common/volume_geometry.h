@@ -0,0 +1,48 @@
+#pragma once
+// Volume geometry with 64-bit cluster counts and the NTFS reserved zones
+//
+// GetDiskFreeSpaceW returns the cluster count as a DWORD, so on a volume
+// with more than 2^32 clusters everything past that point is silently
+// ignored. The tools fill this struct from FSCTL_GET_NTFS_VOLUME_DATA
+// instead (GetDiskFreeSpaceExW byte counts when the volume is not NTFS).
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Half-open LCN range [start, end)
+struct LcnRange {
+    uint64_t start;
+    uint64_t end;
+};
+
+struct VolumeGeometry {
+    bool isNtfs = false;
+    uint64_t volumeSerial = 0;
+    uint64_t totalClusters = 0;
+    uint64_t freeClusters = 0;
+    uint32_t bytesPerSector = 0;
+    uint32_t bytesPerCluster = 0;
+    uint32_t bytesPerFileRecord = 0;
+    uint64_t mftStartLcn = 0;
+    uint64_t mft2StartLcn = 0;      // $MFTMirr
+    uint64_t mftValidDataLength = 0; // bytes
+    uint64_t mftZoneStart = 0;       // NTFS keeps this free for $MFT to grow into
+    uint64_t mftZoneEnd = 0;
+
+    uint64_t TotalBytes() const { return totalClusters * bytesPerCluster; }
+
+    // Ranges that placement must not allocate from, sorted and clamped to the
+    // volume. Today that is the MFT zone: clusters there are free in the
+    // bitmap, but NTFS hands them to $MFT first, and filling them fragments
+    // the MFT later on.
+    std::vector<LcnRange> ReservedRanges() const {
+        std::vector<LcnRange> ranges;
+        uint64_t start = std::min(mftZoneStart, totalClusters);
+        uint64_t end = std::min(mftZoneEnd, totalClusters);
+        if (isNtfs && start < end) {
+            ranges.push_back(LcnRange{start, end});
+        }
+        return ranges;
+    }
+};
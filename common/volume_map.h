@@ -0,0 +1,520 @@
+#pragma once
+// In-memory volume map for the volume-map service
+//
+// A VolumeMapState is an immutable view of one volume at one point in time:
+//
+//   - the snapshot (see snapshot.h), mapped: the bitmap and the file ->
+//     extents map, used in place
+//   - a FreeExtentIndex built from that bitmap: every free run, sorted by
+//     LCN, and the largest one
+//
+// VolumeMap holds the current state. Queries take a reference to it and
+// answer from it without any further locking; a refresh builds the next
+// state off to the side (RefreshVolumeMap: change feed -> IncrementalUpdate
+// -> new snapshot file -> new index) and publishes it with one pointer swap.
+// A state that is no longer current lives on until the last query using it
+// is done, then unmaps its snapshot and, if the service wrote it, deletes it.
+
+#include "free_run.h"
+#include "incremental.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct FreeExtent {
+    uint64_t start;
+    uint64_t length;
+};
+
+// Every run of free clusters of a bitmap, sorted by start. Reserved ranges
+// (the MFT zone) count as allocated.
+//
+// The runs are kept in blocks of up to BLOCK_RUNS, each with its own free
+// cluster count and longest run. Blocks are immutable and shared: the index
+// of the next state (Update) reuses every block the refresh did not touch,
+// so a refresh costs time and memory in proportion to what changed, not to
+// the number of free runs on the volume.
+class FreeExtentIndex {
+public:
+    static const size_t BLOCK_RUNS = 4096;
+
+    template <typename WordSource>
+    void Build(const WordSource &words, uint64_t totalClusters, const std::vector<LcnRange> &reserved) {
+        Clear();
+        Scan(words, 0, totalClusters, reserved);
+        Flush();
+        Summarize();
+    }
+
+    // Build from previous, which indexed the same bitmap before the clusters
+    // in dirty (sorted, not overlapping) changed: runs are scanned again
+    // around the dirty ranges only, and blocks without any change are shared
+    // with previous.
+    template <typename WordSource>
+    void Update(const FreeExtentIndex &previous,
+                const WordSource &words,
+                uint64_t totalClusters,
+                const std::vector<LcnRange> &reserved,
+                const std::vector<LcnRange> &dirty) {
+        Clear();
+
+        // Old runs [firstRun, lastRun) are replaced by a scan of [from, to)
+        struct Edit {
+            uint64_t firstRun;
+            uint64_t lastRun;
+            uint64_t from;
+            uint64_t to;
+        };
+        std::vector<Edit> edits;
+        uint64_t oldCount = previous.RunCount();
+        uint64_t next = 0; // first old run not yet looked at
+        for (size_t d = 0; d < dirty.size();) {
+            uint64_t from = dirty[d].start;
+            uint64_t to = std::min<uint64_t>(dirty[d].end, totalClusters);
+            d++;
+            // Widen the range over the old runs touching it and the dirty
+            // ranges those reach, so that it starts and ends on clusters that
+            // are allocated before and after the change
+            next = previous.FirstRunEndingAtOrAfter(from, next);
+            Edit e;
+            e.firstRun = next;
+            if (next < oldCount && previous.RunAt(next).start < from) {
+                from = previous.RunAt(next).start;
+            }
+            while (true) {
+                if (next < oldCount && previous.RunAt(next).start <= to) {
+                    const FreeExtent &r = previous.RunAt(next);
+                    to = std::max<uint64_t>(to, r.start + r.length);
+                    next++;
+                } else if (d < dirty.size() && dirty[d].start <= to) {
+                    to = std::max<uint64_t>(to, std::min<uint64_t>(dirty[d].end, totalClusters));
+                    d++;
+                } else {
+                    break;
+                }
+            }
+            e.lastRun = next;
+            e.from = from;
+            e.to = to;
+            edits.push_back(e);
+        }
+
+        // Copy the old runs with the edits applied; a block is shared when it
+        // lies entirely between two edits and nothing small is pending
+        size_t e = 0;
+        size_t b = 0;
+        uint64_t at = 0;
+        while (at < oldCount || e < edits.size()) {
+            if (e < edits.size() && edits[e].firstRun == at) {
+                Scan(words, edits[e].from, edits[e].to, reserved);
+                at = edits[e].lastRun;
+                e++;
+                continue;
+            }
+            while (previous.blockFirstRun[b] + previous.blocks[b]->runs.size() <= at) {
+                b++;
+            }
+            const FreeRunBlock &block = *previous.blocks[b];
+            uint64_t blockEnd = previous.blockFirstRun[b] + block.runs.size();
+            if (at == previous.blockFirstRun[b] && (e == edits.size() || edits[e].firstRun >= blockEnd) &&
+                (pending.empty() || pending.size() >= BLOCK_RUNS / 2)) {
+                Flush();
+                Share(previous.blocks[b]);
+                at = blockEnd;
+                continue;
+            }
+            Emit(block.runs[(size_t)(at - previous.blockFirstRun[b])]);
+            at++;
+        }
+        Flush();
+        Summarize();
+    }
+
+    uint64_t FreeClusters() const { return freeClusters; }
+    uint64_t RunCount() const { return runCount; }
+    size_t BlockCount() const { return blocks.size(); }
+
+    // Runs in LCN order, i < RunCount()
+    const FreeExtent &RunAt(uint64_t i) const {
+        size_t b = (size_t)(std::upper_bound(blockFirstRun.begin(), blockFirstRun.end(), i) - blockFirstRun.begin()) - 1;
+        return blocks[b]->runs[(size_t)(i - blockFirstRun[b])];
+    }
+
+    // The longest free run ({0, 0} when nothing is free)
+    FreeExtent Largest() const { return largest; }
+
+    // Up to `clusters` free clusters in at most maxRuns runs, nearest to lcn
+    // first. A run is cut down to the part closest to lcn when it holds more
+    // than is still needed.
+    void Near(uint64_t lcn, uint64_t clusters, size_t maxRuns, std::vector<FreeExtent> &out) const {
+        out.clear();
+        uint64_t right = FirstRunStartingAfter(lcn); // runs [0, right) start at or before lcn
+        uint64_t left = right;
+        uint64_t needed = clusters;
+        while (needed > 0 && out.size() < maxRuns && (left > 0 || right < runCount)) {
+            uint64_t leftDistance = ~0ULL;
+            if (left > 0) {
+                const FreeExtent &r = RunAt(left - 1);
+                leftDistance = lcn < r.start + r.length ? 0 : lcn - (r.start + r.length - 1);
+            }
+            uint64_t rightDistance = right < runCount ? RunAt(right).start - lcn : ~0ULL;
+            FreeExtent take;
+            if (leftDistance <= rightDistance) {
+                const FreeExtent &r = RunAt(--left);
+                take.length = std::min(needed, r.length);
+                if (leftDistance == 0) {
+                    // lcn is inside the run: start at lcn, or as late as the run allows
+                    take.start = std::min(lcn, r.start + r.length - take.length);
+                } else {
+                    take.start = r.start + r.length - take.length; // the end nearest lcn
+                }
+            } else {
+                const FreeExtent &r = RunAt(right++);
+                take.length = std::min(needed, r.length);
+                take.start = r.start;
+            }
+            out.push_back(take);
+            needed -= take.length;
+        }
+    }
+
+private:
+    struct FreeRunBlock {
+        std::vector<FreeExtent> runs;
+        uint64_t freeClusters = 0;
+        FreeExtent largest = {0, 0};
+    };
+
+    void Clear() {
+        blocks.clear();
+        blockFirstRun.clear();
+        blockFirstLcn.clear();
+        pending.clear();
+        runCount = 0;
+    }
+
+    // Index of the first run whose start is greater than lcn
+    uint64_t FirstRunStartingAfter(uint64_t lcn) const {
+        size_t b = (size_t)(std::upper_bound(blockFirstLcn.begin(), blockFirstLcn.end(), lcn) - blockFirstLcn.begin());
+        if (b == 0) {
+            return 0;
+        }
+        const std::vector<FreeExtent> &runs = blocks[b - 1]->runs;
+        auto it = std::upper_bound(runs.begin(), runs.end(), lcn,
+                                   [](uint64_t value, const FreeExtent &r) { return value < r.start; });
+        return blockFirstRun[b - 1] + (uint64_t)(it - runs.begin());
+    }
+
+    // Index of the first run at or after `hint` that ends at or after lcn
+    // (touching it counts)
+    uint64_t FirstRunEndingAtOrAfter(uint64_t lcn, uint64_t hint) const {
+        uint64_t i = FirstRunStartingAfter(lcn);
+        if (i > 0 && RunAt(i - 1).start + RunAt(i - 1).length >= lcn) {
+            i--;
+        }
+        return std::max(i, hint);
+    }
+
+    // Append the free runs of [from, to), which starts and ends at a run boundary
+    template <typename WordSource>
+    void Scan(const WordSource &words, uint64_t from, uint64_t to, const std::vector<LcnRange> &reserved) {
+        uint64_t runStart = 0;
+        bool inRun = false;
+        uint64_t c = from;
+        while (c < to) {
+            uint64_t w = words(c / 64);
+            unsigned bit = (unsigned)(c % 64);
+            uint64_t bitsHere = std::min<uint64_t>(64 - bit, to - c);
+            if (bit == 0 && bitsHere == 64 && (w == 0 || w == ~0ULL)) {
+                if (w == 0 && !inRun) {
+                    runStart = c;
+                    inRun = true;
+                } else if (w != 0 && inRun) {
+                    Add(runStart, c, reserved);
+                    inRun = false;
+                }
+                c += 64;
+                continue;
+            }
+            for (uint64_t i = 0; i < bitsHere; i++, c++) {
+                bool allocated = (w >> (bit + i)) & 1;
+                if (!allocated && !inRun) {
+                    runStart = c;
+                    inRun = true;
+                } else if (allocated && inRun) {
+                    Add(runStart, c, reserved);
+                    inRun = false;
+                }
+            }
+        }
+        if (inRun) {
+            Add(runStart, to, reserved);
+        }
+    }
+
+    // Add [start, end) minus the reserved ranges
+    void Add(uint64_t start, uint64_t end, const std::vector<LcnRange> &reserved) {
+        for (const LcnRange &r : reserved) {
+            if (r.end <= start || r.start >= end) {
+                continue;
+            }
+            if (r.start > start) {
+                Emit(FreeExtent{start, r.start - start});
+            }
+            start = std::max(start, (uint64_t)r.end);
+            if (start >= end) {
+                return;
+            }
+        }
+        Emit(FreeExtent{start, end - start});
+    }
+
+    void Emit(const FreeExtent &run) {
+        pending.push_back(run);
+        if (pending.size() == BLOCK_RUNS) {
+            Flush();
+        }
+    }
+
+    // Close the pending runs into a block of their own
+    void Flush() {
+        if (pending.empty()) {
+            return;
+        }
+        auto block = std::make_shared<FreeRunBlock>();
+        block->runs.swap(pending);
+        for (const FreeExtent &r : block->runs) {
+            block->freeClusters += r.length;
+            if (r.length > block->largest.length) {
+                block->largest = r;
+            }
+        }
+        Share(block);
+        pending.reserve(BLOCK_RUNS);
+    }
+
+    void Share(const std::shared_ptr<const FreeRunBlock> &block) {
+        blocks.push_back(block);
+        blockFirstRun.push_back(runCount);
+        blockFirstLcn.push_back(block->runs.front().start);
+        runCount += block->runs.size();
+    }
+
+    void Summarize() {
+        freeClusters = 0;
+        largest = FreeExtent{0, 0};
+        for (const auto &block : blocks) {
+            freeClusters += block->freeClusters;
+            if (block->largest.length > largest.length) {
+                largest = block->largest;
+            }
+        }
+    }
+
+    std::vector<std::shared_ptr<const FreeRunBlock>> blocks;
+    std::vector<uint64_t> blockFirstRun; // index of each block's first run
+    std::vector<uint64_t> blockFirstLcn; // start of each block's first run
+    std::vector<FreeExtent> pending;     // runs not in a block yet
+    uint64_t runCount = 0;
+    uint64_t freeClusters = 0;
+    FreeExtent largest = {0, 0};
+};
+
+struct VolumeMapState {
+    uint64_t generation = 0;      // 0 for the snapshot the service started from, +1 per refresh
+    SnapshotReader files;         // bitmap and file -> extents map
+    FreeExtentIndex free;
+    std::wstring snapshotPath;
+    double buildSeconds = 0;      // to build this state from the previous one
+
+    // The service deletes the snapshots it wrote once they are replaced;
+    // cleared for the one it leaves behind when it stops
+    mutable bool deleteOnRelease = false;
+
+    ~VolumeMapState() {
+        files.Close();
+        if (deleteOnRelease) {
+            std::error_code ignored;
+            std::filesystem::remove(std::filesystem::path(snapshotPath), ignored);
+        }
+    }
+};
+
+// Map a snapshot and index its bitmap. With previous and dirty, the index
+// is patched from previous' (see FreeExtentIndex::Update) instead of built
+// from scratch.
+inline SnapshotStatus OpenVolumeMapState(const std::wstring &snapshotPath,
+                                         uint64_t generation,
+                                         const std::vector<LcnRange> &reserved,
+                                         std::shared_ptr<VolumeMapState> &out,
+                                         const VolumeMapState *previous = nullptr,
+                                         const std::vector<LcnRange> *dirty = nullptr) {
+    auto state = std::make_shared<VolumeMapState>();
+    SnapshotStatus status = state->files.Open(snapshotPath);
+    if (status != SnapshotStatus::Ok) {
+        return status;
+    }
+    state->generation = generation;
+    state->snapshotPath = snapshotPath;
+    const SnapshotHeader &h = state->files.Header();
+    BitmapWords words(state->files.Bitmap(), (size_t)h.bitmapBytes);
+    if (previous && dirty) {
+        state->free.Update(previous->free, words, h.totalClusters, reserved, *dirty);
+    } else {
+        state->free.Build(words, h.totalClusters, reserved);
+    }
+    out = state;
+    return SnapshotStatus::Ok;
+}
+
+// Sort ranges by start and merge the ones that overlap or touch
+inline void NormalizeRanges(std::vector<LcnRange> &ranges) {
+    std::sort(ranges.begin(), ranges.end(), [](const LcnRange &a, const LcnRange &b) { return a.start < b.start; });
+    size_t out = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (out > 0 && ranges[i].start <= ranges[out - 1].end) {
+            ranges[out - 1].end = std::max(ranges[out - 1].end, ranges[i].end);
+        } else {
+            ranges[out++] = ranges[i];
+        }
+    }
+    ranges.resize(out);
+}
+
+class VolumeMap {
+public:
+    // The state to answer a query from; stays valid while the caller holds it
+    std::shared_ptr<const VolumeMapState> Current() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return current;
+    }
+
+    // Make state current. The previous state is released after the lock,
+    // in the caller: if this was its last reference, it is unmapped there.
+    void Publish(std::shared_ptr<const VolumeMapState> state) {
+        std::lock_guard<std::mutex> guard(lock);
+        current.swap(state);
+    }
+
+private:
+    mutable std::mutex lock;
+    std::shared_ptr<const VolumeMapState> current;
+};
+
+// What the refresh needs from the platform
+struct VolumeMapRefreshHooks {
+    // Fill in what a changed path looks like now (exists = false when it is gone)
+    std::function<void(ChangedFile &)> queryFile;
+    // Append every file below a directory that appeared
+    std::function<void(const std::wstring &, std::vector<std::wstring> &)> listDirectory;
+    wchar_t separator = L'\\';
+};
+
+enum class RefreshResult {
+    Unchanged,     // no changes since the current state (and no new bitmap)
+    Refreshed,     // a new state was published
+    NeedsRebuild,  // the change feed does not reach back to the current state
+    Failed
+};
+
+struct RefreshStats {
+    uint64_t changes = 0;         // change feed entries read
+    IncrementalStats incremental;
+    double seconds = 0;
+};
+
+// Bring the map up to date with the change feed and publish the result as
+// a new state, written to nextSnapshotPath. freshBitmap, when given, is a
+// bitmap fetched from the volume since the current state was taken; it
+// replaces the current one before the changes are applied, which corrects
+// drift the feed cannot show (metadata, files outside the map).
+inline RefreshResult RefreshVolumeMap(VolumeMap &map,
+                                      ChangeSource &source,
+                                      const VolumeMapRefreshHooks &hooks,
+                                      const std::vector<uint8_t> *freshBitmap,
+                                      const std::wstring &nextSnapshotPath,
+                                      uint64_t createdTicks,
+                                      const std::vector<LcnRange> &reserved,
+                                      RefreshStats &stats) {
+    auto started = std::chrono::steady_clock::now();
+    std::shared_ptr<const VolumeMapState> current = map.Current();
+    if (!current) {
+        return RefreshResult::Failed;
+    }
+    const SnapshotReader &previous = current->files;
+    const SnapshotHeader &h = previous.Header();
+
+    std::vector<FileChange> changes;
+    ChangePosition next;
+    ChangeReadStatus status = source.Read(previous.ChangeFeedPosition(), changes, next);
+    if (status == ChangeReadStatus::Discontinuous) {
+        return RefreshResult::NeedsRebuild;
+    }
+    if (status != ChangeReadStatus::Ok) {
+        return RefreshResult::Failed;
+    }
+    stats.changes = changes.size();
+    if (changes.empty() && !freshBitmap) {
+        return RefreshResult::Unchanged;
+    }
+    CoalesceChanges(changes);
+
+    IncrementalUpdate update(previous);
+    std::vector<std::wstring> paths;
+    for (const FileChange &c : changes) {
+        if (c.kind == ChangeKind::DirectoryDeleted) {
+            update.DropDirectory(c.path, hooks.separator);
+        } else if (c.kind == ChangeKind::DirectoryAdded) {
+            update.DropDirectory(c.path, hooks.separator);
+            hooks.listDirectory(c.path, paths);
+        } else {
+            paths.push_back(c.path);
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+    for (const std::wstring &path : paths) {
+        ChangedFile cf;
+        cf.path = path;
+        hooks.queryFile(cf);
+        update.SetFile(std::move(cf));
+    }
+
+    std::vector<uint8_t> bitmap;
+    if (freshBitmap) {
+        bitmap = *freshBitmap;
+    } else {
+        bitmap.assign(previous.Bitmap(), previous.Bitmap() + h.bitmapBytes);
+    }
+    std::vector<LcnRange> dirty;
+    update.ApplyToBitmap(bitmap, &dirty);
+    NormalizeRanges(dirty);
+    SnapshotWriter writer(h.volumeSerial, h.totalClusters, h.bytesPerCluster);
+    writer.SetChangePosition(next);
+    update.Write(writer);
+    if (!writer.Write(nextSnapshotPath, bitmap.data(), createdTicks)) {
+        return RefreshResult::Failed;
+    }
+    std::vector<uint8_t>().swap(bitmap);
+
+    std::shared_ptr<VolumeMapState> state;
+    // A fresh bitmap may differ anywhere: index it from scratch
+    if (OpenVolumeMapState(nextSnapshotPath, current->generation + 1, reserved, state, current.get(),
+                           freshBitmap ? nullptr : &dirty) != SnapshotStatus::Ok) {
+        return RefreshResult::Failed;
+    }
+    state->deleteOnRelease = true;
+    stats.incremental = update.stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    state->buildSeconds = stats.seconds;
+    current.reset();
+    map.Publish(state);
+    return RefreshResult::Refreshed;
+}
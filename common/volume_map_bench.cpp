@@ -0,0 +1,322 @@
+// Volume-map service benchmark on a simulated volume
+//
+//   volume_map_bench <scratch-dir> [files = 200000] [terabytes = 1] [clients = 4] [seconds = 3]
+//
+// Writes a snapshot of a simulated volume and a synthetic file set, loads it
+// into a VolumeMap and serves it on a local socket in <scratch-dir>. Then:
+//
+//   1. checks answers over the socket against the bitmap and the file set:
+//      the largest free run against a bit-by-bit scan, FreeNear against the
+//      bitmap and the nearest free cluster, FileExtents against the files
+//   2. runs `clients` connections issuing a mix of queries for `seconds`
+//      while the main thread refreshes the map from a change log every
+//      250 ms, and reports throughput and latency percentiles
+//   3. checks that the changed files are answered with their new extents,
+//      that the generation counts the refreshes and that the free-run index,
+//      patched at every refresh, matches one built from scratch
+
+#include "simulated_volume.h"
+#include "volume_map_server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+
+struct SyntheticFile {
+    std::wstring path;
+    uint64_t size;
+    uint64_t lastWriteTicks;
+    std::vector<ExtentRun> runs;
+};
+
+static void MakeRuns(std::mt19937_64 &rng, uint64_t totalClusters, SyntheticFile &f) {
+    f.runs.clear();
+    unsigned pieces = (rng() % 100 < 70) ? 1 : 2 + (unsigned)(rng() % 40);
+    int64_t vcn = 0;
+    int64_t lcn = (int64_t)(rng() % (totalClusters - 100000));
+    for (unsigned p = 0; p < pieces; p++) {
+        int64_t count = 1 + (int64_t)(rng() % 64);
+        f.runs.push_back(ExtentRun{vcn, lcn, count});
+        vcn += count;
+        lcn = (rng() % 4 == 0) ? (int64_t)(rng() % (totalClusters - 100000)) : lcn + count + (int64_t)(rng() % 2048);
+    }
+    f.size = (uint64_t)vcn * 4096 - rng() % 4096;
+}
+
+static bool SameRuns(const std::vector<ExtentRun> &a, const std::vector<ExtentRun> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].vcn != b[i].vcn || a[i].lcn != b[i].lcn || a[i].count != b[i].count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool IsFreeBit(const uint8_t *bitmap, uint64_t lcn) { return ((bitmap[lcn / 8] >> (lcn % 8)) & 1) == 0; }
+
+static std::wstring Widen(const std::string &s) { return std::wstring(s.begin(), s.end()); }
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: volume_map_bench <scratch-dir> [files] [terabytes] [clients] [seconds]\n";
+        return 1;
+    }
+    std::string dir = argv[1];
+    uint64_t fileCount = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 200000;
+    uint64_t terabytes = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 1;
+    unsigned clients = argc > 4 ? (unsigned)std::strtoul(argv[4], nullptr, 10) : 4;
+    double seconds = argc > 5 ? std::strtod(argv[5], nullptr) : 3;
+    if (fileCount < 1000 || terabytes == 0 || clients == 0) {
+        std::cerr << "at least 1000 files, 1 TB and 1 client\n";
+        return 1;
+    }
+    uint64_t totalClusters = (terabytes << 40) / 4096;
+    std::string socketPath = dir + "/vmap.sock";
+    std::string logPath = dir + "/vmap-changes.log";
+    std::wstring basePath = Widen(dir + "/vmap-base.snap");
+    std::vector<LcnRange> reserved = {LcnRange{totalClusters / 4, totalClusters / 4 + totalClusters / 64}}; // an "MFT zone"
+
+    // The volume, the files and the first snapshot
+    SimulatedVolume volume(totalClusters, 0x5A4F);
+    std::vector<uint8_t> bitmap((size_t)((totalClusters + 7) / 8));
+    volume.ReadBytes(0, bitmap.data(), bitmap.size());
+    std::mt19937_64 rng(0x5EED);
+    std::vector<SyntheticFile> files((size_t)fileCount);
+    std::unordered_map<std::wstring, size_t> byPath;
+    for (uint64_t i = 0; i < fileCount; i++) {
+        SyntheticFile &f = files[(size_t)i];
+        f.path = L"C:\\dir" + std::to_wstring(i / 1000) + L"\\file" + std::to_wstring(i) + L".dat";
+        f.lastWriteTicks = 100;
+        MakeRuns(rng, totalClusters, f);
+        byPath[f.path] = (size_t)i;
+    }
+    std::remove(logPath.c_str());
+    std::ofstream(logPath).close();
+    ChangeLogSource source(Widen(logPath));
+    ChangePosition start;
+    if (!source.Current(start)) {
+        std::cerr << "cannot read the change log\n";
+        return 1;
+    }
+    SnapshotWriter writer(1, totalClusters, 4096);
+    for (const SyntheticFile &f : files) {
+        writer.AddFile(f.path.data(), f.path.size(), f.size, f.lastWriteTicks, f.runs.data(), f.runs.size());
+    }
+    writer.SetChangePosition(start);
+    if (!writer.Write(basePath, bitmap.data(), 1)) {
+        std::cerr << "cannot write the base snapshot\n";
+        return 1;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    VolumeMap map;
+    std::shared_ptr<VolumeMapState> first;
+    if (OpenVolumeMapState(basePath, 0, reserved, first) != SnapshotStatus::Ok) {
+        std::cerr << "cannot load the base snapshot\n";
+        return 1;
+    }
+    map.Publish(first);
+    double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    uint64_t freeRuns = first->free.RunCount();
+    first.reset();
+
+    LocalSocket::Startup();
+    VolumeMapServer server(map);
+    if (!server.Start(socketPath)) {
+        std::cerr << "cannot listen on " << socketPath << "\n";
+        return 1;
+    }
+
+    // 1. Answers against the bitmap and the files
+    uint64_t mismatches = 0;
+    VolumeMapClient client;
+    if (!client.Connect(socketPath)) {
+        std::cerr << "cannot connect to " << socketPath << "\n";
+        return 1;
+    }
+    FreeExtent largest;
+    uint64_t scanLargest = 0;
+    uint64_t runLength = 0;
+    for (uint64_t c = 0; c < totalClusters; c++) {
+        bool usable = IsFreeBit(bitmap.data(), c) && !IsReservedLcn(reserved, c);
+        runLength = usable ? runLength + 1 : 0;
+        scanLargest = std::max(scanLargest, runLength);
+    }
+    if (client.LargestFreeRun(largest) != VmapStatus::Ok || largest.length != scanLargest) {
+        mismatches++;
+    }
+    std::vector<FreeExtent> near;
+    for (int q = 0; q < 1000; q++) {
+        uint64_t lcn = rng() % totalClusters;
+        uint64_t wanted = 1 + rng() % 4096;
+        if (client.FreeNear(lcn, wanted, 64, near) != VmapStatus::Ok || near.empty()) {
+            mismatches++;
+            continue;
+        }
+        uint64_t got = 0;
+        for (const FreeExtent &r : near) {
+            for (uint64_t c = r.start; c < r.start + r.length; c++) {
+                mismatches += (IsFreeBit(bitmap.data(), c) && !IsReservedLcn(reserved, c)) ? 0 : 1;
+            }
+            got += r.length;
+        }
+        // Fewer clusters only when the run limit was hit
+        mismatches += (got == wanted || near.size() == 64) ? 0 : 1;
+        // The first run holds the usable free cluster nearest to lcn
+        uint64_t nearest = ~0ULL;
+        for (uint64_t d = 0; nearest == ~0ULL && d < totalClusters; d++) {
+            if (lcn >= d && IsFreeBit(bitmap.data(), lcn - d) && !IsReservedLcn(reserved, lcn - d)) {
+                nearest = d;
+            } else if (lcn + d < totalClusters && IsFreeBit(bitmap.data(), lcn + d) && !IsReservedLcn(reserved, lcn + d)) {
+                nearest = d;
+            }
+        }
+        const FreeExtent &r = near[0];
+        uint64_t distance = lcn < r.start ? r.start - lcn : (lcn < r.start + r.length ? 0 : lcn - (r.start + r.length - 1));
+        mismatches += distance == nearest ? 0 : 1;
+    }
+    VmapFileReply fileReply;
+    std::vector<ExtentRun> runs;
+    for (size_t i = 0; i < files.size(); i += 7) {
+        if (client.FileExtents(files[i].path, fileReply, runs) != VmapStatus::Ok || fileReply.size != files[i].size ||
+            !SameRuns(runs, files[i].runs)) {
+            mismatches++;
+        }
+    }
+    bool missOk = client.FileExtents(L"C:\\not\\there.dat", fileReply, runs) == VmapStatus::NotFound;
+    client.Close();
+
+    // 2. Concurrent clients while the map is refreshed
+    std::atomic<bool> stop{false};
+    std::vector<std::vector<double>> latencies(clients);
+    std::vector<uint64_t> failures(clients, 0);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < clients; t++) {
+        threads.emplace_back([&, t] {
+            VolumeMapClient c;
+            if (!c.Connect(socketPath)) {
+                failures[t]++;
+                return;
+            }
+            std::mt19937_64 r(t + 1);
+            std::vector<FreeExtent> n;
+            std::vector<ExtentRun> e;
+            VmapFileReply fr;
+            VmapStatsReply sr;
+            FreeExtent fe;
+            latencies[t].reserve(1 << 20);
+            while (!stop.load(std::memory_order_relaxed)) {
+                unsigned kind = (unsigned)(r() % 10);
+                auto before = std::chrono::steady_clock::now();
+                VmapStatus status;
+                if (kind < 4) {
+                    status = c.FileExtents(files[(size_t)(r() % files.size())].path, fr, e);
+                } else if (kind < 7) {
+                    status = c.FreeNear(r() % totalClusters, 1 + r() % 256, 16, n);
+                } else if (kind < 9) {
+                    status = c.LargestFreeRun(fe);
+                } else {
+                    status = c.Stats(sr);
+                }
+                latencies[t].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - before).count());
+                failures[t] += status == VmapStatus::Ok ? 0 : 1;
+            }
+        });
+    }
+
+    VolumeMapRefreshHooks hooks;
+    std::unordered_map<std::wstring, size_t> changed;
+    hooks.queryFile = [&](ChangedFile &cf) {
+        const SyntheticFile &f = files[byPath[cf.path]];
+        cf.exists = true;
+        cf.size = f.size;
+        cf.lastWriteTicks = f.lastWriteTicks;
+        cf.runs = f.runs;
+    };
+    hooks.listDirectory = [](const std::wstring &, std::vector<std::wstring> &) {};
+    uint64_t refreshes = 0;
+    double refreshSeconds = 0;
+    auto runStarted = std::chrono::steady_clock::now();
+    while (std::chrono::duration<double>(std::chrono::steady_clock::now() - runStarted).count() < seconds) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        std::wofstream log(logPath, std::ios::app);
+        for (int i = 0; i < 100; i++) {
+            size_t index = (size_t)(rng() % files.size());
+            SyntheticFile &f = files[index];
+            MakeRuns(rng, totalClusters, f);
+            f.lastWriteTicks = 200 + refreshes;
+            changed[f.path] = index;
+            log << L"M " << f.path << L"\n";
+        }
+        log.close();
+        RefreshStats stats;
+        std::wstring next = Widen(dir + "/vmap-" + std::to_string(refreshes + 1) + ".snap");
+        if (RefreshVolumeMap(map, source, hooks, nullptr, next, 2 + refreshes, reserved, stats) != RefreshResult::Refreshed) {
+            std::cerr << "refresh failed\n";
+            mismatches++;
+            break;
+        }
+        refreshes++;
+        refreshSeconds += stats.seconds;
+    }
+    stop = true;
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    double runSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - runStarted).count();
+
+    // 3. The changed files, as the last state has them
+    VmapStatsReply statsReply;
+    if (!client.Connect(socketPath) || client.Stats(statsReply) != VmapStatus::Ok || statsReply.generation != refreshes) {
+        mismatches++;
+    }
+    for (const auto &c : changed) {
+        const SyntheticFile &f = files[c.second];
+        if (client.FileExtents(f.path, fileReply, runs) != VmapStatus::Ok || fileReply.lastWriteTicks != f.lastWriteTicks ||
+            !SameRuns(runs, f.runs)) {
+            mismatches++;
+        }
+    }
+    client.Close();
+    server.Stop();
+
+    // The index patched refresh after refresh against one built from scratch
+    std::shared_ptr<const VolumeMapState> last = map.Current();
+    FreeExtentIndex rebuilt;
+    rebuilt.Build(BitmapWords(last->files.Bitmap(), (size_t)last->files.Header().bitmapBytes), totalClusters, reserved);
+    bool indexOk = rebuilt.RunCount() == last->free.RunCount() && rebuilt.FreeClusters() == last->free.FreeClusters();
+    for (uint64_t i = 0; indexOk && i < rebuilt.RunCount(); i++) {
+        indexOk = rebuilt.RunAt(i).start == last->free.RunAt(i).start && rebuilt.RunAt(i).length == last->free.RunAt(i).length;
+    }
+    last.reset();
+
+    std::vector<double> all;
+    uint64_t failed = 0;
+    for (unsigned t = 0; t < clients; t++) {
+        all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+        failed += failures[t];
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) { return all.empty() ? 0.0 : all[std::min(all.size() - 1, (size_t)(p * all.size()))]; };
+
+    std::cout << "Volume: " << terabytes << " TB (" << totalClusters << " clusters), " << freeRuns << " free runs, "
+              << fileCount << " files\n";
+    std::cout << "Map load (map snapshot + index free runs): " << loadMs << " ms\n";
+    std::cout << "Queries: " << all.size() << " from " << clients << " connections in " << runSeconds << " s = "
+              << (double)all.size() / runSeconds << " per second (" << failed << " failed)\n";
+    std::cout << "Latency: p50 " << percentile(0.5) << " us, p99 " << percentile(0.99) << " us, p99.9 "
+              << percentile(0.999) << " us, max " << (all.empty() ? 0.0 : all.back()) << " us\n";
+    std::cout << "Refreshes while serving: " << refreshes << ", " << changed.size() << " files changed, "
+              << (refreshes ? refreshSeconds / (double)refreshes * 1000 : 0.0) << " ms per refresh\n";
+    std::cout << "Check: " << mismatches << " mismatched answers, unknown path " << (missOk ? "not found" : "FOUND")
+              << ", generation " << statsReply.generation << ", patched index "
+              << (indexOk ? "identical to a rebuild" : "DIFFERS from a rebuild") << "\n";
+    return (mismatches == 0 && missOk && indexOk && failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,414 @@
+#pragma once
+// Binary query protocol of the volume-map service, its server and a client
+//
+// Every message is a 16-byte header followed by payloadBytes of payload,
+// little-endian, fixed-size fields:
+//
+//   request    VmapRequestHeader   payload per op (below)
+//   response   VmapResponseHeader  payload when status is Ok
+//
+//   op                 request payload                 response payload
+//   Stats              -                               VmapStatsReply
+//   LargestFreeRun     -                               FreeExtent
+//   FreeNear           VmapFreeNearRequest             uint32 count, uint32 0, count x FreeExtent
+//   FileExtents        path as UTF-16 code units       VmapFileReply, runCount x ExtentRun
+//
+// A connection carries any number of requests, answered in order; a client
+// may send several before reading the answers. requestId is echoed back.
+// Answers come from one state of the map (see volume_map.h) and carry its
+// generation, so a client can tell when the map was refreshed in between.
+//
+// Each connection is served by a thread of its own, blocked in recv between
+// requests; a request is a binary search or two over memory that is already
+// mapped, so it is answered in microseconds.
+
+#include "local_socket.h"
+#include "volume_map.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+const uint16_t VMAP_PROTOCOL_VERSION = 1;
+const uint32_t VMAP_MAX_REQUEST_BYTES = 64 * 1024; // a path of 32K UTF-16 units fits
+const uint32_t VMAP_MAX_NEAR_RUNS = 4096;
+
+enum class VmapOp : uint16_t {
+    Stats = 1,
+    LargestFreeRun = 2,
+    FreeNear = 3,
+    FileExtents = 4
+};
+
+enum class VmapStatus : uint16_t {
+    Ok = 0,
+    NotFound = 1,       // FileExtents: the path is not in the map
+    BadRequest = 2,     // unknown op, wrong version or malformed payload
+    NotReady = 3,       // no map loaded yet
+    Disconnected = 0xFFFF // client side only: the connection failed
+};
+
+struct VmapRequestHeader {
+    uint32_t payloadBytes;
+    uint16_t op;           // VmapOp
+    uint16_t version;      // VMAP_PROTOCOL_VERSION
+    uint64_t requestId;
+};
+
+struct VmapResponseHeader {
+    uint32_t payloadBytes;
+    uint16_t op;
+    uint16_t status;       // VmapStatus
+    uint64_t requestId;
+};
+
+struct VmapStatsReply {
+    uint64_t generation;
+    uint64_t createdTicks;       // when the state's bitmap was taken (FILETIME ticks)
+    uint64_t totalClusters;
+    uint64_t freeClusters;       // outside reserved ranges
+    uint64_t freeRuns;
+    uint64_t fileCount;
+    uint32_t bytesPerCluster;
+    uint32_t reserved;
+};
+
+struct VmapFreeNearRequest {
+    uint64_t lcn;
+    uint64_t clusters;           // how many free clusters are wanted
+    uint32_t maxRuns;            // in at most this many runs (capped at VMAP_MAX_NEAR_RUNS)
+    uint32_t reserved;
+};
+
+struct VmapFileReply {
+    uint64_t generation;
+    uint64_t size;
+    uint64_t lastWriteTicks;
+    uint64_t clusterCount;
+    uint32_t runCount;           // ExtentRun entries that follow (sparse runs have lcn -1)
+    uint32_t reserved;
+};
+
+static_assert(sizeof(VmapRequestHeader) == 16 && sizeof(VmapResponseHeader) == 16, "wire headers are 16 bytes");
+static_assert(sizeof(FreeExtent) == 16 && sizeof(ExtentRun) == 24, "wire records have no padding");
+
+template <typename T>
+inline void AppendPod(std::vector<uint8_t> &out, const T &value) {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&value);
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+// Answer one request from state (which may be null) into response: header and payload
+inline void AnswerVolumeMapRequest(const VolumeMapState *state,
+                                   const VmapRequestHeader &request,
+                                   const uint8_t *payload,
+                                   std::vector<uint8_t> &response,
+                                   std::vector<ExtentRun> &runs,
+                                   std::vector<FreeExtent> &near) {
+    response.resize(sizeof(VmapResponseHeader));
+    VmapStatus status = VmapStatus::Ok;
+    if (request.version != VMAP_PROTOCOL_VERSION) {
+        status = VmapStatus::BadRequest;
+    } else if (!state) {
+        status = VmapStatus::NotReady;
+    } else {
+        switch ((VmapOp)request.op) {
+        case VmapOp::Stats: {
+            const SnapshotHeader &h = state->files.Header();
+            VmapStatsReply reply = {};
+            reply.generation = state->generation;
+            reply.createdTicks = h.createdTicks;
+            reply.totalClusters = h.totalClusters;
+            reply.freeClusters = state->free.FreeClusters();
+            reply.freeRuns = state->free.RunCount();
+            reply.fileCount = h.fileCount;
+            reply.bytesPerCluster = h.bytesPerCluster;
+            AppendPod(response, reply);
+            break;
+        }
+        case VmapOp::LargestFreeRun:
+            AppendPod(response, state->free.Largest());
+            break;
+        case VmapOp::FreeNear: {
+            VmapFreeNearRequest q;
+            if (request.payloadBytes != sizeof(q)) {
+                status = VmapStatus::BadRequest;
+                break;
+            }
+            std::memcpy(&q, payload, sizeof(q));
+            state->free.Near(q.lcn, q.clusters, std::min(q.maxRuns, VMAP_MAX_NEAR_RUNS), near);
+            AppendPod(response, (uint32_t)near.size());
+            AppendPod(response, (uint32_t)0);
+            for (const FreeExtent &r : near) {
+                AppendPod(response, r);
+            }
+            break;
+        }
+        case VmapOp::FileExtents: {
+            if (request.payloadBytes % 2 != 0) {
+                status = VmapStatus::BadRequest;
+                break;
+            }
+            // The payload is not necessarily aligned for uint16_t
+            std::vector<uint16_t> path(request.payloadBytes / 2);
+            std::memcpy(path.data(), payload, request.payloadBytes);
+            const SnapshotFileRecord *r = state->files.FindUtf16(path.data(), path.size());
+            if (!r) {
+                status = VmapStatus::NotFound;
+                break;
+            }
+            if (!state->files.DecodeExtents(*r, runs)) {
+                status = VmapStatus::NotFound; // corrupt record
+                break;
+            }
+            VmapFileReply reply = {};
+            reply.generation = state->generation;
+            reply.size = r->size;
+            reply.lastWriteTicks = r->lastWriteTicks;
+            reply.clusterCount = r->clusterCount;
+            reply.runCount = (uint32_t)runs.size();
+            AppendPod(response, reply);
+            for (const ExtentRun &run : runs) {
+                AppendPod(response, run);
+            }
+            break;
+        }
+        default:
+            status = VmapStatus::BadRequest;
+            break;
+        }
+    }
+    if (status != VmapStatus::Ok) {
+        response.resize(sizeof(VmapResponseHeader));
+    }
+    VmapResponseHeader header;
+    header.payloadBytes = (uint32_t)(response.size() - sizeof(VmapResponseHeader));
+    header.op = request.op;
+    header.status = (uint16_t)status;
+    header.requestId = request.requestId;
+    std::memcpy(response.data(), &header, sizeof(header));
+}
+
+class VolumeMapServer {
+public:
+    explicit VolumeMapServer(const VolumeMap &map) : map(map) {}
+    ~VolumeMapServer() { Stop(); }
+
+    bool Start(const std::string &socketPath) {
+        if (!listener.Listen(socketPath)) {
+            return false;
+        }
+        acceptThread = std::thread([this] { AcceptLoop(); });
+        return true;
+    }
+
+    // Stop accepting, disconnect every client and wait for their threads
+    void Stop() {
+        if (!acceptThread.joinable()) {
+            return;
+        }
+        stopping = true;
+        listener.Shutdown();
+        acceptThread.join();
+        listener.Close();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto &c : connections) {
+                c->socket.Shutdown();
+            }
+        }
+        for (auto &c : connections) {
+            c->thread.join();
+        }
+        connections.clear();
+    }
+
+    uint64_t RequestsServed() const { return served.load(std::memory_order_relaxed); }
+    uint64_t ConnectionsAccepted() const { return accepted.load(std::memory_order_relaxed); }
+
+private:
+    struct Connection {
+        LocalSocket socket;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    void AcceptLoop() {
+        while (!stopping) {
+            LocalSocket client = listener.Accept();
+            if (!client.IsOpen()) {
+                if (stopping) {
+                    break;
+                }
+                continue;
+            }
+            accepted++;
+            std::lock_guard<std::mutex> guard(lock);
+            ReapFinished();
+            auto c = std::make_unique<Connection>();
+            c->socket = std::move(client);
+            Connection *raw = c.get();
+            c->thread = std::thread([this, raw] {
+                Serve(raw->socket);
+                raw->done = true;
+            });
+            connections.push_back(std::move(c));
+        }
+    }
+
+    // Join the threads of connections that have closed (under lock)
+    void ReapFinished() {
+        size_t out = 0;
+        for (size_t i = 0; i < connections.size(); i++) {
+            if (connections[i]->done) {
+                connections[i]->thread.join();
+            } else {
+                connections[out++] = std::move(connections[i]);
+            }
+        }
+        connections.resize(out);
+    }
+
+    void Serve(LocalSocket &socket) {
+        std::vector<uint8_t> payload;
+        std::vector<uint8_t> response;
+        std::vector<ExtentRun> runs;
+        std::vector<FreeExtent> near;
+        VmapRequestHeader request;
+        while (socket.ReceiveAll(&request, sizeof(request))) {
+            if (request.payloadBytes > VMAP_MAX_REQUEST_BYTES) {
+                break; // not a client of this protocol
+            }
+            payload.resize(request.payloadBytes);
+            if (request.payloadBytes > 0 && !socket.ReceiveAll(payload.data(), payload.size())) {
+                break;
+            }
+            std::shared_ptr<const VolumeMapState> state = map.Current();
+            AnswerVolumeMapRequest(state.get(), request, payload.data(), response, runs, near);
+            state.reset();
+            if (!socket.SendAll(response.data(), response.size())) {
+                break;
+            }
+            served.fetch_add(1, std::memory_order_relaxed);
+        }
+        socket.Shutdown();
+    }
+
+    const VolumeMap &map;
+    LocalSocket listener;
+    std::thread acceptThread;
+    std::atomic<bool> stopping{false};
+    std::mutex lock;
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::atomic<uint64_t> served{0};
+    std::atomic<uint64_t> accepted{0};
+};
+
+// One connection to the service; not shared between threads
+class VolumeMapClient {
+public:
+    bool Connect(const std::string &socketPath) { return socket.Connect(socketPath); }
+    void Close() { socket.Close(); }
+
+    VmapStatus Stats(VmapStatsReply &out) {
+        VmapStatus status = Call(VmapOp::Stats, nullptr, 0);
+        if (status == VmapStatus::Ok && !Read(out)) {
+            return VmapStatus::Disconnected;
+        }
+        return status;
+    }
+
+    VmapStatus LargestFreeRun(FreeExtent &out) {
+        VmapStatus status = Call(VmapOp::LargestFreeRun, nullptr, 0);
+        if (status == VmapStatus::Ok && !Read(out)) {
+            return VmapStatus::Disconnected;
+        }
+        return status;
+    }
+
+    VmapStatus FreeNear(uint64_t lcn, uint64_t clusters, uint32_t maxRuns, std::vector<FreeExtent> &out) {
+        VmapFreeNearRequest q = {};
+        q.lcn = lcn;
+        q.clusters = clusters;
+        q.maxRuns = maxRuns;
+        VmapStatus status = Call(VmapOp::FreeNear, &q, sizeof(q));
+        out.clear();
+        if (status != VmapStatus::Ok) {
+            return status;
+        }
+        uint32_t count[2];
+        if (!Read(count) || reply.size() != sizeof(count) + (size_t)count[0] * sizeof(FreeExtent)) {
+            return VmapStatus::Disconnected;
+        }
+        out.resize(count[0]);
+        std::memcpy(out.data(), reply.data() + sizeof(count), out.size() * sizeof(FreeExtent));
+        return status;
+    }
+
+    VmapStatus FileExtents(const std::wstring &path, VmapFileReply &out, std::vector<ExtentRun> &runs) {
+        key.clear();
+        snapshot_detail::AppendUtf16(key, path.data(), path.size());
+        VmapStatus status = Call(VmapOp::FileExtents, key.data(), (uint32_t)(key.size() * sizeof(uint16_t)));
+        runs.clear();
+        if (status != VmapStatus::Ok) {
+            return status;
+        }
+        if (!Read(out) || reply.size() != sizeof(out) + (size_t)out.runCount * sizeof(ExtentRun)) {
+            return VmapStatus::Disconnected;
+        }
+        runs.resize(out.runCount);
+        std::memcpy(runs.data(), reply.data() + sizeof(out), runs.size() * sizeof(ExtentRun));
+        return status;
+    }
+
+private:
+    // Send one request and wait for its answer; the payload is left in reply
+    VmapStatus Call(VmapOp op, const void *payload, uint32_t payloadBytes) {
+        if (payloadBytes > VMAP_MAX_REQUEST_BYTES) {
+            return VmapStatus::BadRequest;
+        }
+        VmapRequestHeader request;
+        request.payloadBytes = payloadBytes;
+        request.op = (uint16_t)op;
+        request.version = VMAP_PROTOCOL_VERSION;
+        request.requestId = ++lastRequestId;
+        // One send per request: header and payload together
+        message.resize(sizeof(request) + payloadBytes);
+        std::memcpy(message.data(), &request, sizeof(request));
+        if (payloadBytes > 0) {
+            std::memcpy(message.data() + sizeof(request), payload, payloadBytes);
+        }
+        VmapResponseHeader response;
+        if (!socket.SendAll(message.data(), message.size()) || !socket.ReceiveAll(&response, sizeof(response)) ||
+            response.requestId != request.requestId) {
+            socket.Close();
+            return VmapStatus::Disconnected;
+        }
+        reply.resize(response.payloadBytes);
+        if (response.payloadBytes > 0 && !socket.ReceiveAll(reply.data(), reply.size())) {
+            socket.Close();
+            return VmapStatus::Disconnected;
+        }
+        return (VmapStatus)response.status;
+    }
+
+    template <typename T>
+    bool Read(T &out) const {
+        if (reply.size() < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&out, reply.data(), sizeof(T));
+        return true;
+    }
+
+    LocalSocket socket;
+    uint64_t lastRequestId = 0;
+    std::vector<uint8_t> message;
+    std::vector<uint8_t> reply;
+    std::vector<uint16_t> key;
+};
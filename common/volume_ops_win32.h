@@ -0,0 +1,149 @@
+#pragma once
+// The volume calls of move_engine.h on a real volume
+//
+// Win32VolumeOps issues FSCTL_GET_VOLUME_BITMAP, FSCTL_GET_RETRIEVAL_POINTERS
+// and FSCTL_MOVE_FILE. Files are named by their open handle. With a trace
+// writer that is open, every call is recorded with its reply, along with
+// the path, size and compression unit of each file opened, so the run can
+// be replayed against a TraceVolume (see io_trace.h). Windows only, like
+// the tools that include it.
+
+#include <windows.h>
+#include <winioctl.h>
+
+#include "async_log.h"
+#include "move_engine.h"
+
+class Win32VolumeOps : public VolumeOps {
+public:
+    HANDLE volumeHandle = INVALID_HANDLE_VALUE; // bitmap range 0 and every move
+    std::wstring volumePath;                    // opened again for the other bitmap ranges
+    IoTraceWriter *trace = nullptr;             // recorded to while open
+
+    static uint64_t FileOf(HANDLE h) { return (uint64_t)(uintptr_t)h; }
+    static HANDLE HandleOf(uint64_t file) { return (HANDLE)(uintptr_t)file; }
+
+    // Compression unit of an NTFS-compressed file in clusters, 0 for any other file
+    static uint32_t CompressionUnitClusters(HANDLE hFile) {
+        FILE_COMPRESSION_INFO info = {};
+        if (!GetFileInformationByHandleEx(hFile, FileCompressionInfo, &info, sizeof(info)) ||
+            info.CompressionFormat == COMPRESSION_FORMAT_NONE || info.CompressionUnitShift <= info.ClusterShift) {
+            return 0;
+        }
+        return 1u << (info.CompressionUnitShift - info.ClusterShift);
+    }
+
+    // Calls name files by handle; bind a freshly opened handle to its path
+    void Opened(HANDLE hFile, const std::wstring &filePath) {
+        if (!trace || !trace->IsOpen() || hFile == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER size = {};
+        GetFileSizeEx(hFile, &size);
+        uint32_t id = trace->AddFile(filePath.data(), filePath.size(), (uint64_t)size.QuadPart,
+                                     CompressionUnitClusters(hFile));
+        trace->BindHandle(FileOf(hFile), id);
+    }
+
+    // Range 0 uses volumeHandle, every other range opens its own handle on
+    // volumePath (calls on one handle would be serialized)
+    std::unique_ptr<BitmapSource> Bitmap(unsigned range) override {
+        if (range == 0) {
+            return std::unique_ptr<BitmapSource>(new Source(volumeHandle, false, Recording()));
+        }
+        HANDLE hRange = CreateFileW(volumePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                    OPEN_EXISTING, 0, NULL);
+        if (hRange == INVALID_HANDLE_VALUE) {
+            LOG(LogLevel::Error, L"Failed to open volume " << volumePath << L" for a bitmap range (Error "
+                                 << GetLastError() << L")");
+            return nullptr;
+        }
+        return std::unique_ptr<BitmapSource>(new Source(hRange, true, Recording()));
+    }
+
+    // The reply is read into the thread arena's ioctl buffer
+    uint32_t Retrieval(uint64_t file, int64_t startingVcn, std::vector<ExtentRun> &runs) override {
+        ScratchArena &arena = ScratchArena::ForThread();
+        STARTING_VCN_INPUT_BUFFER inBuf = {};
+        inBuf.StartingVcn.QuadPart = startingVcn;
+        DWORD bytesReturned = 0;
+        BOOL ok = DeviceIoControl(HandleOf(file), FSCTL_GET_RETRIEVAL_POINTERS, &inBuf, sizeof(inBuf),
+                                  arena.IoctlBuffer(), arena.IoctlBufferSize(), &bytesReturned, NULL);
+        DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+        runs.clear();
+        if (error == ERROR_SUCCESS || error == ERROR_MORE_DATA) {
+            if (bytesReturned < sizeof(RETRIEVAL_POINTERS_BUFFER)) {
+                error = ERROR_INVALID_DATA; // not even the header
+            } else {
+                auto pRet = static_cast<const RETRIEVAL_POINTERS_BUFFER *>(arena.IoctlBuffer());
+                LONGLONG vcn = pRet->StartingVcn.QuadPart;
+                for (DWORD i = 0; i < pRet->ExtentCount; i++) {
+                    LONGLONG nextVcn = pRet->Extents[i].NextVcn.QuadPart;
+                    runs.push_back(ExtentRun{vcn, pRet->Extents[i].Lcn.QuadPart, nextVcn - vcn});
+                    vcn = nextVcn;
+                }
+            }
+        }
+        if (Recording()) {
+            trace->AddRetrieval(trace->HandleFile(file), startingVcn, error, runs.data(), runs.size());
+        }
+        return error;
+    }
+
+    uint32_t Move(uint64_t file, int64_t vcn, int64_t lcn, int64_t count) override {
+        MOVE_FILE_DATA moveData = {};
+        moveData.FileHandle = HandleOf(file);
+        moveData.StartingVcn.QuadPart = vcn;  // which VCN in file
+        moveData.StartingLcn.QuadPart = lcn;  // destination LCN on disk
+        moveData.ClusterCount = (DWORD)count; // a run, or a whole compression unit
+        DWORD bytesReturned = 0;
+        BOOL ok = DeviceIoControl(volumeHandle, FSCTL_MOVE_FILE, &moveData, sizeof(moveData), NULL, 0,
+                                  &bytesReturned, NULL);
+        DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+        if (Recording()) {
+            trace->AddMove(trace->HandleFile(file), vcn, lcn, count, error);
+        }
+        return error;
+    }
+
+private:
+    IoTraceWriter *Recording() const { return trace && trace->IsOpen() ? trace : nullptr; }
+
+    // FSCTL_GET_VOLUME_BITMAP on one volume handle
+    class Source : public BitmapSource {
+    public:
+        Source(HANDLE volumeHandle, bool ownsHandle, IoTraceWriter *trace)
+            : volumeHandle(volumeHandle), ownsHandle(ownsHandle), trace(trace) {}
+        ~Source() override {
+            if (ownsHandle) {
+                CloseHandle(volumeHandle);
+            }
+        }
+
+        IoStatus Read(int64_t startingLcn, void *out, uint32_t outSize, uint32_t &bytesReturned) override {
+            STARTING_LCN_INPUT_BUFFER inBuf = {};
+            inBuf.StartingLcn.QuadPart = startingLcn;
+            DWORD returned = 0;
+            BOOL ok = DeviceIoControl(volumeHandle, FSCTL_GET_VOLUME_BITMAP, &inBuf, sizeof(inBuf), out, outSize,
+                                      &returned, NULL);
+            DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+            bytesReturned = returned;
+            IoStatus status = IoStatus::Success;
+            if (error == ERROR_MORE_DATA) {
+                status = IoStatus::MoreData;
+            } else if (!ok) {
+                LOG(LogLevel::Error, L"FSCTL_GET_VOLUME_BITMAP failed (Error " << error << L")");
+                status = IoStatus::Failed;
+            }
+            if (trace) {
+                trace->AddBitmap(startingLcn, error, out, returned);
+            }
+            return status;
+        }
+
+    private:
+        HANDLE volumeHandle;
+        bool ownsHandle;
+        IoTraceWriter *trace;
+    };
+};
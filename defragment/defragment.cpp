@@ -6,11 +6,59 @@
 #include <cstdlib>
 #include <ctime>
 #include <limits>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <map>
+#include <cwctype>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#if defined(_M_X64) || defined(__x86_64__)
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32C_TARGET
+#else
+#include <cpuid.h>
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif
+#endif
+
+#include "../common/directory_walker.h"
+#include "../common/entry_filter.h"
+#include "../common/scratch_arena.h"
+#include "../common/bitmap_fetch.h"
+#include "../common/volume_geometry.h"
+#include "../common/free_run.h"
+#include "../common/snapshot.h"
+#include "../common/incremental.h"
+#include "../common/fragmentation_report.h"
+#include "../common/read_cost.h"
+#include "../common/io_trace.h"
+#include "../common/extent_plan.h"
+#include "../common/move_engine.h"
+#include "../common/volume_ops_win32.h"
+#include "../common/cluster_map.h"
+#include "../common/bitmap_diff.h"
+#include "../common/staged_pipeline.h"
+#include "../common/async_log.h"
+#include "../common/command_line.h"
 
 // Print a Windows error message
 static void PrintLastError(const wchar_t *msgPrefix) {
     DWORD errCode = GetLastError();
-    std::wcerr << msgPrefix << L" (Error " << errCode << L")" << std::endl;
+    LOG(LogLevel::Error, msgPrefix << L" (Error " << errCode << L")");
     LPWSTR errText = nullptr;
     FormatMessageW(
         FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
@@ -21,7 +69,7 @@ static void PrintLastError(const wchar_t *msgPrefix) {
         0,
         NULL);
     if (errText) {
-        std::wcerr << L"Reason: " << errText << std::endl;
+        LOG(LogLevel::Error, L"Reason: " << errText);
         LocalFree(errText);
     }
 }
@@ -59,450 +107,2263 @@ bool EnablePrivilege(const wchar_t *privName) {
     return true;
 }
 
-// Volume information
-bool GetVolumeClusterInfo(const std::wstring &rootPath, ULONGLONG &totalClusters, DWORD &bytesPerCluster) {
+// Volume geometry from FSCTL_GET_NTFS_VOLUME_DATA: 64-bit cluster counts and
+// the MFT zone. GetDiskFreeSpaceW reports clusters as DWORDs, which truncates
+// volumes with more than 2^32 clusters, so it only supplies the cluster size
+// (with GetDiskFreeSpaceExW for the totals) when the volume is not NTFS.
+bool GetVolumeGeometry(HANDLE volumeHandle, const std::wstring &rootPath, VolumeGeometry &geometry) {
+    geometry = VolumeGeometry();
+    NTFS_VOLUME_DATA_BUFFER data = {};
+    DWORD bytesReturned = 0;
+    if (DeviceIoControl(volumeHandle, FSCTL_GET_NTFS_VOLUME_DATA, NULL, 0, &data, sizeof(data), &bytesReturned, NULL)) {
+        geometry.isNtfs = true;
+        geometry.volumeSerial = (ULONGLONG)data.VolumeSerialNumber.QuadPart;
+        geometry.totalClusters = (ULONGLONG)data.TotalClusters.QuadPart;
+        geometry.freeClusters = (ULONGLONG)data.FreeClusters.QuadPart;
+        geometry.bytesPerSector = data.BytesPerSector;
+        geometry.bytesPerCluster = data.BytesPerCluster;
+        geometry.bytesPerFileRecord = data.BytesPerFileRecordSegment;
+        geometry.mftStartLcn = (ULONGLONG)data.MftStartLcn.QuadPart;
+        geometry.mft2StartLcn = (ULONGLONG)data.Mft2StartLcn.QuadPart;
+        geometry.mftValidDataLength = (ULONGLONG)data.MftValidDataLength.QuadPart;
+        geometry.mftZoneStart = (ULONGLONG)data.MftZoneStart.QuadPart;
+        geometry.mftZoneEnd = (ULONGLONG)data.MftZoneEnd.QuadPart;
+        return true;
+    }
+
     DWORD sectorsPerCluster = 0;
     DWORD bytesPerSector = 0;
     DWORD numberOfFreeClusters = 0;
     DWORD totalNumberOfClusters = 0;
-    if (!GetDiskFreeSpaceW(rootPath.c_str(),
-                           &sectorsPerCluster,
-                           &bytesPerSector,
-                           &numberOfFreeClusters,
-                           &totalNumberOfClusters)) {
+    ULARGE_INTEGER freeBytes = {};
+    ULARGE_INTEGER totalBytes = {};
+    ULARGE_INTEGER totalFreeBytes = {};
+    if (!GetDiskFreeSpaceW(rootPath.c_str(), &sectorsPerCluster, &bytesPerSector,
+                           &numberOfFreeClusters, &totalNumberOfClusters) ||
+        !GetDiskFreeSpaceExW(rootPath.c_str(), &freeBytes, &totalBytes, &totalFreeBytes)) {
         PrintLastError(L"GetDiskFreeSpaceW failed");
         return false;
     }
-    totalClusters = static_cast<ULONGLONG>(totalNumberOfClusters);
-    bytesPerCluster = sectorsPerCluster * bytesPerSector;
+    geometry.bytesPerSector = bytesPerSector;
+    geometry.bytesPerCluster = sectorsPerCluster * bytesPerSector;
+    if (geometry.bytesPerCluster == 0) {
+        return false;
+    }
+    geometry.totalClusters = totalBytes.QuadPart / geometry.bytesPerCluster;
+    geometry.freeClusters = totalFreeBytes.QuadPart / geometry.bytesPerCluster;
+    DWORD serial = 0;
+    if (GetVolumeInformationW(rootPath.c_str(), NULL, 0, &serial, NULL, NULL, NULL, 0)) {
+        geometry.volumeSerial = serial;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Volume calls
+//   Bitmap reads, extent queries and moves go through g_volumeOps, so the
+//   planning and the move executor are the ones fragment and the trace
+//   replay run (see common/move_engine.h). With a trace file, every call is
+//   recorded with its reply, along with the path, size and compression unit
+//   of each file opened, so the run can be replayed against a simulated
+//   volume (see common/io_trace.h).
+// -----------------------------------------------------------------------------
+static IoTraceWriter g_ioTrace;
+static Win32VolumeOps g_volumeOps;
+
+// First-fit planning state: the ranges placement never allocates from (the
+// MFT zone), set once from the volume geometry before anything is placed,
+// the optional read-cost gate, and the extent planning counts
+static FirstFitPlanner g_planner;
+
+// Read all extents of a file (even if very fragmented) into the thread arena's
+// runs. Sparse runs are left out.
+static bool ReadFileRetrievalRuns(HANDLE fileHandle, size_t &clusterCount) {
+    DWORD error = ReadFileRuns(g_volumeOps, Win32VolumeOps::FileOf(fileHandle), clusterCount);
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        PrintLastError(L"FSCTL_GET_RETRIEVAL_POINTERS failed");
+        return false;
+    }
     return true;
 }
 
-// Retrieve the NTFS volume bitmap (1=allocated,0=free) in chunks
-bool GetVolumeBitmapChunked(HANDLE volumeHandle, ULONGLONG totalClusters, std::vector<BYTE> &outBitmap) {
-    outBitmap.clear();
-    outBitmap.resize(static_cast<size_t>((totalClusters + 7) / 8), 0);
+// Retrieve all extents for a file as one entry per cluster
+bool GetAllFileRetrievalPointers(HANDLE fileHandle, FileClusters &outClusters) {
+    DWORD error = ReadFileClusters(g_volumeOps, Win32VolumeOps::FileOf(fileHandle), outClusters);
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        PrintLastError(L"FSCTL_GET_RETRIEVAL_POINTERS failed");
+        return false;
+    }
+    return true;
+}
 
-    STARTING_LCN_INPUT_BUFFER inBuf = {};
-    inBuf.StartingLcn.QuadPart = 0; // start at LCN 0
-    const size_t BUF_SIZE = 64 * 1024;
-    std::vector<BYTE> tempBuf(BUF_SIZE, 0);
-    LONGLONG maxLCN = (LONGLONG)totalClusters - 1;
+// Check if a given cluster index is free in the bitmap
+static bool IsClusterFree(const std::vector<BYTE> &bitmap, ULONGLONG clusterIndex) {
+    size_t byteIndex = (size_t)(clusterIndex / 8);
+    int bitOffset = (int)(clusterIndex % 8);
+    int bitVal = (bitmap[byteIndex] >> bitOffset) & 1;
+    return (bitVal == 0);
+}
 
-    while (true) {
-        ZeroMemory(tempBuf.data(), tempBuf.size());
-        DWORD bytesReturned = 0;
-        BOOL success = DeviceIoControl(
-            volumeHandle,
-            FSCTL_GET_VOLUME_BITMAP,
-            &inBuf,
-            sizeof(inBuf),
-            tempBuf.data(),
-            (DWORD)tempBuf.size(),
-            &bytesReturned,
-            NULL);
-
-        DWORD dwErr = GetLastError();
-        if (bytesReturned < sizeof(VOLUME_BITMAP_BUFFER)) {
-            if (!success) {
-                PrintLastError(L"FSCTL_GET_VOLUME_BITMAP failed (no valid header)");
-            } else {
-                std::wcerr << L"Unexpected: not enough data for VOLUME_BITMAP_BUFFER.\n";
-            }
-            break;
+// Scan [fromLcn, toLcn) for a run of free clusters of a certain size,
+// 64 clusters at a time, stepping over reserved ranges
+static bool ScanForFreeRun(const std::vector<BYTE> &volumeBitmap,
+                           ULONGLONG fromLcn,
+                           ULONGLONG toLcn,
+                           ULONGLONG clustersNeeded,
+                           ULONGLONG &outBlockStart) {
+    uint64_t blockStart = 0;
+    if (!FindFreeBlock(g_planner, volumeBitmap, fromLcn, toLcn, clustersNeeded, blockStart)) {
+        return false;
+    }
+    outBlockStart = blockStart;
+    return true;
+}
+
+// Find a contiguous block of free clusters of a certain size
+static bool FindContiguousFreeBlock(const std::vector<BYTE> &volumeBitmap,
+                                    ULONGLONG totalClusters,
+                                    ULONGLONG clustersNeeded,
+                                    ULONGLONG &outBlockStart) {
+    return ScanForFreeRun(volumeBitmap, 0, totalClusters, clustersNeeded, outBlockStart);
+}
+
+// Same as FindContiguousFreeBlock, but prefer a block at or after hintLcn and
+// only wrap around to the start of the volume if nothing fits past the hint
+static bool FindContiguousFreeBlockNear(const std::vector<BYTE> &volumeBitmap,
+                                        ULONGLONG totalClusters,
+                                        ULONGLONG clustersNeeded,
+                                        ULONGLONG hintLcn,
+                                        ULONGLONG &outBlockStart) {
+    if (hintLcn >= totalClusters) {
+        hintLcn = 0;
+    }
+    if (ScanForFreeRun(volumeBitmap, hintLcn, totalClusters, clustersNeeded, outBlockStart)) {
+        return true;
+    }
+    ULONGLONG wrapEnd = hintLcn + clustersNeeded;
+    if (wrapEnd > totalClusters) {
+        wrapEnd = totalClusters;
+    }
+    return hintLcn > 0 && ScanForFreeRun(volumeBitmap, 0, wrapEnd, clustersNeeded, outBlockStart);
+}
+
+// -----------------------------------------------------------------------------
+// Layout metrics
+//   Seek distance = how many clusters the head has to skip (forwards or
+//   backwards) when a reader walks the clusters in order. A perfectly
+//   sequential layout scores 0.
+// -----------------------------------------------------------------------------
+struct FileLayoutSummary {
+    LONGLONG firstLcn = -1;     // LCN of VCN 0 (or the first allocated VCN)
+    LONGLONG lastLcn = -1;      // LCN of the last allocated VCN
+    ULONGLONG internalSeek = 0; // seek distance while reading the file itself
+    ULONGLONG clusters = 0;
+};
+
+struct LayoutStats {
+    ULONGLONG filesPlaced = 0;
+    ULONGLONG seekBefore = 0;
+    ULONGLONG seekAfter = 0;
+};
+
+// Distance the head travels from the end of one read to the next cluster
+static ULONGLONG SeekBetween(LONGLONG fromLcn, LONGLONG toLcn) {
+    if (fromLcn < 0 || toLcn < 0) {
+        return 0; // nothing read yet
+    }
+    LONGLONG expected = fromLcn + 1;
+    return (ULONGLONG)(toLcn > expected ? toLcn - expected : expected - toLcn);
+}
+
+static FileLayoutSummary SummarizeLayout(const FileClusters &fc) {
+    FileLayoutSummary s;
+    s.clusters = (ULONGLONG)fc.lcns.size();
+    if (fc.lcns.empty()) {
+        return s;
+    }
+    s.firstLcn = fc.lcns.front();
+    s.lastLcn = fc.lcns.back();
+    for (size_t i = 1; i < fc.lcns.size(); i++) {
+        s.internalSeek += SeekBetween(fc.lcns[i - 1], fc.lcns[i]);
+    }
+    return s;
+}
+
+// Seek distance for reading a list of files back to back
+static ULONGLONG SequenceSeekDistance(const std::vector<FileLayoutSummary> &files) {
+    ULONGLONG total = 0;
+    LONGLONG prevLast = -1;
+    for (const auto &f : files) {
+        if (f.clusters == 0) {
+            continue;
+        }
+        total += SeekBetween(prevLast, f.firstLcn) + f.internalSeek;
+        prevLast = f.lastLcn;
+    }
+    return total;
+}
+
+// Open a file with the access FSCTL_MOVE_FILE needs
+static HANDLE OpenFileForMove(const std::wstring &filePath) {
+    HANDLE hFile = CreateFileW(
+        filePath.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        0,
+        NULL);
+
+    if (hFile == INVALID_HANDLE_VALUE) {
+        PrintLastError((L"Failed to open file: " + filePath).c_str());
+    }
+    g_volumeOps.Opened(hFile, filePath);
+    return hFile;
+}
+
+// Account one scanned file in the progress status line
+static void CountScannedFile(const FileClusters &fc) {
+    AsyncLog::Instance().progress.files++;
+    AsyncLog::Instance().progress.clustersScanned += fc.lcns.size();
+}
+
+// -----------------------------------------------------------------------------
+// Read-cost gate (optional)
+//   With a device profile, a fragmented file is only moved when reading it
+//   would get faster by at least the threshold (see FirstFitPlanner in
+//   common/move_engine.h). The profile is a preset, or measured here.
+// -----------------------------------------------------------------------------
+
+// Unbuffered reads of the volume, timed, for CalibrateProfile
+class VolumeReadProbe : public ReadProbe {
+public:
+    VolumeReadProbe(HANDLE volumeHandle, ULONGLONG sizeBytes, DWORD maxBytes)
+        : volumeHandle(volumeHandle), sizeBytes(sizeBytes), storage(maxBytes + ALIGNMENT) {
+        buffer = storage.data() + (ALIGNMENT - (uintptr_t)storage.data() % ALIGNMENT) % ALIGNMENT;
+    }
+
+    uint64_t SizeBytes() const override { return sizeBytes; }
+
+    bool Read(uint64_t offset, uint32_t bytes, double &seconds) override {
+        auto started = std::chrono::steady_clock::now();
+        LARGE_INTEGER pos;
+        pos.QuadPart = (LONGLONG)offset;
+        DWORD got = 0;
+        if (!SetFilePointerEx(volumeHandle, pos, NULL, FILE_BEGIN) ||
+            !ReadFile(volumeHandle, buffer, bytes, &got, NULL) || got != bytes) {
+            PrintLastError(L"Calibration read failed");
+            return false;
         }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return true;
+    }
 
-        auto pVolBmp = reinterpret_cast<PVOLUME_BITMAP_BUFFER>(tempBuf.data());
-        LONGLONG startLCN = pVolBmp->StartingLcn.QuadPart;
-        LONGLONG chunkBits = pVolBmp->BitmapSize.QuadPart;
-        size_t chunkBytes = (size_t)((chunkBits + 7) / 8);
+private:
+    static const size_t ALIGNMENT = 4096; // covers 512-byte and 4K sectors
+    HANDLE volumeHandle;
+    ULONGLONG sizeBytes;
+    std::vector<BYTE> storage;
+    BYTE *buffer = nullptr;
+};
+
+// Measure the device under the volume with a few hundred reads (about 70 MB)
+static bool MeasureDeviceProfile(const std::wstring &volumePath, ULONGLONG sizeBytes, DeviceProfile &profile) {
+    HANDLE hRead = CreateFileW(volumePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                               OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+    if (hRead == INVALID_HANDLE_VALUE) {
+        PrintLastError((L"Failed to open volume for calibration " + volumePath).c_str());
+        return false;
+    }
+    CalibrationOptions options;
+    VolumeReadProbe probe(hRead, sizeBytes, options.largeBytes);
+    CalibrationSamples samples;
+    bool ok = CalibrateProfile(probe, options, profile, &samples);
+    CloseHandle(hRead);
+    if (!ok) {
+        std::wcerr << L"Calibration failed (the volume must be larger than about 200 MB).\n";
+        return false;
+    }
+    std::wcout << L"Measured: " << samples.sequentialBytesPerSecond / 1e6 << L" MB/s sequential, small reads "
+               << samples.adjacentSeconds * 1e3 << L" ms adjacent, " << samples.shortSeconds * 1e3 << L" ms short seek, "
+               << samples.randomSeconds * 1e3 << L" ms random\n";
+    return true;
+}
 
-        DWORD headerSize = sizeof(VOLUME_BITMAP_BUFFER);
-        DWORD bytesReturnedBody = (bytesReturned > headerSize)
-                                      ? (bytesReturned - headerSize)
-                                      : 0;
+// -----------------------------------------------------------------------------
+// Post-move verification (optional)
+//   Each file touched by a move batch is hashed before the batch runs and
+//   again afterwards, and its retrieval pointers are re-read to confirm that
+//   the extent map matches what the executor expects. Files are cut into
+//   HASH_CHUNK_SIZE chunks and the chunks are hashed on a worker pool, each
+//   worker reading through its own handle. The digest is CRC32C over the
+//   per-chunk CRC32Cs, so it only depends on the content and the chunk size.
+//   CRC32C uses the SSE4.2 crc32 instruction when the CPU has it.
+// -----------------------------------------------------------------------------
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned threadCount) {
+        if (threadCount == 0) {
+            threadCount = 1;
+        }
+        for (unsigned i = 0; i < threadCount; i++) {
+            workers.emplace_back([this] { WorkerLoop(); });
+        }
+    }
 
-        if (chunkBytes > bytesReturnedBody) {
-            chunkBytes = bytesReturnedBody;
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
         }
-        LONGLONG chunkBitsAvailable = (LONGLONG)chunkBytes * 8;
-        if (chunkBits > chunkBitsAvailable) {
-            chunkBits = chunkBitsAvailable;
+        wake.notify_all();
+        for (auto &t : workers) {
+            t.join();
         }
+    }
 
-        BYTE *srcBits = pVolBmp->Buffer;
-        for (LONGLONG i = 0; i < chunkBits; i++) {
-            LONGLONG clusterIndex = startLCN + i;
-            if (clusterIndex >= (LONGLONG)totalClusters) {
-                break;
+    void Submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+            pending++;
+        }
+        wake.notify_one();
+    }
+
+    // Block until every submitted task has finished
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return pending == 0; });
+    }
+
+    size_t Size() const { return workers.size(); }
+
+private:
+    void WorkerLoop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return; // stopping
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
             }
-            int srcByteIndex = (int)(i / 8);
-            int srcBitOffset = (int)(i % 8);
-            int bitVal = (srcBits[srcByteIndex] >> srcBitOffset) & 1;
-            if (bitVal == 1) {
-                size_t destByteIndex = (size_t)(clusterIndex / 8);
-                int destBitOffset = (int)(clusterIndex % 8);
-                outBitmap[destByteIndex] |= (BYTE)(1 << destBitOffset);
+            task();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending--;
             }
+            idle.notify_all();
         }
+    }
 
-        LONGLONG nextLCN = startLCN + chunkBits;
-        if (!success) {
-            // ERROR_MORE_DATA indicates partial result
-            if (dwErr == ERROR_MORE_DATA) {
-                if (nextLCN > maxLCN) {
-                    break;
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    size_t pending = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+};
+
+static uint32_t Crc32cSoftware(uint32_t crc, const BYTE *data, size_t len) {
+    static uint32_t table[256];
+    static std::once_flag tableInit;
+    std::call_once(tableInit, [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : (c >> 1); // Castagnoli, reflected
+            }
+            table[i] = c;
+        }
+    });
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(_M_X64) || defined(__x86_64__)
+CRC32C_TARGET static uint32_t Crc32cHardware(uint32_t crc, const BYTE *data, size_t len) {
+    ULONGLONG c = crc;
+    while (len >= 8) {
+        ULONGLONG word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+        data += 8;
+        len -= 8;
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (len > 0) {
+        c32 = _mm_crc32_u8(c32, *data);
+        data++;
+        len--;
+    }
+    return c32;
+}
+
+static bool CpuHasSse42() {
+#if defined(_MSC_VER)
+    int info[4] = {};
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    unsigned a = 0, b = 0, c = 0, d = 0;
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & (1u << 20)) != 0;
+#endif
+}
+#endif
+
+// CRC32C of a buffer (initial value and final xor included)
+static uint32_t Crc32c(const BYTE *data, size_t len) {
+#if defined(_M_X64) || defined(__x86_64__)
+    static const bool hardware = CpuHasSse42();
+    if (hardware) {
+        return ~Crc32cHardware(~0u, data, len);
+    }
+#endif
+    return ~Crc32cSoftware(~0u, data, len);
+}
+
+struct FileDigest {
+    bool ok = false;
+    ULONGLONG size = 0;
+    uint32_t crc = 0;
+};
+
+struct VerificationStats {
+    ULONGLONG filesVerified = 0;
+    ULONGLONG contentMismatches = 0;
+    ULONGLONG extentMismatches = 0;
+    ULONGLONG notContiguous = 0;
+    ULONGLONG bytesHashed = 0;
+    double hashSeconds = 0;
+    double moveSeconds = 0;
+};
+
+class FileVerifier {
+public:
+    explicit FileVerifier(unsigned threadCount) : pool(threadCount) {}
+
+    // Hash all files in parallel; digests[i] belongs to paths[i]
+    void HashFiles(const std::vector<const std::wstring *> &paths, std::vector<FileDigest> &digests) {
+        const ULONGLONG HASH_CHUNK_SIZE = 8ULL * 1024 * 1024;
+        auto started = std::chrono::steady_clock::now();
+
+        digests.assign(paths.size(), FileDigest());
+        std::vector<std::vector<uint32_t>> chunkCrcs(paths.size());
+        std::vector<std::unique_ptr<std::atomic<bool>>> failed;
+        for (size_t f = 0; f < paths.size(); f++) {
+            failed.push_back(std::make_unique<std::atomic<bool>>(false));
+            HANDLE h = CreateFileW(paths[f]->c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                   NULL, OPEN_EXISTING, 0, NULL);
+            LARGE_INTEGER size = {};
+            if (h == INVALID_HANDLE_VALUE || !GetFileSizeEx(h, &size)) {
+                PrintLastError((L"Cannot open file for hashing: " + *paths[f]).c_str());
+                if (h != INVALID_HANDLE_VALUE) {
+                    CloseHandle(h);
                 }
-                inBuf.StartingLcn.QuadPart = nextLCN;
-            } else {
-                PrintLastError(L"FSCTL_GET_VOLUME_BITMAP truly failed");
-                break;
+                failed[f]->store(true);
+                continue;
             }
-        } else {
-            if (chunkBits == 0 || nextLCN > maxLCN) {
+            CloseHandle(h);
+
+            digests[f].size = (ULONGLONG)size.QuadPart;
+            ULONGLONG chunks = (digests[f].size + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+            chunkCrcs[f].assign((size_t)chunks, 0);
+            for (ULONGLONG c = 0; c < chunks; c++) {
+                ULONGLONG offset = c * HASH_CHUNK_SIZE;
+                ULONGLONG length = std::min(HASH_CHUNK_SIZE, digests[f].size - offset);
+                const std::wstring *path = paths[f];
+                uint32_t *out = &chunkCrcs[f][(size_t)c];
+                std::atomic<bool> *fail = failed[f].get();
+                pool.Submit([path, offset, length, out, fail] {
+                    if (!HashChunk(*path, offset, length, *out)) {
+                        fail->store(true);
+                    }
+                });
+            }
+        }
+        pool.Wait();
+
+        for (size_t f = 0; f < paths.size(); f++) {
+            if (failed[f]->load()) {
+                continue;
+            }
+            std::vector<BYTE> summary(sizeof(ULONGLONG) + chunkCrcs[f].size() * sizeof(uint32_t));
+            memcpy(summary.data(), &digests[f].size, sizeof(ULONGLONG));
+            if (!chunkCrcs[f].empty()) {
+                memcpy(summary.data() + sizeof(ULONGLONG), chunkCrcs[f].data(), chunkCrcs[f].size() * sizeof(uint32_t));
+            }
+            digests[f].crc = Crc32c(summary.data(), summary.size());
+            digests[f].ok = true;
+            stats.bytesHashed += digests[f].size;
+        }
+        stats.hashSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    }
+
+    VerificationStats stats;
+
+private:
+    static bool HashChunk(const std::wstring &path, ULONGLONG offset, ULONGLONG length, uint32_t &outCrc) {
+        HANDLE h = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                               NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (h == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER pos;
+        pos.QuadPart = (LONGLONG)offset;
+        if (!SetFilePointerEx(h, pos, NULL, FILE_BEGIN)) {
+            CloseHandle(h);
+            return false;
+        }
+
+        const DWORD READ_SIZE = 1024 * 1024;
+        std::vector<BYTE> buffer(READ_SIZE);
+        uint32_t crc = ~0u;
+        bool ok = true;
+        while (length > 0) {
+            DWORD want = (DWORD)std::min<ULONGLONG>(READ_SIZE, length);
+            DWORD got = 0;
+            if (!ReadFile(h, buffer.data(), want, &got, NULL) || got == 0) {
+                ok = false;
                 break;
             }
-            inBuf.StartingLcn.QuadPart = nextLCN;
+#if defined(_M_X64) || defined(__x86_64__)
+            static const bool hardware = CpuHasSse42();
+            crc = hardware ? Crc32cHardware(crc, buffer.data(), got) : Crc32cSoftware(crc, buffer.data(), got);
+#else
+            crc = Crc32cSoftware(crc, buffer.data(), got);
+#endif
+            length -= got;
         }
+        CloseHandle(h);
+        outCrc = ~crc;
+        return ok;
     }
-    return !outBitmap.empty();
-}
 
-// File cluster mapping structures
-struct FileClusters {
-    std::vector<LONGLONG> vcns; // logical offsets within the file
-    std::vector<LONGLONG> lcns; // physical disk positions
+    WorkerPool pool;
 };
 
-// Retrieve all extents for a file (even if very fragmented) by looping over FSCTL_GET_RETRIEVAL_POINTERS
-bool GetAllFileRetrievalPointers(HANDLE fileHandle, FileClusters &outClusters) {
-    outClusters.vcns.clear();
-    outClusters.lcns.clear();
+// -----------------------------------------------------------------------------
+// Move execution
+//   Planners append PlannedMoves to a batch and ExecuteMoveBatch runs it in
+//   elevator order (see common/move_engine.h). The observer below adds what
+//   only this tool does around a batch: the progress count, the messages of
+//   failed moves and the optional verification.
+// -----------------------------------------------------------------------------
+class DefragMoveObserver : public MoveObserver {
+public:
+    FileVerifier *verifier = nullptr; // optional post-move verification
+
+    // Hash the files touched by the batch
+    void BeforeMoves(const std::vector<PlannedMove> &batch) override {
+        if (!verifier) {
+            return;
+        }
+        verifyPaths.clear();
+        verifyFiles.clear();
+        verifyClusters.clear();
+        for (const auto &m : batch) {
+            if (std::find(verifyClusters.begin(), verifyClusters.end(), m.owner) == verifyClusters.end()) {
+                verifyPaths.push_back(m.filePath);
+                verifyFiles.push_back(m.file);
+                verifyClusters.push_back(m.owner);
+            }
+        }
+        verifier->HashFiles(verifyPaths, digestsBefore);
+        moveStarted = std::chrono::steady_clock::now();
+    }
 
-    STARTING_VCN_INPUT_BUFFER inBuf = {};
-    inBuf.StartingVcn.QuadPart = 0;
+    void Moved(const PlannedMove &m) override {
+        AsyncLog::Instance().progress.moves++;
+        LOG_SAMPLED(LogLevel::Verbose, L"Moved (File: " << *m.filePath << L", VCN=" << m.srcVcn << L", count="
+                                       << m.vcnCount << L", srcLCN=" << m.srcLcn << L", dstLCN=" << m.dstLcn << L")");
+    }
 
-    while (true) {
-        const DWORD BUF_SIZE = 16 * 1024;
-        std::vector<BYTE> buffer(BUF_SIZE, 0);
-        DWORD bytesReturned = 0;
-        BOOL ok = DeviceIoControl(
-            fileHandle,
-            FSCTL_GET_RETRIEVAL_POINTERS,
-            &inBuf,
-            sizeof(inBuf),
-            buffer.data(),
-            (DWORD)buffer.size(),
-            &bytesReturned,
-            NULL);
+    void MoveFailed(const PlannedMove &m, uint32_t error) override {
+        SetLastError(error);
+        PrintLastError(L"FSCTL_MOVE_FILE failed");
+        LOG(LogLevel::Error, L"Move failed (File: " << *m.filePath << L", VCN=" << m.srcVcn << L", count="
+                             << m.vcnCount << L", srcLCN=" << m.srcLcn << L", dstLCN=" << m.dstLcn << L")");
+    }
 
-        if (!ok) {
-            DWORD err = GetLastError();
-            if (err == ERROR_HANDLE_EOF) {
-                // No more extents
-                break;
+    // Hash the files again and re-read their extents
+    void AfterMoves() override {
+        if (!verifier) {
+            return;
+        }
+        FileVerifier &v = *verifier;
+        v.stats.moveSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - moveStarted).count();
+
+        std::vector<FileDigest> digestsAfter;
+        v.HashFiles(verifyPaths, digestsAfter);
+        for (size_t f = 0; f < verifyPaths.size(); f++) {
+            v.stats.filesVerified++;
+            if (!digestsBefore[f].ok || !digestsAfter[f].ok ||
+                digestsBefore[f].size != digestsAfter[f].size || digestsBefore[f].crc != digestsAfter[f].crc) {
+                v.stats.contentMismatches++;
+                LOG(LogLevel::Error, L"VERIFY: content changed or unreadable after moving: " << *verifyPaths[f]);
+            }
+
+            if (!GetAllFileRetrievalPointers(Win32VolumeOps::HandleOf(verifyFiles[f]), actual) ||
+                actual.vcns != verifyClusters[f]->vcns || actual.lcns != verifyClusters[f]->lcns) {
+                v.stats.extentMismatches++;
+                LOG(LogLevel::Error, L"VERIFY: extent map differs from the expected layout: " << *verifyPaths[f]);
+            }
+            if (!IsFileContiguous(actual)) {
+                v.stats.notContiguous++;
             }
-            PrintLastError(L"FSCTL_GET_RETRIEVAL_POINTERS failed");
+        }
+    }
+
+private:
+    std::vector<const std::wstring *> verifyPaths;
+    std::vector<uint64_t> verifyFiles;
+    std::vector<FileClusters *> verifyClusters;
+    std::vector<FileDigest> digestsBefore;
+    FileClusters actual;
+    std::chrono::steady_clock::time_point moveStarted;
+};
+
+// Plan moving the file's allocated clusters, in ascending file order, into
+// [blockStart ... blockStart + count - 1]: one move per run, or per
+// compression unit for a compressed file. Holes take no space.
+static void PlanFileRelocation(const std::wstring &filePath,
+                               HANDLE hFile,
+                               FileClusters &fc,
+                               std::vector<BYTE> &volumeBitmap,
+                               ULONGLONG blockStart,
+                               std::vector<PlannedMove> &batch) {
+    PlanRelocation(g_planner, Win32VolumeOps::FileOf(hFile), &filePath, Win32VolumeOps::CompressionUnitClusters(hFile),
+                   fc, volumeBitmap, blockStart, batch);
+}
+
+// Move every cluster of one file into [blockStart ... blockStart + count - 1]
+static void RelocateFileClusters(const std::wstring &filePath,
+                                 MoveExecutor &executor,
+                                 HANDLE hFile,
+                                 FileClusters &fc,
+                                 std::vector<BYTE> &volumeBitmap,
+                                 ULONGLONG blockStart) {
+    std::vector<PlannedMove> batch;
+    PlanFileRelocation(filePath, hFile, fc, volumeBitmap, blockStart, batch);
+    ExecuteMoveBatch(executor, batch, volumeBitmap);
+}
+
+// -----------------------------------------------------------------------------
+// Defragmentation: simplified approach
+//   1) Check if file is already contiguous -> skip
+//   2) If not, find one block large enough to hold entire file
+//   3) Move all clusters to that block
+// -----------------------------------------------------------------------------
+// Plan the moves of one open file, appended to batch; none if the file is
+// contiguous, not worth moving or has no block to go to
+static void PlanOpenFile(const std::wstring &filePath,
+                         HANDLE hFile,
+                         FileClusters &fc,
+                         std::vector<BYTE> &volumeBitmap,
+                         ULONGLONG totalClusters,
+                         std::vector<PlannedMove> &batch) {
+    FirstFitDecision d = ChooseFirstFitBlock(g_planner, fc, volumeBitmap, totalClusters);
+    switch (d.outcome) {
+    case PlanOutcome::Contiguous:
+        LOG_SAMPLED(LogLevel::Verbose, L"File already contiguous, skipping: " << filePath);
+        return;
+    case PlanOutcome::NotWorthIt:
+        LOG_SAMPLED(LogLevel::Verbose, L"Saves only " << d.secondsSaved * 1000 << L" ms per read, skipping: "
+                                       << filePath);
+        return;
+    case PlanOutcome::NoRoom:
+        // We skip defrag if there's no single run large enough
+        LOG(LogLevel::Warn, L"Cannot find a contiguous region of size " << d.clusters
+                            << L" clusters for file: " << filePath << L". Skipping.");
+        return;
+    case PlanOutcome::Found:
+        break;
+    }
+
+    LOG(LogLevel::Info, L"Defragmenting file: " << filePath
+                        << L" into LCN range [" << d.blockStart << L" ... "
+                        << (d.blockStart + d.clusters - 1) << L"]");
+    PlanFileRelocation(filePath, hFile, fc, volumeBitmap, d.blockStart, batch);
+}
+
+
+static void DefragmentOpenFile(const std::wstring &filePath,
+                               MoveExecutor &executor,
+                               HANDLE hFile,
+                               FileClusters &fc,
+                               std::vector<BYTE> &volumeBitmap,
+                               ULONGLONG totalClusters) {
+    std::vector<PlannedMove> batch;
+    PlanOpenFile(filePath, hFile, fc, volumeBitmap, totalClusters, batch);
+    ExecuteMoveBatch(executor, batch, volumeBitmap);
+}
+
+// fc is scratch storage, reused across files so its capacity carries over
+bool DefragmentFile(const std::wstring &filePath,
+                    FileClusters &fc,
+                    MoveExecutor &executor,
+                    std::vector<BYTE> &volumeBitmap,
+                    ULONGLONG totalClusters,
+                    FileLayoutSummary *layoutBefore = nullptr,
+                    FileLayoutSummary *layoutAfter = nullptr) {
+    // Open the file
+    HANDLE hFile = OpenFileForMove(filePath);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // Retrieve all clusters for this file
+    if (!GetAllFileRetrievalPointers(hFile, fc)) {
+        LOG(LogLevel::Error, L"Could not get retrieval pointers for file: " << filePath);
+        CloseHandle(hFile);
+        return false;
+    }
+
+    // If no clusters, skip
+    CountScannedFile(fc);
+    if (fc.lcns.empty()) {
+        LOG_SAMPLED(LogLevel::Verbose, L"No allocated clusters in file: " << filePath);
+        CloseHandle(hFile);
+        return true;
+    }
+
+    if (layoutBefore) {
+        *layoutBefore = SummarizeLayout(fc);
+    }
+    DefragmentOpenFile(filePath, executor, hFile, fc, volumeBitmap, totalClusters);
+    if (layoutAfter) {
+        *layoutAfter = SummarizeLayout(fc);
+    }
+
+    CloseHandle(hFile);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Snapshots
+//   The extents of every file looked at are recorded and written, together
+//   with the bitmap, to a snapshot file at the end of the run. A later run
+//   that finds a recent snapshot of the same volume takes the bitmap from it
+//   instead of FSCTL_GET_VOLUME_BITMAP, and (first fit) does not open files
+//   that were contiguous and have not been written to since.
+// -----------------------------------------------------------------------------
+struct SnapshotContext {
+    SnapshotReader *previous = nullptr; // recent snapshot of this volume, if any
+    SnapshotWriter *next = nullptr;     // written at the end of the run, if any
+    ULONGLONG filesReused = 0;          // files not opened thanks to the previous snapshot
+    std::vector<ExtentRun> runs;        // scratch
+};
+
+static SnapshotContext g_snapshot;
+
+static ULONGLONG FileTimeToTicks(const FILETIME &ft) {
+    return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+// Map a snapshot and check that it belongs to this volume and is recent enough
+static bool LoadSnapshot(const std::wstring &path,
+                         const VolumeGeometry &geometry,
+                         ULONGLONG maxAgeMinutes,
+                         SnapshotReader &reader) {
+    SnapshotStatus status = reader.Open(path);
+    if (status == SnapshotStatus::CannotOpen) {
+        std::wcout << L"No snapshot at " << path << L", starting from scratch.\n";
+        return false;
+    }
+    if (status != SnapshotStatus::Ok) {
+        std::wcerr << L"Ignoring " << path << (status == SnapshotStatus::WrongVersion ? L": unsupported snapshot version.\n"
+                                                                                      : L": not a valid snapshot.\n");
+        return false;
+    }
+
+    const ULONGLONG TICKS_PER_MINUTE = 10000000ULL * 60;
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    ULONGLONG maxAgeTicks = maxAgeMinutes ? maxAgeMinutes * TICKS_PER_MINUTE : ~0ULL; // 0 = any age
+    SnapshotFreshness freshness = reader.CheckVolume(geometry.volumeSerial, geometry.totalClusters, geometry.bytesPerCluster,
+                                                     FileTimeToTicks(now), maxAgeTicks);
+    if (freshness != SnapshotFreshness::Fresh) {
+        std::wcout << L"Snapshot " << path << (freshness == SnapshotFreshness::OtherVolume ? L" is of another volume"
+                                                                                           : L" is too old")
+                   << L", starting from scratch.\n";
+        reader.Close();
+        return false;
+    }
+    std::wcout << L"Snapshot loaded: " << reader.FileCount() << L" files, taken "
+               << (FileTimeToTicks(now) - reader.Header().createdTicks) / TICKS_PER_MINUTE << L" minutes ago.\n";
+    return true;
+}
+
+// Record the extents of a file for the next snapshot
+static void RecordSnapshotFile(const WalkEntry &e, const FileClusters &fc) {
+    if (!g_snapshot.next) {
+        return;
+    }
+    ClustersToRuns(fc, g_snapshot.runs);
+    g_snapshot.next->AddFile(e.path, e.pathLength, e.size, e.lastWriteTime, g_snapshot.runs.data(), g_snapshot.runs.size());
+}
+
+// true if the previous snapshot has the file as contiguous, with the same
+// size and last write time. runs and layout are filled from the snapshot.
+static bool FindUnchangedInSnapshot(const WalkEntry &e, std::vector<ExtentRun> &runs, FileLayoutSummary &layout) {
+    if (!g_snapshot.previous) {
+        return false;
+    }
+    const SnapshotFileRecord *r = g_snapshot.previous->Find(e.path, e.pathLength);
+    if (!r || !SnapshotReader::IsUnchanged(*r, e.size, e.lastWriteTime) || !SnapshotReader::IsContiguous(*r) ||
+        !g_snapshot.previous->DecodeExtents(*r, runs)) {
+        return false;
+    }
+
+    layout = FileLayoutSummary();
+    if (!runs.empty() && runs[0].lcn >= 0) {
+        layout.firstLcn = runs[0].lcn;
+        layout.lastLcn = runs[0].lcn + runs[0].count - 1;
+        layout.clusters = (ULONGLONG)runs[0].count;
+    }
+    return true;
+}
+
+// If the file is unchanged and contiguous in the previous snapshot, carry its
+// record over and return true: there is nothing to do and the file is not
+// opened. layout is filled from the snapshot.
+static bool ReuseSnapshotFile(const WalkEntry &e, FileLayoutSummary &layout) {
+    std::vector<ExtentRun> &runs = g_snapshot.runs;
+    if (!FindUnchangedInSnapshot(e, runs, layout)) {
+        return false;
+    }
+    if (g_snapshot.next) {
+        g_snapshot.next->AddFile(e.path, e.pathLength, e.size, e.lastWriteTime, runs.data(), runs.size());
+    }
+    g_snapshot.filesReused++;
+    return true;
+}
+
+// Walker callbacks shared by the placement modes: prefilter entries, log
+// subdirectories and enumeration errors, and remember whether anything failed
+struct DefragWalkVisitor : WalkVisitor {
+    EntryFilter &filter;
+    bool success = true;
+    std::wstring filePath; // reused for every file, grows to the longest path only
+    FileClusters clusters; // same, for files that are not kept after their callback
+
+    explicit DefragWalkVisitor(EntryFilter &filter) : filter(filter) {}
+
+    WalkAction OnDirectory(const WalkEntry &e) {
+        if (!filter.AcceptDirectory(e)) {
+            LOG_SAMPLED(LogLevel::Verbose, L"Skipping subdirectory: " << e.path);
+            return WalkAction::SkipDirectory;
+        }
+        LOG(LogLevel::Info, L"Entering subdirectory: " << e.path);
+        return WalkAction::Continue;
+    }
+    void OnError(const wchar_t *path, unsigned long errorCode) {
+        SetLastError((DWORD)errorCode);
+        PrintLastError((std::wstring(L"Cannot enumerate ") + path).c_str());
+        success = false;
+    }
+};
+
+struct FirstFitVisitor : DefragWalkVisitor {
+    MoveExecutor &executor;
+    std::vector<BYTE> &volumeBitmap;
+    ULONGLONG totalClusters;
+    LayoutStats &stats;
+    std::vector<FileLayoutSummary> layoutBefore; // files of the current directory
+    std::vector<FileLayoutSummary> layoutAfter;
+
+    FirstFitVisitor(EntryFilter &filter, MoveExecutor &executor, std::vector<BYTE> &volumeBitmap,
+                    ULONGLONG totalClusters, LayoutStats &stats)
+        : DefragWalkVisitor(filter), executor(executor), volumeBitmap(volumeBitmap), totalClusters(totalClusters), stats(stats) {}
+
+    WalkAction OnFile(const WalkEntry &e) {
+        if (!filter.AcceptFile(e)) {
+            return WalkAction::Continue;
+        }
+        // Defragment the file if needed
+        filePath.assign(e.path, e.pathLength);
+        FileLayoutSummary before;
+        FileLayoutSummary after;
+        if (ReuseSnapshotFile(e, before)) {
+            LOG_SAMPLED(LogLevel::Verbose, L"Contiguous in the snapshot and unchanged, skipping: " << filePath);
+            after = before;
+        } else if (!DefragmentFile(filePath, clusters, executor, volumeBitmap, totalClusters, &before, &after)) {
+            LOG(LogLevel::Error, L"DefragmentFile failed on: " << filePath);
+            success = false;
+        } else {
+            RecordSnapshotFile(e, clusters);
+        }
+        layoutBefore.push_back(before);
+        layoutAfter.push_back(after);
+        return WalkAction::Continue;
+    }
+
+    WalkAction OnDirectoryDone(const wchar_t *, size_t) {
+        // Directory read in enumeration order, as a batch job would
+        stats.seekBefore += SequenceSeekDistance(layoutBefore);
+        stats.seekAfter += SequenceSeekDistance(layoutAfter);
+        layoutBefore.clear();
+        layoutAfter.clear();
+        return WalkAction::Continue;
+    }
+};
+
+bool DefragmentAllFilesInDirectory(const std::wstring &dirPath,
+                                   MoveExecutor &executor,
+                                   std::vector<BYTE> &volumeBitmap,
+                                   ULONGLONG totalClusters,
+                                   LayoutStats &stats,
+                                   EntryFilter &filter) {
+    DirectoryWalker walker;
+    FirstFitVisitor visitor(filter, executor, volumeBitmap, totalClusters, stats);
+    return walker.Walk(dirPath, visitor) && visitor.success;
+}
+
+// -----------------------------------------------------------------------------
+// Staged first fit
+//   The first-fit pass as four stages, each on a thread of its own and
+//   connected by bounded queues (see common/staged_pipeline.h), so the walk,
+//   the extent reads, the planning and the moves of different files
+//   overlap:
+//     enumerate  walks the directories and filters the entries
+//     analyze    opens each file and reads its retrieval pointers
+//     plan       picks the file's block and reserves it in the bitmap
+//     move       runs the file's moves, records it for the snapshot and
+//                closes it
+//   Files arrive at every stage in walk order. The planner is the only user
+//   of the bitmap; clusters the moves give back reach it through
+//   ClusterReleases, so it sees them a few files late and never hands out a
+//   cluster that is still in use. Directory ends travel down with the files,
+//   so the move stage sums the seek distances per directory as before.
+// -----------------------------------------------------------------------------
+const size_t STAGED_FOUND_FILES = 1024;   // enumerated, waiting to be opened
+const size_t STAGED_ANALYZED_FILES = 64;  // open with their extents read
+const size_t STAGED_PLANNED_FILES = 16;   // open with their moves planned
+
+struct StagedFile {
+    std::wstring path;
+    ULONGLONG size = 0;
+    ULONGLONG lastWriteTime = 0;
+    bool directoryEnd = false;  // no file: the files of a directory are done
+    bool fromSnapshot = false;  // unchanged and contiguous in the snapshot, not opened
+    bool failed = false;
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    FileClusters clusters;
+    std::vector<ExtentRun> snapshotRuns; // when fromSnapshot
+    FileLayoutSummary before;
+    std::vector<PlannedMove> moves;
+
+    ~StagedFile() { Close(); }
+
+    void Close() {
+        if (handle != INVALID_HANDLE_VALUE) {
+            CloseHandle(handle);
+            handle = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    // The walk entry the snapshot records the file under
+    WalkEntry Entry() const {
+        WalkEntry e = {};
+        e.path = path.c_str();
+        e.pathLength = path.size();
+        e.size = size;
+        e.lastWriteTime = lastWriteTime;
+        return e;
+    }
+};
+
+typedef std::unique_ptr<StagedFile> StagedFilePtr;
+
+struct StagedPassStats {
+    std::vector<StageReport> stages;
+    std::vector<QueueReport> queues;
+};
+
+struct StagedWalkVisitor : DefragWalkVisitor {
+    StageQueue<StagedFilePtr> &found;
+    StageCounters &counters;
+
+    StagedWalkVisitor(EntryFilter &filter, StageQueue<StagedFilePtr> &found, StageCounters &counters)
+        : DefragWalkVisitor(filter), found(found), counters(counters) {}
+
+    WalkAction OnFile(const WalkEntry &e) {
+        if (!filter.AcceptFile(e)) {
+            return WalkAction::Continue;
+        }
+        StagedFilePtr file(new StagedFile());
+        file->path.assign(e.path, e.pathLength);
+        file->size = e.size;
+        file->lastWriteTime = e.lastWriteTime;
+        file->fromSnapshot = FindUnchangedInSnapshot(e, file->snapshotRuns, file->before);
+        counters.items++;
+        return found.Push(std::move(file), counters) ? WalkAction::Continue : WalkAction::Stop;
+    }
+
+    WalkAction OnDirectoryDone(const wchar_t *, size_t) {
+        StagedFilePtr end(new StagedFile());
+        end->directoryEnd = true;
+        return found.Push(std::move(end), counters) ? WalkAction::Continue : WalkAction::Stop;
+    }
+};
+
+// Open the file and read its extents; a file with nothing to move is closed
+static void AnalyzeStagedFile(StagedFile &file) {
+    file.handle = OpenFileForMove(file.path);
+    if (file.handle == INVALID_HANDLE_VALUE) {
+        file.failed = true;
+        return;
+    }
+    if (!GetAllFileRetrievalPointers(file.handle, file.clusters)) {
+        LOG(LogLevel::Error, L"Could not get retrieval pointers for file: " << file.path);
+        file.failed = true;
+        file.Close();
+        return;
+    }
+    CountScannedFile(file.clusters);
+    if (file.clusters.lcns.empty()) {
+        LOG_SAMPLED(LogLevel::Verbose, L"No allocated clusters in file: " << file.path);
+        file.Close();
+        return;
+    }
+    file.before = SummarizeLayout(file.clusters);
+    if (IsFileContiguous(file.clusters)) {
+        LOG_SAMPLED(LogLevel::Verbose, L"File already contiguous, skipping: " << file.path);
+        file.Close();
+    }
+}
+
+bool DefragmentAllFilesStaged(const std::wstring &dirPath,
+                              MoveExecutor &executor,
+                              std::vector<BYTE> &volumeBitmap,
+                              ULONGLONG totalClusters,
+                              LayoutStats &stats,
+                              EntryFilter &filter,
+                              StagedPassStats &passStats) {
+    StageQueue<StagedFilePtr> found(STAGED_FOUND_FILES);
+    StageQueue<StagedFilePtr> analyzed(STAGED_ANALYZED_FILES);
+    StageQueue<StagedFilePtr> planned(STAGED_PLANNED_FILES);
+    ClusterReleases releases;
+    executor.releases = &releases;
+    bool walkOk = true;
+    bool filesOk = true;
+    ArenaStats analyzeArena;
+    ArenaStats moveArena;
+
+    StagedPipeline pipeline;
+    pipeline.AddQueue("found", found);
+    pipeline.AddQueue("analyzed", analyzed);
+    pipeline.AddQueue("planned", planned);
+    pipeline.AddStage("enumerate", [&](StageCounters &c) {
+        DirectoryWalker walker;
+        StagedWalkVisitor visitor(filter, found, c);
+        walkOk = walker.Walk(dirPath, visitor) && visitor.success;
+        found.Close();
+    });
+    pipeline.AddStage("analyze", [&](StageCounters &c) {
+        StagedFilePtr file;
+        while (found.Pop(file, c)) {
+            if (!file->directoryEnd && !file->fromSnapshot) {
+                AnalyzeStagedFile(*file);
+                c.items++;
+            }
+            if (!analyzed.Push(std::move(file), c)) {
+                found.Cancel();
+                break;
+            }
+        }
+        analyzed.Close();
+        analyzeArena = ScratchArena::ForThread().stats;
+    });
+    pipeline.AddStage("plan", [&](StageCounters &c) {
+        StagedFilePtr file;
+        while (analyzed.Pop(file, c)) {
+            if (file->handle != INVALID_HANDLE_VALUE) {
+                releases.Apply(volumeBitmap);
+                PlanOpenFile(file->path, file->handle, file->clusters, volumeBitmap, totalClusters, file->moves);
+                if (file->moves.empty()) {
+                    file->Close();
+                }
+                c.items++;
+            }
+            if (!planned.Push(std::move(file), c)) {
+                analyzed.Cancel();
+                break;
+            }
+        }
+        planned.Close();
+    });
+    pipeline.AddStage("move", [&](StageCounters &c) {
+        std::vector<FileLayoutSummary> layoutBefore; // files of the current directory
+        std::vector<FileLayoutSummary> layoutAfter;
+        StagedFilePtr file;
+        while (planned.Pop(file, c)) {
+            if (file->directoryEnd) {
+                stats.seekBefore += SequenceSeekDistance(layoutBefore);
+                stats.seekAfter += SequenceSeekDistance(layoutAfter);
+                layoutBefore.clear();
+                layoutAfter.clear();
+                continue;
+            }
+            FileLayoutSummary after;
+            if (file->failed) {
+                LOG(LogLevel::Error, L"DefragmentFile failed on: " << file->path);
+                filesOk = false;
+            } else if (file->fromSnapshot) {
+                LOG_SAMPLED(LogLevel::Verbose, L"Contiguous in the snapshot and unchanged, skipping: " << file->path);
+                after = file->before;
+                if (g_snapshot.next) {
+                    WalkEntry e = file->Entry();
+                    g_snapshot.next->AddFile(e.path, e.pathLength, e.size, e.lastWriteTime, file->snapshotRuns.data(),
+                                             file->snapshotRuns.size());
+                }
+                g_snapshot.filesReused++;
+            } else {
+                ExecuteMoveBatch(executor, file->moves, volumeBitmap);
+                file->Close();
+                if (!file->clusters.lcns.empty()) {
+                    after = SummarizeLayout(file->clusters);
+                }
+                RecordSnapshotFile(file->Entry(), file->clusters);
+                c.items++;
+            }
+            layoutBefore.push_back(file->before);
+            layoutAfter.push_back(after);
+        }
+        moveArena = ScratchArena::ForThread().stats;
+    });
+
+    ProgressCounters &progress = AsyncLog::Instance().progress;
+    {
+        std::lock_guard<std::mutex> lock(progress.pipelineMutex);
+        progress.pipeline = &pipeline;
+    }
+    pipeline.Run();
+    {
+        std::lock_guard<std::mutex> lock(progress.pipelineMutex);
+        progress.pipeline = nullptr;
+    }
+    // The last releases were published after the planner stopped
+    releases.Apply(volumeBitmap);
+    executor.releases = nullptr;
+
+    // Ioctls of the stage threads count with the main thread's
+    ScratchArena::ForThread().stats.Add(analyzeArena);
+    ScratchArena::ForThread().stats.Add(moveArena);
+    passStats.stages = pipeline.Stages();
+    passStats.queues = pipeline.Queues();
+    return walkOk && filesOk;
+}
+
+// -----------------------------------------------------------------------------
+// Directory-locality placement
+//   Files of one directory are packed back to back into a single free block,
+//   in enumeration or name order, so reading the directory is one sweep.
+//   Successive directories are placed after each other via a placement hint.
+//   If no block is large enough for the whole directory, its files fall back
+//   to the first-fit approach above.
+// -----------------------------------------------------------------------------
+enum class DirectoryOrder {
+    Enumeration,
+    Name
+};
+
+// Collects the file names of one directory, then places the whole group when
+// the walker reports the directory as done (before descending into it)
+struct GroupedPlacementVisitor : DefragWalkVisitor {
+    MoveExecutor &executor;
+    std::vector<BYTE> &volumeBitmap;
+    ULONGLONG totalClusters;
+    DirectoryOrder order;
+    ULONGLONG &placementHint;
+    LayoutStats &stats;
+
+    // Per-directory state, cleared but never shrunk so name slots are reused
+    std::wstring dirPath;
+    std::vector<std::wstring> fileNames;
+    size_t fileCount = 0;
+    std::vector<FileLayoutSummary> layoutBefore;
+    std::vector<FileLayoutSummary> layoutAfter;
+    std::vector<std::wstring> batchPaths;
+    std::vector<FileClusters> batchClusters;
+    std::vector<std::pair<size_t, HANDLE>> batchFiles;
+    std::vector<PlannedMove> batch;
+
+    GroupedPlacementVisitor(EntryFilter &filter, MoveExecutor &executor, std::vector<BYTE> &volumeBitmap,
+                            ULONGLONG totalClusters, DirectoryOrder order, ULONGLONG &placementHint, LayoutStats &stats)
+        : DefragWalkVisitor(filter), executor(executor), volumeBitmap(volumeBitmap), totalClusters(totalClusters), order(order),
+          placementHint(placementHint), stats(stats) {}
+
+    WalkAction OnFile(const WalkEntry &e) {
+        if (!filter.AcceptFile(e)) {
+            return WalkAction::Continue;
+        }
+        if (fileCount == fileNames.size()) {
+            fileNames.emplace_back();
+        }
+        fileNames[fileCount++].assign(e.name, e.path + e.pathLength);
+        return WalkAction::Continue;
+    }
+
+    WalkAction OnDirectoryDone(const wchar_t *path, size_t pathLength) {
+        dirPath.assign(path, pathLength);
+        PlaceDirectory();
+        fileCount = 0;
+        return WalkAction::Continue;
+    }
+
+    // Place the collected files of dirPath (which ends with a separator)
+    void PlaceDirectory() {
+        if (order == DirectoryOrder::Name) {
+            std::sort(fileNames.begin(), fileNames.begin() + fileCount,
+                      [](const std::wstring &a, const std::wstring &b) { return _wcsicmp(a.c_str(), b.c_str()) < 0; });
+        }
+
+        // Pass 1: measure how much room the directory needs and how it is laid out today
+        layoutBefore.assign(fileCount, FileLayoutSummary());
+        ULONGLONG groupClusters = 0;
+        for (size_t i = 0; i < fileCount; i++) {
+            filePath.assign(dirPath).append(fileNames[i]);
+            HANDLE hFile = OpenFileForMove(filePath);
+            if (hFile == INVALID_HANDLE_VALUE) {
+                success = false;
+                continue;
+            }
+            if (GetAllFileRetrievalPointers(hFile, clusters)) {
+                layoutBefore[i] = SummarizeLayout(clusters);
+                CountScannedFile(clusters);
+                groupClusters += layoutBefore[i].clusters;
+            } else {
+                LOG(LogLevel::Error, L"Could not get retrieval pointers for file: " << filePath);
+                success = false;
+            }
+            CloseHandle(hFile);
+        }
+
+        ULONGLONG blockStart = 0;
+        bool grouped = groupClusters > 0 &&
+                       FindContiguousFreeBlockNear(volumeBitmap, totalClusters, groupClusters, placementHint, blockStart);
+        if (grouped) {
+            // Reserve the whole block now, so a file placed on its own below
+            // cannot take the slots of the files after it
+            MarkClusters(volumeBitmap, (LONGLONG)blockStart, (size_t)groupClusters, true);
+        }
+        if (groupClusters > 0) {
+            if (grouped) {
+                LOG(LogLevel::Info, L"Placing " << fileCount << L" files of " << dirPath
+                                    << L" into LCN range [" << blockStart << L" ... "
+                                    << (blockStart + groupClusters - 1) << L"]");
+            } else {
+                LOG(LogLevel::Warn, L"Cannot find a contiguous region of size " << groupClusters
+                                    << L" clusters for directory: " << dirPath << L". Falling back to per-file placement.");
+            }
+        }
+
+        // Pass 2: lay the files out back to back. Moves of up to MAX_FILES_PER_BATCH
+        // files are queued and executed together so the executor can order them.
+        const size_t MAX_FILES_PER_BATCH = 256;
+        layoutAfter.assign(fileCount, FileLayoutSummary());
+        if (batchPaths.size() < fileCount) {
+            batchPaths.resize(fileCount);
+            batchClusters.resize(fileCount);
+        }
+        auto flushBatch = [&]() {
+            ExecuteMoveBatch(executor, batch, volumeBitmap);
+            for (const auto &bf : batchFiles) {
+                layoutAfter[bf.first] = SummarizeLayout(batchClusters[bf.first]);
+                batchClusters[bf.first] = FileClusters();
+                CloseHandle(bf.second);
+            }
+            batchFiles.clear();
+        };
+
+        ULONGLONG cursor = blockStart;
+        for (size_t i = 0; i < fileCount; i++) {
+            if (layoutBefore[i].clusters == 0) {
+                continue;
+            }
+            batchPaths[i].assign(dirPath).append(fileNames[i]);
+            const std::wstring &fullPath = batchPaths[i];
+            HANDLE hFile = OpenFileForMove(fullPath);
+            if (hFile == INVALID_HANDLE_VALUE) {
+                success = false;
+                continue;
+            }
+            FileClusters &fc = batchClusters[i];
+            if (!GetAllFileRetrievalPointers(hFile, fc)) {
+                LOG(LogLevel::Error, L"Could not get retrieval pointers for file: " << fullPath);
+                CloseHandle(hFile);
+                success = false;
+                continue;
+            }
+
+            ULONGLONG fileClusterCount = (ULONGLONG)fc.lcns.size();
+            if (grouped && fileClusterCount == layoutBefore[i].clusters) {
+                PlanFileRelocation(fullPath, hFile, fc, volumeBitmap, cursor, batch);
+                cursor += fileClusterCount;
+                stats.filesPlaced++;
+            } else {
+                // File changed size since pass 1, or no group block exists. It
+                // takes no slot: the files after it move up, and the block's
+                // unused end is released below.
+                DefragmentOpenFile(fullPath, executor, hFile, fc, volumeBitmap, totalClusters);
+            }
+            batchFiles.push_back(std::make_pair(i, hFile));
+            if (batchFiles.size() >= MAX_FILES_PER_BATCH) {
+                flushBatch();
+            }
+        }
+        flushBatch();
+        if (grouped) {
+            // Slots of files that could not be opened or changed size
+            MarkClusters(volumeBitmap, (LONGLONG)cursor, (size_t)(blockStart + groupClusters - cursor), false);
+            placementHint = cursor;
+        }
+
+        ULONGLONG seekBefore = SequenceSeekDistance(layoutBefore);
+        ULONGLONG seekAfter = SequenceSeekDistance(layoutAfter);
+        stats.seekBefore += seekBefore;
+        stats.seekAfter += seekAfter;
+        if (groupClusters > 0) {
+            LOG(LogLevel::Info, L"Directory seek distance: " << seekBefore << L" -> " << seekAfter
+                                << L" clusters (" << dirPath << L")");
+        }
+    }
+};
+
+bool DefragmentDirectoryGrouped(const std::wstring &dirPath,
+                                MoveExecutor &executor,
+                                std::vector<BYTE> &volumeBitmap,
+                                ULONGLONG totalClusters,
+                                DirectoryOrder order,
+                                ULONGLONG &placementHint,
+                                LayoutStats &stats,
+                                EntryFilter &filter) {
+    DirectoryWalker walker;
+    GroupedPlacementVisitor visitor(filter, executor, volumeBitmap, totalClusters, order, placementHint, stats);
+    return walker.Walk(dirPath, visitor) && visitor.success;
+}
+
+// -----------------------------------------------------------------------------
+// Trace-driven layout
+//   An access trace is a text file with one read per line, in the order the
+//   application performs them:
+//       C:\App\app.exe
+//       C:\App\core.dll|0|65536        (optional byte range: offset|length)
+//   Blank lines and lines starting with '#' are ignored. The files of the
+//   trace are laid out back to back in order of first appearance, so the
+//   whole trace becomes one sequential read. Files not in the trace stay put.
+// -----------------------------------------------------------------------------
+struct TraceEntry {
+    std::wstring path;
+    ULONGLONG offset = 0;
+    ULONGLONG length = 0; // 0 = whole file
+};
+
+// A decimal byte count filling [begin, end) exactly; false when empty, not a
+// number, signed, or too large
+static bool ParseTraceNumber(const wchar_t *begin, const wchar_t *end, ULONGLONG &out) {
+    if (begin == end || !std::iswdigit(*begin)) {
+        return false;
+    }
+    wchar_t *stop = nullptr;
+    errno = 0;
+    out = std::wcstoull(begin, &stop, 10);
+    return stop == end && errno != ERANGE;
+}
+
+bool LoadAccessTrace(const std::wstring &tracePath, std::vector<TraceEntry> &outEntries) {
+    outEntries.clear();
+    std::wifstream in{std::filesystem::path(tracePath)};
+    if (!in) {
+        LOG(LogLevel::Error, L"Cannot open access trace: " << tracePath);
+        return false;
+    }
+
+    std::wstring line;
+    size_t lineNo = 0;
+    while (std::getline(in, line)) {
+        lineNo++;
+        while (!line.empty() && (line.back() == L'\r' || line.back() == L' ' || line.back() == L'\t')) {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == L'#') {
+            continue;
+        }
+
+        // '|' cannot appear in a Windows path, so it is a safe separator
+        TraceEntry e;
+        size_t bar = line.find(L'|');
+        e.path = line.substr(0, bar);
+        bool valid = !e.path.empty();
+        if (valid && bar != std::wstring::npos) {
+            size_t bar2 = line.find(L'|', bar + 1);
+            const wchar_t *text = line.c_str();
+            valid = bar2 != std::wstring::npos && ParseTraceNumber(text + bar + 1, text + bar2, e.offset) &&
+                    ParseTraceNumber(text + bar2 + 1, text + line.size(), e.length);
+        }
+        if (!valid) {
+            LOG(LogLevel::Error, L"Access trace line " << lineNo << L": expected path|offset|length");
+            return false;
+        }
+        outEntries.push_back(e);
+    }
+    return true;
+}
+
+// Case-insensitive key for matching trace paths
+static std::wstring TracePathKey(const std::wstring &path) {
+    std::wstring key = path;
+    for (auto &ch : key) {
+        ch = (wchar_t)std::towlower(ch);
+    }
+    return key;
+}
+
+// Seek distance for replaying the trace against the given extent maps.
+// Each entry reads the clusters covering its byte range, in VCN order.
+static ULONGLONG TraceSeekDistance(const std::vector<TraceEntry> &entries,
+                                   const std::map<std::wstring, size_t> &fileIndex,
+                                   const std::vector<FileClusters> &files,
+                                   DWORD bytesPerCluster) {
+    ULONGLONG total = 0;
+    LONGLONG prevLcn = -1;
+    for (const auto &e : entries) {
+        auto it = fileIndex.find(TracePathKey(e.path));
+        if (it == fileIndex.end()) {
+            continue;
+        }
+        const FileClusters &fc = files[it->second];
+        LONGLONG firstVcn = 0;
+        LONGLONG lastVcn = std::numeric_limits<LONGLONG>::max();
+        if (e.length > 0) {
+            firstVcn = (LONGLONG)(e.offset / bytesPerCluster);
+            lastVcn = (LONGLONG)((e.offset + e.length - 1) / bytesPerCluster);
+        }
+        for (size_t i = 0; i < fc.vcns.size(); i++) {
+            if (fc.vcns[i] < firstVcn || fc.vcns[i] > lastVcn) {
+                continue;
+            }
+            total += SeekBetween(prevLcn, fc.lcns[i]);
+            prevLcn = fc.lcns[i];
+        }
+    }
+    return total;
+}
+
+bool DefragmentByTrace(const std::vector<TraceEntry> &entries,
+                       MoveExecutor &executor,
+                       std::vector<BYTE> &volumeBitmap,
+                       ULONGLONG totalClusters,
+                       DWORD bytesPerCluster,
+                       LayoutStats &stats) {
+    bool success = true;
+
+    // Unique files, in order of first appearance
+    std::map<std::wstring, size_t> fileIndex;
+    std::vector<std::wstring> filePaths;
+    std::vector<FileClusters> layoutBefore;
+    ULONGLONG traceClusters = 0;
+    for (const auto &e : entries) {
+        std::wstring key = TracePathKey(e.path);
+        if (fileIndex.count(key)) {
+            continue;
+        }
+        HANDLE hFile = OpenFileForMove(e.path);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            success = false;
+            continue;
+        }
+        FileClusters fc;
+        if (!GetAllFileRetrievalPointers(hFile, fc)) {
+            LOG(LogLevel::Error, L"Could not get retrieval pointers for file: " << e.path);
+            success = false;
+            fc = FileClusters();
+        }
+        CloseHandle(hFile);
+
+        fileIndex[key] = filePaths.size();
+        filePaths.push_back(e.path);
+        traceClusters += (ULONGLONG)fc.lcns.size();
+        CountScannedFile(fc);
+        layoutBefore.push_back(std::move(fc));
+    }
+
+    if (traceClusters == 0) {
+        LOG(LogLevel::Error, L"Access trace references no allocated clusters.");
+        return success;
+    }
+
+    // One block for the whole trace if possible; otherwise chain each file
+    // right after the previous one as closely as free space allows
+    ULONGLONG blockStart = 0;
+    bool oneBlock = FindContiguousFreeBlock(volumeBitmap, totalClusters, traceClusters, blockStart);
+    if (oneBlock) {
+        LOG(LogLevel::Info, L"Placing " << filePaths.size() << L" trace files into LCN range ["
+                            << blockStart << L" ... " << (blockStart + traceClusters - 1) << L"]");
+    } else {
+        LOG(LogLevel::Warn, L"Cannot find a contiguous region of size " << traceClusters
+                            << L" clusters for the trace. Chaining files as closely as possible.");
+    }
+
+    // Trace files stay open until their batch has run, MAX_FILES_PER_BATCH at a time
+    const size_t MAX_FILES_PER_BATCH = 256;
+    std::vector<FileClusters> layoutAfter = layoutBefore;
+    std::vector<HANDLE> batchHandles;
+    std::vector<PlannedMove> batch;
+    auto flushBatch = [&]() {
+        ExecuteMoveBatch(executor, batch, volumeBitmap);
+        for (HANDLE h : batchHandles) {
+            CloseHandle(h);
+        }
+        batchHandles.clear();
+    };
+
+    ULONGLONG cursor = blockStart;
+    for (size_t i = 0; i < filePaths.size(); i++) {
+        ULONGLONG plannedClusters = (ULONGLONG)layoutBefore[i].lcns.size();
+        if (plannedClusters == 0) {
+            continue;
+        }
+        HANDLE hFile = OpenFileForMove(filePaths[i]);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            success = false;
+            continue;
+        }
+        FileClusters &fc = layoutAfter[i];
+        if (!GetAllFileRetrievalPointers(hFile, fc)) {
+            LOG(LogLevel::Error, L"Could not get retrieval pointers for file: " << filePaths[i]);
+            CloseHandle(hFile);
+            success = false;
+            continue;
+        }
+
+        ULONGLONG fileClusterCount = (ULONGLONG)fc.lcns.size();
+        ULONGLONG dst = cursor;
+        bool placed = false;
+        if (oneBlock) {
+            placed = (fileClusterCount == plannedClusters);
+        } else {
+            // Destinations of queued moves are already reserved, so this cannot collide
+            placed = FindContiguousFreeBlockNear(volumeBitmap, totalClusters, fileClusterCount, cursor, dst);
+        }
+
+        if (placed) {
+            PlanFileRelocation(filePaths[i], hFile, fc, volumeBitmap, dst, batch);
+            cursor = dst + fileClusterCount;
+            stats.filesPlaced++;
+        } else {
+            LOG(LogLevel::Warn, L"Trace file could not be placed, leaving it where it is: " << filePaths[i]);
+            if (oneBlock) {
+                cursor += plannedClusters; // keep the slot so later files stay in order
+            }
+        }
+        batchHandles.push_back(hFile);
+        if (batchHandles.size() >= MAX_FILES_PER_BATCH) {
+            flushBatch();
+        }
+    }
+    flushBatch();
+
+    stats.seekBefore += TraceSeekDistance(entries, fileIndex, layoutBefore, bytesPerCluster);
+    stats.seekAfter += TraceSeekDistance(entries, fileIndex, layoutAfter, bytesPerCluster);
+    return success;
+}
+
+// -----------------------------------------------------------------------------
+// Hot/cold zoning
+//   Files are classified by the newest of their last-access and last-write
+//   times, as reported by the directory enumeration (no extra I/O):
+//     hot  = touched within hotAgeDays, placed inside [zoneStart, zoneEnd)
+//     cold = everything else, placed outside that zone
+//   The default zone is the first 10% of the volume, which sits on the
+//   outer tracks of an HDD where sequential throughput is highest.
+//   Note: NTFS often has last-access updates disabled, in which case the
+//   last-write time is what effectively decides the tier.
+// -----------------------------------------------------------------------------
+struct ZoningPolicy {
+    ULONGLONG hotAgeDays = 30;
+    ULONGLONG zoneStartLcn = 0;
+    ULONGLONG zoneEndLcn = 0;  // exclusive
+    ULONGLONG nowFileTime = 0; // 100ns ticks since 1601, taken once per run
+};
+
+struct ZoningStats {
+    ULONGLONG hotFiles = 0;
+    ULONGLONG coldFiles = 0;
+    ULONGLONG hotMovedIn = 0;
+    ULONGLONG coldMovedOut = 0;
+    ULONGLONG notPlaced = 0;
+};
+
+static bool IsHotFile(const WalkEntry &e, const ZoningPolicy &policy) {
+    const ULONGLONG TICKS_PER_DAY = 10000000ULL * 60 * 60 * 24;
+    ULONGLONG lastUse = std::max(e.lastAccessTime, e.lastWriteTime);
+    if (lastUse >= policy.nowFileTime) {
+        return true;
+    }
+    return (policy.nowFileTime - lastUse) / TICKS_PER_DAY < policy.hotAgeDays;
+}
+
+// Is every cluster of the file inside [fromLcn, toLcn)?
+static bool IsFileWithin(const FileClusters &fc, ULONGLONG fromLcn, ULONGLONG toLcn) {
+    for (LONGLONG lcn : fc.lcns) {
+        if ((ULONGLONG)lcn < fromLcn || (ULONGLONG)lcn >= toLcn) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Does any cluster of the file fall inside [fromLcn, toLcn)?
+static bool IsFileTouching(const FileClusters &fc, ULONGLONG fromLcn, ULONGLONG toLcn) {
+    for (LONGLONG lcn : fc.lcns) {
+        if ((ULONGLONG)lcn >= fromLcn && (ULONGLONG)lcn < toLcn) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Place one file according to its tier
+static void ZoneOpenFile(const std::wstring &filePath,
+                         MoveExecutor &executor,
+                         HANDLE hFile,
+                         FileClusters &fc,
+                         std::vector<BYTE> &volumeBitmap,
+                         ULONGLONG totalClusters,
+                         bool hot,
+                         const ZoningPolicy &policy,
+                         ZoningStats &stats) {
+    bool contiguous = IsFileContiguous(fc);
+    bool inZone = IsFileWithin(fc, policy.zoneStartLcn, policy.zoneEndLcn);
+    bool touchesZone = IsFileTouching(fc, policy.zoneStartLcn, policy.zoneEndLcn);
+    if (contiguous && (hot ? inZone : !touchesZone)) {
+        return; // already where it belongs
+    }
+
+    ULONGLONG fileClusterCount = (ULONGLONG)fc.lcns.size();
+    ULONGLONG blockStart = 0;
+    bool found = false;
+    if (hot) {
+        found = ScanForFreeRun(volumeBitmap, policy.zoneStartLcn, policy.zoneEndLcn, fileClusterCount, blockStart);
+    } else {
+        found = ScanForFreeRun(volumeBitmap, policy.zoneEndLcn, totalClusters, fileClusterCount, blockStart) ||
+                ScanForFreeRun(volumeBitmap, 0, policy.zoneStartLcn, fileClusterCount, blockStart);
+    }
+
+    if (!found) {
+        stats.notPlaced++;
+        LOG(LogLevel::Warn, L"No room in the " << (hot ? L"hot zone" : L"cold area") << L" for " << fileClusterCount
+                            << L" clusters of file: " << filePath);
+        if (!contiguous) {
+            // Still better to end up contiguous somewhere than to stay fragmented
+            DefragmentOpenFile(filePath, executor, hFile, fc, volumeBitmap, totalClusters);
+        }
+        return;
+    }
+
+    LOG(LogLevel::Info, (hot ? L"Moving hot file: " : L"Moving cold file: ") << filePath
+                        << L" into LCN range [" << blockStart << L" ... "
+                        << (blockStart + fileClusterCount - 1) << L"]");
+    RelocateFileClusters(filePath, executor, hFile, fc, volumeBitmap, blockStart);
+    if (hot) {
+        stats.hotMovedIn++;
+    } else {
+        stats.coldMovedOut++;
+    }
+}
+
+struct ZoningVisitor : DefragWalkVisitor {
+    MoveExecutor &executor;
+    std::vector<BYTE> &volumeBitmap;
+    ULONGLONG totalClusters;
+    const ZoningPolicy &policy;
+    ZoningStats &stats;
+
+    ZoningVisitor(EntryFilter &filter, MoveExecutor &executor, std::vector<BYTE> &volumeBitmap,
+                  ULONGLONG totalClusters, const ZoningPolicy &policy, ZoningStats &stats)
+        : DefragWalkVisitor(filter), executor(executor), volumeBitmap(volumeBitmap), totalClusters(totalClusters), policy(policy), stats(stats) {}
+
+    WalkAction OnFile(const WalkEntry &e) {
+        if (!filter.AcceptFile(e)) {
+            return WalkAction::Continue;
+        }
+        bool hot = IsHotFile(e, policy);
+        if (hot) {
+            stats.hotFiles++;
+        } else {
+            stats.coldFiles++;
+        }
+
+        filePath.assign(e.path, e.pathLength);
+        HANDLE hFile = OpenFileForMove(filePath);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            success = false;
+            return WalkAction::Continue;
+        }
+        if (!GetAllFileRetrievalPointers(hFile, clusters)) {
+            LOG(LogLevel::Error, L"Could not get retrieval pointers for file: " << filePath);
+            success = false;
+        } else {
+            CountScannedFile(clusters);
+            if (!clusters.lcns.empty()) {
+                ZoneOpenFile(filePath, executor, hFile, clusters, volumeBitmap, totalClusters, hot, policy, stats);
+            }
+        }
+        CloseHandle(hFile);
+        return WalkAction::Continue;
+    }
+};
+
+bool DefragmentAllFilesZoned(const std::wstring &dirPath,
+                             MoveExecutor &executor,
+                             std::vector<BYTE> &volumeBitmap,
+                             ULONGLONG totalClusters,
+                             const ZoningPolicy &policy,
+                             ZoningStats &stats,
+                             EntryFilter &filter) {
+    DirectoryWalker walker;
+    ZoningVisitor visitor(filter, executor, volumeBitmap, totalClusters, policy, stats);
+    return walker.Walk(dirPath, visitor) && visitor.success;
+}
+
+// -----------------------------------------------------------------------------
+// Incremental re-analysis
+//   Starts from the snapshot of an earlier run and the changes recorded since
+//   (USN journal or change log): only changed files are opened and queried,
+//   the bitmap is brought up to date from their old and new extents, and
+//   changed files that are fragmented are defragmented first fit.
+// -----------------------------------------------------------------------------
+
+// ChangeSource over the volume's USN journal
+class UsnJournalSource : public ChangeSource {
+public:
+    explicit UsnJournalSource(HANDLE volumeHandle) : volumeHandle(volumeHandle), buffer(64 * 1024 / sizeof(ULONGLONG)) {}
+
+    ULONGLONG unresolved = 0; // records whose directory could not be found any more
+
+    bool Current(ChangePosition &out) override {
+        USN_JOURNAL_DATA journal;
+        if (!QueryJournal(journal)) {
+            return false;
+        }
+        out.kind = ChangeSourceKind::UsnJournal;
+        out.id = journal.UsnJournalID;
+        out.position = (uint64_t)journal.NextUsn;
+        return true;
+    }
+
+    ChangeReadStatus Read(const ChangePosition &from, std::vector<FileChange> &out, ChangePosition &next) override {
+        USN_JOURNAL_DATA journal;
+        if (!QueryJournal(journal)) {
+            return ChangeReadStatus::Unavailable;
+        }
+        if (from.kind != ChangeSourceKind::UsnJournal || from.id != journal.UsnJournalID ||
+            (USN)from.position < journal.FirstUsn) {
+            return ChangeReadStatus::Discontinuous; // journal recreated, or records dropped since
+        }
+
+        READ_USN_JOURNAL_DATA request = {};
+        request.StartUsn = (USN)from.position;
+        request.ReasonMask = USN_REASON_DATA_OVERWRITE | USN_REASON_DATA_EXTEND | USN_REASON_DATA_TRUNCATION |
+                             USN_REASON_FILE_CREATE | USN_REASON_FILE_DELETE |
+                             USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME;
+        request.UsnJournalID = journal.UsnJournalID;
+        while (request.StartUsn < journal.NextUsn) {
+            DWORD bytesReturned = 0;
+            if (!DeviceIoControl(volumeHandle, FSCTL_READ_USN_JOURNAL, &request, sizeof(request), buffer.data(),
+                                 (DWORD)(buffer.size() * sizeof(ULONGLONG)), &bytesReturned, NULL)) {
+                PrintLastError(L"FSCTL_READ_USN_JOURNAL failed");
+                return ChangeReadStatus::Unavailable;
+            }
+            if (bytesReturned < sizeof(USN)) {
+                break;
+            }
+            const BYTE *p = reinterpret_cast<const BYTE *>(buffer.data());
+            USN nextUsn = *reinterpret_cast<const USN *>(p);
+            for (DWORD at = sizeof(USN); at + sizeof(USN_RECORD) <= bytesReturned;) {
+                const USN_RECORD *record = reinterpret_cast<const USN_RECORD *>(p + at);
+                if (record->RecordLength == 0) {
+                    break;
+                }
+                if (record->MajorVersion == 2) {
+                    AddRecord(*record, out);
+                }
+                at += record->RecordLength;
+            }
+            if (nextUsn <= request.StartUsn) {
+                break;
+            }
+            request.StartUsn = nextUsn;
+        }
+        next = from;
+        next.position = (uint64_t)request.StartUsn;
+        return ChangeReadStatus::Ok;
+    }
+
+private:
+    bool QueryJournal(USN_JOURNAL_DATA &journal) {
+        DWORD bytesReturned = 0;
+        if (!DeviceIoControl(volumeHandle, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &journal, sizeof(journal), &bytesReturned, NULL)) {
+            PrintLastError(L"FSCTL_QUERY_USN_JOURNAL failed (is the USN journal enabled?)");
+            return false;
+        }
+        return true;
+    }
+
+    // Records name a file by its parent directory's file reference; the
+    // directory's path is looked up once and cached
+    bool DirectoryPath(DWORDLONG fileReference, std::wstring &outPath) {
+        auto cached = directories.find(fileReference);
+        if (cached != directories.end()) {
+            outPath = cached->second;
+            return true;
+        }
+        FILE_ID_DESCRIPTOR id = {};
+        id.dwSize = sizeof(id);
+        id.Type = FileIdType;
+        id.FileId.QuadPart = (LONGLONG)fileReference;
+        HANDLE h = OpenFileById(volumeHandle, &id, FILE_READ_ATTRIBUTES,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, FILE_FLAG_BACKUP_SEMANTICS);
+        if (h == INVALID_HANDLE_VALUE) {
             return false;
         }
-
-        if (bytesReturned < sizeof(RETRIEVAL_POINTERS_BUFFER)) {
-            std::wcerr << L"Not enough data returned for RETRIEVAL_POINTERS_BUFFER.\n";
+        wchar_t path[MAX_PATH * 4];
+        DWORD length = GetFinalPathNameByHandleW(h, path, (DWORD)(sizeof(path) / sizeof(path[0])),
+                                                 FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+        CloseHandle(h);
+        if (length == 0 || length >= sizeof(path) / sizeof(path[0])) {
             return false;
         }
-
-        auto pRet = reinterpret_cast<PRETRIEVAL_POINTERS_BUFFER>(buffer.data());
-        if (pRet->ExtentCount == 0) {
-            break;
+        outPath.assign(path, length);
+        if (outPath.compare(0, 4, L"\\\\?\\") == 0) {
+            outPath.erase(0, 4);
         }
-
-        LONGLONG currentVcn = pRet->StartingVcn.QuadPart;
-        for (DWORD i = 0; i < pRet->ExtentCount; i++) {
-            LONGLONG nextVcn = pRet->Extents[i].NextVcn.QuadPart;
-            LONGLONG lcn = pRet->Extents[i].Lcn.QuadPart;
-            if (lcn == -1) { // sparse or unallocated
-                currentVcn = nextVcn;
-                continue;
-            }
-
-            LONGLONG count = nextVcn - currentVcn;
-            for (LONGLONG c = 0; c < count; c++) {
-                outClusters.vcns.push_back(currentVcn + c);
-                outClusters.lcns.push_back(lcn + c);
-            }
-            currentVcn = nextVcn;
+        if (outPath.empty() || outPath.back() != L'\\') {
+            outPath.push_back(L'\\');
         }
+        directories[fileReference] = outPath;
+        return true;
+    }
 
-        LONGLONG lastNextVcn = pRet->Extents[pRet->ExtentCount - 1].NextVcn.QuadPart;
-        if (lastNextVcn <= inBuf.StartingVcn.QuadPart) {
-            break;
+    void AddRecord(const USN_RECORD &record, std::vector<FileChange> &out) {
+        FileChange c;
+        if (!DirectoryPath(record.ParentFileReferenceNumber, c.path)) {
+            unresolved++;
+            return;
+        }
+        const wchar_t *name = reinterpret_cast<const wchar_t *>(reinterpret_cast<const BYTE *>(&record) + record.FileNameOffset);
+        c.path.append(name, record.FileNameLength / sizeof(wchar_t));
+
+        bool gone = (record.Reason & (USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME)) != 0;
+        if (record.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            directories.erase(record.FileReferenceNumber); // its cached path may have changed
+            if (gone) {
+                c.kind = ChangeKind::DirectoryDeleted;
+            } else if (record.Reason & USN_REASON_RENAME_NEW_NAME) {
+                c.kind = ChangeKind::DirectoryAdded;
+            } else {
+                return; // a new directory is empty; files created in it have records of their own
+            }
+        } else {
+            c.kind = gone ? ChangeKind::Deleted : ChangeKind::Modified;
         }
-        inBuf.StartingVcn.QuadPart = lastNextVcn;
+        out.push_back(c);
     }
 
-    return true;
-}
+    HANDLE volumeHandle;
+    std::vector<ULONGLONG> buffer;
+    std::unordered_map<DWORDLONG, std::wstring> directories;
+};
 
-// Move a single cluster from srcVcn to dstLcn in the target file (via FSCTL_MOVE_FILE)
-bool MoveSingleCluster(HANDLE volumeHandle, HANDLE fileHandle, LONGLONG srcVcn, LONGLONG dstLcn) {
-    MOVE_FILE_DATA moveData = {};
-    moveData.FileHandle = fileHandle;
-    moveData.StartingVcn.QuadPart = srcVcn; // which VCN in file
-    moveData.StartingLcn.QuadPart = dstLcn; // destination LCN on disk
-    moveData.ClusterCount = 1;              // move one cluster
+// Collects the files below a directory that appeared since the snapshot
+struct AddedDirectoryVisitor : DefragWalkVisitor {
+    std::vector<std::wstring> &paths;
 
-    DWORD bytesReturned = 0;
-    BOOL ok = DeviceIoControl(
-        volumeHandle,
-        FSCTL_MOVE_FILE,
-        &moveData,
-        sizeof(moveData),
-        NULL,
-        0,
-        &bytesReturned,
-        NULL);
+    AddedDirectoryVisitor(EntryFilter &filter, std::vector<std::wstring> &paths) : DefragWalkVisitor(filter), paths(paths) {}
+
+    WalkAction OnFile(const WalkEntry &e) {
+        if (!filter.AcceptFile(e)) {
+            return WalkAction::Continue;
+        }
+        paths.emplace_back(e.path, e.pathLength);
+        return WalkAction::Continue;
+    }
+};
+
+// Open a changed file and read its size, last write time and extents.
+// A file that no longer exists is reported with exists = false.
+static bool QueryChangedFile(ChangedFile &cf, FileClusters &fc) {
+    HANDLE hFile = CreateFileW(cf.path.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        DWORD err = GetLastError();
+        if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND) {
+            return true;
+        }
+        PrintLastError((L"Failed to open changed file: " + cf.path).c_str());
+        return false;
+    }
+    g_volumeOps.Opened(hFile, cf.path);
+    BY_HANDLE_FILE_INFORMATION info;
+    bool ok = GetFileInformationByHandle(hFile, &info) && GetAllFileRetrievalPointers(hFile, fc);
+    CloseHandle(hFile);
     if (!ok) {
-        PrintLastError(L"FSCTL_MOVE_FILE failed");
+        LOG(LogLevel::Error, L"Could not query changed file: " << cf.path);
         return false;
     }
+    if (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+        return true; // not a file after all
+    }
+    cf.exists = true;
+    cf.size = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    cf.lastWriteTicks = FileTimeToTicks(info.ftLastWriteTime);
+    ClustersToRuns(fc, cf.runs);
+    CountScannedFile(fc);
     return true;
 }
 
-// Check if a given cluster index is free in the bitmap
-static bool IsClusterFree(const std::vector<BYTE> &bitmap, ULONGLONG clusterIndex) {
-    size_t byteIndex = (size_t)(clusterIndex / 8);
-    int bitOffset = (int)(clusterIndex % 8);
-    int bitVal = (bitmap[byteIndex] >> bitOffset) & 1;
-    return (bitVal == 0);
-}
-
-// Find a contiguous block of free clusters of a certain size
-static bool FindContiguousFreeBlock(const std::vector<BYTE> &volumeBitmap,
-                                    ULONGLONG totalClusters,
-                                    ULONGLONG clustersNeeded,
-                                    ULONGLONG &outBlockStart) {
-    ULONGLONG runStart = 0;
-    ULONGLONG runLen = 0;
+bool DefragmentIncremental(SnapshotReader &previous,
+                           ChangeSource &source,
+                           MoveExecutor &executor,
+                           std::vector<BYTE> &volumeBitmap,
+                           ULONGLONG totalClusters,
+                           EntryFilter &filter,
+                           SnapshotWriter *nextSnapshot,
+                           IncrementalStats &stats) {
+    std::vector<FileChange> changes;
+    ChangePosition next;
+    ChangeReadStatus status = source.Read(previous.ChangeFeedPosition(), changes, next);
+    if (status != ChangeReadStatus::Ok) {
+        LOG(LogLevel::Error, (status == ChangeReadStatus::Discontinuous
+                                  ? L"The change feed does not reach back to the snapshot; run a full pass first."
+                                  : L"Cannot read the change feed."));
+        return false;
+    }
+    LOG(LogLevel::Info, changes.size() << L" changes since the snapshot.");
+    CoalesceChanges(changes);
 
-    for (ULONGLONG c = 0; c < totalClusters; c++) {
-        if (IsClusterFree(volumeBitmap, c)) {
-            if (runLen == 0) {
-                runStart = c;
-            }
-            runLen++;
-            if (runLen == clustersNeeded) {
-                // Found a big enough free run
-                outBlockStart = runStart;
-                return true;
-            }
+    // Directory changes first: their files leave the map, or are listed by walking them
+    IncrementalUpdate update(previous);
+    std::vector<std::wstring> paths;
+    bool success = true;
+    for (const FileChange &c : changes) {
+        if (c.kind == ChangeKind::DirectoryDeleted) {
+            update.DropDirectory(c.path, WALK_PATH_SEPARATOR);
+        } else if (c.kind == ChangeKind::DirectoryAdded) {
+            update.DropDirectory(c.path, WALK_PATH_SEPARATOR);
+            DirectoryWalker walker;
+            AddedDirectoryVisitor visitor(filter, paths);
+            success = walker.Walk(c.path, visitor) && visitor.success && success;
         } else {
-            runLen = 0;
+            paths.push_back(c.path);
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+    // Query the changed files, then bring the bitmap up to date before placing anything
+    FileClusters fc;
+    for (const std::wstring &path : paths) {
+        ChangedFile cf;
+        cf.path = path;
+        success = QueryChangedFile(cf, fc) && success;
+        update.SetFile(std::move(cf));
+    }
+    update.ApplyToBitmap(volumeBitmap);
+
+    // Defragment the changed files that need it
+    for (ChangedFile &cf : update.Files()) {
+        if (!cf.exists || CountPieces(cf.runs.data(), cf.runs.size()) <= 1) {
+            continue;
+        }
+        if (!DefragmentFile(cf.path, fc, executor, volumeBitmap, totalClusters)) {
+            LOG(LogLevel::Error, L"DefragmentFile failed on: " << cf.path);
+            success = false;
+            continue;
         }
+        ClustersToRuns(fc, cf.runs);
+    }
+
+    if (nextSnapshot) {
+        nextSnapshot->SetChangePosition(next);
+        update.Write(*nextSnapshot);
     }
-    return false; // no sufficiently large free block found
+    stats = update.stats;
+    return success;
 }
 
 // -----------------------------------------------------------------------------
-// Defragmentation: simplified approach
-//   1) Check if file is already contiguous -> skip
-//   2) If not, find one block large enough to hold entire file
-//   3) Move all clusters to that block
+// Analysis only
+//   Walks the volume once and folds every file's extents and every free run
+//   into a FragmentationReport, whose size does not grow with the number of
+//   files. Nothing is moved. Files are opened with FILE_READ_ATTRIBUTES only,
+//   and files the snapshot has as unchanged are not opened at all.
 // -----------------------------------------------------------------------------
-bool DefragmentFile(const std::wstring &filePath,
-                    HANDLE volumeHandle,
-                    std::vector<BYTE> &volumeBitmap,
-                    ULONGLONG totalClusters) {
-    // Open the file
-    HANDLE hFile = CreateFileW(
-        filePath.c_str(),
-        GENERIC_READ | GENERIC_WRITE,
-        FILE_SHARE_READ | FILE_SHARE_WRITE,
-        NULL,
-        OPEN_EXISTING,
-        0,
-        NULL);
+struct AnalysisStats {
+    ULONGLONG filesFromSnapshot = 0;
+    ULONGLONG filesUnreadable = 0; // could not be opened or queried, left out of the report
+};
 
-    if (hFile == INVALID_HANDLE_VALUE) {
-        PrintLastError((L"Failed to open file: " + filePath).c_str());
-        return false;
-    }
+struct AnalyzeVisitor : DefragWalkVisitor {
+    FragmentationReport &report;
+    AnalysisStats &stats;
+    ClusterMap *clusterMap; // fragmented files are drawn on it, if given
 
-    // Retrieve all clusters for this file
-    FileClusters fc;
-    if (!GetAllFileRetrievalPointers(hFile, fc)) {
-        std::wcerr << L"Could not get retrieval pointers for file: " << filePath << L"\n";
-        CloseHandle(hFile);
-        return false;
-    }
+    AnalyzeVisitor(EntryFilter &filter, FragmentationReport &report, AnalysisStats &stats, ClusterMap *clusterMap)
+        : DefragWalkVisitor(filter), report(report), stats(stats), clusterMap(clusterMap) {}
 
-    // If no clusters, skip
-    if (fc.lcns.empty()) {
-        std::wcerr << L"No allocated clusters in file: " << filePath << L"\n";
+    WalkAction OnFile(const WalkEntry &e) {
+        if (!filter.AcceptFile(e)) {
+            return WalkAction::Continue;
+        }
+        if (ReportFromSnapshot(e)) {
+            return WalkAction::Continue;
+        }
+        filePath.assign(e.path, e.pathLength);
+        HANDLE hFile = CreateFileW(filePath.c_str(), FILE_READ_ATTRIBUTES,
+                                   FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            LOG(LogLevel::Warn, L"Cannot open, not in the report: " << filePath);
+            stats.filesUnreadable++;
+            return WalkAction::Continue;
+        }
+        g_volumeOps.Opened(hFile, filePath);
+        size_t clusterCount = 0;
+        bool ok = ReadFileRetrievalRuns(hFile, clusterCount);
         CloseHandle(hFile);
-        return true;
-    }
+        if (!ok) {
+            LOG(LogLevel::Warn, L"Cannot read the extents, not in the report: " << filePath);
+            stats.filesUnreadable++;
+            return WalkAction::Continue;
+        }
 
-    // Check if the file is already contiguous
-    bool isContiguous = true;
-    for (size_t i = 1; i < fc.lcns.size(); i++) {
-        if (fc.lcns[i] != fc.lcns[i - 1] + 1) {
-            isContiguous = false;
-            break;
+        const std::vector<ExtentRun> &runs = ScratchArena::ForThread().runs;
+        report.AddFile(e.path, e.pathLength, e.size, runs.data(), runs.size());
+        if (clusterMap) {
+            clusterMap->AddFile(runs.data(), runs.size());
         }
+        if (g_snapshot.next) {
+            g_snapshot.next->AddFile(e.path, e.pathLength, e.size, e.lastWriteTime, runs.data(), runs.size());
+        }
+        AsyncLog::Instance().progress.files++;
+        AsyncLog::Instance().progress.clustersScanned += clusterCount;
+        return WalkAction::Continue;
     }
-    if (isContiguous) {
-        std::wcout << L"File already contiguous, skipping: " << filePath << std::endl;
-        CloseHandle(hFile);
+
+    // Any file the previous snapshot has with the same size and last write
+    // time is taken from it, fragmented or not
+    bool ReportFromSnapshot(const WalkEntry &e) {
+        if (!g_snapshot.previous) {
+            return false;
+        }
+        const SnapshotFileRecord *r = g_snapshot.previous->Find(e.path, e.pathLength);
+        std::vector<ExtentRun> &runs = g_snapshot.runs;
+        if (!r || !SnapshotReader::IsUnchanged(*r, e.size, e.lastWriteTime) || !g_snapshot.previous->DecodeExtents(*r, runs)) {
+            return false;
+        }
+        report.AddFile(e.path, e.pathLength, e.size, runs.data(), runs.size());
+        if (clusterMap) {
+            clusterMap->AddFile(runs.data(), runs.size());
+        }
+        if (g_snapshot.next) {
+            g_snapshot.next->AddFile(e.path, e.pathLength, e.size, e.lastWriteTime, runs.data(), runs.size());
+        }
+        stats.filesFromSnapshot++;
+        AsyncLog::Instance().progress.files++;
         return true;
     }
+};
 
-    ULONGLONG fileClusterCount = (ULONGLONG)fc.lcns.size();
-    ULONGLONG blockStart = 0;
-
-    // Attempt to find one big free block to hold all clusters
-    bool foundBlock = FindContiguousFreeBlock(volumeBitmap,
-                                              totalClusters,
-                                              fileClusterCount,
-                                              blockStart);
-
-    if (!foundBlock) {
-        // We skip defrag if there's no single run large enough
-        std::wcerr << L"Cannot find a contiguous region of size " << fileClusterCount
-                   << L" clusters for file: " << filePath << L". Skipping.\n";
-        CloseHandle(hFile);
+// Write the report as UTF-8 JSON to a file, or to the console for "-"
+static bool WriteAnalysisReport(const FragmentationReport &report, const std::wstring &reportPath) {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    std::ostringstream json;
+    report.WriteJson(json, FileTimeToTicks(now));
+    std::string text = json.str();
+    if (reportPath == L"-") {
+        int chars = MultiByteToWideChar(CP_UTF8, 0, text.data(), (int)text.size(), NULL, 0);
+        std::wstring wide((size_t)chars, L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, text.data(), (int)text.size(), &wide[0], chars);
+        std::wcout << wide;
         return true;
     }
+    std::ofstream out(std::filesystem::path(reportPath), std::ios::binary);
+    out.write(text.data(), (std::streamsize)text.size());
+    if (!out) {
+        std::wcerr << L"Cannot write the report to " << reportPath << L"\n";
+        return false;
+    }
+    std::wcout << L"Report written to " << reportPath << L"\n";
+    return true;
+}
 
-    std::wcout << L"Defragmenting file: " << filePath
-               << L" into LCN range [" << blockStart << L" ... "
-               << (blockStart + fileClusterCount - 1) << L"]\n";
-
-    // Move each cluster in ascending file order
-    for (size_t i = 0; i < fileClusterCount; i++) {
-        LONGLONG srcVcn = fc.vcns[i];  // which VCN in file
-        LONGLONG srcLcn = fc.lcns[i];  // current on-disk location
-        LONGLONG dstLcn = blockStart + i;
-
-        // If it's already in the correct place, skip
-        if (srcLcn == dstLcn) {
-            continue;
-        }
-
-        // Perform the cluster move
-        if (!MoveSingleCluster(volumeHandle, hFile, srcVcn, dstLcn)) {
-            std::wcerr << L"Cluster move failed (File: " << filePath
-                       << L", srcLCN=" << srcLcn << L", dstLCN=" << dstLcn << L")\n";
-            // We continue to attempt the rest anyway
-            continue;
-        }
+bool AnalyzeVolume(const std::wstring &rootPath,
+                   const std::vector<BYTE> &volumeBitmap,
+                   ULONGLONG totalClusters,
+                   EntryFilter &filter,
+                   FragmentationReport &report,
+                   AnalysisStats &stats,
+                   ClusterMap *clusterMap) {
+    report.ScanFreeSpace(BitmapWords(volumeBitmap), totalClusters, g_planner.reserved);
+    DirectoryWalker walker;
+    AnalyzeVisitor visitor(filter, report, stats, clusterMap);
+    return walker.Walk(rootPath, visitor) && visitor.success;
+}
 
-        // Mark old location free
-        size_t oldByteIndex = (size_t)(srcLcn / 8);
-        int oldBitOffset = (int)(srcLcn % 8);
-        volumeBitmap[oldByteIndex] &= ~(1 << oldBitOffset);
+struct ClusterMapStats {
+    unsigned images = 0;
+    uint64_t clustersFilled = 0; // by the pass, from the before and after bitmaps
+    uint64_t clustersFreed = 0;
+};
 
-        // Mark new location allocated
-        size_t newByteIndex = (size_t)(dstLcn / 8);
-        int newBitOffset = (int)(dstLcn % 8);
-        volumeBitmap[newByteIndex] |= (1 << newBitOffset);
+// "D:\maps\c.png" + "-after" = "D:\maps\c-after.png"
+static std::wstring SuffixedPath(const std::wstring &path, const wchar_t *suffix) {
+    std::filesystem::path p(path);
+    return (p.parent_path() / (p.stem().wstring() + suffix + p.extension().wstring())).wstring();
+}
 
-        // Update cluster map
-        fc.lcns[i] = dstLcn;
+static bool WriteClusterMap(const ClusterMap &map, const std::wstring &path, ClusterMapStats &stats) {
+    if (!map.Write(std::filesystem::path(path))) {
+        std::wcerr << L"Cannot write the cluster map to " << path << L"\n";
+        return false;
     }
-
-    CloseHandle(hFile);
+    std::wcout << L"Cluster map written to " << path << L"\n";
+    stats.images++;
     return true;
 }
 
-bool DefragmentAllFilesInDirectory(const std::wstring &dirPath,
-                                   HANDLE volumeHandle,
-                                   std::vector<BYTE> &volumeBitmap,
-                                   ULONGLONG totalClusters) {
-    std::wstring searchPath = dirPath;
-    if (!searchPath.empty() && searchPath.back() != L'\\') {
-        searchPath += L"\\";
+// Write the analysis map as is. After a move pass, write the map as the pass
+// found the volume, the volume as the pass left it (bitmapAfter, read from
+// the volume again) and what changed: clusters filled in red, freed in green.
+static bool WriteClusterMaps(const ClusterMap &map,
+                             const std::vector<BYTE> &bitmapBefore,
+                             const std::vector<BYTE> *bitmapAfter,
+                             const std::wstring &mapPath,
+                             bool analysis,
+                             ClusterMapStats &stats) {
+    std::wcout << L"Cluster map: " << map.Width() << L" x " << map.Height() << L" pixels, " << map.ClustersPerPixel()
+               << L" clusters per pixel.\n";
+    if (analysis) {
+        return WriteClusterMap(map, mapPath, stats);
     }
-    searchPath += L"*"; // wildcard for all entries
-
-    WIN32_FIND_DATAW ffd;
-    HANDLE hFind = FindFirstFileW(searchPath.c_str(), &ffd);
-
-    if (hFind == INVALID_HANDLE_VALUE) {
-        PrintLastError((L"FindFirstFileW failed on " + searchPath).c_str());
+    bool ok = WriteClusterMap(map, SuffixedPath(mapPath, L"-before"), stats);
+    if (!bitmapAfter) {
+        std::wcerr << L"No bitmap after the pass; no after and changes maps.\n";
         return false;
     }
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    ClusterMap after(map.TotalClusters(), map.Width(), map.Height());
+    after.ScanBitmap(BitmapWords(*bitmapAfter), threads);
+    after.AddReserved(g_planner.reserved);
+    ClusterMap changes(map.TotalClusters(), map.Width(), map.Height());
+    changes.ScanChanges(BitmapWords(bitmapBefore), BitmapWords(*bitmapAfter), threads);
+    for (size_t p = 0; p < changes.Pixels(); p++) {
+        stats.clustersFilled += changes.Filled(p);
+        stats.clustersFreed += changes.Freed(p);
+    }
+    std::wcout << L"Clusters the pass filled: " << stats.clustersFilled << L", freed: " << stats.clustersFreed << L"\n";
+    ok = WriteClusterMap(after, SuffixedPath(mapPath, L"-after"), stats) && ok;
+    return WriteClusterMap(changes, SuffixedPath(mapPath, L"-changes"), stats) && ok;
+}
 
-    bool success = true;
-
-    do {
-        std::wstring fileName = ffd.cFileName;
-        if (fileName == L"." || fileName == L"..") {
-            continue;
-        }
-
-        std::wstring fullPath = dirPath;
-        if (!fullPath.empty() && fullPath.back() != L'\\') {
-            fullPath += L"\\";
-        }
-        fullPath += fileName;
+struct BitmapCheck {
+    BitmapDiffSummary summary;
+    std::vector<BitmapChange> first; // the first few differences, in LCN order
+};
 
-        if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            std::wcout << L"Entering subdirectory: " << fullPath << std::endl;
-            if (!DefragmentAllFilesInDirectory(fullPath, volumeHandle, volumeBitmap, totalClusters)) {
-                std::wcerr << L"Failed to defragment subdirectory: " << fullPath << std::endl;
-                success = false;
-            }
-        } else {
-            // Defragment the file if needed
-            if (!DefragmentFile(fullPath, volumeHandle, volumeBitmap, totalClusters)) {
-                std::wcerr << L"DefragmentFile failed on: " << fullPath << std::endl;
-                success = false;
-            }
+// Compare the bitmap the pass expects (its own, with every move applied)
+// with the one read from the volume after the pass. Clusters allocated that
+// the plan left free were taken by other writers. Clusters free that the
+// plan allocated belong to moves that did not happen, or to files deleted
+// during the pass.
+static void CheckBitmap(const std::vector<BYTE> &expected, const std::vector<BYTE> &actual, ULONGLONG totalClusters,
+                        BitmapCheck &check) {
+    const size_t listed = 10;
+    check.summary = DiffBitmaps(expected.data(), actual.data(), totalClusters, [&](const BitmapChange &c) {
+        if (check.first.size() < listed) {
+            check.first.push_back(c);
         }
-    } while (FindNextFileW(hFind, &ffd) != 0);
-
-    if (GetLastError() != ERROR_NO_MORE_FILES) {
-        PrintLastError(L"FindNextFileW ended unexpectedly");
-        success = false;
+    });
+    const BitmapDiffSummary &s = check.summary;
+    std::wcout << L"Bitmap check: " << s.clustersAllocated << L" clusters allocated that the plan left free ("
+               << s.rangesAllocated << L" ranges), " << s.clustersFreed << L" clusters free that the plan allocated ("
+               << s.rangesFreed << L" ranges).\n";
+    for (const BitmapChange &c : check.first) {
+        std::wcout << L"  LCN " << c.start << L" + " << c.end - c.start
+                   << (c.kind == BitmapChangeKind::Allocated ? L": allocated, planned free\n" : L": free, planned allocated\n");
+    }
+    if (s.RangesChanged() > check.first.size()) {
+        std::wcout << L"  ... and " << s.RangesChanged() - check.first.size() << L" more ranges.\n";
     }
-    FindClose(hFind);
-    return success;
 }
 
-int main() {
+int main(int argc, char **argv) {
+    ToolOptions options(L"defragment", {
+        {L"volume", OptionKind::Text, true, L"drive letter of the volume, e.g. C"},
+        {L"snapshot", OptionKind::Text, false, L"snapshot file, used if recent and rewritten at the end (- = none, default)"},
+        {L"snapshot-age", OptionKind::Count, false, L"use the snapshot if taken within this many minutes, 0 = any age (default 10)"},
+        {L"changes", OptionKind::Text, false, L"change feed for incremental runs: a change log file, - = USN journal (default)"},
+        {L"trace", OptionKind::Text, false, L"record volume operations to this file (- = no, default)"},
+        {L"bitmap-ranges", OptionKind::Count, false, L"bitmap ranges fetched in parallel (default 1)"},
+        {L"bitmap-chunk-kb", OptionKind::Count, false, L"KB of bitmap per call (default 1024)"},
+        {L"mode", OptionKind::Count, false, L"0 = first fit, 1 = group by directory (enumeration order), 2 = group by "
+                                            L"directory (name order), 3 = access trace order, 4 = hot/cold zoning, "
+                                            L"5 = incremental, 6 = analyze only (default 0)"},
+        {L"access-trace", OptionKind::Text, false, L"mode 3: the access trace file"},
+        {L"report", OptionKind::Text, false, L"mode 6: JSON report file (- = console, default)"},
+        {L"report-top", OptionKind::Count, false, L"mode 6: most fragmented files listed (default 20)"},
+        {L"staged", OptionKind::Count, false, L"mode 0: overlap the walk, extent reads, planning and moves, 0 or 1 (default 1)"},
+        {L"map", OptionKind::Text, false, L"cluster map image, .png or .ppm; moves add -before, -after and -changes (- = none, default)"},
+        {L"map-width", OptionKind::Count, false, L"cluster map width in pixels (default 1024)"},
+        {L"map-height", OptionKind::Count, false, L"cluster map height in pixels, less for small volumes (default 768)"},
+        {L"hot-days", OptionKind::Count, false, L"mode 4: hot if accessed or written within this many days (default 30)"},
+        {L"zone-start", OptionKind::Count, false, L"mode 4: hot zone start, in percent of the volume (default 0)"},
+        {L"zone-end", OptionKind::Count, false, L"mode 4: hot zone end, in percent of the volume (default 10)"},
+        {L"cost", OptionKind::Count, false, L"read-cost model: 0 = none, 1 = HDD, 2 = SSD, 3 = measure (default 0)"},
+        {L"threshold-ms", OptionKind::Number, false, L"skip files whose read gets faster by less (default 1)"},
+        {L"max-size-mb", OptionKind::Count, false, L"skip files larger than this, 0 = no limit (default 0)"},
+        {L"include", OptionKind::Text, false, L"only files matching these globs, separated by ';' (default *)"},
+        {L"exclude", OptionKind::Text, false, L"skip files and directories matching these globs (- = none, default)"},
+        {L"move-order", OptionKind::Count, false, L"0 = as planned, 1 = by source LCN, 2 = by destination LCN (default 2)"},
+        {L"verify", OptionKind::Count, false, L"verify file contents and extents after moving, 0 or 1 (default 0)"},
+        {L"verify-threads", OptionKind::Count, false, L"threads hashing files for verification (default: one per core)"},
+        {L"check-bitmap", OptionKind::Count, false, L"compare the bitmap after the pass with the planned one, 0 or 1 (default 0)"},
+        {L"log-level", OptionKind::Count, false, L"0 = errors, 1 = warnings, 2 = per file, 3 = verbose (default 1)"},
+        {L"log-every", OptionKind::Count, false, L"with log level 3, log every Nth verbose line (default 1)"},
+    });
+    int exitCode = 0;
+    if (!options.Parse(argc, argv, exitCode)) {
+        return exitCode;
+    }
+
     std::wcout << L"Attempting to enable SeManageVolumePrivilege...\n";
     if (!EnablePrivilege(L"SeManageVolumePrivilege")) {
         std::wcerr << L"Failed to enable SeManageVolumePrivilege. Try running as Administrator.\n";
     }
 
     // Ask for drive letter
-    std::wstring driveLetter;
-    std::wcout << L"Enter drive letter (e.g. C): ";
-    std::wcin >> driveLetter;
+    std::wstring driveLetter = options.DriveLetter(L"volume", L"Enter drive letter (e.g. C): ");
     if (driveLetter.empty()) {
         std::wcerr << L"No drive letter provided.\n";
-        return 1;
+        return options.Finish(TOOL_EXIT_USAGE);
     }
 
     // Build paths
     std::wstring rootPath = driveLetter + L":\\";
     std::wstring volumePath = L"\\\\.\\" + driveLetter + L":";
 
-    // Get volume geometry
-    ULONGLONG totalClusters = 0;
-    DWORD bytesPerCluster = 0;
-    if (!GetVolumeClusterInfo(rootPath, totalClusters, bytesPerCluster)) {
-        std::wcerr << L"GetVolumeClusterInfo failed.\n";
-        return 1;
-    }
-    if (totalClusters == 0) {
-        std::wcerr << L"Volume reports 0 clusters?\n";
-        return 1;
-    }
-
-    std::wcout << L"Volume has " << totalClusters
-               << L" clusters. Bytes/cluster = " << bytesPerCluster << L"\n";
-
     // Open the volume (with read/write access)
     HANDLE hVolume = CreateFileW(
         volumePath.c_str(),
@@ -515,18 +2376,108 @@ int main() {
 
     if (hVolume == INVALID_HANDLE_VALUE) {
         PrintLastError((L"Failed to open volume " + volumePath).c_str());
-        return 1;
+        return options.Finish(TOOL_EXIT_FAILED);
     }
 
-    // Retrieve the volume bitmap
-    std::vector<BYTE> volumeBitmap;
-    if (!GetVolumeBitmapChunked(hVolume, totalClusters, volumeBitmap)) {
-        std::wcerr << L"GetVolumeBitmapChunked failed.\n";
+    // Get volume geometry (64-bit cluster counts, MFT zone)
+    VolumeGeometry geometry;
+    if (!GetVolumeGeometry(hVolume, rootPath, geometry) || geometry.totalClusters == 0) {
+        std::wcerr << L"GetVolumeGeometry failed.\n";
         CloseHandle(hVolume);
-        return 1;
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+    ULONGLONG totalClusters = geometry.totalClusters;
+    DWORD bytesPerCluster = geometry.bytesPerCluster;
+    std::wcout << L"Volume has " << totalClusters
+               << L" clusters. Bytes/cluster = " << bytesPerCluster << L"\n";
+    g_planner.reserved = geometry.ReservedRanges();
+    g_volumeOps.volumeHandle = hVolume;
+    g_volumeOps.volumePath = volumePath;
+    g_volumeOps.trace = &g_ioTrace;
+    if (geometry.isNtfs) {
+        std::wcout << L"MFT at LCN " << geometry.mftStartLcn << L", MFT zone: LCN [" << geometry.mftZoneStart
+                   << L" ... " << geometry.mftZoneEnd << L"), kept free for $MFT growth.\n";
+    }
+
+    // Optionally start from the snapshot of an earlier run
+    std::wstring snapshotPath =
+        options.Line(L"snapshot", L"Snapshot file (used if recent, rewritten at the end; - = none, default = -): ", L"-");
+    SnapshotReader previousSnapshot;
+    std::unique_ptr<SnapshotWriter> nextSnapshot;
+    std::unique_ptr<ChangeSource> changeSource;
+    if (snapshotPath != L"-") {
+        ULONGLONG maxAgeMinutes = options.Number(
+            L"snapshot-age",
+            L"Use the snapshot if it was taken within how many minutes? 0 = any age, for incremental runs (default = 10): ",
+            10ULL);
+        if (LoadSnapshot(snapshotPath, geometry, maxAgeMinutes, previousSnapshot)) {
+            g_snapshot.previous = &previousSnapshot;
+        }
+        nextSnapshot = std::make_unique<SnapshotWriter>(geometry.volumeSerial, totalClusters, bytesPerCluster);
+        g_snapshot.next = nextSnapshot.get();
+
+        std::wstring changeLogPath = options.Line(
+            L"changes", L"Change feed for incremental runs: a change log file, or - for the USN journal (default = -): ",
+            L"-");
+        if (changeLogPath == L"-") {
+            changeSource = std::make_unique<UsnJournalSource>(hVolume);
+        } else {
+            changeSource = std::make_unique<ChangeLogSource>(changeLogPath);
+        }
     }
 
-    std::wcout << L"Bitmap retrieved: " << volumeBitmap.size() << L" bytes.\n";
+    // Optionally record every bitmap read, extent query and move for replay elsewhere
+    std::wstring ioTracePath =
+        options.Line(L"trace", L"Record volume operations to a trace file (- = no, default = -): ", L"-");
+    if (ioTracePath != L"-") {
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        if (!g_ioTrace.Open(ioTracePath, geometry.volumeSerial, totalClusters, bytesPerCluster, FileTimeToTicks(now))) {
+            PrintLastError((L"Cannot create trace " + ioTracePath).c_str());
+            CloseHandle(hVolume);
+            return options.Finish(TOOL_EXIT_FAILED);
+        }
+        g_ioTrace.AddReserved(g_planner.reserved); // a replay plans around the same MFT zone
+    }
+
+    std::vector<BYTE> volumeBitmap;
+    ULONGLONG bitmapTicks = 0; // when the bitmap was read, which dates the next snapshot
+    double bitmapSeconds = 0;  // 0 when taken from the snapshot
+    if (g_snapshot.previous) {
+        const BYTE *stored = previousSnapshot.Bitmap();
+        volumeBitmap.assign(stored, stored + previousSnapshot.Header().bitmapBytes);
+        bitmapTicks = previousSnapshot.Header().createdTicks;
+        std::wcout << L"Bitmap taken from the snapshot: " << volumeBitmap.size() << L" bytes.\n";
+        if (g_ioTrace.IsOpen()) {
+            // Recorded as if read in one call, so a replay starts from the same bitmap
+            std::vector<BYTE> reply(sizeof(BitmapReplyHeader) + volumeBitmap.size());
+            BitmapReplyHeader header = {0, (int64_t)totalClusters};
+            std::memcpy(reply.data(), &header, sizeof(header));
+            std::memcpy(reply.data() + sizeof(header), volumeBitmap.data(), volumeBitmap.size());
+            g_ioTrace.AddBitmap(0, ERROR_SUCCESS, reply.data(), (uint32_t)reply.size());
+        }
+    } else {
+        // Retrieve the volume bitmap, optionally as several ranges in parallel
+        BitmapFetchOptions fetchOptions;
+        fetchOptions.ranges =
+            options.Number(L"bitmap-ranges", L"Bitmap fetch: how many ranges in parallel? (default = 1): ", fetchOptions.ranges);
+        ULONGLONG chunkKB = options.Number(L"bitmap-chunk-kb", L"Bitmap fetch: KB of bitmap per call (default = 1024): ", 1024ULL);
+        fetchOptions.chunkBytes = (uint32_t)std::max<ULONGLONG>(1, std::min<ULONGLONG>(chunkKB, 64 * 1024)) * 1024;
+
+        FILETIME fetchTime;
+        GetSystemTimeAsFileTime(&fetchTime);
+        bitmapTicks = FileTimeToTicks(fetchTime);
+        BitmapFetchStats fetchStats;
+        if (!FetchBitmap(g_volumeOps, totalClusters, volumeBitmap, fetchOptions, &fetchStats)) {
+            std::wcerr << L"Cannot read the volume bitmap.\n";
+            CloseHandle(hVolume);
+            return options.Finish(TOOL_EXIT_FAILED);
+        }
+
+        std::wcout << L"Bitmap retrieved: " << volumeBitmap.size() << L" bytes in " << fetchStats.seconds
+                   << L" s (" << fetchStats.ioctlCalls << L" calls).\n";
+        bitmapSeconds = fetchStats.seconds;
+    }
 
     // Count free clusters
     ULONGLONG freeCount = 0;
@@ -537,18 +2488,433 @@ int main() {
     }
     std::wcout << L"Free clusters: " << freeCount << L" / " << totalClusters << std::endl;
 
-    // Run defragmentation across entire volume
-    std::wcout << L"Starting defragmentation on " << rootPath << L"...\n";
-    if (!DefragmentAllFilesInDirectory(rootPath, hVolume, volumeBitmap, totalClusters)) {
-        std::wcerr << L"Defragmentation of the volume encountered errors.\n";
+    // Ask for the placement mode
+    int placementMode = options.Number(
+        L"mode",
+        std::wstring(L"Placement mode? 0 = first fit, 1 = group by directory (enumeration order),") +
+            L" 2 = group by directory (name order), 3 = access trace order, 4 = hot/cold zoning," +
+            L" 5 = incremental, changed files only, 6 = analyze only, JSON report (default = 0): ",
+        0);
+    if (placementMode == 5 && !g_snapshot.previous) {
+        std::wcerr << L"Incremental mode needs a snapshot of this volume.\n";
+        CloseHandle(hVolume);
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+
+    std::vector<TraceEntry> traceEntries;
+    if (placementMode == 3) {
+        std::wstring tracePath = options.Line(L"access-trace", L"Access trace file: ");
+        if (!LoadAccessTrace(tracePath, traceEntries)) {
+            CloseHandle(hVolume);
+            return options.Finish(TOOL_EXIT_FAILED);
+        }
+        std::wcout << L"Access trace has " << traceEntries.size() << L" reads.\n";
+    }
+
+    std::wstring reportPath;
+    size_t reportTopFiles = 20;
+    if (placementMode == 6) {
+        reportPath = options.Line(L"report", L"Report file (- = console, default = -): ", L"-");
+        reportTopFiles =
+            options.Number(L"report-top", L"How many of the most fragmented files to list? (default = 20): ", reportTopFiles);
+    }
+
+    // Optionally draw the cluster map: the analysis draws one image with the
+    // fragmented files, a move pass draws the volume before and after
+    std::wstring mapPath = options.Line(
+        L"map",
+        placementMode == 6 ? L"Cluster map image, .png or .ppm (- = none, default = -): "
+                           : L"Cluster map images, .png or .ppm, saved as -before, -after and -changes (- = none, default = -): ",
+        L"-");
+
+    ZoningPolicy zoning;
+    if (placementMode == 4) {
+        zoning.hotAgeDays =
+            options.Number(L"hot-days", L"Hot if accessed or written within how many days? (default = 30): ", zoning.hotAgeDays);
+        int zoneStartPercent = options.Number(L"zone-start", L"Hot zone start, in percent of the volume (default = 0): ", 0);
+        int zoneEndPercent = options.Number(L"zone-end", L"Hot zone end, in percent of the volume (default = 10): ", 10);
+        if (zoneStartPercent < 0 || zoneEndPercent > 100 || zoneStartPercent >= zoneEndPercent) {
+            std::wcerr << L"Invalid hot zone bounds.\n";
+            CloseHandle(hVolume);
+            return options.Finish(TOOL_EXIT_FAILED);
+        }
+        zoning.zoneStartLcn = totalClusters * (ULONGLONG)zoneStartPercent / 100;
+        zoning.zoneEndLcn = totalClusters * (ULONGLONG)zoneEndPercent / 100;
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        zoning.nowFileTime = FileTimeToTicks(now);
+        std::wcout << L"Hot zone: LCN [" << zoning.zoneStartLcn << L" ... " << zoning.zoneEndLcn << L")\n";
+    }
+
+    // Ask for the read-cost model that decides which fragmented files are worth moving
+    int costProfile = options.Number(L"cost",
+                                     std::wstring(L"Read-cost model? 0 = none, move every fragmented file, 1 = HDD (7200 rpm), 2 = SSD,") +
+                                         L" 3 = measure this volume (default = 0): ",
+                                     0);
+    DeviceProfile deviceProfile = (costProfile == 2) ? DeviceProfile::Ssd() : DeviceProfile::Hdd7200();
+    std::unique_ptr<ReadCostModel> readCostModel;
+    if (costProfile == 3 &&
+        !MeasureDeviceProfile(volumePath, totalClusters * bytesPerCluster, deviceProfile)) {
+        CloseHandle(hVolume);
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+    if (costProfile >= 1 && costProfile <= 3) {
+        double thresholdMs =
+            options.Number(L"threshold-ms", L"Skip files whose read would get faster by less than how many ms? (default = 1): ", 1.0);
+        readCostModel = std::make_unique<ReadCostModel>(deviceProfile, totalClusters, bytesPerCluster);
+        g_planner.readCost = readCostModel.get();
+        g_planner.thresholdSeconds = thresholdMs / 1000;
+        std::wcout << L"Device profile: " << (deviceProfile.rotational ? L"rotational" : L"solid state") << L", "
+                   << deviceProfile.bytesPerSecond / 1e6 << L" MB/s, " << deviceProfile.requestSeconds * 1e6
+                   << L" us per request";
+        if (deviceProfile.rotational) {
+            std::wcout << L", seek " << deviceProfile.seekMinSeconds * 1e3 << L" to " << deviceProfile.seekAvgSeconds * 1e3
+                       << L" ms (average), " << deviceProfile.revolutionSeconds * 1e3 << L" ms per revolution";
+        }
+        std::wcout << L"\n";
+    }
+
+    // Ask which files to consider. Everything here is decided from the directory
+    // entry alone, so rejected files are never opened.
+    EntryFilter filter;
+    if (placementMode != 3) {
+        ULONGLONG maxSizeMB =
+            options.Number(L"max-size-mb", L"Skip files larger than how many MB? 0 = no limit (default = 0): ", 0ULL);
+        std::wstring includeGlobs =
+            options.Line(L"include", L"Only files matching (globs separated by ';', default = *): ", L"*");
+        std::wstring excludeGlobs = options.Line(
+            L"exclude", L"Exclude files and directories matching (globs separated by ';', - = none, default = -): ", L"-");
+
+        filter.maxSize = maxSizeMB * 1024 * 1024;
+        if (includeGlobs != L"*") {
+            filter.include.AddList(includeGlobs);
+        }
+        if (excludeGlobs != L"-") {
+            filter.exclude.AddList(excludeGlobs);
+        }
+        if (placementMode == 0) {
+            // A file of at most one cluster is always contiguous
+            filter.minSize = (ULONGLONG)bytesPerCluster + 1;
+        }
+        if (placementMode == 1 || placementMode == 2) {
+            // Grouping opens every file twice (measure, then move)
+            filter.opensPerFile = 2;
+            filter.ioctlsPerFile = 2;
+        }
+    }
+
+    // Ask for the move ordering and verification; analysis moves nothing
+    int moveOrder = 2;
+    int verifyMoves = 0;
+    int checkBitmap = 0;
+    int staged = 0;
+    if (placementMode == 0) {
+        staged = options.Number(
+            L"staged", L"Overlap the walk, extent reads, planning and moves in stages? 0 = no, 1 = yes (default = 1): ", 1);
+    }
+    if (placementMode != 6) {
+        moveOrder = options.Number(L"move-order",
+                                   std::wstring(L"Move ordering? 0 = as planned, 1 = elevator by source LCN,") +
+                                       L" 2 = elevator by destination LCN (default = 2): ",
+                                   moveOrder);
+
+        verifyMoves =
+            options.Number(L"verify", L"Verify file contents and extents after moving? 0 = no, 1 = yes (default = 0): ", 0);
+        checkBitmap = options.Number(
+            L"check-bitmap", L"Compare the bitmap after the pass with the planned one? 0 = no, 1 = yes (default = 0): ", 0);
+    }
+
+    MoveExecutor executor;
+    DefragMoveObserver moveObserver;
+    executor.ops = &g_volumeOps;
+    executor.observer = &moveObserver;
+    std::unique_ptr<FileVerifier> verifier;
+    if (verifyMoves == 1) {
+        unsigned verifyThreads = options.Value(L"verify-threads", std::max(1u, std::thread::hardware_concurrency()));
+        verifier = std::make_unique<FileVerifier>(std::max(1u, verifyThreads));
+        moveObserver.verifier = verifier.get();
+    }
+    executor.order = (moveOrder == 0) ? MoveOrder::Planned
+                   : (moveOrder == 1) ? MoveOrder::SourceLcn
+                                      : MoveOrder::DestinationLcn;
+
+    // Ask how chatty the run should be
+    int logLevel =
+        options.Number(L"log-level", L"Log level? 0 = errors, 1 = warnings, 2 = per file, 3 = verbose (default = 1): ", 1);
+    ULONGLONG sampleEvery = 1;
+    if (logLevel >= 3) {
+        sampleEvery = options.Number(L"log-every", L"Log every Nth verbose line (default = 1): ", 1ULL);
+    }
+
+    // Run defragmentation (or the analysis) across entire volume
+    std::wcout << (placementMode == 6 ? L"Starting analysis of " : L"Starting defragmentation on ") << rootPath << L"...\n";
+    AsyncLog &log = AsyncLog::Instance();
+    log.progress.clustersTotal = totalClusters - freeCount;
+    log.Start((LogLevel)std::max(0, std::min(logLevel, 3)), sampleEvery, options.Interactive());
+
+    // A full pass records where the change feed is now, so that the next
+    // incremental run replays everything that changes from here on
+    if (nextSnapshot && placementMode != 5) {
+        ChangePosition position;
+        if (changeSource->Current(position)) {
+            nextSnapshot->SetChangePosition(position);
+        } else {
+            std::wcerr << L"No change feed position recorded; the snapshot cannot be used for incremental runs.\n";
+        }
+    }
+
+    LayoutStats stats;
+    ZoningStats zoningStats;
+    IncrementalStats incrementalStats;
+    FragmentationReport report(reportTopFiles);
+    AnalysisStats analysisStats;
+    StagedPassStats stagedStats;
+    report.SetVolume(rootPath, totalClusters, bytesPerCluster);
+    report.SetReadCost(g_planner.readCost, g_planner.thresholdSeconds);
+    std::unique_ptr<ClusterMap> clusterMap;
+    std::vector<BYTE> bitmapBefore;
+    if (mapPath != L"-") {
+        clusterMap = std::make_unique<ClusterMap>(totalClusters, options.Value(L"map-width", 1024u),
+                                                  options.Value(L"map-height", 768u));
+        clusterMap->ScanBitmap(BitmapWords(volumeBitmap), std::max(1u, std::thread::hardware_concurrency()));
+        clusterMap->AddReserved(g_planner.reserved);
+        if (placementMode != 6) {
+            bitmapBefore = volumeBitmap; // the changes map compares it with the bitmap read after the pass
+        }
+    }
+    bool ok = false;
+    auto passStarted = std::chrono::steady_clock::now();
+    if (placementMode == 6) {
+        ok = AnalyzeVolume(rootPath, volumeBitmap, totalClusters, filter, report, analysisStats, clusterMap.get());
+    } else if (placementMode == 5) {
+        ok = DefragmentIncremental(previousSnapshot, *changeSource, executor, volumeBitmap, totalClusters, filter,
+                                   nextSnapshot.get(), incrementalStats);
+    } else if (placementMode == 4) {
+        ok = DefragmentAllFilesZoned(rootPath, executor, volumeBitmap, totalClusters, zoning, zoningStats, filter);
+    } else if (placementMode == 3) {
+        ok = DefragmentByTrace(traceEntries, executor, volumeBitmap, totalClusters, bytesPerCluster, stats);
+    } else if (placementMode == 1 || placementMode == 2) {
+        ULONGLONG placementHint = 0;
+        DirectoryOrder order = (placementMode == 2) ? DirectoryOrder::Name : DirectoryOrder::Enumeration;
+        ok = DefragmentDirectoryGrouped(rootPath, executor, volumeBitmap, totalClusters, order, placementHint, stats, filter);
+    } else if (staged == 1) {
+        ok = DefragmentAllFilesStaged(rootPath, executor, volumeBitmap, totalClusters, stats, filter, stagedStats);
+    } else {
+        ok = DefragmentAllFilesInDirectory(rootPath, executor, volumeBitmap, totalClusters, stats, filter);
+    }
+    log.Stop();
+    double passSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - passStarted).count();
+
+    if (placementMode == 6) {
+        LcnRange largest = report.LargestFreeRun();
+        std::wcout << L"Files analyzed: " << report.Files() << L" (" << analysisStats.filesFromSnapshot
+                   << L" from the snapshot, " << analysisStats.filesUnreadable << L" unreadable), "
+                   << report.FragmentedFiles() << L" fragmented, " << report.Extents() << L" extents\n";
+        std::wcout << L"Free space: " << report.FreeRuns() << L" runs, largest " << largest.end - largest.start
+                   << L" clusters at LCN " << largest.start << L", fragmentation score " << report.Score() << L"\n";
+        if (g_planner.readCost) {
+            std::wcout << L"Files worth defragmenting: " << report.FilesWorthMoving() << L", saving "
+                       << report.ReadSecondsSaved() << L" s of read time\n";
+        }
+        ok = WriteAnalysisReport(report, reportPath) && ok;
+    } else if (placementMode == 5) {
+        const IncrementalStats &is = incrementalStats;
+        std::wcout << L"Changed files queried: " << is.filesQueried << L" (" << is.filesGone << L" gone), "
+                   << is.filesDropped << L" files dropped with " << is.directoriesDropped << L" directories, "
+                   << is.filesCarried << L" carried over from the snapshot unopened\n";
+        std::wcout << L"Bitmap updated: " << is.clustersFreed << L" clusters freed, " << is.clustersAllocated
+                   << L" allocated\n";
+    } else if (placementMode == 4) {
+        std::wcout << L"Hot files: " << zoningStats.hotFiles << L" (" << zoningStats.hotMovedIn
+                   << L" moved into the zone), cold files: " << zoningStats.coldFiles << L" ("
+                   << zoningStats.coldMovedOut << L" moved out), not placed: " << zoningStats.notPlaced << L"\n";
+    } else if (placementMode == 3) {
+        std::wcout << L"Trace files placed in trace order: " << stats.filesPlaced << L"\n";
+    } else if (placementMode == 1 || placementMode == 2) {
+        std::wcout << L"Files placed next to their directory siblings: " << stats.filesPlaced << L"\n";
+    }
+    std::wcout << L"Files scanned: " << log.progress.files << L"\n";
+    const ArenaStats &as = ScratchArena::ForThread().stats;
+    std::wcout << L"Ioctl reads: " << as.ioctlCalls << L" calls, " << as.files << L" extent maps ("
+               << as.moreDataReplies << L" ERROR_MORE_DATA, buffer grown " << as.bufferGrowths << L" times), "
+               << as.allocations << L" buffer allocations ("
+               << (as.files ? (double)as.allocations / (double)as.files : 0.0) << L" per file)\n";
+    if (placementMode != 3) {
+        const EntryFilterStats &fs = filter.stats;
+        std::wcout << L"Files skipped before opening: " << fs.FilesSkipped() << L" of " << fs.filesSeen
+                   << L" (size " << fs.skippedSize << L", attributes " << fs.skippedAttributes
+                   << L", globs " << fs.skippedGlob << L"), subdirectories skipped: " << fs.directoriesSkipped << L"\n";
+        std::wcout << L"Avoided " << fs.opensAvoided << L" file opens and at least " << fs.ioctlsAvoided << L" ioctls.\n";
+    }
+    if (!ok) {
+        std::wcerr << (placementMode == 6 ? L"Analysis" : L"Defragmentation") << L" of the volume encountered errors.\n";
     } else {
-        std::wcout << L"Defragmentation complete.\n";
+        std::wcout << (placementMode == 6 ? L"Analysis complete.\n" : L"Defragmentation complete.\n");
+    }
+    if (placementMode < 4) {
+        std::wcout << (placementMode == 3 ? L"Estimated trace replay seek distance: " : L"Directory scan seek distance: ")
+                   << stats.seekBefore << L" clusters before, " << stats.seekAfter << L" clusters after.\n";
+    }
+    if (staged == 1) {
+        size_t bottleneck = StagedPipeline::Bottleneck(stagedStats.stages);
+        for (size_t i = 0; i < stagedStats.stages.size(); i++) {
+            const StageReport &sr = stagedStats.stages[i];
+            std::wcout << L"Stage " << std::wstring(sr.name.begin(), sr.name.end()) << L": " << sr.items << L" files, "
+                       << (int)(sr.utilization * 100) << L"% busy (" << sr.busySeconds << L" s), waited "
+                       << sr.starvedSeconds << L" s for input and " << sr.blockedSeconds << L" s for room"
+                       << (i == bottleneck ? L" - the bottleneck\n" : L"\n");
+        }
+        for (const QueueReport &qr : stagedStats.queues) {
+            std::wcout << L"Queue " << std::wstring(qr.name.begin(), qr.name.end()) << L": " << qr.meanDepth
+                       << L" of " << qr.capacity << L" files on average, at most " << qr.maxDepth << L", full for "
+                       << (int)(qr.fullShare * 100) << L"% of the files\n";
+        }
+    }
+
+    if (nextSnapshot) {
+        if (g_snapshot.previous && placementMode == 0) {
+            std::wcout << L"Files not opened thanks to the snapshot: " << g_snapshot.filesReused << L"\n";
+        }
+        // The old snapshot stays mapped until here and must be unmapped before it is replaced
+        g_snapshot.previous = nullptr;
+        previousSnapshot.Close();
+        if (nextSnapshot->Write(snapshotPath, volumeBitmap.data(), bitmapTicks)) {
+            std::wcout << L"Snapshot written to " << snapshotPath << L": " << nextSnapshot->FileCount() << L" files.\n";
+        } else {
+            PrintLastError((L"Cannot write snapshot " + snapshotPath).c_str());
+        }
+    }
+
+    if (g_ioTrace.IsOpen()) {
+        ULONGLONG records = g_ioTrace.Records();
+        if (g_ioTrace.Close()) {
+            std::wcout << L"Operation trace written to " << ioTracePath << L": " << records << L" records, "
+                       << g_ioTrace.Bytes() << L" bytes.\n";
+        } else {
+            PrintLastError((L"Cannot write trace " + ioTracePath).c_str());
+        }
+    }
+
+    if (g_planner.readCost && placementMode != 6) {
+        const ReadCostStats &rs = g_planner.readCostStats;
+        std::wcout << L"Projected read time of the " << rs.filesMoved << L" files defragmented: " << rs.secondsBefore
+                   << L" s before, " << rs.secondsAfter << L" s after (" << rs.secondsBefore - rs.secondsAfter
+                   << L" s saved per full read)\n";
+        std::wcout << L"Fragmented files skipped below the threshold: " << rs.filesSkipped << L" (would have saved "
+                   << rs.secondsNotSaved << L" s)\n";
+    }
+    if (placementMode != 6) {
+        const ExtentPlanStats &es = g_planner.extentStats;
+        std::wcout << L"Moves: " << executor.movesDone << L" done, " << executor.movesFailed << L" failed ("
+                   << es.unitMoves << L" of whole compression units; " << es.clusterMoves
+                   << L" one cluster at a time, " << es.misalignedMoves << L" of them misaligned).\n";
+        if (es.sparseFiles || es.compressedFiles) {
+            std::wcout << L"Sparse files: " << es.sparseFiles << L", compressed files: " << es.compressedFiles
+                       << L". Destination space: " << es.clusters << L" clusters, " << es.spanClusters - es.clusters
+                       << L" fewer than keeping the holes in place.\n";
+        }
+        std::wcout << L"Simulated head travel: " << executor.seekPlanned << L" clusters as planned, "
+                   << executor.seekExecuted << L" clusters as executed.\n";
+    }
+    if (verifier) {
+        const VerificationStats &vs = verifier->stats;
+        std::wcout << L"Verification: " << vs.filesVerified << L" files, " << vs.contentMismatches
+                   << L" content mismatches, " << vs.extentMismatches << L" extent mismatches, "
+                   << vs.notContiguous << L" still fragmented.\n";
+        std::wcout << L"Verification hashed " << vs.bytesHashed / (1024 * 1024) << L" MB in " << vs.hashSeconds
+                   << L" s (moves took " << vs.moveSeconds << L" s).\n";
+    }
+
+    // Read the bitmap again for the after and changes maps and the check
+    std::vector<BYTE> bitmapAfter;
+    bool haveBitmapAfter = false;
+    if (placementMode != 6 && (clusterMap || checkBitmap == 1)) {
+        haveBitmapAfter = FetchBitmap(g_volumeOps, totalClusters, bitmapAfter);
+        if (!haveBitmapAfter) {
+            std::wcerr << L"Cannot read the bitmap again after the pass.\n";
+            ok = false;
+        }
+    }
+    BitmapCheck bitmapCheck;
+    if (checkBitmap == 1 && haveBitmapAfter) {
+        CheckBitmap(volumeBitmap, bitmapAfter, totalClusters, bitmapCheck);
+    }
+    ClusterMapStats mapStats;
+    if (clusterMap) {
+        ok = WriteClusterMaps(*clusterMap, bitmapBefore, haveBitmapAfter ? &bitmapAfter : nullptr, mapPath,
+                              placementMode == 6, mapStats) &&
+             ok;
     }
 
     CloseHandle(hVolume);
 
-    std::wcout << L"\nDone. Press Enter to exit...";
-    std::wcin.ignore(std::numeric_limits<std::streamsize>::max(), L'\n');
-    std::wcin.get();
-    return 0;
+    JsonObject &result = options.Result();
+    result.Set("totalClusters", totalClusters).Set("bytesPerCluster", bytesPerCluster);
+    result.Set("freeClustersBefore", freeCount);
+    result.Set("bitmapSeconds", bitmapSeconds).Set("passSeconds", passSeconds);
+    result.Set("filesScanned", log.progress.files.load());
+    result.Child("ioctls").Set("calls", as.ioctlCalls).Set("extentMaps", as.files).Set("moreDataReplies", as.moreDataReplies)
+        .Set("bufferAllocations", as.allocations);
+    if (placementMode != 3) {
+        result.Child("filter").Set("filesSeen", filter.stats.filesSeen).Set("filesSkipped", filter.stats.FilesSkipped())
+            .Set("directoriesSkipped", filter.stats.directoriesSkipped).Set("opensAvoided", filter.stats.opensAvoided);
+    }
+    if (placementMode == 6) {
+        LcnRange largest = report.LargestFreeRun();
+        result.Child("analysis").Set("files", report.Files()).Set("fragmentedFiles", report.FragmentedFiles())
+            .Set("extents", report.Extents()).Set("freeRuns", report.FreeRuns())
+            .Set("largestFreeRunClusters", largest.end - largest.start).Set("score", report.Score())
+            .Set("filesWorthMoving", report.FilesWorthMoving()).Set("readSecondsSaved", report.ReadSecondsSaved());
+    } else {
+        result.Child("moves").Set("done", executor.movesDone).Set("failed", executor.movesFailed)
+            .Set("seekPlanned", executor.seekPlanned).Set("seekExecuted", executor.seekExecuted);
+    }
+    if (placementMode == 5) {
+        result.Child("incremental").Set("filesQueried", incrementalStats.filesQueried)
+            .Set("filesGone", incrementalStats.filesGone).Set("filesCarried", incrementalStats.filesCarried);
+    } else if (placementMode == 4) {
+        result.Child("zoning").Set("hotFiles", zoningStats.hotFiles).Set("hotMovedIn", zoningStats.hotMovedIn)
+            .Set("coldFiles", zoningStats.coldFiles).Set("coldMovedOut", zoningStats.coldMovedOut)
+            .Set("notPlaced", zoningStats.notPlaced);
+    } else if (placementMode < 4) {
+        result.Set("filesPlaced", stats.filesPlaced).Set("seekBefore", stats.seekBefore).Set("seekAfter", stats.seekAfter);
+    }
+    if (staged == 1) {
+        JsonObject &pipelineResult = result.Child("pipeline");
+        pipelineResult.Set("bottleneck", stagedStats.stages[StagedPipeline::Bottleneck(stagedStats.stages)].name);
+        for (const StageReport &sr : stagedStats.stages) {
+            pipelineResult.Append("stages").Set("name", sr.name).Set("items", sr.items)
+                .Set("busySeconds", sr.busySeconds).Set("starvedSeconds", sr.starvedSeconds)
+                .Set("blockedSeconds", sr.blockedSeconds).Set("utilization", sr.utilization);
+        }
+        for (const QueueReport &qr : stagedStats.queues) {
+            pipelineResult.Append("queues").Set("name", qr.name).Set("capacity", qr.capacity)
+                .Set("meanDepth", qr.meanDepth).Set("maxDepth", qr.maxDepth).Set("fullShare", qr.fullShare);
+        }
+    }
+    if (g_planner.readCost && placementMode != 6) {
+        const ReadCostStats &rs = g_planner.readCostStats;
+        result.Child("readCost").Set("filesMoved", rs.filesMoved).Set("filesSkipped", rs.filesSkipped)
+            .Set("secondsBefore", rs.secondsBefore).Set("secondsAfter", rs.secondsAfter);
+    }
+    if (clusterMap) {
+        result.Child("clusterMap").Set("width", clusterMap->Width()).Set("height", clusterMap->Height())
+            .Set("clustersPerPixel", clusterMap->ClustersPerPixel()).Set("images", mapStats.images)
+            .Set("clustersFilled", mapStats.clustersFilled).Set("clustersFreed", mapStats.clustersFreed);
+    }
+    if (checkBitmap == 1 && haveBitmapAfter) {
+        const BitmapDiffSummary &bs = bitmapCheck.summary;
+        result.Child("bitmapCheck").Set("allocatedNotPlanned", bs.clustersAllocated)
+            .Set("allocatedNotPlannedRanges", bs.rangesAllocated).Set("freeButPlanned", bs.clustersFreed)
+            .Set("freeButPlannedRanges", bs.rangesFreed);
+    }
+    if (verifier) {
+        const VerificationStats &vs = verifier->stats;
+        result.Child("verification").Set("files", vs.filesVerified).Set("contentMismatches", vs.contentMismatches)
+            .Set("extentMismatches", vs.extentMismatches).Set("notContiguous", vs.notContiguous)
+            .Set("hashSeconds", vs.hashSeconds);
+    }
+
+    options.WaitForEnter(L"\nDone. Press Enter to exit...");
+    return options.Finish(ok ? TOOL_EXIT_OK : TOOL_EXIT_FAILED);
 }
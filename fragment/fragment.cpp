@@ -6,11 +6,31 @@
 #include <cstdlib>
 #include <ctime>
 #include <limits>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <chrono>
+
+#include "../common/directory_walker.h"
+#include "../common/entry_filter.h"
+#include "../common/scratch_arena.h"
+#include "../common/bitmap_fetch.h"
+#include "../common/volume_geometry.h"
+#include "../common/free_run.h"
+#include "../common/io_trace.h"
+#include "../common/move_engine.h"
+#include "../common/volume_ops_win32.h"
+#include "../common/async_log.h"
+#include "../common/command_line.h"
 
 // Print a Windows error message
 static void PrintLastError(const wchar_t *msgPrefix) {
     DWORD errCode = GetLastError();
-    std::wcerr << msgPrefix << L" (Error " << errCode << L")" << std::endl;
+    LOG(LogLevel::Error, msgPrefix << L" (Error " << errCode << L")");
     LPWSTR errText = nullptr;
     FormatMessageW(
         FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
@@ -21,7 +41,7 @@ static void PrintLastError(const wchar_t *msgPrefix) {
         0,
         NULL);
     if (errText) {
-        std::wcerr << L"Reason: " << errText << std::endl;
+        LOG(LogLevel::Error, L"Reason: " << errText);
         LocalFree(errText);
     }
 }
@@ -61,214 +81,102 @@ bool EnablePrivilege(const wchar_t *privName) {
     return true;
 }
 
-// Get volume geometry: total clusters and bytes per cluster
-static bool GetVolumeClusterInfo(const std::wstring &rootPath, ULONGLONG &totalClusters, DWORD &bytesPerCluster) {
+// Volume geometry from FSCTL_GET_NTFS_VOLUME_DATA: 64-bit cluster counts and
+// the MFT zone. GetDiskFreeSpaceW reports clusters as DWORDs, which truncates
+// volumes with more than 2^32 clusters, so it only supplies the cluster size
+// (with GetDiskFreeSpaceExW for the totals) when the volume is not NTFS.
+bool GetVolumeGeometry(HANDLE volumeHandle, const std::wstring &rootPath, VolumeGeometry &geometry) {
+    geometry = VolumeGeometry();
+    NTFS_VOLUME_DATA_BUFFER data = {};
+    DWORD bytesReturned = 0;
+    if (DeviceIoControl(volumeHandle, FSCTL_GET_NTFS_VOLUME_DATA, NULL, 0, &data, sizeof(data), &bytesReturned, NULL)) {
+        geometry.isNtfs = true;
+        geometry.volumeSerial = (ULONGLONG)data.VolumeSerialNumber.QuadPart;
+        geometry.totalClusters = (ULONGLONG)data.TotalClusters.QuadPart;
+        geometry.freeClusters = (ULONGLONG)data.FreeClusters.QuadPart;
+        geometry.bytesPerSector = data.BytesPerSector;
+        geometry.bytesPerCluster = data.BytesPerCluster;
+        geometry.bytesPerFileRecord = data.BytesPerFileRecordSegment;
+        geometry.mftStartLcn = (ULONGLONG)data.MftStartLcn.QuadPart;
+        geometry.mft2StartLcn = (ULONGLONG)data.Mft2StartLcn.QuadPart;
+        geometry.mftValidDataLength = (ULONGLONG)data.MftValidDataLength.QuadPart;
+        geometry.mftZoneStart = (ULONGLONG)data.MftZoneStart.QuadPart;
+        geometry.mftZoneEnd = (ULONGLONG)data.MftZoneEnd.QuadPart;
+        return true;
+    }
+
     DWORD sectorsPerCluster = 0;
     DWORD bytesPerSector = 0;
     DWORD numberOfFreeClusters = 0;
     DWORD totalNumberOfClusters = 0;
-    if (!GetDiskFreeSpaceW(rootPath.c_str(),
-                           &sectorsPerCluster,
-                           &bytesPerSector,
-                           &numberOfFreeClusters,
-                           &totalNumberOfClusters)) {
+    ULARGE_INTEGER freeBytes = {};
+    ULARGE_INTEGER totalBytes = {};
+    ULARGE_INTEGER totalFreeBytes = {};
+    if (!GetDiskFreeSpaceW(rootPath.c_str(), &sectorsPerCluster, &bytesPerSector,
+                           &numberOfFreeClusters, &totalNumberOfClusters) ||
+        !GetDiskFreeSpaceExW(rootPath.c_str(), &freeBytes, &totalBytes, &totalFreeBytes)) {
         PrintLastError(L"GetDiskFreeSpaceW failed");
         return false;
     }
-    totalClusters = static_cast<ULONGLONG>(totalNumberOfClusters);
-    bytesPerCluster = sectorsPerCluster * bytesPerSector;
-    return true;
-}
-
-// Retrieve the entire NTFS volume bitmap (1=allocated, 0=free) in chunks
-bool GetVolumeBitmapChunked(HANDLE volumeHandle, ULONGLONG totalClusters, std::vector<BYTE> &outBitmap) {
-    outBitmap.clear();
-    outBitmap.resize(static_cast<size_t>((totalClusters + 7) / 8), 0);
-    STARTING_LCN_INPUT_BUFFER inBuf = {};
-    inBuf.StartingLcn.QuadPart = 0; // start at LCN 0
-    const size_t BUF_SIZE = 64 * 1024;
-    std::vector<BYTE> tempBuf(BUF_SIZE, 0);
-    LONGLONG maxLCN = (LONGLONG)totalClusters - 1;
-    while (true) {
-        ZeroMemory(tempBuf.data(), tempBuf.size());
-        DWORD bytesReturned = 0;
-        BOOL success = DeviceIoControl(
-            volumeHandle,
-            FSCTL_GET_VOLUME_BITMAP,
-            &inBuf,
-            sizeof(inBuf),
-            tempBuf.data(),
-            (DWORD)tempBuf.size(),
-            &bytesReturned,
-            NULL);
-        DWORD dwErr = GetLastError();
-        if (bytesReturned < sizeof(VOLUME_BITMAP_BUFFER)) {
-            if (!success) {
-                PrintLastError(L"FSCTL_GET_VOLUME_BITMAP failed (no valid header)");
-            } else {
-                std::wcerr << L"Unexpected: not enough data for VOLUME_BITMAP_BUFFER\n";
-            }
-            break;
-        }
-
-        auto pVolBmp = reinterpret_cast<PVOLUME_BITMAP_BUFFER>(tempBuf.data());
-        LONGLONG startLCN = pVolBmp->StartingLcn.QuadPart;
-        LONGLONG chunkBits = pVolBmp->BitmapSize.QuadPart;
-        size_t chunkBytes = (size_t)((chunkBits + 7) / 8);
-        DWORD headerSize = sizeof(VOLUME_BITMAP_BUFFER);
-        DWORD bytesReturnedBody = (bytesReturned > headerSize) ? (bytesReturned - headerSize) : 0;
-
-        if (chunkBytes > bytesReturnedBody) {
-            chunkBytes = bytesReturnedBody;
-        }
-        LONGLONG chunkBitsAvailable = (LONGLONG)chunkBytes * 8;
-
-        if (chunkBits > chunkBitsAvailable) {
-            chunkBits = chunkBitsAvailable;
-            }
-        BYTE *srcBits = pVolBmp->Buffer;
-        for (LONGLONG i = 0; i < chunkBits; i++) {
-            LONGLONG clusterIndex = startLCN + i;
-            if (clusterIndex >= (LONGLONG)totalClusters){
-                break;
-            }
-            int srcByteIndex = (int)(i / 8);
-            int srcBitOffset = (int)(i % 8);
-            int bitVal = (srcBits[srcByteIndex] >> srcBitOffset) & 1;
-
-            if (bitVal == 1) {
-                size_t destByteIndex = (size_t)(clusterIndex / 8);
-                int destBitOffset = (int)(clusterIndex % 8);
-                outBitmap[destByteIndex] |= (BYTE)(1 << destBitOffset);
-            }
-        }
-        LONGLONG nextLCN = startLCN + chunkBits;
-        if (!success) {
-            // ERROR_MORE_DATA indicates partial result.
-            if (dwErr == ERROR_MORE_DATA) {
-                if (nextLCN > maxLCN) {
-                    break;
-                }
-                inBuf.StartingLcn.QuadPart = nextLCN;
-            } else {
-                PrintLastError(L"FSCTL_GET_VOLUME_BITMAP truly failed");
-                break;
-            }
-        } else {
-            if (chunkBits == 0 || nextLCN > maxLCN) {
-                break;
-            }
-            inBuf.StartingLcn.QuadPart = nextLCN;
-        }
+    geometry.bytesPerSector = bytesPerSector;
+    geometry.bytesPerCluster = sectorsPerCluster * bytesPerSector;
+    if (geometry.bytesPerCluster == 0) {
+        return false;
+    }
+    geometry.totalClusters = totalBytes.QuadPart / geometry.bytesPerCluster;
+    geometry.freeClusters = totalFreeBytes.QuadPart / geometry.bytesPerCluster;
+    DWORD serial = 0;
+    if (GetVolumeInformationW(rootPath.c_str(), NULL, 0, &serial, NULL, NULL, NULL, 0)) {
+        geometry.volumeSerial = serial;
     }
-    return !outBitmap.empty();
+    return true;
 }
 
-// Structure to hold a file’s cluster mapping
-struct FileClusters {
-    std::vector<LONGLONG> vcns;
-    std::vector<LONGLONG> lcns;
-};
-
-// Retrieve all extents for a file (even if very fragmented) by looping over FSCTL_GET_RETRIEVAL_POINTERS
+// -----------------------------------------------------------------------------
+// Volume calls
+//   Bitmap reads, extent queries and moves go through g_volumeOps, and the
+//   random moves are planned and issued by the code defragment and the trace
+//   replay use (see common/move_engine.h). With a trace file, every call is
+//   recorded with its reply, along with the files opened (see
+//   common/io_trace.h). The random moves are in the trace, so a replay
+//   repeats exactly this run.
+// -----------------------------------------------------------------------------
+static IoTraceWriter g_ioTrace;
+static Win32VolumeOps g_volumeOps;
+
+// Clusters that moves never target (the MFT zone), set once in main, and the
+// generator that picks the clusters to move and where to; seeded once in
+// main, so a run can be repeated with --seed
+static RandomMovePlanner g_planner;
+
+// Retrieve all extents for a file as one entry per cluster
 bool GetAllFileRetrievalPointers(HANDLE fileHandle, FileClusters &outClusters) {
-    outClusters.vcns.clear();
-    outClusters.lcns.clear();
-    STARTING_VCN_INPUT_BUFFER inBuf = {};
-    inBuf.StartingVcn.QuadPart = 0;
-    while (true) {
-        const DWORD BUF_SIZE = 16 * 1024;
-        std::vector<BYTE> buffer(BUF_SIZE, 0);
-        DWORD bytesReturned = 0;
-        BOOL ok = DeviceIoControl(
-            fileHandle,
-            FSCTL_GET_RETRIEVAL_POINTERS,
-            &inBuf,
-            sizeof(inBuf),
-            buffer.data(),
-            (DWORD)buffer.size(),
-            &bytesReturned,
-            NULL);
-
-        if (!ok) {
-            DWORD err = GetLastError();
-            if (err == ERROR_HANDLE_EOF) {
-                // No more extents
-                break;
-            }
-            PrintLastError(L"FSCTL_GET_RETRIEVAL_POINTERS failed");
-            return false;
-        }
-
-        if (bytesReturned < sizeof(RETRIEVAL_POINTERS_BUFFER)) {
-            std::wcerr << L"Not enough data returned for RETRIEVAL_POINTERS_BUFFER.\n";
-            return false;
-        }
-
-        auto pRet = reinterpret_cast<PRETRIEVAL_POINTERS_BUFFER>(buffer.data());
-
-        if (pRet->ExtentCount == 0){
-            break;
-        }
-        LONGLONG currentVcn = pRet->StartingVcn.QuadPart;
-        for (DWORD i = 0; i < pRet->ExtentCount; i++)
-        {
-            LONGLONG nextVcn = pRet->Extents[i].NextVcn.QuadPart;
-            LONGLONG lcn = pRet->Extents[i].Lcn.QuadPart;
-            if (lcn == -1) { // sparse or unallocated
-                currentVcn = nextVcn;
-                continue;
-            }
-
-            LONGLONG count = nextVcn - currentVcn;
-
-            for (LONGLONG c = 0; c < count; c++) {
-                outClusters.vcns.push_back(currentVcn + c);
-                outClusters.lcns.push_back(lcn + c);
-            }
-            currentVcn = nextVcn;
-        }
-
-        LONGLONG lastNextVcn = pRet->Extents[pRet->ExtentCount - 1].NextVcn.QuadPart;
-        if (lastNextVcn <= inBuf.StartingVcn.QuadPart) {
-            break;
-        }
-        inBuf.StartingVcn.QuadPart = lastNextVcn;
+    DWORD error = ReadFileClusters(g_volumeOps, Win32VolumeOps::FileOf(fileHandle), outClusters);
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        PrintLastError(L"FSCTL_GET_RETRIEVAL_POINTERS failed");
+        return false;
     }
     return true;
 }
 
-// Move a single cluster from srcVcn to dstLcn in the target file (via FSCTL_MOVE_FILE)
-bool MoveSingleCluster(HANDLE volumeHandle,
-                       HANDLE fileHandle,
-                       LONGLONG srcVcn,
-                       LONGLONG dstLcn) {
-    MOVE_FILE_DATA moveData = {};
-    moveData.FileHandle = fileHandle;
-    moveData.StartingVcn.QuadPart = srcVcn; // which VCN in file to move
-    moveData.StartingLcn.QuadPart = dstLcn; // destination LCN on disk
-    moveData.ClusterCount = 1;              // move one cluster
-    DWORD bytesReturned = 0;
-    BOOL ok = DeviceIoControl(
-        volumeHandle,
-        FSCTL_MOVE_FILE,
-        &moveData,
-        sizeof(moveData),
-        NULL,
-        0,
-        &bytesReturned,
-        NULL);
+// Progress and the messages of failed moves
+class FragmentMoveObserver : public MoveObserver {
+public:
+    void Moved(const PlannedMove &) override { AsyncLog::Instance().progress.moves++; }
 
-    if (!ok) {
+    void MoveFailed(const PlannedMove &m, uint32_t error) override {
+        SetLastError(error);
         PrintLastError(L"FSCTL_MOVE_FILE failed");
-        return false;
+        LOG(LogLevel::Error, L"Cluster move failed for file: " << *m.filePath);
     }
-    return true;
-}
+};
 
 // Fragment a single file by performing a number of random single-cluster moves
+// fc is scratch storage, reused across files so its capacity carries over
 bool FragmentFileRandomly(const std::wstring &filePath,
-                          HANDLE volumeHandle,
+                          FileClusters &fc,
+                          MoveExecutor &executor,
                           std::vector<BYTE> &volumeBitmap,
                           ULONGLONG totalClusters,
                           int movesToPerform) {
@@ -285,183 +193,127 @@ bool FragmentFileRandomly(const std::wstring &filePath,
         PrintLastError((L"Failed to open file: " + filePath).c_str());
         return false;
     }
+    g_volumeOps.Opened(hFile, filePath);
 
-    FileClusters fc;
     if (!GetAllFileRetrievalPointers(hFile, fc)) {
-        std::wcerr << L"Could not get retrieval pointers for file: " << filePath << L"\n";
+        LOG(LogLevel::Error, L"Could not get retrieval pointers for file: " << filePath);
         CloseHandle(hFile);
         return false;
     }
 
+    AsyncLog::Instance().progress.files++;
+    AsyncLog::Instance().progress.clustersScanned += fc.vcns.size();
     if (fc.vcns.empty()) {
-        std::wcerr << L"File has no allocated clusters: " << filePath << L"\n";
+        LOG(LogLevel::Warn, L"File has no allocated clusters: " << filePath);
         CloseHandle(hFile);
         return false;
     }
 
-    std::srand((unsigned)std::time(nullptr));
+    // Each move is its own batch: the next pick sees where the last one went
+    std::vector<PlannedMove> batch;
     for (int i = 0; i < movesToPerform; i++) {
-        int randomIndex = std::rand() % (int)fc.vcns.size();
-        LONGLONG srcVcn = fc.vcns[randomIndex];
-        LONGLONG srcLcn = fc.lcns[randomIndex];
-        // Find a free cluster
-        ULONGLONG newLcn = 0;
-        bool foundFree = false;
-        const int RANDOM_ATTEMPTS = 2000;
-        for (int attempt = 0; attempt < RANDOM_ATTEMPTS; attempt++) {
-            ULONGLONG candidate = std::rand() % totalClusters;
-            size_t byteIndex = (size_t)(candidate / 8);
-            int bitOffset = (int)(candidate % 8);
-            int bitVal = (volumeBitmap[byteIndex] >> bitOffset) & 1;
-            if (bitVal == 0) {
-                newLcn = candidate;
-                foundFree = true;
-                break;
-            }
-        }
-
-        // Fallback linear search
-        if (!foundFree) {
-            for (ULONGLONG c = 0; c < totalClusters; c++) {
-                size_t byteIndex = (size_t)(c / 8);
-                int bitOffset = (int)(c % 8);
-                int bitVal = (volumeBitmap[byteIndex] >> bitOffset) & 1;
-                if (bitVal == 0) {
-                    newLcn = c;
-                    foundFree = true;
-                    break;
-                }
-            }
-        }
-
-        if (!foundFree) {
-            std::wcerr << L"Could not find a free cluster for file: " << filePath
-                       << L" (volume may be nearly full)\n";
+        // A free cluster outside the MFT zone
+        if (!PlanRandomMove(g_planner, Win32VolumeOps::FileOf(hFile), &filePath, fc, volumeBitmap, totalClusters,
+                            batch)) {
+            LOG(LogLevel::Error, L"Could not find a free cluster for file: " << filePath
+                                     << L" (volume may be nearly full)");
             CloseHandle(hFile);
             return false;
         }
-
-        std::wcout << L"[File: " << filePath << L"] Move " << (i + 1)
-                   << L"/" << movesToPerform << L": VCN=" << srcVcn
-                   << L" (LCN=" << srcLcn << L") -> LCN=" << newLcn << L"\n";
-
-        if (!MoveSingleCluster(volumeHandle, hFile, srcVcn, newLcn)) {
-            std::wcerr << L"Cluster move failed for file: " << filePath << L"\n";
-            continue;
-        }
-        // Update volume bitmap.
-        {
-            size_t oldByteIndex = (size_t)(srcLcn / 8);
-            int oldBitOffset = (int)(srcLcn % 8);
-            volumeBitmap[oldByteIndex] &= ~(1 << oldBitOffset);
-            size_t newByteIndex = (size_t)(newLcn / 8);
-            int newBitOffset = (int)(newLcn % 8);
-            volumeBitmap[newByteIndex] |= (1 << newBitOffset);
-        }
-        fc.lcns[randomIndex] = newLcn;
+        const PlannedMove &m = batch.back();
+        LOG_SAMPLED(LogLevel::Verbose, L"[File: " << filePath << L"] Move " << (i + 1)
+                                           << L"/" << movesToPerform << L": VCN=" << m.srcVcn
+                                           << L" (LCN=" << m.srcLcn << L") -> LCN=" << m.dstLcn);
+        ExecuteMoveBatch(executor, batch, volumeBitmap);
     }
     CloseHandle(hFile);
     return true;
 }
 
-// Recursively fragment all files in a given directory
-// For each file in the directory tree, perform 'movesPerFile' moves
-bool FragmentAllFilesInDirectory(const std::wstring &dirPath,
-                                 HANDLE volumeHandle,
-                                 std::vector<BYTE> &volumeBitmap,
-                                 ULONGLONG totalClusters,
-                                 int movesPerFile) {
-
-    std::wstring searchPath = dirPath;
-
-    if (!searchPath.empty() && searchPath.back() != L'\\') {
-        searchPath += L"\\";
-    }
-
-    searchPath += L"*"; // wildcard for all entries
-    WIN32_FIND_DATAW ffd;
-    HANDLE hFind = FindFirstFileW(searchPath.c_str(), &ffd);
-
-    if (hFind == INVALID_HANDLE_VALUE) {
-        PrintLastError((L"FindFirstFileW failed on " + searchPath).c_str());
-        return false;
-    }
-
+struct FragmentVisitor : WalkVisitor {
+    EntryFilter &filter;
+    MoveExecutor &executor;
+    std::vector<BYTE> &volumeBitmap;
+    ULONGLONG totalClusters;
+    int movesPerFile;
     bool success = true;
+    std::wstring filePath; // reused for every file, grows to the longest path only
+    FileClusters clusters; // same
 
-    do {
-        std::wstring fileName = ffd.cFileName;
-        if (fileName == L"." || fileName == L"..") {
-            continue;
-        }
-
-        std::wstring fullPath = dirPath;
+    FragmentVisitor(EntryFilter &filter, MoveExecutor &executor, std::vector<BYTE> &volumeBitmap,
+                    ULONGLONG totalClusters, int movesPerFile)
+        : filter(filter), executor(executor), volumeBitmap(volumeBitmap), totalClusters(totalClusters), movesPerFile(movesPerFile) {}
 
-        if (!fullPath.empty() && fullPath.back() != L'\\') {
-            fullPath += L"\\";
+    WalkAction OnFile(const WalkEntry &e) {
+        if (!filter.AcceptFile(e)) {
+            return WalkAction::Continue;
         }
-
-        fullPath += fileName;
-
-        if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            std::wcout << L"Entering subdirectory: " << fullPath << std::endl;
-            if (!FragmentAllFilesInDirectory(fullPath, volumeHandle, volumeBitmap, totalClusters, movesPerFile)) {
-                std::wcerr << L"Failed to fragment subdirectory: " << fullPath << std::endl;
-                success = false;
-            }
-        } else {
-            std::wcout << L"Fragmenting file: " << fullPath << std::endl;
-            if (!FragmentFileRandomly(fullPath, volumeHandle, volumeBitmap, totalClusters, movesPerFile)) {
-                std::wcerr << L"FragmentFileRandomly failed on: " << fullPath << std::endl;
-                success = false;
-            }
+        filePath.assign(e.path, e.pathLength);
+        LOG(LogLevel::Info, L"Fragmenting file: " << filePath);
+        if (!FragmentFileRandomly(filePath, clusters, executor, volumeBitmap, totalClusters, movesPerFile)) {
+            LOG(LogLevel::Error, L"FragmentFileRandomly failed on: " << filePath);
+            success = false;
         }
-    } while (FindNextFileW(hFind, &ffd) != 0);
-
-    if (GetLastError() != ERROR_NO_MORE_FILES) {
-        PrintLastError(L"FindNextFileW ended unexpectedly");
+        return WalkAction::Continue;
+    }
+    WalkAction OnDirectory(const WalkEntry &e) {
+        if (!filter.AcceptDirectory(e)) {
+            return WalkAction::SkipDirectory;
+        }
+        LOG(LogLevel::Info, L"Entering subdirectory: " << e.path);
+        return WalkAction::Continue;
+    }
+    void OnError(const wchar_t *path, unsigned long errorCode) {
+        SetLastError((DWORD)errorCode);
+        PrintLastError((std::wstring(L"Cannot enumerate ") + path).c_str());
         success = false;
     }
+};
 
-    FindClose(hFind);
-    return success;
+// Fragment all files in the directory tree, 'movesPerFile' moves each
+bool FragmentAllFilesInDirectory(const std::wstring &dirPath,
+                                 MoveExecutor &executor,
+                                 std::vector<BYTE> &volumeBitmap,
+                                 ULONGLONG totalClusters,
+                                 int movesPerFile,
+                                 EntryFilter &filter) {
+    DirectoryWalker walker;
+    FragmentVisitor visitor(filter, executor, volumeBitmap, totalClusters, movesPerFile);
+    return walker.Walk(dirPath, visitor) && visitor.success;
 }
 
-int main() {
+int main(int argc, char **argv) {
+    ToolOptions options(L"fragment", {
+        {L"volume", OptionKind::Text, true, L"drive letter of the volume, e.g. C"},
+        {L"trace", OptionKind::Text, false, L"record volume operations to this file (- = no, default)"},
+        {L"moves", OptionKind::Count, false, L"single-cluster moves per file (default 5)"},
+        {L"log-level", OptionKind::Count, false, L"0 = errors, 1 = warnings, 2 = per file, 3 = per move (default 1)"},
+        {L"log-every", OptionKind::Count, false, L"with log level 3, log every Nth move (default 1)"},
+        {L"seed", OptionKind::Count, false, L"seed of the random moves (default: the time)"},
+    });
+    int exitCode = 0;
+    if (!options.Parse(argc, argv, exitCode)) {
+        return exitCode;
+    }
+    ULONGLONG seed = options.Value(L"seed", (ULONGLONG)std::time(nullptr));
+    g_planner.random.seed(seed);
+
     std::wcout << L"Attempting to enable SeManageVolumePrivilege...\n";
     if (!EnablePrivilege(L"SeManageVolumePrivilege")) {
         std::wcerr << L"Failed to enable SeManageVolumePrivilege. Try running as Administrator.\n";
     }
 
     // Ask for drive letter
-    std::wstring driveLetter;
-    std::wcout << L"Enter drive letter (e.g. C): ";
-    std::wcin >> driveLetter;
+    std::wstring driveLetter = options.DriveLetter(L"volume", L"Enter drive letter (e.g. C): ");
     if (driveLetter.empty()) {
         std::wcerr << L"No drive letter provided.\n";
-        return 1;
+        return options.Finish(TOOL_EXIT_USAGE);
     }
 
     // Build paths
     std::wstring rootPath = driveLetter + L":\\";
     std::wstring volumePath = L"\\\\.\\" + driveLetter + L":";
 
-    // Get volume geometry
-    ULONGLONG totalClusters = 0;
-    DWORD bytesPerCluster = 0;
-    if (!GetVolumeClusterInfo(rootPath, totalClusters, bytesPerCluster)) {
-        std::wcerr << L"GetVolumeClusterInfo failed.\n";
-        return 1;
-    }
-
-    if (totalClusters == 0) {
-        std::wcerr << L"Volume reports 0 clusters?\n";
-        return 1;
-    }
-
-    std::wcout << L"Volume has " << totalClusters
-               << L" clusters. Bytes/cluster = " << bytesPerCluster << L"\n";
-            
     // Open the volume (with read/write access)
     HANDLE hVolume = CreateFileW(
         volumePath.c_str(),
@@ -473,15 +325,50 @@ int main() {
         NULL);
     if (hVolume == INVALID_HANDLE_VALUE) {
         PrintLastError((L"Failed to open volume " + volumePath).c_str());
-        return 1;
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+
+    // Get volume geometry (64-bit cluster counts, MFT zone)
+    VolumeGeometry geometry;
+    if (!GetVolumeGeometry(hVolume, rootPath, geometry) || geometry.totalClusters == 0) {
+        std::wcerr << L"GetVolumeGeometry failed.\n";
+        CloseHandle(hVolume);
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+    ULONGLONG totalClusters = geometry.totalClusters;
+    DWORD bytesPerCluster = geometry.bytesPerCluster;
+    std::wcout << L"Volume has " << totalClusters
+               << L" clusters. Bytes/cluster = " << bytesPerCluster << L"\n";
+    g_planner.reserved = geometry.ReservedRanges();
+    g_volumeOps.volumeHandle = hVolume;
+    g_volumeOps.volumePath = volumePath;
+    g_volumeOps.trace = &g_ioTrace;
+    if (geometry.isNtfs) {
+        std::wcout << L"MFT zone (not used as a move target): LCN " << geometry.mftZoneStart
+                   << L" - " << geometry.mftZoneEnd << L"\n";
+    }
+
+    // Optionally record every bitmap read, extent query and move for replay elsewhere
+    std::wstring ioTracePath =
+        options.Line(L"trace", L"Record volume operations to a trace file (- = no, default = -): ", L"-");
+    if (ioTracePath != L"-") {
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        ULONGLONG nowTicks = ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+        if (!g_ioTrace.Open(ioTracePath, geometry.volumeSerial, totalClusters, bytesPerCluster, nowTicks)) {
+            PrintLastError((L"Cannot create trace " + ioTracePath).c_str());
+            CloseHandle(hVolume);
+            return options.Finish(TOOL_EXIT_FAILED);
+        }
+        g_ioTrace.AddReserved(g_planner.reserved);
     }
 
     // Retrieve the volume bitmap
     std::vector<BYTE> volumeBitmap;
-    if (!GetVolumeBitmapChunked(hVolume, totalClusters, volumeBitmap)) {
-        std::wcerr << L"GetVolumeBitmapChunked failed.\n";
+    if (!FetchBitmap(g_volumeOps, totalClusters, volumeBitmap)) {
+        std::wcerr << L"Cannot read the volume bitmap.\n";
         CloseHandle(hVolume);
-        return 1;
+        return options.Finish(TOOL_EXIT_FAILED);
     }
 
     std::wcout << L"Bitmap retrieved: " << volumeBitmap.size() << L" bytes.\n";
@@ -498,19 +385,63 @@ int main() {
     std::wcout << L"Free clusters: " << freeCount << L" / " << totalClusters << std::endl;
 
     // Ask how many moves per file
-    int movesPerFile = 5;
-    std::wcout << L"How many single-cluster moves to perform per file? (default = 5): ";
-    std::wcin >> movesPerFile;
+    int movesPerFile = options.Number(L"moves", L"How many single-cluster moves to perform per file? (default = 5): ", 5);
+
+    // Ask how chatty the run should be
+    int logLevel =
+        options.Number(L"log-level", L"Log level? 0 = errors, 1 = warnings, 2 = per file, 3 = per move (default = 1): ", 1);
+    ULONGLONG sampleEvery = 1;
+    if (logLevel >= 3) {
+        sampleEvery = options.Number(L"log-every", L"Log every Nth move (default = 1): ", 1ULL);
+    }
+
     std::wcout << L"Fragmenting entire volume (starting at " << rootPath << L")...\n";
-    if (!FragmentAllFilesInDirectory(rootPath, hVolume, volumeBitmap, totalClusters, movesPerFile)) {
+    AsyncLog &log = AsyncLog::Instance();
+    log.progress.clustersTotal = totalClusters - freeCount;
+    log.Start((LogLevel)std::max(0, std::min(logLevel, 3)), sampleEvery, options.Interactive());
+    // Files of at most one cluster cannot be fragmented, skip them without opening
+    EntryFilter filter;
+    filter.minSize = (ULONGLONG)bytesPerCluster + 1;
+    FragmentMoveObserver moveObserver;
+    MoveExecutor executor;
+    executor.ops = &g_volumeOps;
+    executor.order = MoveOrder::Planned;
+    executor.observer = &moveObserver;
+    bool ok = FragmentAllFilesInDirectory(rootPath, executor, volumeBitmap, totalClusters, movesPerFile, filter);
+    log.Stop();
+    if (!ok) {
         std::wcerr << L"Fragmentation of the volume encountered errors.\n";
     } else {
         std::wcout << L"Fragmentation complete.\n";
     }
+    std::wcout << L"Files: " << log.progress.files << L", cluster moves: " << log.progress.moves << L"\n";
+    const ArenaStats &as = ScratchArena::ForThread().stats;
+    std::wcout << L"Ioctl reads: " << as.ioctlCalls << L" calls, " << as.files << L" extent maps ("
+               << as.moreDataReplies << L" ERROR_MORE_DATA), " << as.allocations << L" buffer allocations\n";
+    std::wcout << L"Files skipped without opening: " << filter.stats.FilesSkipped()
+               << L", subdirectories skipped: " << filter.stats.directoriesSkipped << L"\n";
+    if (g_ioTrace.IsOpen()) {
+        ULONGLONG records = g_ioTrace.Records();
+        if (g_ioTrace.Close()) {
+            std::wcout << L"Operation trace written to " << ioTracePath << L": " << records << L" records, "
+                       << g_ioTrace.Bytes() << L" bytes.\n";
+        } else {
+            PrintLastError((L"Cannot write trace " + ioTracePath).c_str());
+        }
+    }
 
     CloseHandle(hVolume);
-    std::wcout << L"\nDone. Press Enter to exit...";
-    std::wcin.ignore(std::numeric_limits<std::streamsize>::max(), L'\n');
-    std::wcin.get();
-    return 0;
+
+    JsonObject &result = options.Result();
+    result.Set("seed", seed).Set("totalClusters", totalClusters).Set("bytesPerCluster", bytesPerCluster);
+    result.Set("freeClustersBefore", freeCount);
+    result.Set("files", log.progress.files.load()).Set("clusterMoves", log.progress.moves.load());
+    result.Set("filesSkipped", filter.stats.FilesSkipped());
+    result.Set("ioctlCalls", as.ioctlCalls).Set("moreDataReplies", as.moreDataReplies);
+    if (!ioTracePath.empty() && ioTracePath != L"-") {
+        result.Set("traceRecords", g_ioTrace.Records()).Set("traceBytes", g_ioTrace.Bytes());
+    }
+
+    options.WaitForEnter(L"\nDone. Press Enter to exit...");
+    return options.Finish(ok ? TOOL_EXIT_OK : TOOL_EXIT_FAILED);
 }
@@ -6,7 +6,11 @@
 #include <cstdlib>
 #include <ctime>
 #include <limits>
+#include <algorithm>
+#include <random>
+#include <chrono>
 
+#include "../common/command_line.h"
 
 // Print a Windows error message
 static void PrintLastError(const wchar_t *msgPrefix) {
@@ -41,8 +45,20 @@ static bool GetVolumeClusterInfo(const std::wstring &rootPath, ULONGLONG &totalC
         return false;
     }
 
-    totalClusters = static_cast<ULONGLONG>(totalNumberOfClusters);
     bytesPerCluster = sectorsPerCluster * bytesPerSector;
+    if (bytesPerCluster == 0) {
+        return false;
+    }
+
+    // totalNumberOfClusters is a DWORD and is clamped on volumes with more
+    // than 2^32 clusters (16 TB at 4 KB), so derive the count from the 64-bit
+    // byte total instead
+    ULARGE_INTEGER freeBytesAvailable, totalBytes, totalFreeBytes;
+    if (!GetDiskFreeSpaceExW(rootPath.c_str(), &freeBytesAvailable, &totalBytes, &totalFreeBytes)) {
+        PrintLastError(L"GetDiskFreeSpaceExW failed");
+        return false;
+    }
+    totalClusters = totalBytes.QuadPart / bytesPerCluster;
     return true;
 }
 
@@ -189,9 +205,12 @@ std::vector<ULONGLONG> LinearFindFreeClusters(const std::vector<BYTE> &bitmap, U
 }
 
 
-// Random search for free clusters
-std::vector<ULONGLONG> FindRandomFreeClusters(const std::vector<BYTE> &bitmap, ULONGLONG totalClusters, int howMany) {
-    std::srand((unsigned)std::time(nullptr));
+// Random search for free clusters. The same seed picks the same candidates,
+// so a run can be repeated. A 64-bit generator reaches every cluster;
+// std::rand() stops at RAND_MAX (32767 on MSVC).
+std::vector<ULONGLONG> FindRandomFreeClusters(const std::vector<BYTE> &bitmap, ULONGLONG totalClusters, int howMany,
+                                              ULONGLONG seed) {
+    std::mt19937_64 rng(seed);
     std::vector<ULONGLONG> found;
     found.reserve(howMany);
 
@@ -201,7 +220,7 @@ std::vector<ULONGLONG> FindRandomFreeClusters(const std::vector<BYTE> &bitmap, U
     while ((int)found.size() < howMany && attempts < maxAttempts) {
         attempts++;
         // pick random
-        ULONGLONG candidate = std::rand() % totalClusters;
+        ULONGLONG candidate = rng() % totalClusters;
 
         size_t byteIndex = (size_t)(candidate / 8);
         int bitOffset = (int)(candidate % 8);
@@ -216,15 +235,25 @@ std::vector<ULONGLONG> FindRandomFreeClusters(const std::vector<BYTE> &bitmap, U
 
 
 // main
-int main() {
+int main(int argc, char **argv) {
+    ToolOptions options(L"free-cluster-finder", {
+        {L"volume", OptionKind::Text, true, L"drive letter of the volume, e.g. C"},
+        {L"count", OptionKind::Count, false, L"free clusters each search looks for (default 10)"},
+        {L"seed", OptionKind::Count, false, L"seed of the random search (default: the time)"},
+    });
+    int exitCode = 0;
+    if (!options.Parse(argc, argv, exitCode)) {
+        return exitCode;
+    }
+
     // 1) Ask for drive letter
-    std::wstring driveLetter;
-    std::wcout << L"Enter drive letter (e.g. C): ";
-    std::wcin >> driveLetter;
+    std::wstring driveLetter = options.DriveLetter(L"volume", L"Enter drive letter (e.g. C): ");
     if (driveLetter.empty()) {
         std::wcerr << L"No drive letter.\n";
-        return 1;
+        return options.Finish(TOOL_EXIT_USAGE);
     }
+    const int NEEDED = std::max(1, options.Value(L"count", 10));
+    ULONGLONG seed = options.Value(L"seed", (ULONGLONG)std::time(nullptr));
 
     // Build paths
     std::wstring rootPath = driveLetter + L":\\";
@@ -235,11 +264,11 @@ int main() {
     DWORD bytesPerCluster = 0;
     if (!GetVolumeClusterInfo(rootPath, totalClusters, bytesPerCluster)) {
         std::wcerr << L"GetVolumeClusterInfo failed.\n";
-        return 1;
+        return options.Finish(TOOL_EXIT_FAILED);
     }
     if (totalClusters == 0) {
         std::wcerr << L"Volume reports 0 clusters?\n";
-        return 1;
+        return options.Finish(TOOL_EXIT_FAILED);
     }
     std::wcout << L"Volume has " << totalClusters
                << L" clusters. Bytes/cluster=" << bytesPerCluster << L"\n";
@@ -255,18 +284,20 @@ int main() {
         NULL);
     if (hVolume == INVALID_HANDLE_VALUE) {
         PrintLastError((L"Failed to open volume " + volumePath).c_str());
-        return 1;
+        return options.Finish(TOOL_EXIT_FAILED);
     }
 
     // 4) Retrieve bitmap
+    auto started = std::chrono::steady_clock::now();
     std::vector<BYTE> volumeBitmap;
     if (!GetVolumeBitmapChunked(hVolume, totalClusters, volumeBitmap)) {
         std::wcerr << L"GetVolumeBitmapChunked failed.\n";
         CloseHandle(hVolume);
-        return 1;
+        return options.Finish(TOOL_EXIT_FAILED);
     }
     CloseHandle(hVolume);
 
+    double bitmapSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
     std::wcout << L"Bitmap retrieved: " << volumeBitmap.size()
                << L" bytes.\n";
 
@@ -276,7 +307,6 @@ int main() {
                << freeCount << L" / " << totalClusters << std::endl;
 
     // 6) Linear search test
-    const int NEEDED = 10;
     auto linearFound = LinearFindFreeClusters(volumeBitmap, totalClusters, NEEDED);
     if ((int)linearFound.size() < NEEDED) {
         std::wcout << L"Linear search found only " << linearFound.size()
@@ -291,7 +321,7 @@ int main() {
     }
 
     // 7) Random search test
-    auto randomFound = FindRandomFreeClusters(volumeBitmap, totalClusters, NEEDED);
+    auto randomFound = FindRandomFreeClusters(volumeBitmap, totalClusters, NEEDED, seed);
     if ((int)randomFound.size() < NEEDED) {
         std::wcout << L"Random search found only " << randomFound.size()
                    << L" free clusters. Fewer than " << NEEDED << L".\n";
@@ -303,8 +333,16 @@ int main() {
         }
     }
 
-    std::wcout << L"\nDone. Press Enter to exit...";
-    std::wcin.ignore(std::numeric_limits<std::streamsize>::max(), L'\n');
-    std::wcin.get();
-    return 0;
+    JsonObject &result = options.Result();
+    result.Set("totalClusters", totalClusters).Set("bytesPerCluster", bytesPerCluster);
+    result.Set("freeClusters", freeCount).Set("bitmapSeconds", bitmapSeconds);
+    for (ULONGLONG lcn : linearFound) {
+        result.AppendValue("linearFound", lcn);
+    }
+    for (ULONGLONG lcn : randomFound) {
+        result.AppendValue("randomFound", lcn);
+    }
+
+    options.WaitForEnter(L"\nDone. Press Enter to exit...");
+    return options.Finish(TOOL_EXIT_OK);
 }
@@ -3,11 +3,19 @@
 #include <string>
 #include <limits>
 
-int main() {
+#include "../common/command_line.h"
+
+int main(int argc, char **argv) {
+    ToolOptions options(L"open-volume", {
+        {L"volume", OptionKind::Text, true, L"drive letter of the volume, e.g. C"},
+    });
+    int exitCode = 0;
+    if (!options.Parse(argc, argv, exitCode)) {
+        return exitCode;
+    }
+
     // Prompt user to type just "C"
-    std::wstring driveLetter;
-    std::wcout << L"Enter the drive letter (e.g. C): ";
-    std::wcin >> driveLetter;
+    std::wstring driveLetter = options.DriveLetter(L"volume", L"Enter the drive letter (e.g. C): ");
 
     // Construct the volume path: L"\\\\.\\C:"
     std::wstring volumePath = L"\\\\.\\" + driveLetter + L":";
@@ -43,7 +51,8 @@ int main() {
             std::wcerr << L"Reason: " << errText << std::endl;
             LocalFree(errText);
         }
-        return 1;
+        options.Result().Set("opened", false).Set("error", (unsigned)dwError);
+        return options.Finish(TOOL_EXIT_FAILED);
     }
 
     std::cout << "Successfully opened volume "
@@ -51,9 +60,12 @@ int main() {
               << std::endl;
 
     CloseHandle(hVolume);
-    std::cout << "Program finished successfully.\n"
-              << "Press Enter to exit...";
-    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-    std::cin.get();
-    return 0;
+    options.Result().Set("opened", true);
+    std::cout << "Program finished successfully.\n";
+    if (options.Interactive()) {
+        std::cout << "Press Enter to exit...";
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::cin.get();
+    }
+    return options.Finish(TOOL_EXIT_OK);
 }
@@ -4,6 +4,12 @@
 #include <vector>
 #include <string>
 #include <limits>
+#include <algorithm>
+#include <bitset>
+#include <cstddef>
+#include <chrono>
+
+#include "../common/command_line.h"
 
 // Helper to print a Windows error message
 static void PrintLastError(const wchar_t *msgPrefix) {
@@ -47,17 +53,35 @@ static bool GetVolumeClusterInfo(
         return false;
     }
 
-    // Fill out parameters
-    totalClusters = static_cast<ULONGLONG>(totalNumberOfClusters);
     bytesPerCluster = sectorsPerCluster * bytesPerSector;
+    if (bytesPerCluster == 0) {
+        return false;
+    }
+
+    // totalNumberOfClusters is a DWORD and is clamped on volumes with more
+    // than 2^32 clusters (16 TB at 4 KB), so derive the count from the 64-bit
+    // byte total instead
+    ULARGE_INTEGER freeBytesAvailable, totalBytes, totalFreeBytes;
+    if (!GetDiskFreeSpaceExW(rootPath.c_str(), &freeBytesAvailable, &totalBytes, &totalFreeBytes)) {
+        PrintLastError(L"GetDiskFreeSpaceExW failed");
+        return false;
+    }
+    totalClusters = totalBytes.QuadPart / bytesPerCluster;
     return true;
 }
 
-int main() {
+int main(int argc, char **argv) {
+    ToolOptions options(L"read-bitmap", {
+        {L"volume", OptionKind::Text, true, L"drive letter of the volume, e.g. C"},
+        {L"buffer-kb", OptionKind::Count, false, L"bitmap bytes asked for per call, in KB (default 64)"},
+    });
+    int exitCode = 0;
+    if (!options.Parse(argc, argv, exitCode)) {
+        return exitCode;
+    }
+
     // 1) Ask for a drive letter (e.g. "C")
-    std::wstring driveLetter;
-    std::wcout << L"Enter drive letter (e.g. C): ";
-    std::wcin >> driveLetter;
+    std::wstring driveLetter = options.DriveLetter(L"volume", L"Enter drive letter (e.g. C): ");
 
     // Construct root path => "C:\\"
     std::wstring rootPath = driveLetter + L":\\";
@@ -67,7 +91,7 @@ int main() {
     DWORD bytesPerCluster = 0;
     if (!GetVolumeClusterInfo(rootPath, totalClusters, bytesPerCluster)) {
         std::wcerr << L"Failed to get volume cluster info for " << rootPath << std::endl;
-        return 1;
+        return options.Finish(TOOL_EXIT_FAILED);
     }
 
     // The highest valid LCN is totalClusters - 1
@@ -89,15 +113,24 @@ int main() {
         NULL);
     if (hVolume == INVALID_HANDLE_VALUE) {
         PrintLastError((L"Failed to open volume " + volumePath).c_str());
-        return 1;
+        return options.Finish(TOOL_EXIT_FAILED);
     }
 
     // Prepare the input for FSCTL_GET_VOLUME_BITMAP
     STARTING_LCN_INPUT_BUFFER inBuf;
     inBuf.StartingLcn.QuadPart = 0; // begin at LCN=0
 
-    // We will pick a 64KB buffer for our data
-    std::vector<BYTE> outBuf(64 * 1024);
+    // 64KB per call unless the command line says otherwise; the header
+    // takes 16 bytes of it
+    unsigned bufferKB = std::max(1u, options.Value(L"buffer-kb", 64u));
+    std::vector<BYTE> outBuf((size_t)bufferKB * 1024);
+
+    // What the calls covered, for the summary
+    bool ok = false;
+    ULONGLONG calls = 0;
+    ULONGLONG clustersCovered = 0;
+    ULONGLONG clustersAllocated = 0;
+    auto started = std::chrono::steady_clock::now();
 
     // 5) Loop calling FSCTL_GET_VOLUME_BITMAP until we have covered all clusters
     while (true) {
@@ -117,6 +150,7 @@ int main() {
             NULL);
 
         DWORD dwErr = GetLastError();
+        calls++;
 
         // Basic sanity check on returned data
         if (bytesReturned < sizeof(VOLUME_BITMAP_BUFFER)) {
@@ -134,6 +168,19 @@ int main() {
 
         // Each bit in pVolBmp->Buffer corresponds to one cluster (0=free, 1=allocated)
         // The number of bytes of actual bitmap bits is (chunkClusters + 7) / 8
+        if (success || dwErr == ERROR_MORE_DATA) {
+            // Clusters past the end of the volume are reported as allocated; leave them out
+            LONGLONG counted = std::max<LONGLONG>(0, std::min(chunkClusters, maxLCN + 1 - startLCN));
+            size_t available = bytesReturned - offsetof(VOLUME_BITMAP_BUFFER, Buffer);
+            counted = std::min(counted, (LONGLONG)available * 8);
+            for (LONGLONG byte = 0; byte < counted / 8; byte++) {
+                clustersAllocated += std::bitset<8>(pVolBmp->Buffer[byte]).count();
+            }
+            if (counted % 8) {
+                clustersAllocated += std::bitset<8>(pVolBmp->Buffer[counted / 8] & ((1u << (counted % 8)) - 1)).count();
+            }
+            clustersCovered += (ULONGLONG)counted;
+        }
 
         if (!success) {
             if (dwErr == ERROR_MORE_DATA) {
@@ -147,6 +194,7 @@ int main() {
                 if (nextLCN > maxLCN) {
                     // We already covered all clusters, so stop
                     std::wcout << L"We have covered the volume. Done." << std::endl;
+                    ok = true;
                     break;
                 }
 
@@ -167,6 +215,7 @@ int main() {
             if (chunkClusters == 0) {
                 // 0 means no more data
                 std::wcout << L"No more clusters to read. Done." << std::endl;
+                ok = true;
                 break;
             }
 
@@ -177,6 +226,7 @@ int main() {
             if (nextLCN > maxLCN) {
                 // We covered the volume
                 std::wcout << L"Reached or exceeded max LCN. Done." << std::endl;
+                ok = true;
                 break;
             }
             inBuf.StartingLcn.QuadPart = nextLCN;
@@ -186,9 +236,26 @@ int main() {
     }
 
     CloseHandle(hVolume);
-    std::cout << "Program finished successfully.\n" 
-              << "Press Enter to exit...";
-    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-    std::cin.get();
-    return 0;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::wcout << L"Read " << clustersCovered << L" of " << totalClusters << L" clusters in " << calls
+               << L" calls: " << clustersAllocated << L" allocated, " << clustersCovered - clustersAllocated
+               << L" free (" << seconds * 1000 << L" ms)" << std::endl;
+
+    JsonObject &result = options.Result();
+    result.Set("totalClusters", totalClusters).Set("bytesPerCluster", bytesPerCluster);
+    result.Set("calls", calls).Set("clustersRead", clustersCovered);
+    result.Set("allocatedClusters", clustersAllocated).Set("freeClusters", clustersCovered - clustersAllocated);
+    result.Set("bitmapSeconds", seconds);
+    if (!ok) {
+        std::wcerr << L"The bitmap was not read to the end." << std::endl;
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+
+    std::cout << "Program finished successfully.\n";
+    if (options.Interactive()) {
+        std::cout << "Press Enter to exit...";
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::cin.get();
+    }
+    return options.Finish(TOOL_EXIT_OK);
 }
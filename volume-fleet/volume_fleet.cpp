@@ -0,0 +1,983 @@
+#include <windows.h>
+#include <winioctl.h>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <sstream>
+#include <cwctype>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <chrono>
+
+#include "../common/directory_walker.h"
+#include "../common/entry_filter.h"
+#include "../common/scratch_arena.h"
+#include "../common/bitmap_fetch.h"
+#include "../common/volume_geometry.h"
+#include "../common/free_run.h"
+#include "../common/fragmentation_report.h"
+#include "../common/extent_plan.h"
+#include "../common/fleet_scheduler.h"
+#include "../common/command_line.h"
+
+// -----------------------------------------------------------------------------
+// Console
+//   Every volume reports from its own threads, so lines go out whole under
+//   one lock. A status line with the sum over all volumes is redrawn under
+//   the same lock and cleared before any other line is written.
+// -----------------------------------------------------------------------------
+static std::mutex g_consoleMutex;
+static bool g_statusShown = false;
+static size_t g_statusWidth = 0;
+static bool g_logFiles = false; // one line per file that cannot be read or moved
+
+static void ClearStatus() {
+    if (g_statusShown) {
+        std::wcerr << L"\r" << std::wstring(g_statusWidth, L' ') << L"\r";
+        g_statusShown = false;
+    }
+}
+
+static void PrintLine(const std::wstring &line, bool error = false) {
+    std::lock_guard<std::mutex> lock(g_consoleMutex);
+    ClearStatus();
+    (error ? std::wcerr : std::wcout) << line << std::endl;
+}
+
+// Print a Windows error message
+static void PrintLastError(const std::wstring &msgPrefix) {
+    DWORD errCode = GetLastError();
+    std::wostringstream line;
+    line << msgPrefix << L" (Error " << errCode << L")";
+
+    LPWSTR errText = nullptr;
+    FormatMessageW(
+        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        NULL,
+        errCode,
+        0,
+        (LPWSTR)&errText,
+        0,
+        NULL);
+    if (errText) {
+        line << L"\nReason: " << errText;
+        LocalFree(errText);
+    }
+    PrintLine(line.str(), true);
+}
+
+// Enable a named privilege (e.g. "SeManageVolumePrivilege") in this process
+bool EnablePrivilege(const wchar_t *privName) {
+    HANDLE hToken = nullptr;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken)) {
+        PrintLastError(L"OpenProcessToken failed");
+        return false;
+    }
+    LUID luid;
+    if (!LookupPrivilegeValueW(NULL, privName, &luid)) {
+        PrintLastError(L"LookupPrivilegeValueW failed");
+        CloseHandle(hToken);
+        return false;
+    }
+    TOKEN_PRIVILEGES tp;
+    ZeroMemory(&tp, sizeof(tp));
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Luid = luid;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    if (!AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL)) {
+        PrintLastError(L"AdjustTokenPrivileges failed");
+        CloseHandle(hToken);
+        return false;
+    }
+    if (GetLastError() != ERROR_SUCCESS) {
+        PrintLastError(L"AdjustTokenPrivileges error (post-check)");
+        CloseHandle(hToken);
+        return false;
+    }
+    CloseHandle(hToken);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Volume discovery
+//   Every volume the volume manager knows of is listed, mounted or not. A
+//   volume is eligible when it is a fixed NTFS volume that can be opened
+//   (and, to defragment it, is not read-only). Its physical disks come from
+//   IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, so partitions of one disk are
+//   recognized as such and a spanned or striped volume holds all its disks.
+//   Disks without a seek penalty (SSDs) are left out of the disks a volume
+//   waits for: their volumes can run side by side.
+// -----------------------------------------------------------------------------
+struct FleetVolume {
+    std::wstring guidPath;   // \\?\Volume{...}\  (root of the walk)
+    std::wstring devicePath; // \\?\Volume{...}   (the volume itself, for CreateFileW)
+    std::wstring name;       // first mount point, or the GUID path when not mounted
+    std::vector<uint32_t> disks;
+    std::vector<uint32_t> seekDisks; // of those, the ones with a seek penalty
+    VolumeGeometry geometry;
+    bool readOnly = false;
+};
+
+// Volume geometry from FSCTL_GET_NTFS_VOLUME_DATA; fails on anything but NTFS
+static bool GetVolumeGeometry(HANDLE volumeHandle, VolumeGeometry &geometry) {
+    geometry = VolumeGeometry();
+    NTFS_VOLUME_DATA_BUFFER data = {};
+    DWORD bytesReturned = 0;
+    if (!DeviceIoControl(volumeHandle, FSCTL_GET_NTFS_VOLUME_DATA, NULL, 0, &data, sizeof(data), &bytesReturned, NULL)) {
+        return false;
+    }
+    geometry.isNtfs = true;
+    geometry.volumeSerial = (ULONGLONG)data.VolumeSerialNumber.QuadPart;
+    geometry.totalClusters = (ULONGLONG)data.TotalClusters.QuadPart;
+    geometry.freeClusters = (ULONGLONG)data.FreeClusters.QuadPart;
+    geometry.bytesPerSector = data.BytesPerSector;
+    geometry.bytesPerCluster = data.BytesPerCluster;
+    geometry.bytesPerFileRecord = data.BytesPerFileRecordSegment;
+    geometry.mftStartLcn = (ULONGLONG)data.MftStartLcn.QuadPart;
+    geometry.mft2StartLcn = (ULONGLONG)data.Mft2StartLcn.QuadPart;
+    geometry.mftValidDataLength = (ULONGLONG)data.MftValidDataLength.QuadPart;
+    geometry.mftZoneStart = (ULONGLONG)data.MftZoneStart.QuadPart;
+    geometry.mftZoneEnd = (ULONGLONG)data.MftZoneEnd.QuadPart;
+    return geometry.bytesPerCluster != 0;
+}
+
+// Physical disk numbers a volume lies on, in ascending order without repeats
+static bool GetVolumeDisks(HANDLE volumeHandle, std::vector<uint32_t> &disks) {
+    disks.clear();
+    // Room for 32 extents; a volume striped over more disks than that asks again
+    std::vector<BYTE> buffer(sizeof(VOLUME_DISK_EXTENTS) + 31 * sizeof(DISK_EXTENT));
+    DWORD bytesReturned = 0;
+    while (!DeviceIoControl(volumeHandle, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0, buffer.data(),
+                            (DWORD)buffer.size(), &bytesReturned, NULL)) {
+        if (GetLastError() != ERROR_MORE_DATA) {
+            return false;
+        }
+        auto extents = reinterpret_cast<PVOLUME_DISK_EXTENTS>(buffer.data());
+        buffer.resize(sizeof(VOLUME_DISK_EXTENTS) + extents->NumberOfDiskExtents * sizeof(DISK_EXTENT));
+    }
+    auto extents = reinterpret_cast<PVOLUME_DISK_EXTENTS>(buffer.data());
+    for (DWORD i = 0; i < extents->NumberOfDiskExtents; i++) {
+        disks.push_back(extents->Extents[i].DiskNumber);
+    }
+    std::sort(disks.begin(), disks.end());
+    disks.erase(std::unique(disks.begin(), disks.end()), disks.end());
+    return !disks.empty();
+}
+
+// Whether reads on a physical disk pay for seeks. Unknown counts as yes.
+static bool DiskHasSeekPenalty(uint32_t diskNumber) {
+    std::wstring diskPath = L"\\\\.\\PhysicalDrive" + std::to_wstring(diskNumber);
+    HANDLE hDisk = CreateFileW(diskPath.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (hDisk == INVALID_HANDLE_VALUE) {
+        return true;
+    }
+    STORAGE_PROPERTY_QUERY query = {};
+    query.PropertyId = StorageDeviceSeekPenaltyProperty;
+    query.QueryType = PropertyStandardQuery;
+    DEVICE_SEEK_PENALTY_DESCRIPTOR penalty = {};
+    DWORD bytesReturned = 0;
+    BOOL ok = DeviceIoControl(hDisk, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &penalty, sizeof(penalty),
+                              &bytesReturned, NULL);
+    CloseHandle(hDisk);
+    return !ok || bytesReturned < sizeof(penalty) || penalty.IncursSeekPenalty;
+}
+
+// Look at one volume; false (with the reason) when it is not eligible
+static bool InspectVolume(const std::wstring &guidPath, FleetVolume &volume, std::wstring &reason) {
+    volume = FleetVolume();
+    volume.guidPath = guidPath;
+    volume.devicePath = guidPath.substr(0, guidPath.size() - 1);
+    volume.name = guidPath;
+
+    // Mount points come back as a list of strings ending with an empty one
+    std::vector<wchar_t> names(MAX_PATH + 1);
+    DWORD needed = 0;
+    if (!GetVolumePathNamesForVolumeNameW(guidPath.c_str(), names.data(), (DWORD)names.size(), &needed) &&
+        GetLastError() == ERROR_MORE_DATA) {
+        names.resize(needed);
+        GetVolumePathNamesForVolumeNameW(guidPath.c_str(), names.data(), (DWORD)names.size(), &needed);
+    }
+    if (names[0] != L'\0') {
+        volume.name = names.data();
+    }
+
+    if (GetDriveTypeW(guidPath.c_str()) != DRIVE_FIXED) {
+        reason = L"not a fixed disk";
+        return false;
+    }
+    wchar_t fileSystem[MAX_PATH + 1] = {};
+    DWORD flags = 0;
+    if (!GetVolumeInformationW(guidPath.c_str(), NULL, 0, NULL, NULL, &flags, fileSystem, MAX_PATH + 1)) {
+        reason = L"no file system (Error " + std::to_wstring(GetLastError()) + L")";
+        return false;
+    }
+    if (std::wstring(fileSystem) != L"NTFS") {
+        reason = std::wstring(fileSystem) + L", not NTFS";
+        return false;
+    }
+    volume.readOnly = (flags & FILE_READ_ONLY_VOLUME) != 0;
+
+    HANDLE hVolume = CreateFileW(volume.devicePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                 OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE) {
+        reason = L"cannot be opened (Error " + std::to_wstring(GetLastError()) + L")";
+        return false;
+    }
+    bool haveGeometry = GetVolumeGeometry(hVolume, volume.geometry);
+    bool haveDisks = GetVolumeDisks(hVolume, volume.disks);
+    CloseHandle(hVolume);
+    if (!haveGeometry) {
+        reason = L"no NTFS volume data";
+        return false;
+    }
+    if (!haveDisks) {
+        reason = L"not on a physical disk";
+        return false;
+    }
+    return true;
+}
+
+// Every eligible volume, in the order the volume manager lists them
+static bool DiscoverVolumes(std::vector<FleetVolume> &volumes) {
+    volumes.clear();
+    wchar_t guidPath[MAX_PATH + 1];
+    HANDLE hFind = FindFirstVolumeW(guidPath, MAX_PATH + 1);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        PrintLastError(L"FindFirstVolumeW failed");
+        return false;
+    }
+    std::vector<std::pair<uint32_t, bool>> seekPenalty; // disk number, has one
+    do {
+        FleetVolume volume;
+        std::wstring reason;
+        if (!InspectVolume(guidPath, volume, reason)) {
+            std::wcout << L"  skipped " << volume.name << L": " << reason << L"\n";
+            continue;
+        }
+        for (uint32_t d : volume.disks) {
+            auto known = std::find_if(seekPenalty.begin(), seekPenalty.end(),
+                                      [&](const std::pair<uint32_t, bool> &p) { return p.first == d; });
+            if (known == seekPenalty.end()) {
+                seekPenalty.emplace_back(d, DiskHasSeekPenalty(d));
+                known = seekPenalty.end() - 1;
+            }
+            if (known->second) {
+                volume.seekDisks.push_back(d);
+            }
+        }
+        volumes.push_back(volume);
+    } while (FindNextVolumeW(hFind, guidPath, MAX_PATH + 1));
+    DWORD error = GetLastError();
+    FindVolumeClose(hFind);
+    if (error != ERROR_NO_MORE_FILES) {
+        SetLastError(error);
+        PrintLastError(L"FindNextVolumeW failed");
+        return false;
+    }
+    return true;
+}
+
+static std::wstring Lowered(std::wstring s) {
+    for (wchar_t &c : s) {
+        c = (wchar_t)std::towlower(c);
+    }
+    return s;
+}
+
+// "C", "C:" and "C:\" all name the volume mounted at C:\ ; GUID paths and
+// folder mount points are matched with or without the trailing backslash
+static bool VolumeMatches(const FleetVolume &volume, std::wstring wanted) {
+    if (wanted.size() == 1) {
+        wanted += L":";
+    }
+    if (wanted.back() != L'\\') {
+        wanted += L"\\";
+    }
+    wanted = Lowered(wanted);
+    return wanted == Lowered(volume.name) || wanted == Lowered(volume.guidPath);
+}
+
+// -----------------------------------------------------------------------------
+// I/O on a volume
+//   Everything the passes read or write is taken from one budget shared by
+//   all volumes: a bitmap read costs the bytes asked for, an extent query
+//   one file record (the MFT record it reads), a move its clusters twice
+//   (read at the source, written at the destination).
+// -----------------------------------------------------------------------------
+static IoBudget g_ioBudget;
+
+// FSCTL_GET_VOLUME_BITMAP on one volume handle
+class VolumeBitmapSource : public BitmapSource {
+public:
+    VolumeBitmapSource(HANDLE volumeHandle, const std::wstring &volumeName)
+        : volumeHandle(volumeHandle), volumeName(volumeName) {}
+
+    IoStatus Read(int64_t startingLcn, void *out, uint32_t outSize, uint32_t &bytesReturned) override {
+        g_ioBudget.Acquire(outSize);
+        STARTING_LCN_INPUT_BUFFER inBuf = {};
+        inBuf.StartingLcn.QuadPart = startingLcn;
+        DWORD returned = 0;
+        BOOL ok = DeviceIoControl(volumeHandle, FSCTL_GET_VOLUME_BITMAP, &inBuf, sizeof(inBuf),
+                                  out, outSize, &returned, NULL);
+        bytesReturned = returned;
+        if (!ok && GetLastError() == ERROR_MORE_DATA) {
+            return IoStatus::MoreData;
+        }
+        if (!ok) {
+            PrintLastError(volumeName + L": FSCTL_GET_VOLUME_BITMAP failed");
+            return IoStatus::Failed;
+        }
+        return IoStatus::Success;
+    }
+
+private:
+    HANDLE volumeHandle;
+    std::wstring volumeName;
+};
+
+// All runs of a file in VCN order, sparse runs included (lcn = -1)
+static bool ReadFileRuns(HANDLE fileHandle, uint32_t bytesPerRecord, std::vector<ExtentRun> &runs) {
+    ScratchArena &arena = ScratchArena::ForThread();
+    arena.BeginRequest();
+    runs.clear();
+
+    STARTING_VCN_INPUT_BUFFER inBuf = {};
+    inBuf.StartingVcn.QuadPart = 0;
+    while (true) {
+        g_ioBudget.Acquire(bytesPerRecord);
+        DWORD bytesReturned = 0;
+        BOOL ok = DeviceIoControl(fileHandle, FSCTL_GET_RETRIEVAL_POINTERS, &inBuf, sizeof(inBuf),
+                                  arena.IoctlBuffer(), arena.IoctlBufferSize(), &bytesReturned, NULL);
+        // ERROR_MORE_DATA: the buffer is full, ask again from the last VCN returned
+        bool moreData = false;
+        if (!ok) {
+            DWORD err = GetLastError();
+            if (err == ERROR_HANDLE_EOF) {
+                arena.NoteIoctl(false);
+                return true; // no extents: resident or empty
+            }
+            if (err != ERROR_MORE_DATA) {
+                return false;
+            }
+            moreData = true;
+        }
+        arena.NoteIoctl(moreData);
+        if (bytesReturned < sizeof(RETRIEVAL_POINTERS_BUFFER)) {
+            return false;
+        }
+
+        auto pRet = reinterpret_cast<PRETRIEVAL_POINTERS_BUFFER>(arena.IoctlBuffer());
+        if (pRet->ExtentCount == 0) {
+            return true;
+        }
+        LONGLONG vcn = pRet->StartingVcn.QuadPart;
+        for (DWORD i = 0; i < pRet->ExtentCount; i++) {
+            LONGLONG nextVcn = pRet->Extents[i].NextVcn.QuadPart;
+            runs.push_back(ExtentRun{vcn, pRet->Extents[i].Lcn.QuadPart, nextVcn - vcn});
+            vcn = nextVcn;
+        }
+        if (!moreData || vcn <= inBuf.StartingVcn.QuadPart) {
+            return true; // a successful reply holds every remaining extent
+        }
+        inBuf.StartingVcn.QuadPart = vcn;
+    }
+}
+
+// Physically contiguous pieces and allocated clusters of a file's runs
+static void CountPieces(const std::vector<ExtentRun> &runs, uint64_t &pieces, uint64_t &clusters) {
+    pieces = 0;
+    clusters = 0;
+    int64_t next = -1;
+    for (const ExtentRun &r : runs) {
+        if (r.lcn < 0 || r.count <= 0) {
+            continue;
+        }
+        pieces += r.lcn != next ? 1 : 0;
+        clusters += (uint64_t)r.count;
+        next = r.lcn + r.count;
+    }
+}
+
+// Move count VCNs starting at srcVcn to dstLcn in the target file (via FSCTL_MOVE_FILE)
+static bool MoveClusters(HANDLE volumeHandle, HANDLE fileHandle, LONGLONG srcVcn, LONGLONG dstLcn, LONGLONG count) {
+    MOVE_FILE_DATA moveData = {};
+    moveData.FileHandle = fileHandle;
+    moveData.StartingVcn.QuadPart = srcVcn;
+    moveData.StartingLcn.QuadPart = dstLcn;
+    moveData.ClusterCount = (DWORD)count;
+    DWORD bytesReturned = 0;
+    return DeviceIoControl(volumeHandle, FSCTL_MOVE_FILE, &moveData, sizeof(moveData), NULL, 0, &bytesReturned,
+                           NULL) != FALSE;
+}
+
+// Compression unit of an NTFS-compressed file in clusters, 0 for any other file
+static uint32_t CompressionUnitClusters(HANDLE hFile) {
+    FILE_COMPRESSION_INFO info = {};
+    if (!GetFileInformationByHandleEx(hFile, FileCompressionInfo, &info, sizeof(info)) ||
+        info.CompressionFormat == COMPRESSION_FORMAT_NONE || info.CompressionUnitShift <= info.ClusterShift) {
+        return 0;
+    }
+    return 1u << (info.CompressionUnitShift - info.ClusterShift);
+}
+
+static void MarkClusters(std::vector<BYTE> &bitmap, int64_t lcn, int64_t count, bool allocated) {
+    for (int64_t c = lcn; c < lcn + count; c++) {
+        BYTE bit = (BYTE)(1 << (c % 8));
+        bitmap[(size_t)(c / 8)] = allocated ? (BYTE)(bitmap[(size_t)(c / 8)] | bit) : (BYTE)(bitmap[(size_t)(c / 8)] & ~bit);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// One volume's pass
+//   The walker (the scheduler thread the volume runs on) lists the files and
+//   hands them to a pool of workers through a bounded queue; the workers open
+//   each file and query its extents, which is where an analysis spends its
+//   time. Analysis folds the extents into the volume's FragmentationReport.
+//   Defragmentation passes the fragmented files on to one mover per volume,
+//   which places each into the first free run that holds it (searching on
+//   from the previous one and wrapping around once) and moves it there an
+//   extent at a time, as defragment's first-fit mode does. Moves on a volume
+//   are serial: they share its bitmap, and its disk serves one at a time.
+// -----------------------------------------------------------------------------
+enum class FleetMode { Analyze = 0, Defragment = 1 };
+
+struct FleetSettings {
+    FleetMode mode = FleetMode::Analyze;
+    unsigned workersPerVolume = 4;
+    size_t reportTopFiles = 20;
+    std::wstring reportDirectory; // empty = no JSON reports
+};
+
+struct VolumeResult {
+    std::unique_ptr<FragmentationReport> report;
+    uint64_t filesUnreadable = 0;
+    uint64_t filesMoved = 0;
+    uint64_t filesNoRoom = 0;
+    uint64_t movesFailed = 0;
+    ExtentPlanStats plan;
+    std::wstring failure; // why the volume could not be processed
+};
+
+struct FileItem {
+    std::wstring path;
+    uint64_t size = 0;
+};
+
+class VolumePass {
+public:
+    VolumePass(const FleetVolume &volume, const FleetSettings &settings, VolumeProgress &progress, VolumeResult &result)
+        : volume(volume),
+          settings(settings),
+          progress(progress),
+          result(result),
+          files(4096),
+          fragmented(1024) {}
+
+    bool Run() {
+        const VolumeGeometry &g = volume.geometry;
+        DWORD access = settings.mode == FleetMode::Defragment ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+        hVolume = CreateFileW(volume.devicePath.c_str(), access, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, 0, NULL);
+        if (hVolume == INVALID_HANDLE_VALUE) {
+            result.failure = L"cannot open the volume (Error " + std::to_wstring(GetLastError()) + L")";
+            return false;
+        }
+        // The geometry is from discovery; the free space has changed since
+        VolumeGeometry now;
+        if (GetVolumeGeometry(hVolume, now)) {
+            volume.geometry = now;
+        }
+        progress.clustersTotal = g.totalClusters - std::min(g.freeClusters, g.totalClusters);
+        reserved = g.ReservedRanges();
+
+        BitmapFetchOptions fetchOptions;
+        bool haveBitmap = FetchVolumeBitmap(g.totalClusters, bitmap, fetchOptions, [&](unsigned) {
+            return std::unique_ptr<BitmapSource>(new VolumeBitmapSource(hVolume, volume.name));
+        });
+        if (!haveBitmap) {
+            result.failure = L"cannot read the volume bitmap";
+            CloseHandle(hVolume);
+            return false;
+        }
+
+        if (settings.mode == FleetMode::Analyze) {
+            result.report.reset(new FragmentationReport(settings.reportTopFiles));
+            result.report->SetVolume(volume.name, g.totalClusters, g.bytesPerCluster);
+            result.report->ScanFreeSpace(BitmapWords(bitmap), g.totalClusters, reserved);
+        }
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < std::max(settings.workersPerVolume, 1u); i++) {
+            workers.emplace_back([this] { Worker(); });
+        }
+        std::thread mover;
+        if (settings.mode == FleetMode::Defragment) {
+            mover = std::thread([this] { Mover(); });
+        }
+
+        DirectoryWalker walker;
+        WalkFeeder feeder(*this);
+        bool walked = walker.Walk(volume.guidPath, feeder);
+        files.Close();
+        for (auto &t : workers) {
+            t.join();
+        }
+        fragmented.Close();
+        if (mover.joinable()) {
+            mover.join();
+        }
+        CloseHandle(hVolume);
+        if (!walked) {
+            result.failure = L"the walk stopped early";
+        }
+        return walked;
+    }
+
+private:
+    struct WalkFeeder : WalkVisitor {
+        VolumePass &pass;
+        explicit WalkFeeder(VolumePass &pass) : pass(pass) {}
+
+        WalkAction OnFile(const WalkEntry &e) {
+            if (!pass.filter.AcceptFile(e)) {
+                return WalkAction::Continue;
+            }
+            FileItem item;
+            item.path.assign(e.path, e.pathLength);
+            item.size = e.size;
+            return pass.files.Push(std::move(item)) ? WalkAction::Continue : WalkAction::Stop;
+        }
+
+        WalkAction OnDirectory(const WalkEntry &e) {
+            return pass.filter.AcceptDirectory(e) ? WalkAction::Continue : WalkAction::SkipDirectory;
+        }
+    };
+
+    void Worker() {
+        FileItem item;
+        std::vector<ExtentRun> runs;
+        while (files.Pop(item)) {
+            HANDLE hFile = CreateFileW(item.path.c_str(), FILE_READ_ATTRIBUTES,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                                       0, NULL);
+            bool ok = hFile != INVALID_HANDLE_VALUE && ReadFileRuns(hFile, volume.geometry.bytesPerFileRecord, runs);
+            if (hFile != INVALID_HANDLE_VALUE) {
+                CloseHandle(hFile);
+            }
+            if (!ok) {
+                if (g_logFiles) {
+                    PrintLine(L"Cannot read the extents of " + item.path, true);
+                }
+                std::lock_guard<std::mutex> lock(resultMutex);
+                result.filesUnreadable++;
+                continue;
+            }
+            uint64_t pieces = 0;
+            uint64_t clusters = 0;
+            CountPieces(runs, pieces, clusters);
+            progress.files.fetch_add(1, std::memory_order_relaxed);
+            progress.clustersScanned.fetch_add(clusters, std::memory_order_relaxed);
+            if (pieces > 1) {
+                progress.fragmented.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (result.report) {
+                std::lock_guard<std::mutex> lock(resultMutex);
+                result.report->AddFile(item.path.data(), item.path.size(), item.size, runs.data(), runs.size());
+            } else if (pieces > 1) {
+                fragmented.Push(std::move(item));
+            }
+        }
+    }
+
+    void Mover() {
+        const VolumeGeometry &g = volume.geometry;
+        FileItem item;
+        std::vector<ExtentRun> runs;
+        std::vector<ExtentMove> moves;
+        uint64_t hint = 0;
+        while (fragmented.Pop(item)) {
+            HANDLE hFile = CreateFileW(item.path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+            if (hFile == INVALID_HANDLE_VALUE) {
+                if (g_logFiles) {
+                    PrintLine(L"Cannot open for moving " + item.path, true);
+                }
+                progress.errors.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            // Query again: the file may have changed since a worker looked at it
+            uint64_t pieces = 0;
+            uint64_t clusters = 0;
+            if (ReadFileRuns(hFile, g.bytesPerFileRecord, runs)) {
+                CountPieces(runs, pieces, clusters);
+            }
+            if (pieces > 1) {
+                MoveIntoFreeRun(hFile, item.path, runs, clusters, moves, hint);
+            }
+            CloseHandle(hFile);
+        }
+    }
+
+    void MoveIntoFreeRun(HANDLE hFile,
+                         const std::wstring &path,
+                         const std::vector<ExtentRun> &runs,
+                         uint64_t clusters,
+                         std::vector<ExtentMove> &moves,
+                         uint64_t &hint) {
+        const VolumeGeometry &g = volume.geometry;
+        BitmapWords words(bitmap);
+        uint64_t blockStart = 0;
+        if (!FindFreeRun(words, hint, g.totalClusters, clusters, reserved, blockStart) &&
+            (hint == 0 ||
+             !FindFreeRun(words, 0, std::min(hint + clusters, g.totalClusters), clusters, reserved, blockStart))) {
+            result.filesNoRoom++;
+            return;
+        }
+        hint = blockStart + clusters;
+        moves.clear();
+        PlanExtentMoves(runs.data(), runs.size(), CompressionUnitClusters(hFile), blockStart, moves, &result.plan);
+        MarkClusters(bitmap, (int64_t)blockStart, (int64_t)clusters, true);
+
+        bool allMoved = true;
+        for (const ExtentMove &m : moves) {
+            g_ioBudget.Acquire((uint64_t)m.clusters * g.bytesPerCluster * 2);
+            if (!MoveClusters(hVolume, hFile, m.vcn, m.dstLcn, m.vcnCount)) {
+                if (g_logFiles) {
+                    PrintLastError(volume.name + L": FSCTL_MOVE_FILE failed for " + path);
+                }
+                allMoved = false;
+                result.movesFailed++;
+                progress.errors.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+            progress.moves.fetch_add(1, std::memory_order_relaxed);
+            progress.clustersMoved.fetch_add((uint64_t)m.clusters, std::memory_order_relaxed);
+        }
+        if (allMoved) {
+            // The old clusters are free now; the parts that were already in
+            // place lie inside the block, which is marked again
+            for (const ExtentRun &r : runs) {
+                if (r.lcn >= 0) {
+                    MarkClusters(bitmap, r.lcn, r.count, false);
+                }
+            }
+            MarkClusters(bitmap, (int64_t)blockStart, (int64_t)clusters, true);
+            result.filesMoved++;
+        }
+        // After a failed move both the old clusters and the block stay marked
+    }
+
+    FleetVolume volume;
+    const FleetSettings &settings;
+    VolumeProgress &progress;
+    VolumeResult &result;
+    HANDLE hVolume = INVALID_HANDLE_VALUE;
+    std::vector<BYTE> bitmap;
+    std::vector<LcnRange> reserved;
+    EntryFilter filter; // used by the walker thread only
+    BoundedQueue<FileItem> files;
+    BoundedQueue<FileItem> fragmented;
+    std::mutex resultMutex;
+};
+
+// -----------------------------------------------------------------------------
+// Fleet status line
+// -----------------------------------------------------------------------------
+class StatusLine {
+public:
+    explicit StatusLine(const FleetProgress &progress) : progress(progress) {
+        started = std::chrono::steady_clock::now();
+        drawer = std::thread([this] { DrawLoop(); });
+    }
+
+    ~StatusLine() {
+        {
+            std::lock_guard<std::mutex> lock(stopMutex);
+            running = false;
+        }
+        stopSignal.notify_all();
+        drawer.join();
+        std::lock_guard<std::mutex> consoleLock(g_consoleMutex);
+        ClearStatus();
+    }
+
+private:
+    void DrawLoop() {
+        std::unique_lock<std::mutex> lock(stopMutex);
+        while (running) {
+            stopSignal.wait_for(lock, std::chrono::milliseconds(500));
+            if (running) {
+                Draw();
+            }
+        }
+    }
+
+    void Draw() {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        FleetTotals t = progress.Sum();
+        std::wostringstream line;
+        line << L"[fleet] " << t.done + t.failed << L"/" << progress.Size() << L" volumes done, " << t.running
+             << L" running, " << t.files << L" files, " << t.fragmented << L" fragmented";
+        if (t.moves > 0) {
+            line << L", " << t.moves << L" moves";
+        }
+        line << L", " << (ULONGLONG)((double)g_ioBudget.BytesTaken() / std::max(seconds, 0.001) / (1 << 20))
+             << L" MB/s";
+        if (t.clustersTotal > 0 && t.clustersScanned > 0) {
+            double fraction = std::min(1.0, (double)t.clustersScanned / (double)t.clustersTotal);
+            ULONGLONG etaSec = (ULONGLONG)(seconds / fraction - seconds);
+            line << L", " << (int)(fraction * 100) << L"% scanned, ETA " << etaSec / 3600 << L"h"
+                 << (etaSec / 60) % 60 << L"m" << etaSec % 60 << L"s";
+        }
+
+        std::lock_guard<std::mutex> consoleLock(g_consoleMutex);
+        std::wstring text = line.str();
+        if (text.size() < g_statusWidth) {
+            text.append(g_statusWidth - text.size(), L' ');
+        }
+        g_statusWidth = text.size();
+        std::wcerr << L"\r" << text;
+        g_statusShown = true;
+    }
+
+    const FleetProgress &progress;
+    std::chrono::steady_clock::time_point started;
+    bool running = true;
+    std::mutex stopMutex;
+    std::condition_variable stopSignal;
+    std::thread drawer;
+};
+
+// A file name for a volume's report: the mount point or GUID without the
+// characters a file name cannot hold
+static std::wstring ReportFileName(const FleetVolume &volume) {
+    std::wstring name;
+    for (wchar_t c : volume.name) {
+        if (std::iswalnum(c) || c == L'-' || c == L'{' || c == L'}') {
+            name.push_back(c);
+        } else if (!name.empty() && name.back() != L'_') {
+            name.push_back(L'_');
+        }
+    }
+    while (!name.empty() && name.back() == L'_') {
+        name.pop_back();
+    }
+    return name + L".json";
+}
+
+static bool WriteVolumeReport(const FragmentationReport &report, const std::wstring &path) {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    std::ofstream out(std::filesystem::path(path), std::ios::binary);
+    report.WriteJson(out, ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime);
+    if (!out) {
+        PrintLine(L"Cannot write the report to " + path, true);
+        return false;
+    }
+    return true;
+}
+
+static std::wstring DiskList(const std::vector<uint32_t> &disks) {
+    std::wstring list;
+    for (uint32_t d : disks) {
+        list += (list.empty() ? L"" : L"+") + std::to_wstring(d);
+    }
+    return list;
+}
+
+int main(int argc, char **argv) {
+    ToolOptions options(L"volume-fleet", {
+        {L"mode", OptionKind::Count, false, L"0 = analyze, 1 = defragment, first fit (default 0)"},
+        {L"volumes", OptionKind::Text, false, L"mount points or GUID paths separated by ';', * = all (default)"},
+        {L"max-volumes", OptionKind::Count, false, L"volumes at once at most, 0 = one per hard disk (default 0)"},
+        {L"workers", OptionKind::Count, false, L"worker threads per volume (default 4)"},
+        {L"budget-mb", OptionKind::Count, false, L"I/O budget for all volumes together in MB/s, 0 = no limit (default 0)"},
+        {L"reports", OptionKind::Text, false, L"analyze: directory for a JSON report per volume (- = none, default)"},
+        {L"log-files", OptionKind::Count, false, L"log files that cannot be read or moved, 0 or 1 (default 0)"},
+    });
+    int exitCode = 0;
+    if (!options.Parse(argc, argv, exitCode)) {
+        return exitCode;
+    }
+
+    std::wcout << L"Attempting to enable SeManageVolumePrivilege...\n";
+    if (!EnablePrivilege(L"SeManageVolumePrivilege")) {
+        std::wcerr << L"Failed to enable SeManageVolumePrivilege. Try running as Administrator.\n";
+    }
+
+    // 1) Find the volumes
+    std::wcout << L"Looking for fixed NTFS volumes...\n";
+    std::vector<FleetVolume> found;
+    if (!DiscoverVolumes(found)) {
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+    if (found.empty()) {
+        std::wcerr << L"No eligible volume found.\n";
+        return options.Finish(TOOL_EXIT_FAILED);
+    }
+    for (const FleetVolume &v : found) {
+        const VolumeGeometry &g = v.geometry;
+        std::wcout << L"  " << v.name << L": disk " << DiskList(v.disks)
+                   << (v.seekDisks.empty() ? L" (no seek penalty)" : L"") << L", " << g.TotalBytes() / (1 << 30)
+                   << L" GB, " << (g.totalClusters - g.freeClusters) * 100 / std::max<ULONGLONG>(g.totalClusters, 1)
+                   << L"% used" << (v.readOnly ? L", read-only" : L"") << L"\n";
+    }
+
+    // 2) Ask what to do, and where
+    FleetSettings settings;
+    int mode = options.Number(L"mode", L"Mode? 0 = analyze, 1 = defragment, first fit (default = 0): ", 0);
+    settings.mode = mode == 1 ? FleetMode::Defragment : FleetMode::Analyze;
+
+    std::wstring selection = options.Line(
+        L"volumes", L"Volumes (mount points or GUID paths separated by ';', * = all listed, default = *): ", L"*");
+    std::vector<FleetVolume> volumes;
+    for (const FleetVolume &v : found) {
+        bool wanted = selection.empty() || selection == L"*";
+        std::wstringstream list(selection);
+        std::wstring item;
+        while (!wanted && std::getline(list, item, L';')) {
+            wanted = !item.empty() && VolumeMatches(v, item);
+        }
+        if (wanted && settings.mode == FleetMode::Defragment && v.readOnly) {
+            std::wcout << L"  " << v.name << L" is read-only, left out.\n";
+            wanted = false;
+        }
+        if (wanted) {
+            volumes.push_back(v);
+        }
+    }
+    if (volumes.empty()) {
+        std::wcerr << L"No volume selected.\n";
+        return options.Finish(TOOL_EXIT_USAGE);
+    }
+
+    FleetOptions fleetOptions;
+    fleetOptions.maxVolumes = options.Number(
+        L"max-volumes", L"How many volumes at once at most? 0 = one per hard disk, any number on SSDs (default = 0): ",
+        fleetOptions.maxVolumes);
+    settings.workersPerVolume =
+        options.Number(L"workers", L"Worker threads per volume (default = 4): ", settings.workersPerVolume);
+    ULONGLONG budgetMB =
+        options.Number(L"budget-mb", L"I/O budget for all volumes together, in MB/s? 0 = no limit (default = 0): ", 0ULL);
+    g_ioBudget.SetRate(budgetMB * (1 << 20));
+    if (settings.mode == FleetMode::Analyze) {
+        std::wstring reportDirectory =
+            options.Line(L"reports", L"Write a JSON report per volume to which directory? (- = none, default = -): ", L"-");
+        if (!reportDirectory.empty() && reportDirectory != L"-") {
+            settings.reportDirectory = reportDirectory;
+        }
+    }
+    int logFiles =
+        options.Number(L"log-files", L"Log files that cannot be read or moved? 0 = no, 1 = yes (default = 0): ", 0);
+    g_logFiles = logFiles == 1;
+
+    // 3) Run the volumes: biggest disks first, one volume per disk with a seek penalty
+    std::vector<FleetJob> jobs(volumes.size());
+    FleetProgress progress(volumes.size());
+    std::vector<VolumeResult> results(volumes.size());
+    for (size_t i = 0; i < volumes.size(); i++) {
+        const VolumeGeometry &g = volumes[i].geometry;
+        jobs[i].name = volumes[i].name;
+        jobs[i].disks = volumes[i].seekDisks;
+        jobs[i].work = g.totalClusters - std::min(g.freeClusters, g.totalClusters);
+    }
+    std::wcout << (settings.mode == FleetMode::Analyze ? L"Analyzing " : L"Defragmenting ") << volumes.size()
+               << L" volume(s)...\n";
+
+    std::vector<FleetJobResult> ran;
+    auto started = std::chrono::steady_clock::now();
+    {
+        std::unique_ptr<StatusLine> status;
+        if (options.Interactive()) {
+            status.reset(new StatusLine(progress));
+        }
+        FleetScheduler scheduler;
+        ran = scheduler.Run(jobs, fleetOptions, [&](size_t i) {
+            PrintLine(L"Started " + volumes[i].name);
+            VolumePass pass(volumes[i], settings, progress[i], results[i]);
+            bool ok = pass.Run();
+            PrintLine((ok ? L"Finished " : L"Failed ") + volumes[i].name +
+                      (ok ? L"" : L": " + results[i].failure), !ok);
+            return ok;
+        }, &progress);
+    }
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    // 4) Per-volume results, then the whole fleet
+    bool ok = true;
+    double volumeSeconds = 0;
+    JsonObject &result = options.Result();
+    for (size_t i = 0; i < volumes.size(); i++) {
+        const VolumeProgress &p = progress[i];
+        const VolumeResult &r = results[i];
+        double seconds = ran[i].finished - ran[i].started;
+        JsonObject &v = result.Append("volumes");
+        v.Set("name", volumes[i].name).Set("guidPath", volumes[i].guidPath).Set("ok", ran[i].ok);
+        if (!ran[i].ok) {
+            v.Set("failure", r.failure);
+        }
+        v.Set("started", ran[i].started).Set("seconds", seconds);
+        v.Set("files", p.files.load()).Set("filesUnreadable", r.filesUnreadable).Set("fragmented", p.fragmented.load());
+        for (uint32_t d : volumes[i].disks) {
+            v.AppendValue("disks", d);
+        }
+        volumeSeconds += seconds;
+        ok = ok && ran[i].ok;
+        std::wcout << volumes[i].name << L" (disk " << DiskList(volumes[i].disks) << L"): "
+                   << (ran[i].ok ? L"" : L"FAILED, ") << seconds << L" s, " << p.files.load() << L" files ("
+                   << r.filesUnreadable << L" unreadable), " << p.fragmented.load() << L" fragmented";
+        if (r.report) {
+            LcnRange largest = r.report->LargestFreeRun();
+            std::wcout << L", " << r.report->Extents() << L" extents, largest free run "
+                       << largest.end - largest.start << L" clusters, score " << r.report->Score();
+            v.Set("extents", r.report->Extents()).Set("largestFreeRunClusters", largest.end - largest.start)
+                .Set("score", r.report->Score());
+        } else {
+            v.Set("filesMoved", r.filesMoved).Set("filesNoRoom", r.filesNoRoom).Set("moves", p.moves.load())
+                .Set("movesFailed", r.movesFailed).Set("clustersMoved", p.clustersMoved.load());
+            std::wcout << L", " << r.filesMoved << L" moved (" << r.filesNoRoom << L" without room, "
+                       << r.plan.sparseFiles << L" sparse, " << r.plan.compressedFiles << L" compressed), "
+                       << p.moves.load() << L" moves (" << r.movesFailed << L" failed), " << p.clustersMoved.load()
+                       << L" clusters";
+        }
+        std::wcout << L"\n";
+        if (r.report && !settings.reportDirectory.empty()) {
+            std::wstring path = (std::filesystem::path(settings.reportDirectory) / ReportFileName(volumes[i])).wstring();
+            if (WriteVolumeReport(*r.report, path)) {
+                std::wcout << L"  report written to " << path << L"\n";
+                v.Set("report", path);
+            } else {
+                ok = false;
+            }
+        }
+    }
+    FleetTotals t = progress.Sum();
+    std::wcout << L"Fleet: " << t.done << L" of " << volumes.size() << L" volumes done in " << wallSeconds
+               << L" s; one after the other they took " << volumeSeconds << L" s ("
+               << volumeSeconds / std::max(wallSeconds, 0.001) << L"x)\n";
+    std::wcout << L"Files: " << t.files << L", " << t.fragmented << L" fragmented";
+    if (settings.mode == FleetMode::Defragment) {
+        std::wcout << L"; " << t.moves << L" moves, " << t.clustersMoved << L" clusters moved";
+    }
+    std::wcout << L"\nI/O: " << g_ioBudget.BytesTaken() / (1 << 20) << L" MB, "
+               << (ULONGLONG)((double)g_ioBudget.BytesTaken() / std::max(wallSeconds, 0.001) / (1 << 20)) << L" MB/s";
+    if (g_ioBudget.Limited()) {
+        std::wcout << L" (budget " << budgetMB << L" MB/s, " << g_ioBudget.SecondsWaited()
+                   << L" s spent waiting for it)";
+    }
+    std::wcout << L"\n";
+    result.Set("volumesDone", t.done).Set("wallSeconds", wallSeconds).Set("volumeSeconds", volumeSeconds);
+    result.Set("files", t.files).Set("fragmented", t.fragmented).Set("moves", t.moves).Set("clustersMoved", t.clustersMoved);
+    result.Set("ioBytes", g_ioBudget.BytesTaken()).Set("secondsWaitedForBudget", g_ioBudget.SecondsWaited());
+
+    options.WaitForEnter(L"\nDone. Press Enter to exit...");
+    return options.Finish(ok ? TOOL_EXIT_OK : TOOL_EXIT_FAILED);
+}
@@ -0,0 +1,782 @@
+// local_socket.h includes winsock2.h, which must come before windows.h
+#include "../common/local_socket.h"
+
+#include <windows.h>
+#include <winioctl.h>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <unordered_map>
+
+#include "../common/directory_walker.h"
+#include "../common/bitmap_fetch.h"
+#include "../common/volume_geometry.h"
+#include "../common/volume_map_server.h"
+#include "../common/command_line.h"
+
+// Helper to print a Windows error message
+static void PrintLastError(const wchar_t *msgPrefix) {
+    DWORD errCode = GetLastError();
+    std::wcerr << msgPrefix << L" Error: " << errCode << std::endl;
+
+    LPWSTR errText = nullptr;
+    FormatMessageW(
+        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        NULL,
+        errCode,
+        0,
+        (LPWSTR)&errText,
+        0,
+        NULL);
+
+    if (errText) {
+        std::wcerr << L"Reason: " << errText << std::endl;
+        LocalFree(errText);
+    }
+}
+
+static ULONGLONG FileTimeToTicks(const FILETIME &ft) {
+    return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+static ULONGLONG NowTicks() {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return FileTimeToTicks(now);
+}
+
+// Socket paths are narrow (UTF-8) strings
+static std::string ToUtf8(const std::wstring &s) {
+    if (s.empty()) {
+        return std::string();
+    }
+    int bytes = WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), NULL, 0, NULL, NULL);
+    std::string out((size_t)bytes, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), &out[0], bytes, NULL, NULL);
+    return out;
+}
+
+// Where the socket and the snapshot go unless told otherwise: %TEMP%\volume-map-<drive>.<extension>
+static std::wstring DefaultPath(const std::wstring &driveLetter, const wchar_t *extension) {
+    wchar_t temp[MAX_PATH + 1];
+    DWORD length = GetTempPathW(MAX_PATH + 1, temp);
+    std::wstring dir = (length > 0 && length <= MAX_PATH) ? std::wstring(temp, length) : L".\\";
+    return dir + L"volume-map-" + driveLetter + L"." + extension;
+}
+
+// -----------------------------------------------------------------------------
+// Volume access
+// -----------------------------------------------------------------------------
+
+// Volume geometry from FSCTL_GET_NTFS_VOLUME_DATA: 64-bit cluster counts and
+// the MFT zone, with GetDiskFreeSpaceExW as the fallback on other file systems
+static bool GetVolumeGeometry(HANDLE volumeHandle, const std::wstring &rootPath, VolumeGeometry &geometry) {
+    geometry = VolumeGeometry();
+    NTFS_VOLUME_DATA_BUFFER data = {};
+    DWORD bytesReturned = 0;
+    if (DeviceIoControl(volumeHandle, FSCTL_GET_NTFS_VOLUME_DATA, NULL, 0, &data, sizeof(data), &bytesReturned, NULL)) {
+        geometry.isNtfs = true;
+        geometry.volumeSerial = (ULONGLONG)data.VolumeSerialNumber.QuadPart;
+        geometry.totalClusters = (ULONGLONG)data.TotalClusters.QuadPart;
+        geometry.freeClusters = (ULONGLONG)data.FreeClusters.QuadPart;
+        geometry.bytesPerSector = data.BytesPerSector;
+        geometry.bytesPerCluster = data.BytesPerCluster;
+        geometry.bytesPerFileRecord = data.BytesPerFileRecordSegment;
+        geometry.mftStartLcn = (ULONGLONG)data.MftStartLcn.QuadPart;
+        geometry.mft2StartLcn = (ULONGLONG)data.Mft2StartLcn.QuadPart;
+        geometry.mftValidDataLength = (ULONGLONG)data.MftValidDataLength.QuadPart;
+        geometry.mftZoneStart = (ULONGLONG)data.MftZoneStart.QuadPart;
+        geometry.mftZoneEnd = (ULONGLONG)data.MftZoneEnd.QuadPart;
+        return true;
+    }
+
+    DWORD sectorsPerCluster = 0;
+    DWORD bytesPerSector = 0;
+    DWORD numberOfFreeClusters = 0;
+    DWORD totalNumberOfClusters = 0;
+    ULARGE_INTEGER freeBytes = {};
+    ULARGE_INTEGER totalBytes = {};
+    ULARGE_INTEGER totalFreeBytes = {};
+    if (!GetDiskFreeSpaceW(rootPath.c_str(), &sectorsPerCluster, &bytesPerSector,
+                           &numberOfFreeClusters, &totalNumberOfClusters) ||
+        !GetDiskFreeSpaceExW(rootPath.c_str(), &freeBytes, &totalBytes, &totalFreeBytes)) {
+        PrintLastError(L"GetDiskFreeSpaceW failed");
+        return false;
+    }
+    geometry.bytesPerSector = bytesPerSector;
+    geometry.bytesPerCluster = sectorsPerCluster * bytesPerSector;
+    if (geometry.bytesPerCluster == 0) {
+        return false;
+    }
+    geometry.totalClusters = totalBytes.QuadPart / geometry.bytesPerCluster;
+    geometry.freeClusters = totalFreeBytes.QuadPart / geometry.bytesPerCluster;
+    DWORD serial = 0;
+    if (GetVolumeInformationW(rootPath.c_str(), NULL, 0, &serial, NULL, NULL, NULL, 0)) {
+        geometry.volumeSerial = serial;
+    }
+    return true;
+}
+
+// FSCTL_GET_VOLUME_BITMAP on one volume handle
+class VolumeBitmapSource : public BitmapSource {
+public:
+    VolumeBitmapSource(HANDLE volumeHandle, bool ownsHandle) : volumeHandle(volumeHandle), ownsHandle(ownsHandle) {}
+    ~VolumeBitmapSource() override {
+        if (ownsHandle) {
+            CloseHandle(volumeHandle);
+        }
+    }
+
+    IoStatus Read(int64_t startingLcn, void *out, uint32_t outSize, uint32_t &bytesReturned) override {
+        STARTING_LCN_INPUT_BUFFER inBuf = {};
+        inBuf.StartingLcn.QuadPart = startingLcn;
+        DWORD returned = 0;
+        BOOL ok = DeviceIoControl(volumeHandle, FSCTL_GET_VOLUME_BITMAP, &inBuf, sizeof(inBuf),
+                                  out, outSize, &returned, NULL);
+        bytesReturned = returned;
+        if (ok) {
+            return IoStatus::Success;
+        }
+        if (GetLastError() == ERROR_MORE_DATA) {
+            return IoStatus::MoreData;
+        }
+        PrintLastError(L"FSCTL_GET_VOLUME_BITMAP failed");
+        return IoStatus::Failed;
+    }
+
+private:
+    HANDLE volumeHandle;
+    bool ownsHandle;
+};
+
+// The whole volume bitmap, fetched as `ranges` LCN ranges in parallel, each
+// range but the first on a volume handle of its own
+static bool GetVolumeBitmap(HANDLE volumeHandle,
+                            const std::wstring &volumePath,
+                            ULONGLONG totalClusters,
+                            unsigned ranges,
+                            std::vector<BYTE> &outBitmap) {
+    auto makeSource = [&](unsigned range) -> std::unique_ptr<BitmapSource> {
+        if (range == 0) {
+            return std::unique_ptr<BitmapSource>(new VolumeBitmapSource(volumeHandle, false));
+        }
+        HANDLE hRange = CreateFileW(volumePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                    NULL, OPEN_EXISTING, 0, NULL);
+        if (hRange == INVALID_HANDLE_VALUE) {
+            PrintLastError((L"Failed to open volume " + volumePath + L" for a bitmap range").c_str());
+            return nullptr;
+        }
+        return std::unique_ptr<BitmapSource>(new VolumeBitmapSource(hRange, true));
+    };
+    BitmapFetchOptions options;
+    options.ranges = std::max(1u, ranges);
+    return FetchVolumeBitmap(totalClusters, outBitmap, options, makeSource, nullptr);
+}
+
+// The extents of an open file as runs, sparse runs with lcn = -1
+static bool GetFileRuns(HANDLE fileHandle, std::vector<BYTE> &buffer, std::vector<ExtentRun> &runs) {
+    runs.clear();
+    if (buffer.size() < 64 * 1024) {
+        buffer.resize(64 * 1024);
+    }
+    STARTING_VCN_INPUT_BUFFER inBuf = {};
+    while (true) {
+        DWORD bytesReturned = 0;
+        BOOL ok = DeviceIoControl(fileHandle, FSCTL_GET_RETRIEVAL_POINTERS, &inBuf, sizeof(inBuf),
+                                  buffer.data(), (DWORD)buffer.size(), &bytesReturned, NULL);
+        bool moreData = false;
+        if (!ok) {
+            DWORD err = GetLastError();
+            if (err == ERROR_HANDLE_EOF) {
+                return true; // resident or empty: no clusters
+            }
+            if (err != ERROR_MORE_DATA) {
+                PrintLastError(L"FSCTL_GET_RETRIEVAL_POINTERS failed");
+                return false;
+            }
+            moreData = true;
+        }
+        if (bytesReturned < sizeof(RETRIEVAL_POINTERS_BUFFER)) {
+            return false;
+        }
+        auto pRet = reinterpret_cast<PRETRIEVAL_POINTERS_BUFFER>(buffer.data());
+        if (pRet->ExtentCount == 0) {
+            return true;
+        }
+        LONGLONG currentVcn = pRet->StartingVcn.QuadPart;
+        for (DWORD i = 0; i < pRet->ExtentCount; i++) {
+            LONGLONG nextVcn = pRet->Extents[i].NextVcn.QuadPart;
+            runs.push_back(ExtentRun{currentVcn, pRet->Extents[i].Lcn.QuadPart, nextVcn - currentVcn});
+            currentVcn = nextVcn;
+        }
+        if (!moreData || currentVcn <= inBuf.StartingVcn.QuadPart) {
+            return true;
+        }
+        inBuf.StartingVcn.QuadPart = currentVcn;
+    }
+}
+
+// Open a file by path and read its size, last write time and extents.
+// A file that no longer exists is reported with exists = false.
+static void QueryFile(ChangedFile &cf, std::vector<BYTE> &buffer) {
+    HANDLE hFile = CreateFileW(cf.path.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    BY_HANDLE_FILE_INFORMATION info;
+    bool ok = GetFileInformationByHandle(hFile, &info) && !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+              GetFileRuns(hFile, buffer, cf.runs);
+    CloseHandle(hFile);
+    if (ok) {
+        cf.exists = true;
+        cf.size = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+        cf.lastWriteTicks = FileTimeToTicks(info.ftLastWriteTime);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// USN journal
+//   The same change source as defragment's incremental mode: journal records
+//   are turned into path changes, directories resolved by file reference.
+// -----------------------------------------------------------------------------
+class UsnJournalSource : public ChangeSource {
+public:
+    explicit UsnJournalSource(HANDLE volumeHandle) : volumeHandle(volumeHandle), buffer(64 * 1024 / sizeof(ULONGLONG)) {}
+
+    bool Current(ChangePosition &out) override {
+        USN_JOURNAL_DATA journal;
+        if (!QueryJournal(journal)) {
+            return false;
+        }
+        out.kind = ChangeSourceKind::UsnJournal;
+        out.id = journal.UsnJournalID;
+        out.position = (uint64_t)journal.NextUsn;
+        return true;
+    }
+
+    ChangeReadStatus Read(const ChangePosition &from, std::vector<FileChange> &out, ChangePosition &next) override {
+        USN_JOURNAL_DATA journal;
+        if (!QueryJournal(journal)) {
+            return ChangeReadStatus::Unavailable;
+        }
+        if (from.kind != ChangeSourceKind::UsnJournal || from.id != journal.UsnJournalID ||
+            (USN)from.position < journal.FirstUsn) {
+            return ChangeReadStatus::Discontinuous;
+        }
+
+        READ_USN_JOURNAL_DATA request = {};
+        request.StartUsn = (USN)from.position;
+        request.ReasonMask = USN_REASON_DATA_OVERWRITE | USN_REASON_DATA_EXTEND | USN_REASON_DATA_TRUNCATION |
+                             USN_REASON_FILE_CREATE | USN_REASON_FILE_DELETE |
+                             USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME;
+        request.UsnJournalID = journal.UsnJournalID;
+        while (request.StartUsn < journal.NextUsn) {
+            DWORD bytesReturned = 0;
+            if (!DeviceIoControl(volumeHandle, FSCTL_READ_USN_JOURNAL, &request, sizeof(request), buffer.data(),
+                                 (DWORD)(buffer.size() * sizeof(ULONGLONG)), &bytesReturned, NULL)) {
+                PrintLastError(L"FSCTL_READ_USN_JOURNAL failed");
+                return ChangeReadStatus::Unavailable;
+            }
+            if (bytesReturned < sizeof(USN)) {
+                break;
+            }
+            const BYTE *p = reinterpret_cast<const BYTE *>(buffer.data());
+            USN nextUsn = *reinterpret_cast<const USN *>(p);
+            for (DWORD at = sizeof(USN); at + sizeof(USN_RECORD) <= bytesReturned;) {
+                const USN_RECORD *record = reinterpret_cast<const USN_RECORD *>(p + at);
+                if (record->RecordLength == 0) {
+                    break;
+                }
+                if (record->MajorVersion == 2) {
+                    AddRecord(*record, out);
+                }
+                at += record->RecordLength;
+            }
+            if (nextUsn <= request.StartUsn) {
+                break;
+            }
+            request.StartUsn = nextUsn;
+        }
+        next = from;
+        next.position = (uint64_t)request.StartUsn;
+        return ChangeReadStatus::Ok;
+    }
+
+private:
+    bool QueryJournal(USN_JOURNAL_DATA &journal) {
+        DWORD bytesReturned = 0;
+        if (!DeviceIoControl(volumeHandle, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &journal, sizeof(journal), &bytesReturned, NULL)) {
+            PrintLastError(L"FSCTL_QUERY_USN_JOURNAL failed (is the USN journal enabled?)");
+            return false;
+        }
+        return true;
+    }
+
+    bool DirectoryPath(DWORDLONG fileReference, std::wstring &outPath) {
+        auto cached = directories.find(fileReference);
+        if (cached != directories.end()) {
+            outPath = cached->second;
+            return true;
+        }
+        FILE_ID_DESCRIPTOR id = {};
+        id.dwSize = sizeof(id);
+        id.Type = FileIdType;
+        id.FileId.QuadPart = (LONGLONG)fileReference;
+        HANDLE h = OpenFileById(volumeHandle, &id, FILE_READ_ATTRIBUTES,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, FILE_FLAG_BACKUP_SEMANTICS);
+        if (h == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        wchar_t path[MAX_PATH * 4];
+        DWORD length = GetFinalPathNameByHandleW(h, path, (DWORD)(sizeof(path) / sizeof(path[0])),
+                                                 FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+        CloseHandle(h);
+        if (length == 0 || length >= sizeof(path) / sizeof(path[0])) {
+            return false;
+        }
+        outPath.assign(path, length);
+        if (outPath.compare(0, 4, L"\\\\?\\") == 0) {
+            outPath.erase(0, 4);
+        }
+        if (outPath.empty() || outPath.back() != L'\\') {
+            outPath.push_back(L'\\');
+        }
+        directories[fileReference] = outPath;
+        return true;
+    }
+
+    void AddRecord(const USN_RECORD &record, std::vector<FileChange> &out) {
+        FileChange c;
+        if (!DirectoryPath(record.ParentFileReferenceNumber, c.path)) {
+            return;
+        }
+        const wchar_t *name = reinterpret_cast<const wchar_t *>(reinterpret_cast<const BYTE *>(&record) + record.FileNameOffset);
+        c.path.append(name, record.FileNameLength / sizeof(wchar_t));
+
+        bool gone = (record.Reason & (USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME)) != 0;
+        if (record.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            directories.erase(record.FileReferenceNumber);
+            if (gone) {
+                c.kind = ChangeKind::DirectoryDeleted;
+            } else if (record.Reason & USN_REASON_RENAME_NEW_NAME) {
+                c.kind = ChangeKind::DirectoryAdded;
+            } else {
+                return;
+            }
+        } else {
+            c.kind = gone ? ChangeKind::Deleted : ChangeKind::Modified;
+        }
+        out.push_back(c);
+    }
+
+    HANDLE volumeHandle;
+    std::vector<ULONGLONG> buffer;
+    std::unordered_map<DWORDLONG, std::wstring> directories;
+};
+
+// -----------------------------------------------------------------------------
+// Building the map
+//   A full scan walks the volume and reads the extents of every file into a
+//   snapshot, together with the bitmap. It is only needed when there is no
+//   usable snapshot (none yet, another volume, or the journal no longer
+//   reaches back to it); otherwise the service starts from the snapshot and
+//   catches up with the journal.
+// -----------------------------------------------------------------------------
+struct SnapshotScanVisitor : WalkVisitor {
+    SnapshotWriter &writer;
+    std::vector<BYTE> buffer;
+    std::vector<ExtentRun> runs;
+    ULONGLONG failed = 0;
+
+    explicit SnapshotScanVisitor(SnapshotWriter &writer) : writer(writer) {}
+
+    WalkAction OnFile(const WalkEntry &e) {
+        HANDLE hFile = CreateFileW(e.path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   NULL, OPEN_EXISTING, 0, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            failed++;
+            return WalkAction::Continue;
+        }
+        if (GetFileRuns(hFile, buffer, runs)) {
+            writer.AddFile(e.path, e.pathLength, e.size, e.lastWriteTime, runs.data(), runs.size());
+        } else {
+            failed++;
+        }
+        CloseHandle(hFile);
+        return WalkAction::Continue;
+    }
+};
+
+// Files below a directory, for directories that appeared since the last refresh
+struct ListFilesVisitor : WalkVisitor {
+    std::vector<std::wstring> &paths;
+
+    explicit ListFilesVisitor(std::vector<std::wstring> &paths) : paths(paths) {}
+
+    WalkAction OnFile(const WalkEntry &e) {
+        paths.emplace_back(e.path, e.pathLength);
+        return WalkAction::Continue;
+    }
+};
+
+struct VolumeContext {
+    HANDLE volumeHandle = INVALID_HANDLE_VALUE;
+    std::wstring rootPath;
+    std::wstring volumePath;
+    VolumeGeometry geometry;
+    std::vector<LcnRange> reserved;
+    unsigned bitmapRanges = 4;
+};
+
+// Walk the volume into a new snapshot at path. The journal position is taken
+// before anything is read, so whatever changes during the scan is replayed by
+// the next refresh.
+static bool ScanVolume(const VolumeContext &volume, ChangeSource &source, const std::wstring &path) {
+    std::wcout << L"Scanning " << volume.rootPath << L" for a full snapshot...\n";
+    auto started = std::chrono::steady_clock::now();
+    ChangePosition position;
+    if (!source.Current(position)) {
+        std::wcerr << L"No change feed position; the map could not be refreshed incrementally.\n";
+        return false;
+    }
+    ULONGLONG bitmapTicks = NowTicks();
+    std::vector<BYTE> bitmap;
+    if (!GetVolumeBitmap(volume.volumeHandle, volume.volumePath, volume.geometry.totalClusters, volume.bitmapRanges, bitmap)) {
+        std::wcerr << L"Cannot read the volume bitmap.\n";
+        return false;
+    }
+    SnapshotWriter writer(volume.geometry.volumeSerial, volume.geometry.totalClusters, volume.geometry.bytesPerCluster);
+    writer.SetChangePosition(position);
+    DirectoryWalker walker;
+    SnapshotScanVisitor visitor(writer);
+    walker.Walk(volume.rootPath, visitor);
+    if (!writer.Write(path, bitmap.data(), bitmapTicks)) {
+        PrintLastError((L"Cannot write snapshot " + path).c_str());
+        return false;
+    }
+    std::wcout << L"Full snapshot: " << writer.FileCount() << L" files (" << visitor.failed << L" could not be read) in "
+               << std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count() << L" s.\n";
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Service
+//   Queries are answered by VolumeMapServer threads from the current state;
+//   this thread refreshes the map every interval from the USN journal and,
+//   every few refreshes, from a freshly fetched bitmap.
+// -----------------------------------------------------------------------------
+class RefreshLoop {
+public:
+    RefreshLoop(VolumeMap &map, VolumeContext &volume, ChangeSource &source, const std::wstring &snapshotPath)
+        : map(map), volume(volume), source(source), snapshotPath(snapshotPath) {}
+
+    void Start(unsigned intervalSeconds, unsigned fullBitmapEvery) {
+        thread = std::thread([this, intervalSeconds, fullBitmapEvery] { Run(intervalSeconds, fullBitmapEvery); });
+    }
+
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+private:
+    void Run(unsigned intervalSeconds, unsigned fullBitmapEvery) {
+        VolumeMapRefreshHooks hooks;
+        std::vector<BYTE> buffer;
+        hooks.queryFile = [&buffer](ChangedFile &cf) { QueryFile(cf, buffer); };
+        hooks.listDirectory = [](const std::wstring &dir, std::vector<std::wstring> &paths) {
+            DirectoryWalker walker;
+            ListFilesVisitor visitor(paths);
+            walker.Walk(dir, visitor);
+        };
+        hooks.separator = WALK_PATH_SEPARATOR;
+
+        unsigned refreshes = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                if (wake.wait_for(guard, std::chrono::seconds(intervalSeconds), [this] { return stopping; })) {
+                    return;
+                }
+            }
+            uint64_t generation = map.Current()->generation + 1;
+            std::wstring next = snapshotPath + L"." + std::to_wstring(generation);
+            std::vector<BYTE> freshBitmap;
+            bool fetchBitmap = fullBitmapEvery > 0 && (refreshes + 1) % fullBitmapEvery == 0;
+            ULONGLONG ticks = NowTicks();
+            if (fetchBitmap && !GetVolumeBitmap(volume.volumeHandle, volume.volumePath, volume.geometry.totalClusters,
+                                                volume.bitmapRanges, freshBitmap)) {
+                fetchBitmap = false;
+            }
+            RefreshStats stats;
+            RefreshResult result = RefreshVolumeMap(map, source, hooks, fetchBitmap ? &freshBitmap : nullptr, next, ticks,
+                                                    volume.reserved, stats);
+            if (result == RefreshResult::NeedsRebuild) {
+                std::wcout << L"The USN journal no longer reaches back to the map; rebuilding.\n";
+                std::shared_ptr<VolumeMapState> state;
+                if (ScanVolume(volume, source, next) &&
+                    OpenVolumeMapState(next, generation, volume.reserved, state) == SnapshotStatus::Ok) {
+                    state->deleteOnRelease = true;
+                    map.Publish(state);
+                }
+            } else if (result == RefreshResult::Refreshed) {
+                refreshes++;
+                const IncrementalStats &is = stats.incremental;
+                std::wcout << L"Map generation " << generation << L": " << stats.changes << L" journal records, "
+                           << is.filesQueried << L" files queried, " << is.filesDropped << L" dropped"
+                           << (fetchBitmap ? L", bitmap fetched" : L"") << L", " << stats.seconds * 1000 << L" ms\n";
+            } else if (result == RefreshResult::Failed) {
+                std::wcerr << L"Refresh failed; serving generation " << generation - 1 << L" until the next one.\n";
+            }
+        }
+    }
+
+    VolumeMap &map;
+    VolumeContext &volume;
+    ChangeSource &source;
+    std::wstring snapshotPath;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+static int Serve(ToolOptions &options, const std::wstring &driveLetter, const std::string &socketPath) {
+    VolumeContext volume;
+    volume.rootPath = driveLetter + L":\\";
+    volume.volumePath = L"\\\\.\\" + driveLetter + L":";
+    volume.volumeHandle = CreateFileW(volume.volumePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                      NULL, OPEN_EXISTING, 0, NULL);
+    if (volume.volumeHandle == INVALID_HANDLE_VALUE) {
+        PrintLastError((L"Failed to open volume " + volume.volumePath).c_str());
+        return 1;
+    }
+    if (!GetVolumeGeometry(volume.volumeHandle, volume.rootPath, volume.geometry) || volume.geometry.totalClusters == 0) {
+        std::wcerr << L"GetVolumeGeometry failed.\n";
+        CloseHandle(volume.volumeHandle);
+        return 1;
+    }
+    volume.reserved = volume.geometry.ReservedRanges();
+    std::wcout << L"Volume has " << volume.geometry.totalClusters << L" clusters. Bytes/cluster = "
+               << volume.geometry.bytesPerCluster << L"\n";
+
+    std::wstring defaultSnapshot = DefaultPath(driveLetter, L"snap");
+    std::wstring snapshotPath =
+        options.Line(L"snapshot", L"Snapshot to start from and keep up to date (- = " + defaultSnapshot + L"): ", L"-");
+    if (snapshotPath.empty() || snapshotPath == L"-") {
+        snapshotPath = defaultSnapshot;
+    }
+    unsigned intervalSeconds =
+        options.Number(L"interval", L"Refresh from the USN journal every how many seconds? (default = 30): ", 30u);
+    unsigned fullBitmapEvery = options.Number(
+        L"full-bitmap-every", L"Fetch the whole bitmap again every how many refreshes? 0 = never (default = 20): ", 20u);
+    volume.bitmapRanges =
+        options.Number(L"bitmap-ranges", L"Bitmap fetch: how many ranges in parallel? (default = 4): ", volume.bitmapRanges);
+    intervalSeconds = std::max(1u, intervalSeconds);
+    unsigned serveSeconds = options.Value(L"seconds", 0u);
+
+    // Start from the snapshot if it is of this volume (any age: the journal
+    // brings it up to date), else from a full scan
+    UsnJournalSource journal(volume.volumeHandle);
+    VolumeMap map;
+    std::shared_ptr<VolumeMapState> state;
+    SnapshotStatus status = OpenVolumeMapState(snapshotPath, 0, volume.reserved, state);
+    if (status == SnapshotStatus::Ok &&
+        state->files.CheckVolume(volume.geometry.volumeSerial, volume.geometry.totalClusters,
+                                 volume.geometry.bytesPerCluster, NowTicks(), ~0ULL) != SnapshotFreshness::Fresh) {
+        std::wcout << L"Snapshot " << snapshotPath << L" is of another volume.\n";
+        state.reset();
+    }
+    if (!state) {
+        std::wstring scanned = snapshotPath + L".0";
+        if (!ScanVolume(volume, journal, scanned) ||
+            OpenVolumeMapState(scanned, 0, volume.reserved, state) != SnapshotStatus::Ok) {
+            CloseHandle(volume.volumeHandle);
+            return 1;
+        }
+        state->deleteOnRelease = true;
+    }
+    std::wcout << L"Map loaded: " << state->files.FileCount() << L" files, " << state->free.RunCount() << L" free runs, "
+               << state->free.FreeClusters() << L" free clusters outside the MFT zone.\n";
+    map.Publish(state);
+    state.reset();
+
+    LocalSocket::Startup();
+    VolumeMapServer server(map);
+    if (!server.Start(socketPath)) {
+        std::wcerr << L"Cannot listen on " << socketPath.c_str() << L" (Error " << WSAGetLastError() << L")\n";
+        CloseHandle(volume.volumeHandle);
+        return 1;
+    }
+    RefreshLoop refresh(map, volume, journal, snapshotPath);
+    refresh.Start(intervalSeconds, fullBitmapEvery);
+    if (serveSeconds > 0) {
+        std::wcout << L"Serving " << volume.rootPath << L" on " << socketPath.c_str() << L" for " << serveSeconds
+                   << L" s...\n";
+        std::this_thread::sleep_for(std::chrono::seconds(serveSeconds));
+    } else {
+        std::wcout << L"Serving " << volume.rootPath << L" on " << socketPath.c_str() << L". Press Enter to stop...\n";
+        std::wcin.ignore(std::numeric_limits<std::streamsize>::max(), L'\n');
+        std::wcin.get();
+    }
+
+    server.Stop();
+    refresh.Stop();
+    std::wcout << L"Served " << server.RequestsServed() << L" requests on " << server.ConnectionsAccepted()
+               << L" connections.\n";
+    options.Result().Set("requestsServed", server.RequestsServed()).Set("connections", server.ConnectionsAccepted());
+
+    // Leave the last state behind as the snapshot the next start uses
+    std::shared_ptr<const VolumeMapState> last = map.Current();
+    options.Result().Set("generation", last->generation).Set("files", last->files.FileCount())
+        .Set("freeRuns", last->free.RunCount()).Set("freeClusters", last->free.FreeClusters());
+    bool moveIntoPlace = last->deleteOnRelease;
+    last->deleteOnRelease = false;
+    std::wstring lastPath = last->snapshotPath;
+    last.reset();
+    map.Publish(nullptr);
+    if (moveIntoPlace && !MoveFileExW(lastPath.c_str(), snapshotPath.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        PrintLastError((L"Cannot move " + lastPath + L" to " + snapshotPath).c_str());
+    }
+    CloseHandle(volume.volumeHandle);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Query client
+// -----------------------------------------------------------------------------
+// On the console, queries until 9; in batch mode, the one query of the command line
+static int Query(ToolOptions &options, const std::string &socketPath) {
+    LocalSocket::Startup();
+    VolumeMapClient client;
+    if (!client.Connect(socketPath)) {
+        std::wcerr << L"Cannot connect to " << socketPath.c_str() << L"; is the service running?\n";
+        return 1;
+    }
+    JsonObject &result = options.Result();
+    for (bool first = true; first || options.Interactive(); first = false) {
+        int query = options.Number(L"query",
+                                   std::wstring(L"\nQuery? 0 = stats, 1 = largest free run, 2 = free clusters near an LCN,") +
+                                       L" 3 = extents of a file, 9 = quit (default = 9): ",
+                                   9);
+        auto started = std::chrono::steady_clock::now();
+        VmapStatus status = VmapStatus::BadRequest;
+        if (query == 0) {
+            VmapStatsReply s;
+            status = client.Stats(s);
+            if (status == VmapStatus::Ok) {
+                std::wcout << L"Generation " << s.generation << L": " << s.totalClusters << L" clusters of "
+                           << s.bytesPerCluster << L" bytes, " << s.freeClusters << L" free in " << s.freeRuns
+                           << L" runs, " << s.fileCount << L" files\n";
+                result.Set("generation", s.generation).Set("totalClusters", s.totalClusters)
+                    .Set("bytesPerCluster", s.bytesPerCluster).Set("freeClusters", s.freeClusters)
+                    .Set("freeRuns", s.freeRuns).Set("files", s.fileCount);
+            }
+        } else if (query == 1) {
+            FreeExtent run;
+            status = client.LargestFreeRun(run);
+            if (status == VmapStatus::Ok) {
+                std::wcout << L"Largest free run: LCN " << run.start << L", " << run.length << L" clusters\n";
+                result.Set("lcn", run.start).Set("clusters", run.length);
+            }
+        } else if (query == 2) {
+            ULONGLONG lcn = options.Number(L"lcn", L"LCN: ", 0ULL);
+            ULONGLONG clusters = options.Number(L"clusters", L"How many clusters? (default = 1): ", 1ULL);
+            std::vector<FreeExtent> runs;
+            started = std::chrono::steady_clock::now();
+            status = client.FreeNear(lcn, clusters, 64, runs);
+            for (const FreeExtent &r : runs) {
+                std::wcout << L"  LCN " << r.start << L", " << r.length << L" clusters\n";
+                result.Append("runs").Set("lcn", r.start).Set("clusters", r.length);
+            }
+        } else if (query == 3) {
+            std::wstring path = options.Line(L"path", L"File path: ");
+            VmapFileReply reply;
+            std::vector<ExtentRun> runs;
+            started = std::chrono::steady_clock::now();
+            status = client.FileExtents(path, reply, runs);
+            if (status == VmapStatus::Ok) {
+                std::wcout << L"Size " << reply.size << L" bytes, " << reply.clusterCount << L" clusters in "
+                           << reply.runCount << L" runs (generation " << reply.generation << L")\n";
+                result.Set("generation", reply.generation).Set("size", reply.size)
+                    .Set("clusters", reply.clusterCount);
+                for (const ExtentRun &r : runs) {
+                    std::wcout << L"  VCN " << r.vcn << L": " << (r.lcn < 0 ? L"sparse" : L"LCN " + std::to_wstring(r.lcn))
+                               << L", " << r.count << L" clusters\n";
+                    result.Append("runs").Set("vcn", r.vcn).Set("lcn", r.lcn).Set("clusters", r.count);
+                }
+            } else if (status == VmapStatus::NotFound) {
+                std::wcout << L"Not in the map.\n";
+            }
+        } else {
+            break;
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count();
+        if (status == VmapStatus::Disconnected) {
+            std::wcerr << L"The service closed the connection.\n";
+            return TOOL_EXIT_FAILED;
+        }
+        std::wcout << L"(" << us << L" us)\n";
+        result.Set("status", (unsigned)status).Set("microseconds", us);
+        if (options.Batch() && status != VmapStatus::Ok) {
+            return TOOL_EXIT_FAILED;
+        }
+    }
+    return TOOL_EXIT_OK;
+}
+
+int main(int argc, char **argv) {
+    ToolOptions options(L"volume-map-service", {
+        {L"mode", OptionKind::Count, false, L"0 = serve a volume map, 1 = query a running service (default 0)"},
+        {L"volume", OptionKind::Text, true, L"drive letter of the volume, e.g. C"},
+        {L"socket", OptionKind::Text, false, L"socket path (- = %TEMP%\\volume-map-<drive>.sock, default)"},
+        {L"snapshot", OptionKind::Text, false, L"serve: snapshot to start from and keep up to date (- = %TEMP%, default)"},
+        {L"interval", OptionKind::Count, false, L"serve: seconds between refreshes from the USN journal (default 30)"},
+        {L"full-bitmap-every", OptionKind::Count, false, L"serve: refreshes between full bitmap fetches, 0 = never (default 20)"},
+        {L"bitmap-ranges", OptionKind::Count, false, L"serve: bitmap ranges fetched in parallel (default 4)"},
+        {L"seconds", OptionKind::Count, false, L"serve: stop after this many seconds (default: at Enter)"},
+        {L"query", OptionKind::Count, false, L"query: 0 = stats, 1 = largest free run, 2 = free clusters near an LCN, "
+                                             L"3 = extents of a file"},
+        {L"lcn", OptionKind::Count, false, L"query 2: the LCN"},
+        {L"clusters", OptionKind::Count, false, L"query 2: how many clusters (default 1)"},
+        {L"path", OptionKind::Text, false, L"query 3: the file"},
+    });
+    int exitCode = 0;
+    if (!options.Parse(argc, argv, exitCode)) {
+        return exitCode;
+    }
+
+    int mode = options.Number(L"mode", L"Mode? 0 = serve a volume map, 1 = query a running service (default = 0): ", 0);
+
+    std::wstring driveLetter = options.DriveLetter(L"volume", L"Enter drive letter (e.g. C): ");
+    if (driveLetter.empty()) {
+        std::wcerr << L"No drive letter provided.\n";
+        return options.Finish(TOOL_EXIT_USAGE);
+    }
+
+    std::wstring defaultSocket = DefaultPath(driveLetter, L"sock");
+    std::wstring socketPath = options.Line(L"socket", L"Socket path (- = " + defaultSocket + L"): ", L"-");
+    if (socketPath.empty() || socketPath == L"-") {
+        socketPath = defaultSocket;
+    }
+
+    int result = (mode == 1) ? Query(options, ToUtf8(socketPath)) : Serve(options, driveLetter, ToUtf8(socketPath));
+
+    options.WaitForEnter(L"\nDone. Press Enter to exit...");
+    return options.Finish(result);
+}